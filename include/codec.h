@@ -0,0 +1,127 @@
+/*  codec.h - in-process codec definitions
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stdio.h>
+#include "format-types.h"
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+#define HAVE_CODEC_STREAMS 1
+#endif
+
+/* the audio format described by the WAVE header that modes send to an encoder */
+typedef struct _codec_wave_format {
+  int   format;               /* WAVE_FORMAT_PCM, also for extensible headers that describe plain PCM */
+  int   channels;
+  int   bits_per_sample;
+  int   block_align;
+  wlong samples_per_sec;
+  wlong data_size;
+  unsigned char *header;      /* the header itself, up to the contents of the data chunk */
+  int   header_size;
+} codec_wave_format;
+
+/* the parts of an AIFF header needed to convert its sound data to WAVE data */
+typedef struct _aiff_header {
+  wlong  samples;             /* sample frames */
+  wshort channels;
+  wshort bits_per_sample;
+  wlong  samples_per_sec;
+  bool   little_endian;       /* AIFF-C 'sowt' compression */
+  long   data_offset;         /* where the sound data starts, past any ID3v2 tag - 0 if unknown */
+} aiff_header;
+
+/* wrap in-process codecs in streams that modes can use like a decoder's output or an encoder's input */
+FILE *open_decoder_stream(void *,int (*)(void *,unsigned char *,int),int (*)(void *));
+FILE *open_encoder_stream(void *,int (*)(void *,unsigned char *,int),int (*)(void *));
+
+/* wraps an in-process decoder that can seek in its output, giving a stream that fseeko() works on */
+FILE *open_seekable_decoder_stream(void *,int (*)(void *,unsigned char *,int),int (*)(void *,wlong),int (*)(void *));
+
+/* wraps an in-process encoder in a stream that takes WAVE data, falling back to the helper for data it can't handle */
+FILE *open_wave_encoder_stream(void *,char *,int (*)(void *,codec_wave_format *),int (*)(void *,unsigned char *,int),
+                               int (*)(void *),FILE *(*)(char *,proc_info *));
+
+/* FLAC decoder - returns a stream of WAVE data that can seek, or NULL if the file can't be decoded in-process */
+FILE *flac_decode_open(char *);
+
+/* whether flac_decode_open() can handle audio with these properties (never, if codec streams aren't available) */
+bool flac_decode_supported(int,int);
+
+/* FLAC encoder - returns a stream that takes WAVE data, or NULL if the file couldn't be created.  WAVE data the
+ * encoder can't handle is passed on to the stream returned by the given function, which launches the helper.
+ */
+FILE *flac_encode_open(char *,FILE *(*)(char *,proc_info *));
+
+/* AIFF decoder - takes over an open file, and returns a stream of WAVE data converted from its sound data */
+FILE *aiff_decode_open(FILE *,aiff_header *);
+
+/* whether aiff_decode_open() can handle an AIFF file with this header */
+bool aiff_decode_supported(aiff_header *);
+
+/* AIFF encoder - as for flac_encode_open() */
+FILE *aiff_encode_open(char *,FILE *(*)(char *,proc_info *));
+
+/* WavPack decoder - takes the name of the correction file to use, if any, and returns a stream of WAVE data,
+ * or NULL if the file can't be decoded in-process
+ */
+FILE *wv_decode_open(char *,char *);
+
+/* Shorten decoder - returns a stream of WAVE data that can seek, using the file's seek table if it has one,
+ * or NULL if the file can't be decoded in-process
+ */
+FILE *shn_decode_open(char *);
+
+/* Shorten encoder - as for flac_encode_open(), and appends a seek table to the file */
+FILE *shn_encode_open(char *,FILE *(*)(char *,proc_info *));
+
+/* ALAC decoder - reads the first ALAC track of an MP4 file, and returns a stream of WAVE data that can seek, or
+ * NULL if the file can't be decoded in-process
+ */
+FILE *alac_decode_open(char *);
+
+/* whether alac_decode_open() can handle audio with these properties (never, if codec streams aren't available) */
+bool alac_decode_supported(int,int);
+
+/* TTA decoder - returns a stream of WAVE data that can seek, or NULL if the file can't be decoded in-process */
+FILE *tta_decode_open(char *);
+
+/* whether tta_decode_open() can handle audio with these properties (never, if codec streams aren't available) */
+bool tta_decode_supported(int,int);
+
+/* TTA encoder - as for flac_encode_open() */
+FILE *tta_encode_open(char *,FILE *(*)(char *,proc_info *));
+
+/* Monkey's Audio decoder - returns a stream of WAVE data that can seek, or NULL if the file can't be decoded
+ * in-process
+ */
+FILE *ape_decode_open(char *);
+
+/* whether ape_decode_open() can handle a file with this version, compression level, and audio properties
+ * (never, if codec streams aren't available)
+ */
+bool ape_decode_supported(int,int,int,int);
+
+/* builds the WAVE header that ape_decode_open() sends, from the header stored in the file (NULL if there is none)
+ * and the audio properties.  returns its size, or 0 if the properties are invalid.
+ */
+int ape_make_header(unsigned char *,unsigned char *,int,int,int,wlong,wlong,char *);
+
+#endif
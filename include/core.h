@@ -24,6 +24,8 @@
 #define __CORE_H__
 
 #include "config.h"
+#include <sys/types.h>
+#include <sys/stat.h>
 
 
 
@@ -31,12 +33,15 @@
 #define GLOBAL_OPTS_CORE   "afhjmv"
 
 /* options reserved for global use - modes cannot use these */
-#define GLOBAL_OPTS        "DF:HP:hi:qr:vw"
+#define GLOBAL_OPTS        "CDF:HP:hi:j:qr:vw"
 #define GLOBAL_OPTS_OUTPUT "O:a:d:o:z:"
 
 /* set this environment variable to enable debugging.  can also use -D, but this enables it earlier */
 #define SHDTOOL_DEBUG_ENV "ST_DEBUG"
 
+/* set this environment variable to change the location of the probe cache enabled by -C */
+#define PROBE_CACHE_ENV "ST_PROBE_CACHE"
+
 /* various buffer sizes */
 #define PROGNAME_SIZE 256
 #define MAX_FILENAMES 32768
@@ -121,6 +126,8 @@ typedef struct _private_opts {
   bool   suppress_warnings;
   bool   suppress_stderr;
   bool   screen_dirty;
+  bool   use_probe_cache;
+  int    jobs;
   mode_module *mode;
 } private_opts;
 
@@ -147,4 +154,17 @@ void st_version(void);
 /* functions for building argument lists in format modules */
 void arg_init(format_module *);
 
+/* makes sure a freshly opened input stream is sending a valid WAVE header */
+bool verify_input_stream(wave_info *);
+
+/* functions to keep a verified input stream open until a mode reopens the same file */
+void park_input_stream(wave_info *);
+void close_parked_input_stream(void);
+void close_stale_parked_input_stream(char *);
+
+/* persistent cache of probe results, keyed by device, inode, size and modification time */
+bool probe_cache_lookup(wave_info *,struct stat *);
+void probe_cache_store(wave_info *,struct stat *);
+void probe_cache_close(void);
+
 #endif
@@ -40,6 +40,12 @@ unsigned long transfer_n_bytes_internal(FILE *,FILE *,FILE *,unsigned long,progr
 #define transfer_n_bytes(a,b,c,d)       transfer_n_bytes_internal(a,b,NULL,c,d)
 #define transfer_n_bytes2(a,b,c,d,e)    transfer_n_bytes_internal(a,b,c,d,e)
 
+/* copies up to n bytes between regular files and/or pipes in the kernel, returning how many it managed */
+unsigned long copy_n_bytes_in_kernel(FILE *,FILE *,unsigned long);
+
+/* skips n bytes of a file, seeking past them when possible */
+unsigned long skip_n_bytes(FILE *,unsigned long,progress_info *);
+
 /* reads an unsigned long in big- and/or little-endian format from a file descriptor */
 bool read_value_long(FILE * file,unsigned long *,unsigned long *,unsigned char *);
 #define read_tag(f,t)     read_value_long(f,NULL,NULL,t)
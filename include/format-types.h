@@ -29,12 +29,31 @@
 
 #define MAX_CHILD_ARGS 256
 
+/* number of bytes read from the beginning of each input file for format detection */
+#define SNIFF_SIZE 16384
+
+/* maximum number of format modules whose magic strings can match a single file */
+#define MAX_MAGIC_MATCHES 8
+
 /* child argument lists */
 typedef struct _child_args {
   int num_args;
   char *args[MAX_CHILD_ARGS];
 } child_args;
 
+/* beginning of an input file, read once and shared by all format modules during format detection */
+typedef struct _sniff_buffer {
+  char *filename;                            /* file name of input file */
+  FILE *file;                                /* input file, used when a format needs to look past the buffered data */
+  unsigned char data[SNIFF_SIZE];            /* first bytes of the input file, following any ID3v2 tag */
+  int size;                                  /* number of valid bytes in data */
+  bool file_has_id3v2_tag;                   /* does this file contain an ID3v2 tag? */
+  wlong id3v2_tag_size;                      /* size of the ID3v2 tag this file contains, if any */
+  struct _format_module
+        *magic_matches[MAX_MAGIC_MATCHES];   /* format modules whose magic string was found in data */
+  int num_magic_matches;                     /* number of entries in magic_matches */
+} sniff_buffer;
+
 typedef struct _format_module {
   /* set at compile time */
   char   *const name;                        /* format name, specified on command line in certain modes */
@@ -58,12 +77,13 @@ typedef struct _format_module {
   char   *encoder_args;                      /* encoder arguments */
 
   /* optional functions - set to NULL if not applicable */
-  bool  (*is_our_file)(char *);              /* routine to determine whether the given file belongs to this format plugin */
+  bool  (*is_our_file)(sniff_buffer *);      /* routine to determine whether the given (sniffed) file belongs to this format plugin */
   FILE *(*input_func)(char *,proc_info *);   /* routine to open a file of this format for input - if NULL, shdtool will launch the decoder */
   FILE *(*output_func)(char *,proc_info *);  /* routine to open a file of this format for output - if NULL, shdtool will launch the encoder */
   void  (*extra_info)(char *);               /* routine to display extra information in info mode */
   void  (*create_output_filename)(char *);   /* routine to create a custom output filename */
   bool  (*input_header_kluge)(unsigned char *,struct _wave_info *);  /* routine to determine correct header info for when decoders are unable to do so themselves */
+  bool  (*probe_func)(sniff_buffer *,struct _wave_info *);  /* routine to fill out WAVE info from the file's own header, so that no decoder is needed until PCM data is read */
 
   /* internal argument lists (do not assign these in format modules) */
   child_args input_args_template;           /* input argument template (filled out by shdtool, based on default_decoder_args) */
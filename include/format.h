@@ -44,7 +44,17 @@ format_module *find_format(char *);
 FILE *launch_input(format_module *,char *,proc_info *);
 FILE *launch_output(format_module *,char *,proc_info *);
 
+/* reads the beginning of an input file into a sniff buffer, skipping any ID3v2 tag */
+bool sniff_open(sniff_buffer *,char *);
+void sniff_close(sniff_buffer *);
+
+/* reads bytes at the given offset (relative to the end of any ID3v2 tag) from a sniffed file */
+int sniff_read(sniff_buffer *,long,unsigned char *,int);
+
 /* generic check for "magic" strings at known offsets */
-bool check_for_magic(char *,char *,int);
+bool check_for_magic(sniff_buffer *,char *,int);
+
+/* determines whether the format module's magic string matches the sniffed file, using a lookup table */
+bool sniff_magic_matches(sniff_buffer *,format_module *);
 
 #endif
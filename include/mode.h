@@ -95,6 +95,9 @@ wlong smrt_parse(unsigned char *,wave_info *);
 /* function to determine whether odd-sized data chunks are NULL-padded to an even length */
 bool odd_sized_data_chunk_is_null_padded(wave_info *);
 
+/* records whether the byte after an odd-sized data chunk is a NULL pad, for modes that have just read the data */
+void check_null_pad(wave_info *);
+
 /* functions for building argument lists in format modules */
 void arg_reset(child_args *);
 void arg_add(child_args *,char *);
@@ -105,6 +108,19 @@ void prog_update(progress_info *);
 void prog_success(progress_info *);
 void prog_error(progress_info *);
 
+/* function to run a mode's per-file routine on every input file, several files at a time with -j */
+bool run_input_jobs(bool (*)(char *),void (*)(unsigned char *,int));
+
+/* function to pass per-file results (e.g. running totals) from a job back to the mode's merge routine */
+void job_send_result(unsigned char *,int);
+
+/* function to get the number of jobs that may run at once (-j) */
+int job_limit(void);
+
+/* functions to share the processors among the jobs actually running at once, for codecs and modes that use threads */
+void set_jobs_at_once(int);
+int job_threads(int);
+
 /* functions for managing the input file source */
 void input_init(int,int,char **);
 char *input_get_filename();
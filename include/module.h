@@ -75,6 +75,9 @@ char *scan_env(char *);
 /* function to determine whether the data on the given file pointer contains an ID3v2 tag */
 unsigned long check_for_id3v2_tag(FILE *);
 
+/* function to determine whether the given buffer begins with an ID3v2 header - returns the tag size if so */
+unsigned long parse_id3v2_header(unsigned char *);
+
 /* function to trim carriage returns and newlines from the end of strings */
 void trim(char *);
 
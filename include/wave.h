@@ -30,6 +30,7 @@
 #define WAVE_WAVE                       "WAVE"
 #define WAVE_FMT                        "fmt "
 #define WAVE_DATA                       "data"
+#define WAVE_JUNK                       "JUNK"
 
 #define AIFF_FORM                       "FORM"
 #define AIFF_FORM_TYPE_AIFF             "AIFF"
@@ -59,6 +60,7 @@
 #define WAVE_FORMAT_MPEGLAYER3          (0x0055)
 #define WAVE_FORMAT_G726_ADPCM          (0x0064)
 #define WAVE_FORMAT_G722_ADPCM          (0x0065)
+#define WAVE_FORMAT_EXTENSIBLE          (0xfffe)
 
 #define CD_BLOCK_SIZE                   (2352)
 #define CD_BLOCKS_PER_SEC               (75)
@@ -71,6 +73,8 @@
 
 #define CANONICAL_HEADER_SIZE           (44)
 
+#define HEADER_CACHE_SIZE               (2048)
+
 #define PROBLEM_NOT_CD_QUALITY          (0x00000001)
 #define PROBLEM_CD_BUT_BAD_BOUND        (0x00000002)
 #define PROBLEM_CD_BUT_TOO_SHORT        (0x00000004)
@@ -94,6 +98,11 @@
 #define PROB_DATA_NOT_ALIGNED(f)        ((f->problems) & (PROBLEM_DATA_NOT_ALIGNED))
 #define PROB_ODD_SIZED_DATA(f)          (f->data_size & 1)
 
+/* whether an odd-sized data chunk is followed by a NULL pad byte, once something has looked */
+#define NULL_PAD_UNKNOWN                (0)
+#define NULL_PAD_PRESENT                (1)
+#define NULL_PAD_ABSENT                 (2)
+
 typedef struct _wave_info {
   char *filename,              /* file name of input file                             */
         m_ss[16];              /* length, in m:ss.nnn or m:ss.ff format               */
@@ -136,6 +145,16 @@ typedef struct _wave_info {
   bool file_has_id3v2_tag;     /* does this file contain an ID3v2 tag?                */
   bool stream_has_id3v2_tag;   /* does the decoded input stream contain an ID3v2 tag? */
   wlong id3v2_tag_size;        /* size of the ID3v2 tag this file contains, if any    */
+
+  unsigned char header_cache[HEADER_CACHE_SIZE];
+                               /* WAVE header bytes already read from the input stream */
+  wint header_cached,          /* number of valid bytes in header_cache               */
+       header_cache_pos;       /* number of header bytes consumed so far by readers   */
+
+  bool header_probed;          /* was this info read from the file's own header,      */
+                               /* rather than from the decoded input stream?          */
+
+  int null_pad;                /* NULL_PAD_* state of the byte after odd-sized data   */
 } wave_info;
 
 /* returns a wave_info struct, filled out with the values of the WAVE data contained in the filename given. */
@@ -158,8 +177,19 @@ void put_data_size(unsigned char *,int,unsigned long);
 /* kluges the WAVE header to get correct values when helper programs don't provide them */
 bool do_header_kluges(unsigned char *,wave_info *);
 
+/* reads WAVE header bytes from the input stream, using any bytes already cached in the wave_info struct first */
+int read_header_bytes(wave_info *,unsigned char *,int);
+
 /* verifies that data coming in on the associated file descriptor describes a valid WAVE header */
 bool verify_wav_header_internal(wave_info *,bool);
 #define verify_wav_header(a) verify_wav_header_internal(a,FALSE)
 
+/* fills out the wave_info struct from a WAVE header stored in the input file, which its decoder will send verbatim */
+bool probe_wav_header(wave_info *,unsigned char *,int);
+
+/* fills out the wave_info struct as if the decoder had sent a canonical WAVE header describing the given
+ * number of channels, bits/sample, samples/sec and samples (per channel)
+ */
+bool probe_canonical_header(wave_info *,wshort,wshort,wlong,wlong);
+
 #endif
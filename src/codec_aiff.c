@@ -0,0 +1,455 @@
+/*  codec_aiff.c - in-process AIFF reader and writer
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * AIFF sound data is just PCM, stored big-endian (or little-endian, for AIFF-C
+ * 'sowt'), with signed 8-bit samples where WAVE has unsigned ones.  So both
+ * directions come down to swapping bytes, and flipping the sign bit of 8-bit
+ * samples - which is done a 64-bit word at a time wherever possible.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "shdtool.h"
+#include "codec.h"
+
+#define AIFF_HEADER_SIZE  54        /* FORM, COMM and SSND chunk headers, as written here */
+#define AIFF_COMM_SIZE    18
+#define AIFF_BUF_SIZE     65536
+
+typedef struct _aiff_decoder {
+  FILE          *file;
+  int            bytes_per_sample;
+  bool           swap;
+  wlong          data_left;
+  bool           pad_byte;
+  unsigned char  out[CANONICAL_HEADER_SIZE];   /* the WAVE header, or a sample split between reads */
+  int            out_pos;
+  int            out_len;
+} aiff_decoder;
+
+typedef struct _aiff_encoder {
+  char          *filename;
+  FILE          *out;
+  bool           started;
+  bool           failed;
+  int            channels;
+  int            bytes_per_sample;
+  wlong          samples_per_sec;
+  wlong          expected_size;
+  wlong          data_size;
+  unsigned char  partial[4];                   /* a sample split between writes */
+  int            partial_len;
+  unsigned char *buf;
+} aiff_encoder;
+
+static void flip_sign_8(unsigned char *p,size_t len)
+{
+  uint64_t w;
+  size_t i;
+
+  for (i=0;i+8<=len;i+=8) {
+    memcpy(&w,p+i,8);
+    w ^= 0x8080808080808080ULL;
+    memcpy(p+i,&w,8);
+  }
+
+  for (;i<len;i++)
+    p[i] ^= 0x80;
+}
+
+static void swap_16(unsigned char *p,size_t len)
+{
+  uint64_t w;
+  unsigned char t;
+  size_t i;
+
+  for (i=0;i+8<=len;i+=8) {
+    memcpy(&w,p+i,8);
+    w = ((w & 0x00ff00ff00ff00ffULL) << 8) | ((w >> 8) & 0x00ff00ff00ff00ffULL);
+    memcpy(p+i,&w,8);
+  }
+
+  for (;i+2<=len;i+=2) {
+    t = p[i];
+    p[i] = p[i+1];
+    p[i+1] = t;
+  }
+}
+
+static void swap_24(unsigned char *p,size_t len)
+{
+  unsigned char t;
+  size_t i;
+
+  for (i=0;i+3<=len;i+=3) {
+    t = p[i];
+    p[i] = p[i+2];
+    p[i+2] = t;
+  }
+}
+
+static void swap_32(unsigned char *p,size_t len)
+{
+  uint64_t w;
+  unsigned char t;
+  size_t i;
+
+  for (i=0;i+8<=len;i+=8) {
+    memcpy(&w,p+i,8);
+    w = ((w & 0x00ff00ff00ff00ffULL) << 8) | ((w >> 8) & 0x00ff00ff00ff00ffULL);
+    w = ((w & 0x0000ffff0000ffffULL) << 16) | ((w >> 16) & 0x0000ffff0000ffffULL);
+    memcpy(p+i,&w,8);
+  }
+
+  for (;i+4<=len;i+=4) {
+    t = p[i];
+    p[i] = p[i+3];
+    p[i+3] = t;
+    t = p[i+1];
+    p[i+1] = p[i+2];
+    p[i+2] = t;
+  }
+}
+
+static void convert_samples(unsigned char *p,size_t len,int bytes_per_sample,bool swap)
+/* converts whole samples between AIFF and WAVE byte order - the same operation both ways */
+{
+  switch (bytes_per_sample) {
+    case 1:
+      flip_sign_8(p,len);
+      break;
+    case 2:
+      if (swap)
+        swap_16(p,len);
+      break;
+    case 3:
+      if (swap)
+        swap_24(p,len);
+      break;
+    default:
+      if (swap)
+        swap_32(p,len);
+      break;
+  }
+}
+
+/* reader */
+
+static int aiff_read(void *decoder,unsigned char *buf,int size)
+{
+  aiff_decoder *d = (aiff_decoder *)decoder;
+  int bytes,copied = 0;
+  size_t got;
+
+  while (copied < size) {
+    if (d->out_pos < d->out_len) {
+      bytes = min(size - copied,d->out_len - d->out_pos);
+      memcpy(buf + copied,d->out + d->out_pos,bytes);
+      d->out_pos += bytes;
+      copied += bytes;
+      continue;
+    }
+
+    if (0 == d->data_left) {
+      if (!d->pad_byte)
+        break;
+      d->out[0] = 0;
+      d->out_pos = 0;
+      d->out_len = 1;
+      d->pad_byte = FALSE;
+      continue;
+    }
+
+    /* whole samples are read straight into the caller's buffer, and converted there */
+    bytes = (int)min((wlong)(size - copied),d->data_left);
+    bytes -= bytes % d->bytes_per_sample;
+
+    if (0 == bytes) {
+      if (1 != fread(d->out,d->bytes_per_sample,1,d->file))
+        break;
+      convert_samples(d->out,d->bytes_per_sample,d->bytes_per_sample,d->swap);
+      d->out_pos = 0;
+      d->out_len = d->bytes_per_sample;
+      d->data_left -= d->bytes_per_sample;
+      continue;
+    }
+
+    got = fread(buf + copied,1,bytes,d->file);
+    got -= got % d->bytes_per_sample;
+
+    convert_samples(buf + copied,got,d->bytes_per_sample,d->swap);
+    copied += (int)got;
+    d->data_left -= got;
+
+    /* the file is shorter than its header says - let the mode report it */
+    if (got < (size_t)bytes) {
+      d->data_left = 0;
+      d->pad_byte = FALSE;
+      break;
+    }
+  }
+
+  return copied;
+}
+
+static int aiff_close(void *decoder)
+{
+  aiff_decoder *d = (aiff_decoder *)decoder;
+
+  if (d->file)
+    fclose(d->file);
+
+  st_free(d);
+
+  return 0;
+}
+
+bool aiff_decode_supported(aiff_header *ah)
+{
+#ifndef HAVE_CODEC_STREAMS
+  return FALSE;
+#endif
+
+  return (ah->channels > 0 && ah->samples > 0 && ah->samples_per_sec > 0 && ah->data_offset > 0 &&
+          (8 == ah->bits_per_sample || 16 == ah->bits_per_sample || 24 == ah->bits_per_sample || 32 == ah->bits_per_sample) &&
+          ah->samples <= (0xffffffffUL - CANONICAL_HEADER_SIZE) / ah->channels / (ah->bits_per_sample / 8));
+}
+
+FILE *aiff_decode_open(FILE *file,aiff_header *ah)
+/* takes over a file positioned at the start of the sound data described by ah.  returns NULL if it
+ * can't be read in-process, in which case the file has been closed.
+ */
+{
+  aiff_decoder *d;
+  wave_info info;
+
+  if (!aiff_decode_supported(ah) || NULL == (d = calloc(1,sizeof(aiff_decoder)))) {
+    fclose(file);
+    return NULL;
+  }
+
+  d->file = file;
+  d->bytes_per_sample = ah->bits_per_sample / 8;
+  d->swap = !ah->little_endian;
+
+  memset(&info,0,sizeof(info));
+
+  info.wave_format = WAVE_FORMAT_PCM;
+  info.channels = ah->channels;
+  info.samples_per_sec = ah->samples_per_sec;
+  info.bits_per_sample = ah->bits_per_sample;
+  info.block_align = ah->channels * d->bytes_per_sample;
+  info.avg_bytes_per_sec = info.samples_per_sec * info.block_align;
+  info.data_size = ah->samples * info.block_align;
+  info.chunk_size = CANONICAL_HEADER_SIZE - 8 + info.data_size + (info.data_size & 1);
+
+  d->data_left = info.data_size;
+  d->pad_byte = (info.data_size & 1) ? TRUE : FALSE;
+
+  make_canonical_header(d->out,&info);
+  d->out_pos = 0;
+  d->out_len = CANONICAL_HEADER_SIZE;
+
+  return open_decoder_stream(d,aiff_read,aiff_close);
+}
+
+/* writer */
+
+static void rate_to_extended(unsigned char *p,wlong rate)
+/* stores a sample rate as an 80-bit IEEE 754 extended precision number */
+{
+  int exponent = 16383 + 31;
+
+  memset(p,0,10);
+
+  if (0 == rate)
+    return;
+
+  while (!(rate & 0x80000000UL)) {
+    rate <<= 1;
+    exponent--;
+  }
+
+  p[0] = (unsigned char)(exponent >> 8);
+  p[1] = (unsigned char)exponent;
+  ulong_to_uchar_be(p + 2,rate);
+}
+
+static void make_aiff_header(aiff_encoder *e,unsigned char *h)
+{
+  wlong frames = e->data_size / (e->channels * e->bytes_per_sample);
+
+  tagcpy(h,(unsigned char *)AIFF_FORM);
+  ulong_to_uchar_be(h + 4,AIFF_HEADER_SIZE - 8 + e->data_size + (e->data_size & 1));
+  tagcpy(h + 8,(unsigned char *)AIFF_FORM_TYPE_AIFF);
+
+  tagcpy(h + 12,(unsigned char *)AIFF_COMM);
+  ulong_to_uchar_be(h + 16,AIFF_COMM_SIZE);
+  ushort_to_uchar_be(h + 20,(unsigned short)e->channels);
+  ulong_to_uchar_be(h + 22,frames);
+  ushort_to_uchar_be(h + 26,(unsigned short)(e->bytes_per_sample * 8));
+  rate_to_extended(h + 28,e->samples_per_sec);
+
+  /* no offset or block size */
+  tagcpy(h + 38,(unsigned char *)AIFF_SSND);
+  ulong_to_uchar_be(h + 42,8 + e->data_size);
+  ulong_to_uchar_be(h + 46,0);
+  ulong_to_uchar_be(h + 50,0);
+}
+
+static int aiff_start(void *encoder,codec_wave_format *wf)
+{
+  aiff_encoder *e = (aiff_encoder *)encoder;
+  unsigned char header[AIFF_HEADER_SIZE];
+
+  if (WAVE_FORMAT_PCM != wf->format || wf->channels < 1 || 0 != (wf->bits_per_sample % 8) ||
+      wf->bits_per_sample > 32 || wf->block_align != wf->channels * (wf->bits_per_sample / 8) || 0 == wf->samples_per_sec)
+  {
+    fclose(e->out);
+    e->out = NULL;
+    remove_file(e->filename);
+    return 0;
+  }
+
+  e->channels = wf->channels;
+  e->bytes_per_sample = wf->bits_per_sample / 8;
+  e->samples_per_sec = wf->samples_per_sec;
+  e->started = TRUE;
+
+  if (NULL == (e->buf = malloc(AIFF_BUF_SIZE))) {
+    e->failed = TRUE;
+    return -1;
+  }
+
+  /* written again at the end, should the data turn out to be shorter */
+  e->data_size = e->expected_size = wf->data_size - wf->data_size % wf->block_align;
+  make_aiff_header(e,header);
+  e->data_size = 0;
+
+  if (AIFF_HEADER_SIZE != fwrite(header,1,AIFF_HEADER_SIZE,e->out)) {
+    e->failed = TRUE;
+    return -1;
+  }
+
+  return 1;
+}
+
+static void write_samples(aiff_encoder *e,unsigned char *p,size_t len)
+{
+  size_t n;
+
+  while (len > 0 && !e->failed) {
+    n = min(len,(size_t)(AIFF_BUF_SIZE - AIFF_BUF_SIZE % 12));
+    n -= n % e->bytes_per_sample;
+
+    memcpy(e->buf,p,n);
+    convert_samples(e->buf,n,e->bytes_per_sample,TRUE);
+
+    if (n != fwrite(e->buf,1,n,e->out))
+      e->failed = TRUE;
+
+    e->data_size += n;
+    p += n;
+    len -= n;
+  }
+}
+
+static int aiff_write(void *encoder,unsigned char *buf,int size)
+{
+  aiff_encoder *e = (aiff_encoder *)encoder;
+  int n,whole,total = size;
+
+  if (e->partial_len) {
+    n = min(size,e->bytes_per_sample - e->partial_len);
+    memcpy(e->partial + e->partial_len,buf,n);
+    e->partial_len += n;
+    buf += n;
+    size -= n;
+
+    if (e->partial_len < e->bytes_per_sample)
+      return total;
+
+    write_samples(e,e->partial,e->bytes_per_sample);
+    e->partial_len = 0;
+  }
+
+  whole = size - size % e->bytes_per_sample;
+  write_samples(e,buf,whole);
+
+  e->partial_len = size - whole;
+  memcpy(e->partial,buf + whole,e->partial_len);
+
+  return (e->failed) ? -1 : total;
+}
+
+static int aiff_finish(void *encoder)
+{
+  aiff_encoder *e = (aiff_encoder *)encoder;
+  unsigned char header[AIFF_HEADER_SIZE];
+  int retval = 0;
+
+  if (e->started && !e->failed) {
+    /* a stray partial sample frame can't be described in the header, so it is dropped */
+    if (e->data_size % (e->channels * e->bytes_per_sample))
+      st_debug1("dropping partial sample frame at end of AIFF file: [%s]",e->filename);
+
+    if (e->data_size & 1)
+      fputc(0,e->out);
+
+    if (e->data_size != e->expected_size) {
+      make_aiff_header(e,header);
+      if (fseek(e->out,0,SEEK_SET) || AIFF_HEADER_SIZE != fwrite(header,1,AIFF_HEADER_SIZE,e->out))
+        e->failed = TRUE;
+    }
+  }
+
+  if (e->out && fclose(e->out))
+    e->failed = TRUE;
+
+  if (e->failed) {
+    st_warning("error while writing AIFF file: [%s]",e->filename);
+    retval = EOF;
+  }
+
+  st_free(e->buf);
+  st_free(e->filename);
+  st_free(e);
+
+  return retval;
+}
+
+FILE *aiff_encode_open(char *filename,FILE *(*fallback)(char *,proc_info *))
+/* creates an AIFF file from the WAVE data written to the returned stream.  WAVE data that isn't plain PCM
+ * with whole-byte samples is passed on to the stream returned by fallback(), which launches the helper.
+ */
+{
+  aiff_encoder *e;
+
+  if (NULL == (e = calloc(1,sizeof(aiff_encoder))))
+    return NULL;
+
+  if (NULL == (e->filename = strdup(filename)) || NULL == (e->out = fopen(filename,"wb"))) {
+    st_free(e->filename);
+    st_free(e);
+    return NULL;
+  }
+
+  return open_wave_encoder_stream(e,filename,aiff_start,aiff_write,aiff_finish,fallback);
+}
@@ -0,0 +1,961 @@
+/*  codec_alac.c - in-process ALAC decoder
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * ALAC audio lives in an MP4 container, one packet per MP4 sample.  The file is mapped into memory, and the
+ * sample tables of the first ALAC track are read to find each packet (stsz/stsc/stco or co64) and how many
+ * samples it holds (stts).  Packets don't depend on each other, so the stream returned by alac_decode_open()
+ * decodes one packet at a time as it is read, and can seek by jumping to the packet it needs.
+ *
+ * The packet decoder follows the layout of Apple's reference decoder: each packet is a run of elements, of which
+ * only a single-channel or channel-pair element carries audio for mono and stereo files.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "shdtool.h"
+#include "codec.h"
+
+#define MP4_ATOM_MOOV "moov"
+#define MP4_ATOM_TRAK "trak"
+#define MP4_ATOM_MDIA "mdia"
+#define MP4_ATOM_MINF "minf"
+#define MP4_ATOM_STBL "stbl"
+#define MP4_ATOM_STSD "stsd"
+#define MP4_ATOM_STTS "stts"
+#define MP4_ATOM_STSC "stsc"
+#define MP4_ATOM_STSZ "stsz"
+#define MP4_ATOM_STCO "stco"
+#define MP4_ATOM_CO64 "co64"
+#define MP4_ATOM_ALAC "alac"
+
+/* offsets within an 'alac' sample description, counted from the start of the entry */
+#define ALAC_ENTRY_SIZE         36
+
+/* offsets within the 'alac' magic cookie, counted from its contents */
+#define ALAC_COOKIE_FRAME_LEN   4
+#define ALAC_COOKIE_BIT_DEPTH   9
+#define ALAC_COOKIE_PB          10
+#define ALAC_COOKIE_MB          11
+#define ALAC_COOKIE_KB          12
+#define ALAC_COOKIE_CHANNELS    13
+#define ALAC_COOKIE_SAMPLE_RATE 24
+#define ALAC_COOKIE_SIZE        28
+
+/* element types */
+#define ALAC_ID_SCE             0
+#define ALAC_ID_CPE             1
+#define ALAC_ID_DSE             4
+#define ALAC_ID_FIL             6
+#define ALAC_ID_END             7
+
+#define ALAC_MAX_CHANNELS       2
+#define ALAC_MAX_LPC_ORDER      32
+#define ALAC_MAX_FRAME_LEN      65536
+#define ALAC_RICE_THRESHOLD     8
+
+typedef struct _alac_decoder {
+  char          *filename;
+  unsigned char *map;
+  size_t         map_size;
+  unsigned char *data;              /* the MP4 file, past any ID3v2 tag */
+  size_t         size;
+  uint64_t       pos;               /* bit position in data */
+  uint64_t       end;               /* bit position where the current packet ends */
+  bool           overrun;
+
+  int            channels;
+  int            bits_per_sample;
+  int            bytes_per_sample;
+  int            block_align;
+  wlong          samples_per_sec;
+  uint32_t       frame_len;         /* from the magic cookie */
+  uint32_t       initial_history;
+  uint32_t       history_mult;
+  int            rice_limit;
+
+  wlong          packets;
+  uint64_t      *packet_offsets;
+  uint32_t      *packet_sizes;
+  wlong         *packet_starts;     /* the first sample of each packet, and the total at the end */
+  wlong          packet;            /* the next packet to decode */
+
+  int32_t       *error_buf[ALAC_MAX_CHANNELS];
+  int32_t       *sample_buf[ALAC_MAX_CHANNELS];
+  uint16_t      *extra_buf[ALAC_MAX_CHANNELS];
+
+  unsigned char  header[CANONICAL_HEADER_SIZE];
+  wlong          data_size;
+  unsigned char *out;
+  int            out_pos;
+  int            out_len;
+  wlong          out_start;         /* stream offset of out[0] */
+  wlong          out_packet;        /* the packet in out, or -1 if it holds the header or pad byte */
+  bool           pad_sent;
+  bool           failed;
+} alac_decoder;
+
+static uint32_t get_be32(unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(unsigned char *p)
+{
+  return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static int count_leading_zeros(uint64_t v)
+{
+#if defined(__GNUC__)
+  return __builtin_clzll(v);
+#else
+  int n = 0;
+
+  while (!(v & ((uint64_t)1 << 63))) {
+    v <<= 1;
+    n++;
+  }
+
+  return n;
+#endif
+}
+
+static int log2_int(uint32_t v)
+/* the position of the highest set bit, or 0 for 0 */
+{
+  return 63 - count_leading_zeros((uint64_t)(v | 1));
+}
+
+static int32_t sign_extend(uint32_t v,int bits)
+{
+  if (bits >= 32)
+    return (int32_t)v;
+
+  return (int32_t)(v << (32 - bits)) >> (32 - bits);
+}
+
+static int sign_of(int32_t v)
+{
+  return (v > 0) - (v < 0);
+}
+
+/* bit reader - ALAC packs bits starting from the most significant one */
+
+static uint64_t peek_64(alac_decoder *d)
+/* returns the next 64 bits (zero-filled past the end of data), starting at the byte holding the current bit */
+{
+  size_t byte = (size_t)(d->pos >> 3);
+  unsigned char *p = d->data + byte;
+  uint64_t v = 0;
+  int i;
+
+  if (byte + 8 <= d->size)
+    return get_be64(p);
+
+  for (i=0;i<8;i++)
+    v = (v << 8) | ((byte + i < d->size) ? p[i] : 0);
+
+  return v;
+}
+
+static uint32_t show_bits(alac_decoder *d,int bits)
+/* returns the next bits (up to 32) without reading them */
+{
+  if (0 == bits)
+    return 0;
+
+  return (uint32_t)((peek_64(d) << (d->pos & 7)) >> (64 - bits));
+}
+
+static void skip_bits(alac_decoder *d,int bits)
+{
+  d->pos += bits;
+
+  if (d->pos > d->end)
+    d->overrun = TRUE;
+}
+
+static uint32_t get_bits(alac_decoder *d,int bits)
+{
+  uint32_t v = show_bits(d,bits);
+
+  skip_bits(d,bits);
+
+  return v;
+}
+
+static uint32_t get_unary(alac_decoder *d)
+/* counts one bits up to, and including, the next zero bit - giving up after ALAC_RICE_THRESHOLD + 1 of them */
+{
+  int n = count_leading_zeros(~(peek_64(d) << (d->pos & 7)) | 1);
+
+  if (n > ALAC_RICE_THRESHOLD) {
+    skip_bits(d,ALAC_RICE_THRESHOLD + 1);
+    return ALAC_RICE_THRESHOLD + 1;
+  }
+
+  skip_bits(d,n + 1);
+
+  return (uint32_t)n;
+}
+
+/* packet decoder */
+
+static uint32_t decode_scalar(alac_decoder *d,int k,int bits)
+/* reads a value coded with the Rice parameter k, or escaped as a raw value of the given size */
+{
+  uint32_t x = get_unary(d),extra;
+
+  if (x > ALAC_RICE_THRESHOLD)
+    return get_bits(d,bits);
+
+  if (1 != k) {
+    extra = show_bits(d,k);
+    x = (x << k) - x;
+
+    /* a low part of 0 is coded in k-1 bits */
+    if (extra > 1) {
+      x += extra - 1;
+      skip_bits(d,k);
+    }
+    else
+      skip_bits(d,k - 1);
+  }
+
+  return x;
+}
+
+static bool decode_residuals(alac_decoder *d,int32_t *out,int samples,int bits,uint32_t history_mult)
+/* reads the prediction errors, with the Rice parameter adapting to their recent size */
+{
+  uint32_t history = d->initial_history,x;
+  int i,k,run,sign_modifier = 0;
+
+  for (i=0;i<samples;i++) {
+    k = min(log2_int((history >> 9) + 3),d->rice_limit);
+    x = decode_scalar(d,k,bits) + sign_modifier;
+    sign_modifier = 0;
+
+    out[i] = (int32_t)((x >> 1) ^ (0 - (x & 1)));
+
+    if (x > 0xffff)
+      history = 0xffff;
+    else
+      history += x * history_mult - ((history * history_mult) >> 9);
+
+    /* quiet stretches are coded as runs of zeros */
+    if (history < 128 && i + 1 < samples) {
+      k = min(7 - log2_int(history) + (int)((history + 16) >> 6),d->rice_limit);
+      run = (int)decode_scalar(d,k,16);
+
+      if (run > 0) {
+        if (run >= samples - i)
+          return FALSE;
+
+        memset(out + i + 1,0,run * sizeof(int32_t));
+        i += run;
+      }
+
+      if (run <= 0xffff)
+        sign_modifier = 1;
+
+      history = 0;
+    }
+
+    if (d->overrun)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void predict(int32_t *error,int32_t *out,int samples,int bits,int16_t *coefs,int order,int quant)
+/* undoes the adaptive LPC filter, adapting its coefficients as it goes.  the arithmetic wraps around like that of
+ * the reference decoder.
+ */
+{
+  int32_t *history = out,base,val;
+  uint32_t sum,error_val;
+  int i,j,error_sign,sign;
+
+  out[0] = error[0];
+
+  if (samples <= 1)
+    return;
+
+  if (0 == order) {
+    memcpy(out + 1,error + 1,(samples - 1) * sizeof(int32_t));
+    return;
+  }
+
+  /* order 31 means plain first-order prediction */
+  if (31 == order) {
+    for (i=1;i<samples;i++)
+      out[i] = sign_extend((uint32_t)out[i - 1] + (uint32_t)error[i],bits);
+    return;
+  }
+
+  for (i=1;i<=order && i<samples;i++)
+    out[i] = sign_extend((uint32_t)out[i - 1] + (uint32_t)error[i],bits);
+
+  for (;i<samples;i++) {
+    base = *history++;
+    error_val = (uint32_t)error[i];
+    sum = 0;
+
+    for (j=0;j<order;j++)
+      sum += ((uint32_t)history[j] - (uint32_t)base) * (uint32_t)(int32_t)coefs[j];
+
+    val = (int32_t)(((int64_t)(int32_t)sum + ((int64_t)1 << (quant - 1))) >> quant);
+    out[i] = sign_extend((uint32_t)val + (uint32_t)base + error_val,bits);
+
+    /* nudge the coefficients towards a smaller error */
+    if ((error_sign = sign_of((int32_t)error_val))) {
+      for (j=0;j<order && (int32_t)(error_val * (uint32_t)error_sign) > 0;j++) {
+        val = (int32_t)((uint32_t)base - (uint32_t)history[j]);
+        sign = sign_of(val) * error_sign;
+        coefs[j] -= sign;
+        val = (int32_t)((uint32_t)val * (uint32_t)sign);
+        error_val -= (uint32_t)(val >> quant) * (uint32_t)(j + 1);
+      }
+    }
+  }
+}
+
+static int decode_element(alac_decoder *d,int channels)
+/* decodes a single-channel or channel-pair element into sample_buf, and returns how many samples it holds */
+{
+  int16_t coefs[ALAC_MAX_CHANNELS][ALAC_MAX_LPC_ORDER];
+  int mode[ALAC_MAX_CHANNELS],quant[ALAC_MAX_CHANNELS],mult[ALAC_MAX_CHANNELS],order[ALAC_MAX_CHANNELS];
+  int has_size,extra_bits,bits,compressed,shift = 0,weight = 0,c,i;
+  uint32_t samples,a,b;
+
+  skip_bits(d,4 + 12);              /* element instance tag, unused */
+
+  has_size = (int)get_bits(d,1);
+  extra_bits = (int)get_bits(d,2) * 8;
+  compressed = !get_bits(d,1);
+  samples = (has_size) ? get_bits(d,32) : d->frame_len;
+
+  /* the size of escaped residuals - the channel pair's difference channel needs an extra bit */
+  bits = d->bits_per_sample - extra_bits + channels - 1;
+
+  if (0 == samples || samples > d->frame_len || bits > 32 || d->overrun)
+    return -1;
+
+  if (compressed) {
+    /* files written without compression may leave the Rice parameters out of the magic cookie */
+    if (0 == d->rice_limit)
+      return -1;
+
+    shift = (int)get_bits(d,8);
+    weight = (int)get_bits(d,8);
+
+    for (c=0;c<channels;c++) {
+      mode[c] = (int)get_bits(d,4);
+      quant[c] = (int)get_bits(d,4);
+      mult[c] = (int)get_bits(d,3);
+      order[c] = (int)get_bits(d,5);
+
+      if (0 == quant[c])
+        return -1;
+
+      for (i=order[c]-1;i>=0;i--)
+        coefs[c][i] = (int16_t)get_bits(d,16);
+    }
+
+    if (extra_bits)
+      for (i=0;i<(int)samples;i++)
+        for (c=0;c<channels;c++)
+          d->extra_buf[c][i] = (uint16_t)get_bits(d,extra_bits);
+
+    for (c=0;c<channels;c++) {
+      if (!decode_residuals(d,d->error_buf[c],(int)samples,bits,(uint32_t)mult[c] * d->history_mult / 4))
+        return -1;
+
+      /* mode 15 runs the residuals through a first-order filter first - the reference encoder never uses it */
+      if (15 == mode[c])
+        predict(d->error_buf[c],d->error_buf[c],(int)samples,bits,NULL,31,0);
+
+      predict(d->error_buf[c],d->sample_buf[c],(int)samples,bits,coefs[c],order[c],quant[c]);
+    }
+  }
+  else {
+    for (i=0;i<(int)samples;i++)
+      for (c=0;c<channels;c++)
+        d->sample_buf[c][i] = sign_extend(get_bits(d,d->bits_per_sample),d->bits_per_sample);
+
+    extra_bits = 0;
+  }
+
+  if (d->overrun)
+    return -1;
+
+  /* undo the mid/side coding */
+  if (2 == channels && weight) {
+    for (i=0;i<(int)samples;i++) {
+      a = (uint32_t)d->sample_buf[0][i];
+      b = (uint32_t)d->sample_buf[1][i];
+      a -= (uint32_t)((int32_t)(b * (uint32_t)weight) >> shift);
+      b += a;
+      d->sample_buf[0][i] = (int32_t)b;
+      d->sample_buf[1][i] = (int32_t)a;
+    }
+  }
+
+  /* the low bits that were left out of prediction */
+  if (extra_bits)
+    for (c=0;c<channels;c++)
+      for (i=0;i<(int)samples;i++)
+        d->sample_buf[c][i] = (int32_t)(((uint32_t)d->sample_buf[c][i] << extra_bits) | d->extra_buf[c][i]);
+
+  return (int)samples;
+}
+
+static bool skip_element(alac_decoder *d,int element)
+/* skips over data stream and fill elements, which carry no audio */
+{
+  int count;
+
+  if (ALAC_ID_DSE == element) {
+    skip_bits(d,4);                 /* element instance tag */
+    if (get_bits(d,1)) {
+      count = (int)get_bits(d,8);
+      if (255 == count)
+        count += (int)get_bits(d,8);
+      /* byte-aligned data */
+      d->pos = (d->pos + 7) & ~(uint64_t)7;
+    }
+    else {
+      count = (int)get_bits(d,8);
+      if (255 == count)
+        count += (int)get_bits(d,8);
+    }
+  }
+  else {
+    count = (int)get_bits(d,4);
+    if (15 == count)
+      count += (int)get_bits(d,8) - 1;
+  }
+
+  skip_bits(d,count * 8);
+
+  return !d->overrun;
+}
+
+static bool decode_packet(alac_decoder *d)
+/* decodes the next packet into d->out */
+{
+  unsigned char *p = d->out;
+  wlong count;
+  int element,samples = -1,i,c;
+  int32_t v;
+
+  d->pos = d->packet_offsets[d->packet] * 8;
+  d->end = d->pos + (uint64_t)d->packet_sizes[d->packet] * 8;
+  d->overrun = FALSE;
+
+  count = d->packet_starts[d->packet + 1] - d->packet_starts[d->packet];
+
+  while (ALAC_ID_END != (element = (int)get_bits(d,3)) && !d->overrun) {
+    switch (element) {
+      case ALAC_ID_SCE:
+      case ALAC_ID_CPE:
+        if (samples >= 0 || d->channels != ((ALAC_ID_CPE == element) ? 2 : 1))
+          goto damaged;
+        if ((samples = decode_element(d,d->channels)) < 0)
+          goto damaged;
+        break;
+      case ALAC_ID_DSE:
+      case ALAC_ID_FIL:
+        if (!skip_element(d,element))
+          goto damaged;
+        break;
+      default:
+        goto damaged;
+    }
+  }
+
+  if (d->overrun || samples < count)
+    goto damaged;
+
+  for (i=0;i<(int)count;i++) {
+    for (c=0;c<d->channels;c++) {
+      v = d->sample_buf[c][i];
+
+      *p++ = (unsigned char)(v & 0xff);
+      *p++ = (unsigned char)((v >> 8) & 0xff);
+      if (3 == d->bytes_per_sample)
+        *p++ = (unsigned char)((v >> 16) & 0xff);
+    }
+  }
+
+  d->out_packet = d->packet++;
+  d->out_pos = 0;
+  d->out_len = (int)(count * d->block_align);
+
+  return TRUE;
+
+damaged:
+  st_warning("ALAC packet %lu is damaged in file: [%s]",(unsigned long)d->packet,d->filename);
+  return FALSE;
+}
+
+static bool next_chunk(alac_decoder *d)
+{
+  d->out_start += d->out_len;
+
+  if (d->packet < d->packets)
+    return decode_packet(d);
+
+  /* the pad byte after an odd-sized data chunk */
+  d->out[0] = 0;
+  d->out_pos = 0;
+  d->out_len = 1;
+  d->out_packet = -1;
+  d->pad_sent = TRUE;
+
+  return TRUE;
+}
+
+static bool finished(alac_decoder *d)
+{
+  return d->packet >= d->packets && (d->pad_sent || !(d->data_size & 1));
+}
+
+static int alac_read(void *decoder,unsigned char *buf,int size)
+{
+  alac_decoder *d = (alac_decoder *)decoder;
+  int bytes,copied = 0;
+
+  while (copied < size) {
+    if (d->out_pos == d->out_len) {
+      if (d->failed || finished(d))
+        break;
+
+      if (!next_chunk(d)) {
+        d->failed = TRUE;
+        break;
+      }
+    }
+
+    bytes = min(size - copied,d->out_len - d->out_pos);
+    memcpy(buf + copied,d->out + d->out_pos,bytes);
+    d->out_pos += bytes;
+    copied += bytes;
+  }
+
+  if (0 == copied && d->failed)
+    return -1;
+
+  return copied;
+}
+
+static void send_header(alac_decoder *d)
+{
+  memcpy(d->out,d->header,CANONICAL_HEADER_SIZE);
+  d->out_start = 0;
+  d->out_pos = 0;
+  d->out_len = CANONICAL_HEADER_SIZE;
+  d->out_packet = -1;
+  d->packet = 0;
+  d->pad_sent = FALSE;
+}
+
+static int alac_seek(void *decoder,wlong offset)
+/* packets are independent, so the one holding the offset is decoded straight away */
+{
+  alac_decoder *d = (alac_decoder *)decoder;
+  wlong sample,lo,hi,mid;
+
+  if (d->failed || offset > CANONICAL_HEADER_SIZE + d->data_size)
+    return -1;
+
+  if (offset < CANONICAL_HEADER_SIZE) {
+    send_header(d);
+    d->out_pos = (int)offset;
+    return 0;
+  }
+
+  /* the very end is the end of the last packet */
+  sample = (offset - CANONICAL_HEADER_SIZE) / d->block_align;
+  if (sample >= d->packet_starts[d->packets])
+    sample = d->packet_starts[d->packets] - 1;
+
+  /* find the last packet starting at or before the sample */
+  for (lo=0,hi=d->packets-1;lo<hi;) {
+    mid = (lo + hi + 1) / 2;
+    if (d->packet_starts[mid] <= sample)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  if (d->out_packet != lo) {
+    d->packet = lo;
+
+    if (!decode_packet(d)) {
+      d->failed = TRUE;
+      return -1;
+    }
+
+    d->pad_sent = FALSE;
+  }
+
+  d->out_start = CANONICAL_HEADER_SIZE + d->packet_starts[lo] * d->block_align;
+  d->out_pos = (int)(offset - d->out_start);
+
+  return 0;
+}
+
+static int alac_close(void *decoder)
+{
+  alac_decoder *d = (alac_decoder *)decoder;
+  int c;
+
+  if (d->map)
+    munmap(d->map,d->map_size);
+
+  for (c=0;c<ALAC_MAX_CHANNELS;c++) {
+    st_free(d->error_buf[c]);
+    st_free(d->sample_buf[c]);
+    st_free(d->extra_buf[c]);
+  }
+
+  st_free(d->packet_offsets);
+  st_free(d->packet_sizes);
+  st_free(d->packet_starts);
+  st_free(d->out);
+  st_free(d->filename);
+  st_free(d);
+
+  return 0;
+}
+
+/* MP4 container */
+
+static bool map_file(alac_decoder *d)
+{
+  struct stat sz;
+  unsigned long tag_size;
+  int fd;
+
+  if ((fd = open(d->filename,O_RDONLY)) < 0)
+    return FALSE;
+
+  if (fstat(fd,&sz) || sz.st_size < 8 || (uint64_t)sz.st_size != (uint64_t)(size_t)sz.st_size) {
+    close(fd);
+    return FALSE;
+  }
+
+  d->map_size = (size_t)sz.st_size;
+  d->map = mmap(NULL,d->map_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+
+  if (MAP_FAILED == d->map) {
+    d->map = NULL;
+    return FALSE;
+  }
+
+  d->data = d->map;
+  d->size = d->map_size;
+
+  /* MP4 offsets count from the start of the MP4 data */
+  if (d->size > sizeof(id3v2_header) && (tag_size = parse_id3v2_header(d->map)) > 0) {
+    if (tag_size + sizeof(id3v2_header) + 8 > d->size)
+      return FALSE;
+    d->data += tag_size + sizeof(id3v2_header);
+    d->size -= tag_size + sizeof(id3v2_header);
+  }
+
+  return TRUE;
+}
+
+static bool find_atom(alac_decoder *d,uint64_t start,uint64_t end,char *type,uint64_t *contents,uint64_t *contents_end)
+/* finds the first atom of the given type between start and end, and returns where its contents begin and end */
+{
+  unsigned char *p;
+  uint64_t pos,size,header_size;
+
+  for (pos=start;pos+8<=end;pos+=size) {
+    p = d->data + pos;
+    size = get_be32(p);
+    header_size = 8;
+
+    if (1 == size) {
+      if (pos + 16 > end)
+        return FALSE;
+      size = get_be64(p + 8);
+      header_size = 16;
+    }
+    else if (0 == size) {
+      /* atom extends to the end of its container */
+      size = end - pos;
+    }
+
+    if (size < header_size || size > end - pos)
+      return FALSE;
+
+    if (!tagcmp(p + 4,(unsigned char *)type)) {
+      *contents = pos + header_size;
+      *contents_end = pos + size;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static bool read_cookie(alac_decoder *d,uint64_t stsd,uint64_t stsd_end)
+/* reads the decoder parameters from the magic cookie in the track's 'alac' sample description */
+{
+  uint64_t entry = stsd + 8,entry_end,cookie,cookie_end;
+  unsigned char *p;
+
+  if (entry + ALAC_ENTRY_SIZE > stsd_end || tagcmp(d->data + entry + 4,(unsigned char *)MP4_ATOM_ALAC))
+    return FALSE;
+
+  entry_end = entry + get_be32(d->data + entry);
+
+  if (entry_end > stsd_end || !find_atom(d,entry + ALAC_ENTRY_SIZE,entry_end,MP4_ATOM_ALAC,&cookie,&cookie_end) ||
+      cookie + ALAC_COOKIE_SIZE > cookie_end)
+    return FALSE;
+
+  p = d->data + cookie;
+
+  d->frame_len = get_be32(p + ALAC_COOKIE_FRAME_LEN);
+  d->bits_per_sample = p[ALAC_COOKIE_BIT_DEPTH];
+  d->history_mult = p[ALAC_COOKIE_PB];
+  d->initial_history = p[ALAC_COOKIE_MB];
+  d->rice_limit = p[ALAC_COOKIE_KB];
+  d->channels = p[ALAC_COOKIE_CHANNELS];
+  d->samples_per_sec = get_be32(p + ALAC_COOKIE_SAMPLE_RATE);
+
+  return TRUE;
+}
+
+static bool read_sample_tables(alac_decoder *d,uint64_t stbl,uint64_t stbl_end)
+/* works out where each packet is, how big it is, and which samples it holds */
+{
+  uint64_t atom,atom_end,chunk_pos;
+  uint32_t fixed_size,entries,chunks,first,next_first,per_chunk,count,delta,i,j;
+  unsigned char *p,*chunk_table;
+  bool co64 = FALSE;
+  wlong packet,chunk;
+
+  /* sizes */
+  if (!find_atom(d,stbl,stbl_end,MP4_ATOM_STSZ,&atom,&atom_end) || atom + 12 > atom_end)
+    return FALSE;
+
+  p = d->data + atom;
+  fixed_size = get_be32(p + 4);
+  d->packets = get_be32(p + 8);
+
+  if (0 == d->packets || (0 == fixed_size && (uint64_t)d->packets > (atom_end - atom - 12) / 4))
+    return FALSE;
+
+  if (NULL == (d->packet_sizes = malloc((size_t)d->packets * sizeof(uint32_t))) ||
+      NULL == (d->packet_offsets = malloc((size_t)d->packets * sizeof(uint64_t))) ||
+      NULL == (d->packet_starts = malloc(((size_t)d->packets + 1) * sizeof(wlong))))
+    return FALSE;
+
+  for (packet=0;packet<d->packets;packet++)
+    d->packet_sizes[packet] = (fixed_size) ? fixed_size : get_be32(p + 12 + packet * 4);
+
+  /* offsets of chunks, which hold runs of packets */
+  if (!find_atom(d,stbl,stbl_end,MP4_ATOM_STCO,&atom,&atom_end)) {
+    if (!find_atom(d,stbl,stbl_end,MP4_ATOM_CO64,&atom,&atom_end))
+      return FALSE;
+    co64 = TRUE;
+  }
+
+  if (atom + 8 > atom_end)
+    return FALSE;
+
+  chunks = get_be32(d->data + atom + 4);
+  chunk_table = d->data + atom + 8;
+
+  if ((uint64_t)chunks > (atom_end - atom - 8) / ((co64) ? 8 : 4))
+    return FALSE;
+
+  /* how many packets each chunk holds */
+  if (!find_atom(d,stbl,stbl_end,MP4_ATOM_STSC,&atom,&atom_end) || atom + 8 > atom_end)
+    return FALSE;
+
+  p = d->data + atom;
+  entries = get_be32(p + 4);
+
+  if ((uint64_t)entries > (atom_end - atom - 8) / 12)
+    return FALSE;
+
+  packet = 0;
+
+  for (i=0;i<entries;i++) {
+    first = get_be32(p + 8 + i * 12);
+    per_chunk = get_be32(p + 8 + i * 12 + 4);
+    next_first = (i + 1 < entries) ? get_be32(p + 8 + (i + 1) * 12) : chunks + 1;
+
+    if (first < 1 || next_first < first || next_first > chunks + 1)
+      return FALSE;
+
+    for (chunk=first-1;chunk<next_first-1;chunk++) {
+      chunk_pos = (co64) ? get_be64(chunk_table + chunk * 8) : get_be32(chunk_table + chunk * 4);
+
+      for (j=0;j<per_chunk;j++,packet++) {
+        if (packet >= d->packets || chunk_pos > d->size || d->packet_sizes[packet] > d->size - chunk_pos)
+          return FALSE;
+
+        d->packet_offsets[packet] = chunk_pos;
+        chunk_pos += d->packet_sizes[packet];
+      }
+    }
+  }
+
+  if (packet != d->packets)
+    return FALSE;
+
+  /* how many samples each packet holds */
+  if (!find_atom(d,stbl,stbl_end,MP4_ATOM_STTS,&atom,&atom_end) || atom + 8 > atom_end)
+    return FALSE;
+
+  p = d->data + atom;
+  entries = get_be32(p + 4);
+
+  if ((uint64_t)entries > (atom_end - atom - 8) / 8)
+    return FALSE;
+
+  d->packet_starts[0] = 0;
+  packet = 0;
+
+  for (i=0;i<entries;i++) {
+    count = get_be32(p + 8 + i * 8);
+    delta = get_be32(p + 8 + i * 8 + 4);
+
+    if (delta > d->frame_len || count > d->packets - packet)
+      return FALSE;
+
+    for (j=0;j<count;j++,packet++)
+      d->packet_starts[packet + 1] = d->packet_starts[packet] + delta;
+  }
+
+  return (packet == d->packets && d->packet_starts[packet] > 0);
+}
+
+static bool find_track(alac_decoder *d)
+/* finds the first track described by an 'alac' sample entry, like the format module does when probing */
+{
+  static char *stbl_path[] = { MP4_ATOM_MDIA, MP4_ATOM_MINF, MP4_ATOM_STBL, NULL };
+  uint64_t moov,moov_end,trak,trak_end,stbl,stbl_end,stsd,stsd_end;
+  char **path;
+
+  if (!find_atom(d,0,d->size,MP4_ATOM_MOOV,&moov,&moov_end))
+    return FALSE;
+
+  for (trak=moov;find_atom(d,trak,moov_end,MP4_ATOM_TRAK,&trak,&trak_end);trak=trak_end) {
+    stbl = trak;
+    stbl_end = trak_end;
+
+    for (path=stbl_path;*path;path++)
+      if (!find_atom(d,stbl,stbl_end,*path,&stbl,&stbl_end))
+        break;
+
+    if (*path || !find_atom(d,stbl,stbl_end,MP4_ATOM_STSD,&stsd,&stsd_end) || !read_cookie(d,stsd,stsd_end))
+      continue;
+
+    return read_sample_tables(d,stbl,stbl_end);
+  }
+
+  return FALSE;
+}
+
+bool alac_decode_supported(int channels,int bits_per_sample)
+{
+#ifdef HAVE_CODEC_STREAMS
+  return (channels >= 1 && channels <= ALAC_MAX_CHANNELS && (16 == bits_per_sample || 24 == bits_per_sample));
+#else
+  return FALSE;
+#endif
+}
+
+FILE *alac_decode_open(char *filename)
+/* opens an MP4 file for decoding its ALAC track in-process.  returns NULL if it can't be decoded this way, in which
+ * case the caller should fall back to the external decoder, which will report any real problems.
+ */
+{
+  alac_decoder *d;
+  wave_info info;
+  int c;
+
+#ifndef HAVE_CODEC_STREAMS
+  return NULL;
+#endif
+
+  if (NULL == (d = calloc(1,sizeof(alac_decoder))))
+    return NULL;
+
+  if (NULL == (d->filename = strdup(filename)) || !map_file(d))
+    goto fail;
+
+  if (!find_track(d))
+    goto fail;
+
+  /* from here on, packets are read in order */
+#ifdef MADV_SEQUENTIAL
+  madvise(d->map,d->map_size,MADV_SEQUENTIAL);
+#endif
+
+  if (!alac_decode_supported(d->channels,d->bits_per_sample) || 0 == d->frame_len || d->frame_len > ALAC_MAX_FRAME_LEN)
+    goto fail;
+
+  memset(&info,0,sizeof(info));
+  info.filename = d->filename;
+
+  if (!probe_canonical_header(&info,(wshort)d->channels,(wshort)d->bits_per_sample,d->samples_per_sec,d->packet_starts[d->packets]))
+    goto fail;
+
+  make_canonical_header(d->header,&info);
+
+  d->bytes_per_sample = d->bits_per_sample / 8;
+  d->block_align = d->channels * d->bytes_per_sample;
+  d->data_size = info.data_size;
+
+  for (c=0;c<d->channels;c++) {
+    if (NULL == (d->error_buf[c] = malloc(d->frame_len * sizeof(int32_t))) ||
+        NULL == (d->sample_buf[c] = malloc(d->frame_len * sizeof(int32_t))) ||
+        NULL == (d->extra_buf[c] = malloc(d->frame_len * sizeof(uint16_t))))
+      goto fail;
+  }
+
+  if (NULL == (d->out = malloc(max((size_t)d->frame_len * d->block_align,CANONICAL_HEADER_SIZE))))
+    goto fail;
+
+  send_header(d);
+
+  return open_seekable_decoder_stream(d,alac_read,alac_seek,alac_close);
+
+fail:
+  alac_close(d);
+  return NULL;
+}
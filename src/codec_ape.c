@@ -0,0 +1,1289 @@
+/*  codec_ape.c - in-process Monkey's Audio decoder
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Handles files written by Monkey's Audio 3.99 and later, which is what every
+ * release of the last two decades writes.  Older files are left to 'mac'.
+ *
+ * A file is a descriptor, a header, a seek table giving the position of each
+ * frame, the original WAVE header (unless 'mac' was told not to keep it), and
+ * the frames, which are stored as little-endian 32-bit words.  Each frame is
+ * coded independently: a range coder feeds up to three stages of adaptive
+ * "neural net" filters, followed by a predictor that works across channels.
+ * So the decoder maps the file into memory, decodes frames as the stream
+ * returned by ape_decode_open() is read, and can seek by jumping to the frame
+ * it needs.  Frames hold over six seconds of audio and take a while to
+ * decode at the higher compression levels, so when there are processors to
+ * spare, a pool of threads decodes the frames ahead of the reader.
+ *
+ * The stream starts with the stored WAVE header, with its sizes fixed up to
+ * match the audio - 'mac' sends it verbatim, sizes and all - or a canonical
+ * header if there is none.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "shdtool.h"
+#include "codec.h"
+
+#define APE_MAGIC                  "MAC "
+#define APE_MIN_VERSION            3990
+#define APE_DESCRIPTOR_SIZE        52
+#define APE_HEADER_SIZE            24
+#define APE_FLAG_CREATE_WAV_HEADER 0x0020
+#define APE_MAX_CHANNELS           2
+#define APE_MAX_BLOCKS_PER_FRAME   (1L << 22)
+#define APE_MAX_THREADS            16
+
+#define APE_FRAME_STEREO_SILENCE   3
+#define APE_FRAME_PSEUDO_STEREO    4
+
+/* range coder */
+#define APE_TOP_VALUE              ((uint32_t)1 << 31)
+#define APE_BOTTOM_VALUE           (APE_TOP_VALUE >> 8)
+#define APE_EXTRA_BITS             7
+#define APE_MODEL_ELEMENTS         64
+
+/* filters and predictor */
+#define APE_MAX_FILTERS            3
+#define APE_HISTORY_SIZE           512
+#define APE_PREDICTOR_SIZE         50
+
+#define APE_YDELAYA                50
+#define APE_YDELAYB                42
+#define APE_XDELAYA                34
+#define APE_XDELAYB                26
+#define APE_YADAPTA                18
+#define APE_XADAPTA                14
+#define APE_YADAPTB                10
+#define APE_XADAPTB                5
+
+#define APESIGN(x)                 (((x) < 0) - ((x) > 0))
+
+/* what became of a frame */
+#define APE_FRAME_OK               0
+#define APE_FRAME_DAMAGED          1
+#define APE_FRAME_BAD_CRC          2
+
+/* slots for decoded frames */
+#define APE_SLOT_FREE              0
+#define APE_SLOT_QUEUED            1
+#define APE_SLOT_BUSY              2
+#define APE_SLOT_DONE              3
+
+/* cumulative frequencies of the overflow part of each value */
+static const uint32_t counts_3980[22] = {
+  0,19578,36160,48417,56323,60899,63265,64435,64971,65232,65351,65416,65447,65466,65476,65482,65485,65488,65490,65491,65492,65493
+};
+
+/* filter orders and fractional bits, by compression level */
+static const int filter_orders[5][APE_MAX_FILTERS] = {
+  {0,0,0},{16,0,0},{64,0,0},{32,256,0},{16,256,1280}
+};
+
+static const int filter_fracbits[5][APE_MAX_FILTERS] = {
+  {0,0,0},{11,0,0},{11,0,0},{10,13,0},{11,13,15}
+};
+
+typedef struct _ape_range {
+  unsigned char *data;              /* the frame data, in its little-endian words */
+  size_t         pos;               /* byte position, as if the words were big-endian */
+  size_t         size;
+  uint32_t       low;
+  uint32_t       range;
+  uint32_t       help;
+  uint32_t       buffer;
+  bool           overrun;           /* read past the end, or found a symbol that can't be there */
+} ape_range;
+
+typedef struct _ape_rice {
+  uint32_t       k;
+  uint32_t       ksum;
+} ape_rice;
+
+typedef struct _ape_filter {
+  int            order;
+  int            fracbits;
+  int16_t       *coeffs;
+  int16_t       *history;           /* delay line, with the adaption values trailing it by order entries */
+  int16_t       *delay;
+  int16_t       *adapt;
+  int32_t        avg;
+} ape_filter;
+
+typedef struct _ape_predictor {
+  int64_t        history[APE_HISTORY_SIZE + APE_PREDICTOR_SIZE];
+  int64_t       *buf;
+  int64_t        last_a[2];
+  int64_t        filter_a[2];
+  int64_t        filter_b[2];
+  int32_t        coeffs_a[2][4];
+  int32_t        coeffs_b[2][5];
+} ape_predictor;
+
+typedef struct _ape_workspace {
+  int32_t       *decoded[APE_MAX_CHANNELS];
+  ape_filter     filters[APE_MAX_CHANNELS][APE_MAX_FILTERS];
+  ape_predictor  predictor;
+} ape_workspace;
+
+typedef struct _ape_slot {
+  wlong          frame;             /* the frame it holds or is waiting for, if not free */
+  int            state;
+  int            status;            /* APE_FRAME_... */
+  unsigned char *out;
+} ape_slot;
+
+typedef struct _ape_thread {
+  struct _ape_decoder *decoder;
+  ape_workspace *ws;
+  pthread_t      id;
+  bool           running;
+} ape_thread;
+
+typedef struct _ape_decoder {
+  char          *filename;
+  unsigned char *map;
+  size_t         map_size;
+  unsigned char *data;              /* the frames, starting with the first one */
+  size_t         size;
+  size_t        *frame_pos;         /* where each frame starts in data */
+
+  int            channels;
+  int            bytes_per_sample;
+  int            block_align;
+  int            level;             /* compression level, from 0 for 1000 ("fast") */
+  wlong          blocks_per_frame;
+  wlong          final_frame_blocks;
+  wlong          frames;
+
+  unsigned char  header[HEADER_CACHE_SIZE];
+  int            header_size;
+  wlong          data_size;
+  unsigned char  pad[1];
+  unsigned char *out;
+  int            out_pos;
+  int            out_len;
+  wlong          out_start;         /* stream offset of out[0] */
+  wlong          out_frame;         /* the frame in out, or -1 if it holds the header or pad byte */
+  wlong          frame;             /* the next frame to send */
+  bool           pad_sent;
+  bool           failed;
+
+  ape_slot      *slots;
+  int            num_slots;
+  ape_slot      *current;           /* slot being read from, if any */
+  wlong          next_queued;       /* the next frame to hand to the threads */
+
+  ape_workspace *ws;                /* for decoding without threads */
+  ape_thread    *threads;
+  int            num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  bool           quit;
+} ape_decoder;
+
+static uint32_t crc32_table[256];
+static bool crc_table_built = FALSE;
+
+static void build_crc_table()
+{
+  uint32_t crc;
+  int i,j;
+
+  for (i=0;i<256;i++) {
+    crc = (uint32_t)i;
+    for (j=0;j<8;j++)
+      crc = (crc & 1) ? ((crc >> 1) ^ 0xedb88320) : (crc >> 1);
+    crc32_table[i] = crc;
+  }
+
+  crc_table_built = TRUE;
+}
+
+static uint32_t crc32(unsigned char *buf,size_t len)
+{
+  uint32_t crc = 0xffffffff;
+
+  while (len--)
+    crc = crc32_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+  return crc ^ 0xffffffff;
+}
+
+static uint32_t get_le16(unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get_le32(unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* range decoder */
+
+static unsigned char get_byte(ape_range *rc)
+{
+  size_t pos = rc->pos++ ^ 3;
+
+  if (pos >= rc->size) {
+    rc->overrun = TRUE;
+    return 0;
+  }
+
+  return rc->data[pos];
+}
+
+static uint32_t get_be32(ape_range *rc)
+{
+  uint32_t v = 0;
+  int i;
+
+  for (i=0;i<4;i++)
+    v = (v << 8) | get_byte(rc);
+
+  return v;
+}
+
+static void range_start(ape_range *rc)
+{
+  rc->buffer = get_byte(rc);
+  rc->low = rc->buffer >> (8 - APE_EXTRA_BITS);
+  rc->range = (uint32_t)1 << APE_EXTRA_BITS;
+}
+
+static void range_normalize(ape_range *rc)
+{
+  while (rc->range <= APE_BOTTOM_VALUE) {
+    rc->buffer = (rc->buffer << 8) | get_byte(rc);
+    rc->low = (rc->low << 8) | ((rc->buffer >> 1) & 0xff);
+    rc->range <<= 8;
+  }
+}
+
+static uint32_t range_culfreq(ape_range *rc,uint32_t tot)
+{
+  range_normalize(rc);
+  rc->help = rc->range / tot;
+  return rc->low / rc->help;
+}
+
+static uint32_t range_culshift(ape_range *rc,int shift)
+{
+  range_normalize(rc);
+  rc->help = rc->range >> shift;
+  return rc->low / rc->help;
+}
+
+static void range_update(ape_range *rc,uint32_t sy_f,uint32_t lt_f)
+{
+  rc->low -= rc->help * lt_f;
+  rc->range = rc->help * sy_f;
+}
+
+static uint32_t range_bits(ape_range *rc,int bits)
+{
+  uint32_t sym = range_culshift(rc,bits);
+
+  range_update(rc,1,sym);
+
+  return sym;
+}
+
+static uint32_t range_symbol(ape_range *rc)
+{
+  uint32_t cf,symbol;
+
+  cf = range_culshift(rc,16);
+
+  /* the rarest symbols each get a frequency of one */
+  if (cf > 65492) {
+    if (cf > 65535)
+      rc->overrun = TRUE;
+    range_update(rc,1,cf);
+    return cf - 65535 + 63;
+  }
+
+  for (symbol=0;counts_3980[symbol+1]<=cf;symbol++)
+    ;
+
+  range_update(rc,counts_3980[symbol+1] - counts_3980[symbol],counts_3980[symbol]);
+
+  return symbol;
+}
+
+static void update_rice(ape_rice *rice,uint32_t x)
+{
+  uint32_t lim = rice->k ? ((uint32_t)1 << (rice->k + 4)) : 0;
+
+  rice->ksum += ((x + 1) / 2) - ((rice->ksum + 16) >> 5);
+
+  if (rice->ksum < lim)
+    rice->k--;
+  else if (rice->ksum >= ((uint32_t)1 << (rice->k + 5)) && rice->k < 24)
+    rice->k++;
+}
+
+static int32_t decode_value(ape_range *rc,ape_rice *rice)
+{
+  uint32_t x,overflow,base,pivot,base_hi,base_lo;
+  int bbits;
+
+  pivot = max(rice->ksum >> 5,1);
+
+  overflow = range_symbol(rc);
+
+  if (APE_MODEL_ELEMENTS - 1 == overflow) {
+    overflow = range_bits(rc,16) << 16;
+    overflow |= range_bits(rc,16);
+  }
+
+  if (pivot < 0x10000) {
+    base = range_culfreq(rc,pivot);
+    range_update(rc,1,base);
+  }
+  else {
+    /* the base won't fit in 16 bits, so it comes in two parts */
+    for (base_hi=pivot,bbits=0;base_hi & ~0xffff;bbits++)
+      base_hi >>= 1;
+
+    base_hi = range_culfreq(rc,base_hi + 1);
+    range_update(rc,1,base_hi);
+    base_lo = range_culfreq(rc,(uint32_t)1 << bbits);
+    range_update(rc,1,base_lo);
+
+    base = (base_hi << bbits) + base_lo;
+  }
+
+  x = base + overflow * pivot;
+
+  update_rice(rice,x);
+
+  return (int32_t)(((x >> 1) ^ ((x & 1) - 1)) + 1);
+}
+
+/* filters */
+
+static void init_filter(ape_filter *f)
+{
+  memset(f->coeffs,0,f->order * sizeof(int16_t));
+  memset(f->history,0,(APE_HISTORY_SIZE + f->order * 2) * sizeof(int16_t));
+  f->delay = f->history + f->order * 2;
+  f->adapt = f->history + f->order;
+  f->avg = 0;
+}
+
+static void run_filter(ape_filter *f,int32_t *data,wlong count)
+/* undoes one stage of adaptive filtering - the coefficients learn from the sign of each input */
+{
+  int16_t *coeffs = f->coeffs,*delay,*adapt;
+  int order = f->order,i;
+  int32_t in,res;
+  uint32_t sum,absres;
+
+  while (count--) {
+    in = *data;
+    delay = f->delay - order;
+    adapt = f->adapt - order;
+
+    for (sum=0,i=0;i<order;i++)
+      sum += (uint32_t)(coeffs[i] * delay[i]);
+
+    if (in < 0)
+      for (i=0;i<order;i++)
+        coeffs[i] = (int16_t)(coeffs[i] + adapt[i]);
+    else if (in > 0)
+      for (i=0;i<order;i++)
+        coeffs[i] = (int16_t)(coeffs[i] - adapt[i]);
+
+    res = (int32_t)(((int64_t)(int32_t)sum + ((int64_t)1 << (f->fracbits - 1))) >> f->fracbits);
+    res = (int32_t)((uint32_t)res + (uint32_t)in);
+    *data++ = res;
+
+    *f->delay++ = (int16_t)((res > 32767) ? 32767 : ((res < -32768) ? -32768 : res));
+
+    absres = (res < 0) ? (uint32_t)0 - (uint32_t)res : (uint32_t)res;
+
+    if (absres)
+      *f->adapt = (int16_t)(APESIGN(res) * (8 << (((int64_t)absres > (int64_t)f->avg * 3) +
+                                                  (absres > (uint32_t)(f->avg + f->avg / 3)))));
+    else
+      *f->adapt = 0;
+
+    f->avg += (int32_t)(absres - (uint32_t)f->avg) / 16;
+
+    f->adapt[-1] >>= 1;
+    f->adapt[-2] >>= 1;
+    f->adapt[-8] >>= 1;
+    f->adapt++;
+
+    if (f->delay == f->history + APE_HISTORY_SIZE + order * 2) {
+      memmove(f->history,f->delay - order * 2,order * 2 * sizeof(int16_t));
+      f->delay = f->history + order * 2;
+      f->adapt = f->history + order;
+    }
+  }
+}
+
+/* predictor - files from 3.99 on may need 64-bit arithmetic where older ones wrapped around at 32 bits, and
+ * nothing in the file says which, so a frame that fails its CRC check is decoded again the other way.
+ */
+
+#define NARROW(x) (wide ? (x) : (int64_t)(int32_t)(x))
+
+static void init_predictor(ape_predictor *p)
+{
+  static const int32_t initial_a[4] = {360,317,-109,98};
+  int f;
+
+  memset(p,0,sizeof(ape_predictor));
+
+  for (f=0;f<2;f++)
+    memcpy(p->coeffs_a[f],initial_a,sizeof(initial_a));
+
+  p->buf = p->history;
+}
+
+static void advance_predictor(ape_predictor *p)
+{
+  p->buf++;
+
+  if (p->buf == p->history + APE_HISTORY_SIZE) {
+    memmove(p->history,p->buf,APE_PREDICTOR_SIZE * sizeof(int64_t));
+    p->buf = p->history;
+  }
+}
+
+static int32_t predict_stereo(ape_predictor *p,int32_t decoded,int filter,int delay_a,int delay_b,int adapt_a,int adapt_b,bool wide)
+{
+  int64_t *buf = p->buf,prediction_a,prediction_b;
+  int32_t sign;
+  int i;
+
+  buf[delay_a] = p->last_a[filter];
+  buf[adapt_a] = APESIGN(buf[delay_a]);
+  buf[delay_a - 1] = NARROW((int64_t)((uint64_t)buf[delay_a] - (uint64_t)buf[delay_a - 1]));
+  buf[adapt_a - 1] = APESIGN(buf[delay_a - 1]);
+
+  prediction_a = 0;
+  for (i=0;i<4;i++)
+    prediction_a += buf[delay_a - i] * p->coeffs_a[filter][i];
+
+  /* the other channel, through a first-order filter */
+  buf[delay_b] = NARROW(p->filter_a[filter ^ 1] - ((int64_t)((uint64_t)p->filter_b[filter] * 31) >> 5));
+  buf[adapt_b] = APESIGN(buf[delay_b]);
+  buf[delay_b - 1] = NARROW((int64_t)((uint64_t)buf[delay_b] - (uint64_t)buf[delay_b - 1]));
+  buf[adapt_b - 1] = APESIGN(buf[delay_b - 1]);
+  p->filter_b[filter] = p->filter_a[filter ^ 1];
+
+  prediction_b = 0;
+  for (i=0;i<5;i++)
+    prediction_b += buf[delay_b - i] * p->coeffs_b[filter][i];
+
+  if (wide)
+    p->last_a[filter] = decoded + ((int64_t)((uint64_t)prediction_a + (uint64_t)(prediction_b >> 1)) >> 10);
+  else
+    p->last_a[filter] = (int32_t)((uint32_t)decoded +
+                                  (uint32_t)((int32_t)((uint32_t)prediction_a + (uint32_t)((int32_t)prediction_b >> 1)) >> 10));
+
+  p->filter_a[filter] = p->last_a[filter] + ((int64_t)((uint64_t)p->filter_a[filter] * 31) >> 5);
+
+  sign = APESIGN(decoded);
+  for (i=0;i<4;i++)
+    p->coeffs_a[filter][i] += (int32_t)buf[adapt_a - i] * sign;
+  for (i=0;i<5;i++)
+    p->coeffs_b[filter][i] += (int32_t)buf[adapt_b - i] * sign;
+
+  return (int32_t)p->filter_a[filter];
+}
+
+static void predict_frame_stereo(ape_predictor *p,int32_t *y,int32_t *x,wlong count,bool wide)
+{
+  wlong i;
+
+  for (i=0;i<count;i++) {
+    y[i] = predict_stereo(p,y[i],0,APE_YDELAYA,APE_YDELAYB,APE_YADAPTA,APE_YADAPTB,wide);
+    x[i] = predict_stereo(p,x[i],1,APE_XDELAYA,APE_XDELAYB,APE_XADAPTA,APE_XADAPTB,wide);
+    advance_predictor(p);
+  }
+}
+
+static void predict_frame_mono(ape_predictor *p,int32_t *a,wlong count,bool wide)
+{
+  int64_t *buf,prediction;
+  int32_t current,sign;
+  wlong n;
+  int i;
+
+  current = (int32_t)p->last_a[0];
+
+  for (n=0;n<count;n++) {
+    buf = p->buf;
+
+    buf[APE_YDELAYA] = current;
+    buf[APE_YDELAYA - 1] = NARROW((int64_t)((uint64_t)buf[APE_YDELAYA] - (uint64_t)buf[APE_YDELAYA - 1]));
+
+    prediction = 0;
+    for (i=0;i<4;i++)
+      prediction += buf[APE_YDELAYA - i] * p->coeffs_a[0][i];
+
+    current = (int32_t)((uint32_t)a[n] + (uint32_t)(NARROW(prediction) >> 10));
+
+    buf[APE_YADAPTA] = APESIGN(buf[APE_YDELAYA]);
+    buf[APE_YADAPTA - 1] = APESIGN(buf[APE_YDELAYA - 1]);
+
+    sign = APESIGN(a[n]);
+    for (i=0;i<4;i++)
+      p->coeffs_a[0][i] += (int32_t)buf[APE_YADAPTA - i] * sign;
+
+    advance_predictor(p);
+
+    p->filter_a[0] = current + ((int64_t)((uint64_t)p->filter_a[0] * 31) >> 5);
+    a[n] = (int32_t)p->filter_a[0];
+  }
+
+  p->last_a[0] = current;
+}
+
+#undef NARROW
+
+/* frames */
+
+static wlong frame_blocks(ape_decoder *d,wlong frame)
+{
+  return (frame == d->frames - 1) ? d->final_frame_blocks : d->blocks_per_frame;
+}
+
+static int decode_frame_once(ape_decoder *d,ape_workspace *ws,wlong frame,unsigned char *out,bool wide)
+{
+  ape_range rc;
+  ape_rice rice[APE_MAX_CHANNELS];
+  int32_t *y = ws->decoded[0],*x = ws->decoded[1],left;
+  uint32_t stored_crc,flags = 0;
+  wlong blocks,i;
+  unsigned char *p;
+  int c,f;
+
+  blocks = frame_blocks(d,frame);
+
+  memset(&rc,0,sizeof(rc));
+  rc.data = d->data;
+  rc.size = d->size;
+  rc.pos = d->frame_pos[frame];
+
+  stored_crc = get_be32(&rc);
+  if (stored_crc & 0x80000000) {
+    stored_crc &= 0x7fffffff;
+    flags = get_be32(&rc);
+  }
+
+  /* the first byte of range coded data is always zero */
+  get_byte(&rc);
+  range_start(&rc);
+
+  for (c=0;c<APE_MAX_CHANNELS;c++) {
+    rice[c].k = 10;
+    rice[c].ksum = ((uint32_t)1 << rice[c].k) * 16;
+    for (f=0;f<APE_MAX_FILTERS && ws->filters[c][f].order;f++)
+      init_filter(&ws->filters[c][f]);
+  }
+
+  init_predictor(&ws->predictor);
+
+  if (1 == d->channels || (flags & APE_FRAME_PSEUDO_STEREO)) {
+    if (flags & APE_FRAME_STEREO_SILENCE)
+      memset(y,0,blocks * sizeof(int32_t));
+    else {
+      for (i=0;i<blocks;i++)
+        y[i] = decode_value(&rc,&rice[0]);
+      for (f=0;f<APE_MAX_FILTERS && ws->filters[0][f].order;f++)
+        run_filter(&ws->filters[0][f],y,blocks);
+      predict_frame_mono(&ws->predictor,y,blocks,wide);
+    }
+
+    if (2 == d->channels)
+      memcpy(x,y,blocks * sizeof(int32_t));
+  }
+  else if (APE_FRAME_STEREO_SILENCE == (flags & APE_FRAME_STEREO_SILENCE)) {
+    memset(y,0,blocks * sizeof(int32_t));
+    memset(x,0,blocks * sizeof(int32_t));
+  }
+  else {
+    for (i=0;i<blocks;i++) {
+      y[i] = decode_value(&rc,&rice[0]);
+      x[i] = decode_value(&rc,&rice[1]);
+    }
+
+    for (f=0;f<APE_MAX_FILTERS && ws->filters[0][f].order;f++) {
+      run_filter(&ws->filters[0][f],y,blocks);
+      run_filter(&ws->filters[1][f],x,blocks);
+    }
+
+    predict_frame_stereo(&ws->predictor,y,x,blocks,wide);
+
+    /* x and y become left and right */
+    for (i=0;i<blocks;i++) {
+      left = (int32_t)((uint32_t)x[i] - (uint32_t)(y[i] / 2));
+      x[i] = (int32_t)((uint32_t)left + (uint32_t)y[i]);
+      y[i] = left;
+    }
+  }
+
+  if (rc.overrun)
+    return APE_FRAME_DAMAGED;
+
+  p = out;
+
+  for (i=0;i<blocks;i++) {
+    for (c=0;c<d->channels;c++) {
+      int32_t s = c ? x[i] : y[i];
+
+      switch (d->bytes_per_sample) {
+        case 1:
+          *p++ = (unsigned char)((s + 0x80) & 0xff);
+          break;
+        case 2:
+          *p++ = (unsigned char)(s & 0xff);
+          *p++ = (unsigned char)((s >> 8) & 0xff);
+          break;
+        default:
+          *p++ = (unsigned char)(s & 0xff);
+          *p++ = (unsigned char)((s >> 8) & 0xff);
+          *p++ = (unsigned char)((s >> 16) & 0xff);
+          break;
+      }
+    }
+  }
+
+  if ((crc32(out,(size_t)(p - out)) >> 1) != stored_crc)
+    return APE_FRAME_BAD_CRC;
+
+  return APE_FRAME_OK;
+}
+
+static int decode_frame(ape_decoder *d,ape_workspace *ws,wlong frame,unsigned char *out)
+/* decodes a frame into out, which must hold blocks_per_frame sample frames - this may run on any thread */
+{
+  int status;
+
+  if (APE_FRAME_BAD_CRC != (status = decode_frame_once(d,ws,frame,out,FALSE)))
+    return status;
+
+  if (APE_FRAME_OK == decode_frame_once(d,ws,frame,out,TRUE))
+    return APE_FRAME_OK;
+
+  return status;
+}
+
+static ape_workspace *new_workspace(ape_decoder *d)
+{
+  ape_workspace *ws;
+  ape_filter *f;
+  int c,i;
+
+  if (NULL == (ws = calloc(1,sizeof(ape_workspace))))
+    return NULL;
+
+  for (c=0;c<APE_MAX_CHANNELS;c++) {
+    if (NULL == (ws->decoded[c] = malloc(d->blocks_per_frame * sizeof(int32_t))))
+      return ws;
+
+    for (i=0;i<APE_MAX_FILTERS && filter_orders[d->level][i];i++) {
+      f = &ws->filters[c][i];
+      f->order = filter_orders[d->level][i];
+      f->fracbits = filter_fracbits[d->level][i];
+      if (NULL == (f->coeffs = malloc(f->order * sizeof(int16_t))) ||
+          NULL == (f->history = malloc((APE_HISTORY_SIZE + f->order * 2) * sizeof(int16_t))))
+        return ws;
+    }
+  }
+
+  return ws;
+}
+
+static void free_workspace(ape_workspace *ws)
+{
+  int c,i;
+
+  if (NULL == ws)
+    return;
+
+  for (c=0;c<APE_MAX_CHANNELS;c++) {
+    st_free(ws->decoded[c]);
+    for (i=0;i<APE_MAX_FILTERS;i++) {
+      st_free(ws->filters[c][i].coeffs);
+      st_free(ws->filters[c][i].history);
+    }
+  }
+
+  st_free(ws);
+}
+
+static bool workspace_ok(ape_decoder *d,ape_workspace *ws)
+{
+  int i;
+
+  if (NULL == ws || NULL == ws->decoded[APE_MAX_CHANNELS-1])
+    return FALSE;
+
+  for (i=0;i<APE_MAX_FILTERS && filter_orders[d->level][i];i++)
+    if (NULL == ws->filters[APE_MAX_CHANNELS-1][i].history)
+      return FALSE;
+
+  return TRUE;
+}
+
+/* decoding threads - each slot holds a frame, and the threads decode the queued ones in order, while the
+ * reader works its way through them
+ */
+
+static ape_slot *queued_slot(ape_decoder *d)
+/* returns the queued slot with the earliest frame, if any */
+{
+  ape_slot *s = NULL;
+  int i;
+
+  for (i=0;i<d->num_slots;i++)
+    if (APE_SLOT_QUEUED == d->slots[i].state && (NULL == s || d->slots[i].frame < s->frame))
+      s = &d->slots[i];
+
+  return s;
+}
+
+static void *decoding_thread(void *arg)
+{
+  ape_thread *t = (ape_thread *)arg;
+  ape_decoder *d = t->decoder;
+  ape_slot *s;
+  int status;
+
+  pthread_mutex_lock(&d->lock);
+
+  for (;;) {
+    while (!d->quit && NULL == (s = queued_slot(d)))
+      pthread_cond_wait(&d->work,&d->lock);
+
+    if (d->quit)
+      break;
+
+    s->state = APE_SLOT_BUSY;
+
+    pthread_mutex_unlock(&d->lock);
+
+    status = decode_frame(d,t->ws,s->frame,s->out);
+
+    pthread_mutex_lock(&d->lock);
+
+    s->status = status;
+    s->state = APE_SLOT_DONE;
+    pthread_cond_broadcast(&d->done);
+  }
+
+  pthread_mutex_unlock(&d->lock);
+
+  return NULL;
+}
+
+static ape_slot *find_slot(ape_decoder *d,wlong frame)
+{
+  int i;
+
+  for (i=0;i<d->num_slots;i++)
+    if (APE_SLOT_FREE != d->slots[i].state && frame == d->slots[i].frame)
+      return &d->slots[i];
+
+  return NULL;
+}
+
+static ape_slot *threaded_frame(ape_decoder *d,wlong frame)
+/* waits for a frame from the threads, queueing the ones after it to keep them busy */
+{
+  ape_slot *s;
+  bool busy;
+  int i;
+
+  /* seeking back to the start of the frame being read */
+  if (d->current && frame == d->current->frame)
+    return d->current;
+
+  pthread_mutex_lock(&d->lock);
+
+  if (d->current) {
+    d->current->state = APE_SLOT_FREE;
+    d->current = NULL;
+  }
+
+  /* after a seek, whatever was decoded ahead is of no use */
+  if (NULL == find_slot(d,frame)) {
+    do {
+      busy = FALSE;
+      for (i=0;i<d->num_slots;i++)
+        if (APE_SLOT_BUSY == d->slots[i].state)
+          busy = TRUE;
+        else
+          d->slots[i].state = APE_SLOT_FREE;
+      if (busy)
+        pthread_cond_wait(&d->done,&d->lock);
+    } while (busy);
+
+    d->next_queued = frame;
+  }
+
+  for (i=0;i<d->num_slots && d->next_queued<d->frames;i++) {
+    if (APE_SLOT_FREE == d->slots[i].state) {
+      d->slots[i].frame = d->next_queued++;
+      d->slots[i].state = APE_SLOT_QUEUED;
+    }
+  }
+
+  pthread_cond_broadcast(&d->work);
+
+  s = find_slot(d,frame);
+
+  while (APE_SLOT_DONE != s->state)
+    pthread_cond_wait(&d->done,&d->lock);
+
+  d->current = s;
+
+  pthread_mutex_unlock(&d->lock);
+
+  return s;
+}
+
+static void stop_threads(ape_decoder *d)
+{
+  int i;
+
+  if (0 == d->num_threads)
+    return;
+
+  pthread_mutex_lock(&d->lock);
+  d->quit = TRUE;
+  pthread_cond_broadcast(&d->work);
+  pthread_mutex_unlock(&d->lock);
+
+  for (i=0;i<d->num_threads;i++) {
+    if (d->threads[i].running)
+      pthread_join(d->threads[i].id,NULL);
+    free_workspace(d->threads[i].ws);
+  }
+
+  pthread_mutex_destroy(&d->lock);
+  pthread_cond_destroy(&d->work);
+  pthread_cond_destroy(&d->done);
+
+  d->num_threads = 0;
+}
+
+static bool start_threads(ape_decoder *d,int wanted)
+/* starts the decoding threads, along with the slots they fill - with only one thread wanted, frames are
+ * decoded in this thread instead, as they are read
+ */
+{
+  int i;
+
+  d->num_slots = (wanted < 2) ? 1 : wanted + 2;
+
+  if (NULL == (d->slots = calloc(d->num_slots,sizeof(ape_slot))))
+    return FALSE;
+
+  for (i=0;i<d->num_slots;i++) {
+    d->slots[i].frame = -1;
+    if (NULL == (d->slots[i].out = malloc(d->blocks_per_frame * d->block_align)))
+      return FALSE;
+  }
+
+  if (wanted < 2)
+    return workspace_ok(d,d->ws = new_workspace(d));
+
+  if (NULL == (d->threads = calloc(wanted,sizeof(ape_thread))))
+    return FALSE;
+
+  pthread_mutex_init(&d->lock,NULL);
+  pthread_cond_init(&d->work,NULL);
+  pthread_cond_init(&d->done,NULL);
+
+  d->num_threads = wanted;
+
+  for (i=0;i<wanted;i++) {
+    d->threads[i].decoder = d;
+    if (!workspace_ok(d,d->threads[i].ws = new_workspace(d)))
+      return FALSE;
+    if (pthread_create(&d->threads[i].id,NULL,decoding_thread,&d->threads[i]))
+      return FALSE;
+    d->threads[i].running = TRUE;
+  }
+
+  st_debug2("decoding Monkey's Audio file with %d threads: [%s]",wanted,d->filename);
+
+  return TRUE;
+}
+
+/* stream */
+
+static bool load_frame(ape_decoder *d,wlong frame)
+/* makes the given frame the one being read */
+{
+  ape_slot *s;
+
+  if (d->num_threads)
+    s = threaded_frame(d,frame);
+  else {
+    s = &d->slots[0];
+    if (s->frame != frame) {
+      s->status = decode_frame(d,d->ws,frame,s->out);
+      s->frame = frame;
+    }
+  }
+
+  switch (s->status) {
+    case APE_FRAME_OK:
+      break;
+    case APE_FRAME_BAD_CRC:
+      st_warning("Monkey's Audio frame %lu failed its CRC check, so the file is damaged: [%s]",(unsigned long)frame,d->filename);
+      return FALSE;
+    default:
+      st_warning("Monkey's Audio frame %lu is damaged or cut short in file: [%s]",(unsigned long)frame,d->filename);
+      return FALSE;
+  }
+
+  d->out = s->out;
+  d->out_pos = 0;
+  d->out_len = (int)(frame_blocks(d,frame) * d->block_align);
+  d->out_start = d->header_size + frame * d->blocks_per_frame * d->block_align;
+  d->out_frame = frame;
+  d->frame = frame + 1;
+
+  return TRUE;
+}
+
+static bool next_chunk(ape_decoder *d)
+{
+  if (d->frame < d->frames)
+    return load_frame(d,d->frame);
+
+  /* the pad byte after an odd-sized data chunk */
+  d->out_start += d->out_len;
+  d->out = d->pad;
+  d->out_pos = 0;
+  d->out_len = 1;
+  d->out_frame = -1;
+  d->pad_sent = TRUE;
+
+  return TRUE;
+}
+
+static bool finished(ape_decoder *d)
+{
+  return d->frame >= d->frames && (d->pad_sent || !(d->data_size & 1));
+}
+
+static int ape_read(void *decoder,unsigned char *buf,int size)
+{
+  ape_decoder *d = (ape_decoder *)decoder;
+  int bytes,copied = 0;
+
+  while (copied < size) {
+    if (d->out_pos == d->out_len) {
+      if (d->failed || finished(d))
+        break;
+
+      if (!next_chunk(d)) {
+        d->failed = TRUE;
+        break;
+      }
+    }
+
+    bytes = min(size - copied,d->out_len - d->out_pos);
+    memcpy(buf + copied,d->out + d->out_pos,bytes);
+    d->out_pos += bytes;
+    copied += bytes;
+  }
+
+  if (0 == copied && d->failed)
+    return -1;
+
+  return copied;
+}
+
+static void send_header(ape_decoder *d)
+{
+  d->out = d->header;
+  d->out_start = 0;
+  d->out_pos = 0;
+  d->out_len = d->header_size;
+  d->out_frame = -1;
+  d->frame = 0;
+  d->pad_sent = FALSE;
+}
+
+static int ape_seek(void *decoder,wlong offset)
+/* frames are independent, so any of them can be decoded straight away */
+{
+  ape_decoder *d = (ape_decoder *)decoder;
+  wlong frame;
+
+  if (d->failed || offset > d->header_size + d->data_size)
+    return -1;
+
+  if (offset < d->header_size) {
+    send_header(d);
+    d->out_pos = (int)offset;
+    return 0;
+  }
+
+  /* the very end is the end of the last frame */
+  frame = (offset - d->header_size - ((offset - d->header_size == d->data_size) ? 1 : 0)) /
+          d->block_align / d->blocks_per_frame;
+
+  if (frame >= d->frames)
+    frame = d->frames - 1;
+
+  if (d->out_frame != frame && !load_frame(d,frame)) {
+    d->failed = TRUE;
+    return -1;
+  }
+
+  d->out_pos = (int)(offset - d->out_start);
+  d->pad_sent = FALSE;
+
+  return 0;
+}
+
+static int ape_close(void *decoder)
+{
+  ape_decoder *d = (ape_decoder *)decoder;
+  int i;
+
+  stop_threads(d);
+
+  if (d->map)
+    munmap(d->map,d->map_size);
+
+  if (d->slots)
+    for (i=0;i<d->num_slots;i++)
+      st_free(d->slots[i].out);
+
+  free_workspace(d->ws);
+  st_free(d->threads);
+  st_free(d->slots);
+  st_free(d->frame_pos);
+  st_free(d->filename);
+  st_free(d);
+
+  return 0;
+}
+
+static bool map_file(ape_decoder *d)
+{
+  struct stat sz;
+  unsigned long tag_size;
+  int fd;
+
+  if ((fd = open(d->filename,O_RDONLY)) < 0)
+    return FALSE;
+
+  if (fstat(fd,&sz) || sz.st_size < APE_DESCRIPTOR_SIZE + APE_HEADER_SIZE ||
+      (uint64_t)sz.st_size != (uint64_t)(size_t)sz.st_size) {
+    close(fd);
+    return FALSE;
+  }
+
+  d->map_size = (size_t)sz.st_size;
+  d->map = mmap(NULL,d->map_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+
+  if (MAP_FAILED == d->map) {
+    d->map = NULL;
+    return FALSE;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  madvise(d->map,d->map_size,MADV_SEQUENTIAL);
+#endif
+
+  d->data = d->map;
+  d->size = d->map_size;
+
+  if (d->size > sizeof(id3v2_header) && (tag_size = parse_id3v2_header(d->map)) > 0) {
+    if (tag_size + sizeof(id3v2_header) + APE_DESCRIPTOR_SIZE + APE_HEADER_SIZE > d->size)
+      return FALSE;
+    d->data += tag_size + sizeof(id3v2_header);
+    d->size -= tag_size + sizeof(id3v2_header);
+  }
+
+  return TRUE;
+}
+
+int ape_make_header(unsigned char *header,unsigned char *stored,int stored_size,int channels,int bits_per_sample,
+                    wlong samples_per_sec,wlong samples,char *filename)
+{
+  wave_info info;
+  wlong data_size;
+
+  memset(&info,0,sizeof(info));
+  info.filename = filename;
+
+  if (!probe_canonical_header(&info,(wshort)channels,(wshort)bits_per_sample,samples_per_sec,samples))
+    return 0;
+
+  data_size = info.data_size;
+
+  if (stored && stored_size > 0 && stored_size <= HEADER_CACHE_SIZE) {
+    memset(&info,0,sizeof(info));
+    info.filename = filename;
+
+    memcpy(header,stored,stored_size);
+    put_data_size(header,stored_size,data_size);
+    put_chunk_size(header,data_size + stored_size - 8 + (data_size & 1));
+
+    if (probe_wav_header(&info,header,stored_size) && stored_size == info.header_size && channels == info.channels &&
+        info.block_align == channels * ((bits_per_sample + 7) / 8))
+      return stored_size;
+
+    st_debug1("stored WAVE header doesn't describe the audio, so sending a canonical one: [%s]",filename);
+
+    memset(&info,0,sizeof(info));
+    info.filename = filename;
+    probe_canonical_header(&info,(wshort)channels,(wshort)bits_per_sample,samples_per_sec,samples);
+  }
+
+  make_canonical_header(header,&info);
+
+  return CANONICAL_HEADER_SIZE;
+}
+
+bool ape_decode_supported(int version,int compression,int channels,int bits_per_sample)
+{
+#ifdef HAVE_CODEC_STREAMS
+  return (version >= APE_MIN_VERSION && compression >= 1000 && compression <= 5000 && 0 == compression % 1000 &&
+          channels >= 1 && channels <= APE_MAX_CHANNELS &&
+          (8 == bits_per_sample || 16 == bits_per_sample || 24 == bits_per_sample));
+#else
+  return FALSE;
+#endif
+}
+
+FILE *ape_decode_open(char *filename)
+/* opens a Monkey's Audio file for decoding in-process.  returns NULL if it can't be decoded this way, in which
+ * case the caller should fall back to 'mac', which will report any real problems.
+ */
+{
+  ape_decoder *d;
+  unsigned char *h,*stored;
+  unsigned long descriptor_size,header_size,seek_table_size,wav_header_size;
+  int version,compression,flags,bits_per_sample;
+  size_t first,pos;
+  wlong i;
+
+#ifndef HAVE_CODEC_STREAMS
+  return NULL;
+#endif
+
+  if (!crc_table_built)
+    build_crc_table();
+
+  if (NULL == (d = calloc(1,sizeof(ape_decoder))))
+    return NULL;
+
+  if (NULL == (d->filename = strdup(filename)) || !map_file(d))
+    goto fail;
+
+  h = d->data;
+
+  if (tagcmp(h,(unsigned char *)APE_MAGIC) || (version = (int)get_le16(h + 4)) < APE_MIN_VERSION)
+    goto fail;
+
+  descriptor_size = get_le32(h + 8);
+  header_size = get_le32(h + 12);
+  seek_table_size = get_le32(h + 16);
+  wav_header_size = get_le32(h + 20);
+
+  if (descriptor_size < APE_DESCRIPTOR_SIZE || header_size < APE_HEADER_SIZE ||
+      (uint64_t)descriptor_size + header_size + seek_table_size + wav_header_size > d->size)
+    goto fail;
+
+  h += descriptor_size;
+
+  compression = (int)get_le16(h);
+  flags = (int)get_le16(h + 2);
+  d->blocks_per_frame = get_le32(h + 4);
+  d->final_frame_blocks = get_le32(h + 8);
+  d->frames = get_le32(h + 12);
+  bits_per_sample = (int)get_le16(h + 16);
+  d->channels = (int)get_le16(h + 18);
+
+  if (!ape_decode_supported(version,compression,d->channels,bits_per_sample) ||
+      d->blocks_per_frame < 1 || d->blocks_per_frame > APE_MAX_BLOCKS_PER_FRAME ||
+      d->final_frame_blocks < 1 || d->final_frame_blocks > d->blocks_per_frame ||
+      d->frames < 1 || seek_table_size / 4 < (unsigned long)d->frames)
+    goto fail;
+
+  d->level = compression / 1000 - 1;
+  d->bytes_per_sample = bits_per_sample / 8;
+  d->block_align = d->channels * d->bytes_per_sample;
+
+  stored = (flags & APE_FLAG_CREATE_WAV_HEADER) ? NULL : h + header_size + seek_table_size;
+
+  if (0 == (d->header_size = ape_make_header(d->header,stored,(int)wav_header_size,d->channels,bits_per_sample,
+                                             get_le32(h + 20),(d->frames - 1) * d->blocks_per_frame + d->final_frame_blocks,
+                                             d->filename)))
+    goto fail;
+
+  d->data_size = ((d->frames - 1) * d->blocks_per_frame + d->final_frame_blocks) * d->block_align;
+
+  /* the seek table gives absolute positions, but the words the frames are stored in line up with the first one */
+  first = descriptor_size + header_size + seek_table_size + wav_header_size;
+
+  if (NULL == (d->frame_pos = malloc(d->frames * sizeof(size_t))))
+    goto fail;
+
+  for (i=0;i<d->frames;i++) {
+    pos = i ? (size_t)get_le32(h + header_size + i * 4) : first;
+
+    if (pos < first || pos >= d->size || (i && pos - first < d->frame_pos[i-1])) {
+      st_debug1("Monkey's Audio seek table doesn't match the file: [%s]",filename);
+      goto fail;
+    }
+
+    d->frame_pos[i] = pos - first;
+  }
+
+  d->data += first;
+  d->size -= first;
+
+  if (!start_threads(d,(int)min(job_threads(APE_MAX_THREADS),d->frames)))
+    goto fail;
+
+  send_header(d);
+
+  return open_seekable_decoder_stream(d,ape_read,ape_seek,ape_close);
+
+fail:
+  ape_close(d);
+  return NULL;
+}
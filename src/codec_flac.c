@@ -0,0 +1,2247 @@
+/*  codec_flac.c - in-process FLAC decoder and encoder
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * The decoder maps the whole file into memory and decodes one frame at a time
+ * as the stream returned by flac_decode_open() is read.  The stream starts with
+ * a canonical WAVE header built from STREAMINFO, so it looks just like the
+ * output of 'flac -d', except that any sample size that is a multiple of 8 bits
+ * is described with a plain PCM header, which shdtool can actually read.  The
+ * stream can seek, by narrowing down the frame that holds the target sample
+ * with the seek table, if there is one, and then searching for frame headers.
+ *
+ * The encoder collects the WAVE data written to the stream returned by
+ * flac_encode_open() into batches of fixed-size frames.  While one batch is
+ * being filled, the previous one is encoded by a pool of threads, one frame
+ * per thread at a time, and then written out in order.  STREAMINFO and the
+ * seek table are written as placeholders up front, and filled in at the end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "shdtool.h"
+#include "codec.h"
+#include "md5.h"
+
+#define FLAC_MAGIC "fLaC"
+
+#define FLAC_METADATA_STREAMINFO      0
+#define FLAC_METADATA_PADDING         1
+#define FLAC_METADATA_SEEKTABLE       3
+#define FLAC_METADATA_VORBIS_COMMENT  4
+#define FLAC_METADATA_LAST            0x80
+#define FLAC_STREAMINFO_SIZE          34
+#define FLAC_SEEKPOINT_SIZE           18
+#define FLAC_SEEK_DECODE_AHEAD        8       /* frames worth decoding through rather than searching */
+
+#define FLAC_MAX_CHANNELS        8
+#define FLAC_MAX_LPC_ORDER       32
+
+#define FLAC_CHANNELS_LEFT_SIDE  8
+#define FLAC_CHANNELS_RIGHT_SIDE 9
+#define FLAC_CHANNELS_MID_SIDE   10
+
+typedef struct _flac_decoder {
+  char          *filename;
+  unsigned char *map;                /* the whole file */
+  size_t         map_size;
+  unsigned char *data;               /* the FLAC stream, after any ID3v2 tag */
+  size_t         size;
+  uint64_t       pos;                /* current bit position in data */
+  bool           overrun;            /* set when a read went past the end of data */
+  bool           failed;
+
+  wlong          samples_per_sec;
+  int            channels;
+  int            bits_per_sample;
+  int            max_block_size;
+  int            block_align;
+  size_t         first_frame;        /* offset of the first frame in data */
+  uint64_t       total_samples;
+  uint64_t       samples_left;
+  uint64_t       frame_sample;       /* first sample of the frame last decoded */
+
+  unsigned char *seek_table;         /* SEEKTABLE entries, if any */
+  int            seek_points;
+
+  int32_t       *samples[FLAC_MAX_CHANNELS];
+  unsigned char *out;                /* WAVE header or data waiting to be read */
+  int            out_pos;
+  int            out_len;
+  uint64_t       out_sample;         /* first sample in out */
+  int            out_samples;        /* samples in out, or 0 if it holds the header or pad byte */
+  bool           pad_byte;           /* odd-sized data chunk still needs its pad byte */
+  unsigned char  header[CANONICAL_HEADER_SIZE];
+} flac_decoder;
+
+static unsigned char crc8_table[256];
+static uint16_t crc16_table[256];
+static bool crc_tables_built = FALSE;
+
+static void build_crc_tables()
+{
+  int i,j;
+  unsigned int crc8,crc16;
+
+  for (i=0;i<256;i++) {
+    crc8 = i;
+    crc16 = i << 8;
+
+    for (j=0;j<8;j++) {
+      crc8 = (crc8 & 0x80) ? ((crc8 << 1) ^ 0x07) : (crc8 << 1);
+      crc16 = (crc16 & 0x8000) ? ((crc16 << 1) ^ 0x8005) : (crc16 << 1);
+    }
+
+    crc8_table[i] = (unsigned char)(crc8 & 0xff);
+    crc16_table[i] = (uint16_t)(crc16 & 0xffff);
+  }
+
+  crc_tables_built = TRUE;
+}
+
+static unsigned int crc8(unsigned char *buf,size_t len)
+{
+  unsigned int crc = 0;
+
+  while (len--)
+    crc = crc8_table[crc ^ *buf++];
+
+  return crc;
+}
+
+static unsigned int crc16(unsigned char *buf,size_t len)
+{
+  unsigned int crc = 0;
+
+  while (len--)
+    crc = ((crc << 8) & 0xffff) ^ crc16_table[(crc >> 8) ^ *buf++];
+
+  return crc;
+}
+
+/* bit reader */
+
+static uint64_t load_be64(unsigned char *p)
+{
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+         ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+static uint64_t peek_64(flac_decoder *d)
+/* returns the next 64 bits (zero-filled past the end of data), starting at the byte holding the current bit */
+{
+  size_t byte = (size_t)(d->pos >> 3);
+  uint64_t v = 0;
+  int i;
+
+  if (byte + 8 <= d->size)
+    return load_be64(d->data + byte);
+
+  for (i=0;i<8;i++)
+    v = (v << 8) | ((byte + i < d->size) ? d->data[byte + i] : 0);
+
+  return v;
+}
+
+static uint32_t get_bits(flac_decoder *d,int bits)
+/* reads an unsigned value of up to 32 bits */
+{
+  uint64_t v;
+
+  if (0 == bits)
+    return 0;
+
+  if (d->pos + bits > (uint64_t)d->size * 8) {
+    d->overrun = TRUE;
+    return 0;
+  }
+
+  v = peek_64(d) << (d->pos & 7);
+  d->pos += bits;
+
+  return (uint32_t)(v >> (64 - bits));
+}
+
+static int32_t get_sbits(flac_decoder *d,int bits)
+/* reads a two's complement value of up to 32 bits */
+{
+  uint32_t v;
+
+  if (0 == bits)
+    return 0;
+
+  v = get_bits(d,bits);
+
+  if (bits < 32 && (v & ((uint32_t)1 << (bits - 1))))
+    v |= ~(((uint32_t)1 << bits) - 1);
+
+  return (int32_t)v;
+}
+
+static int count_leading_zeros(uint64_t v)
+{
+#if defined(__GNUC__)
+  return __builtin_clzll(v);
+#else
+  int n = 0;
+
+  while (!(v & ((uint64_t)1 << 63))) {
+    v <<= 1;
+    n++;
+  }
+
+  return n;
+#endif
+}
+
+static uint32_t get_unary(flac_decoder *d)
+/* counts zero bits up to, and including, the next 1 bit */
+{
+  uint32_t zeros = 0;
+  uint64_t v;
+  int skip,valid,lz;
+
+  for (;;) {
+    if (d->pos >= (uint64_t)d->size * 8) {
+      d->overrun = TRUE;
+      return zeros;
+    }
+
+    skip = (int)(d->pos & 7);
+    valid = 64 - skip;
+    v = peek_64(d) << skip;
+
+    if (v) {
+      lz = count_leading_zeros(v);
+      d->pos += lz + 1;
+      return zeros + lz;
+    }
+
+    d->pos += valid;
+    zeros += valid;
+  }
+}
+
+static void align_to_byte(flac_decoder *d)
+{
+  d->pos = (d->pos + 7) & ~(uint64_t)7;
+}
+
+/* frame decoding */
+
+static bool decode_residual(flac_decoder *d,int32_t *res,int block_size,int order)
+/* reads the Rice-coded prediction residual of a subframe */
+{
+  int method,param_bits,escape,partition_order,partitions,p,i,n,k,raw_bits;
+  uint32_t u;
+
+  method = get_bits(d,2);
+  if (method > 1)
+    return FALSE;
+
+  param_bits = (method) ? 5 : 4;
+  escape = (1 << param_bits) - 1;
+
+  partition_order = get_bits(d,4);
+  partitions = 1 << partition_order;
+
+  if ((block_size & (partitions - 1)) || (block_size >> partition_order) < order)
+    return FALSE;
+
+  for (p=0;p<partitions;p++) {
+    n = (block_size >> partition_order) - ((0 == p) ? order : 0);
+    k = get_bits(d,param_bits);
+
+    if (k == escape) {
+      raw_bits = get_bits(d,5);
+      for (i=0;i<n;i++)
+        res[i] = get_sbits(d,raw_bits);
+    }
+    else {
+      for (i=0;i<n;i++) {
+        u = (get_unary(d) << k) | get_bits(d,k);
+        res[i] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+      }
+    }
+
+    if (d->overrun)
+      return FALSE;
+
+    res += n;
+  }
+
+  return TRUE;
+}
+
+static void restore_fixed(int32_t *s,int block_size,int order)
+/* adds the fixed polynomial predictions back to the residual */
+{
+  int i;
+
+  switch (order) {
+    case 1:
+      for (i=1;i<block_size;i++)
+        s[i] += s[i-1];
+      break;
+    case 2:
+      for (i=2;i<block_size;i++)
+        s[i] += 2 * s[i-1] - s[i-2];
+      break;
+    case 3:
+      for (i=3;i<block_size;i++)
+        s[i] += 3 * (s[i-1] - s[i-2]) + s[i-3];
+      break;
+    case 4:
+      for (i=4;i<block_size;i++)
+        s[i] += 4 * (s[i-1] + s[i-3]) - 6 * s[i-2] - s[i-4];
+      break;
+    default:
+      break;
+  }
+}
+
+static void restore_lpc(int32_t *s,int block_size,int32_t *coefs,int order,int shift)
+/* adds the linear predictions back to the residual */
+{
+  int i,j;
+  int64_t sum;
+
+  for (i=order;i<block_size;i++) {
+    sum = 0;
+    for (j=0;j<order;j++)
+      sum += (int64_t)coefs[j] * s[i-1-j];
+    s[i] += (int32_t)(sum >> shift);
+  }
+}
+
+static bool decode_subframe(flac_decoder *d,int32_t *s,int block_size,int bits)
+{
+  int type,wasted,order,precision,shift,i;
+  int32_t coefs[FLAC_MAX_LPC_ORDER],v;
+
+  if (get_bits(d,1))
+    return FALSE;
+
+  type = get_bits(d,6);
+
+  wasted = 0;
+  if (get_bits(d,1))
+    wasted = get_unary(d) + 1;
+
+  if (wasted >= bits)
+    return FALSE;
+
+  bits -= wasted;
+
+  if (0 == type) {
+    /* constant */
+    v = get_sbits(d,bits);
+    for (i=0;i<block_size;i++)
+      s[i] = v;
+  }
+  else if (1 == type) {
+    /* verbatim */
+    for (i=0;i<block_size;i++)
+      s[i] = get_sbits(d,bits);
+  }
+  else if (type >= 8 && type <= 12) {
+    /* fixed predictor */
+    order = type - 8;
+    if (order > block_size)
+      return FALSE;
+
+    for (i=0;i<order;i++)
+      s[i] = get_sbits(d,bits);
+
+    if (!decode_residual(d,s + order,block_size,order))
+      return FALSE;
+
+    restore_fixed(s,block_size,order);
+  }
+  else if (type >= 32) {
+    /* linear predictor */
+    order = type - 31;
+    if (order > block_size)
+      return FALSE;
+
+    for (i=0;i<order;i++)
+      s[i] = get_sbits(d,bits);
+
+    precision = get_bits(d,4) + 1;
+    shift = get_sbits(d,5);
+
+    if (16 == precision || shift < 0)
+      return FALSE;
+
+    for (i=0;i<order;i++)
+      coefs[i] = get_sbits(d,precision);
+
+    if (!decode_residual(d,s + order,block_size,order))
+      return FALSE;
+
+    restore_lpc(s,block_size,coefs,order,shift);
+  }
+  else {
+    return FALSE;
+  }
+
+  if (wasted) {
+    for (i=0;i<block_size;i++)
+      s[i] = (int32_t)((uint32_t)s[i] << wasted);
+  }
+
+  return !d->overrun;
+}
+
+static int decode_frame(flac_decoder *d)
+/* decodes the next frame into d->samples, returning its block size, or -1 if the frame is corrupt */
+{
+  size_t start;
+  int blocking,block_size_code,rate_code,assignment,size_code,channels,bits,block_size,ch,i,ones;
+  uint32_t first,next;
+  uint64_t number;
+  int32_t *s0,*s1,mid,side;
+
+  start = (size_t)(d->pos >> 3);
+
+  if (start + 2 > d->size || 0xff != d->data[start] || 0xf8 != (d->data[start+1] & 0xfe))
+    return -1;
+
+  blocking = get_bits(d,16) & 1;
+  block_size_code = get_bits(d,4);
+  rate_code = get_bits(d,4);
+  assignment = get_bits(d,4);
+  size_code = get_bits(d,3);
+
+  if (get_bits(d,1) || 15 == rate_code || 3 == size_code || 0 == block_size_code)
+    return -1;
+
+  /* frame or sample number, UTF-8 style */
+  first = get_bits(d,8);
+  for (ones=0;ones<8 && (first & (0x80 >> ones));ones++)
+    ;
+  if (1 == ones || ones > 7)
+    return -1;
+  number = first & (0x7f >> ones);
+  for (i=1;i<ones;i++) {
+    if (0x80 != ((next = get_bits(d,8)) & 0xc0))
+      return -1;
+    number = (number << 6) | (next & 0x3f);
+  }
+
+  if (1 == block_size_code)
+    block_size = 192;
+  else if (block_size_code <= 5)
+    block_size = 576 << (block_size_code - 2);
+  else if (6 == block_size_code)
+    block_size = get_bits(d,8) + 1;
+  else if (7 == block_size_code)
+    block_size = get_bits(d,16) + 1;
+  else
+    block_size = 256 << (block_size_code - 8);
+
+  /* the sample rate was already taken from STREAMINFO */
+  if (12 == rate_code)
+    get_bits(d,8);
+  else if (13 == rate_code || 14 == rate_code)
+    get_bits(d,16);
+
+  if (d->overrun || crc8(d->data + start,(size_t)(d->pos >> 3) - start) != get_bits(d,8))
+    return -1;
+
+  if (assignment < 8)
+    channels = assignment + 1;
+  else if (assignment <= FLAC_CHANNELS_MID_SIDE)
+    channels = 2;
+  else
+    return -1;
+
+  switch (size_code) {
+    case 0:  bits = d->bits_per_sample; break;
+    case 1:  bits = 8;  break;
+    case 2:  bits = 12; break;
+    case 4:  bits = 16; break;
+    case 5:  bits = 20; break;
+    case 6:  bits = 24; break;
+    default: bits = 32; break;
+  }
+
+  if (channels != d->channels || bits != d->bits_per_sample || block_size > d->max_block_size)
+    return -1;
+
+  /* fixed-blocksize streams number their frames rather than their samples */
+  d->frame_sample = (blocking) ? number : number * d->max_block_size;
+
+  for (ch=0;ch<channels;ch++) {
+    /* the side channel carries one extra bit */
+    if (!decode_subframe(d,d->samples[ch],block_size,bits +
+          (((FLAC_CHANNELS_LEFT_SIDE == assignment || FLAC_CHANNELS_MID_SIDE == assignment) && 1 == ch) ||
+           (FLAC_CHANNELS_RIGHT_SIDE == assignment && 0 == ch))))
+      return -1;
+  }
+
+  align_to_byte(d);
+
+  if (d->overrun || crc16(d->data + start,(size_t)(d->pos >> 3) - start) != get_bits(d,16) || d->overrun)
+    return -1;
+
+  s0 = d->samples[0];
+  s1 = d->samples[1];
+
+  switch (assignment) {
+    case FLAC_CHANNELS_LEFT_SIDE:
+      for (i=0;i<block_size;i++)
+        s1[i] = s0[i] - s1[i];
+      break;
+    case FLAC_CHANNELS_RIGHT_SIDE:
+      for (i=0;i<block_size;i++)
+        s0[i] += s1[i];
+      break;
+    case FLAC_CHANNELS_MID_SIDE:
+      for (i=0;i<block_size;i++) {
+        side = s1[i];
+        mid = (int32_t)(((uint32_t)s0[i] << 1) | (side & 1));
+        s0[i] = (mid + side) >> 1;
+        s1[i] = (mid - side) >> 1;
+      }
+      break;
+    default:
+      break;
+  }
+
+  return block_size;
+}
+
+static void interleave(flac_decoder *d,int samples)
+/* converts decoded samples to little-endian WAVE data in d->out */
+{
+  unsigned char *p = d->out;
+  int i,ch;
+  int32_t v;
+
+  for (i=0;i<samples;i++) {
+    for (ch=0;ch<d->channels;ch++) {
+      v = d->samples[ch][i];
+
+      switch (d->bits_per_sample) {
+        case 8:
+          *p++ = (unsigned char)(v + 128);
+          break;
+        case 16:
+          *p++ = (unsigned char)v;
+          *p++ = (unsigned char)(v >> 8);
+          break;
+        default:
+          *p++ = (unsigned char)v;
+          *p++ = (unsigned char)(v >> 8);
+          *p++ = (unsigned char)(v >> 16);
+          break;
+      }
+    }
+  }
+
+  d->out_pos = 0;
+  d->out_len = (int)(p - d->out);
+}
+
+static bool next_frame(flac_decoder *d)
+{
+  int samples;
+  size_t offset;
+
+  offset = (size_t)(d->pos >> 3);
+
+  if (offset >= d->size) {
+    st_warning("FLAC stream ended %lu samples early in file: [%s]",(unsigned long)d->samples_left,d->filename);
+    return FALSE;
+  }
+
+  if ((samples = decode_frame(d)) < 0) {
+    st_warning("corrupt FLAC frame at byte %lu of file: [%s]",(unsigned long)offset,d->filename);
+    return FALSE;
+  }
+
+  if ((uint64_t)samples > d->samples_left)
+    samples = (int)d->samples_left;
+
+  d->out_sample = d->total_samples - d->samples_left;
+  d->out_samples = samples;
+  d->samples_left -= samples;
+
+  interleave(d,samples);
+
+  return TRUE;
+}
+
+static int flac_read(void *decoder,unsigned char *buf,int size)
+{
+  flac_decoder *d = (flac_decoder *)decoder;
+  int bytes,copied = 0;
+
+  while (copied < size) {
+    if (d->out_pos == d->out_len) {
+      if (d->failed)
+        break;
+
+      if (0 == d->samples_left) {
+        if (!d->pad_byte)
+          break;
+        d->out[0] = 0;
+        d->out_pos = 0;
+        d->out_len = 1;
+        d->out_samples = 0;
+        d->pad_byte = FALSE;
+      }
+      else if (!next_frame(d)) {
+        d->failed = TRUE;
+        break;
+      }
+    }
+
+    bytes = min(size - copied,d->out_len - d->out_pos);
+    memcpy(buf + copied,d->out + d->out_pos,bytes);
+    d->out_pos += bytes;
+    copied += bytes;
+  }
+
+  if (0 == copied && d->failed)
+    return -1;
+
+  return copied;
+}
+
+static void restart(flac_decoder *d,size_t offset,uint64_t sample)
+/* resumes decoding at the frame at the given offset, which starts at the given sample */
+{
+  d->pos = (uint64_t)offset * 8;
+  d->overrun = FALSE;
+  d->samples_left = d->total_samples - sample;
+  d->out_pos = 0;
+  d->out_len = 0;
+  d->out_samples = 0;
+  d->pad_byte = ((d->total_samples * d->block_align) & 1) ? TRUE : FALSE;
+}
+
+static bool find_frame(flac_decoder *d,size_t from,size_t to,size_t *offset)
+/* looks for the first frame that starts in [from,to), and decodes it to make sure it is one */
+{
+  size_t i;
+
+  for (i=from;i<to && i+1<d->size;i++) {
+    if (0xff != d->data[i] || 0xf8 != (d->data[i+1] & 0xfe))
+      continue;
+
+    d->pos = (uint64_t)i * 8;
+    d->overrun = FALSE;
+
+    if (decode_frame(d) >= 0 && d->frame_sample < d->total_samples) {
+      *offset = i;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static int find_seek_point(flac_decoder *d,uint64_t sample)
+/* returns the last seek table entry at or before the given sample, or -1 if there isn't one */
+{
+  int lo = 0,hi = d->seek_points - 1,mid,found = -1;
+
+  /* placeholder entries sort last, since their sample number is all ones */
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    if (load_be64(d->seek_table + mid * FLAC_SEEKPOINT_SIZE) <= sample) {
+      found = mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+
+  return found;
+}
+
+static void find_start_frame(flac_decoder *d,uint64_t sample)
+/* restarts decoding at the last frame that starts at or before the given sample.  the seek table entries either
+ * side of it narrow down where that frame can be, and then a binary search for frame headers finds it.
+ */
+{
+  unsigned char *e;
+  size_t lo = d->first_frame,hi = d->size,mid,offset;
+  uint64_t lo_sample = 0,next_offset;
+  int entry;
+
+  if ((entry = find_seek_point(d,sample)) >= 0) {
+    e = d->seek_table + entry * FLAC_SEEKPOINT_SIZE;
+    next_offset = load_be64(e + 8);
+
+    if (next_offset < d->size - d->first_frame && find_frame(d,d->first_frame + (size_t)next_offset,
+          d->first_frame + (size_t)next_offset + 1,&offset) && d->frame_sample == load_be64(e)) {
+      lo = offset;
+      lo_sample = d->frame_sample;
+
+      if (entry + 1 < d->seek_points && load_be64(e + FLAC_SEEKPOINT_SIZE) > sample &&
+          (next_offset = load_be64(e + FLAC_SEEKPOINT_SIZE + 8)) < d->size - d->first_frame &&
+          d->first_frame + (size_t)next_offset > lo)
+        hi = d->first_frame + (size_t)next_offset;
+    }
+    else {
+      st_debug1("ignoring seek table that doesn't match the audio in file: [%s]",d->filename);
+      d->seek_points = 0;
+    }
+  }
+
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+
+    if (find_frame(d,mid,hi,&offset) && d->frame_sample <= sample) {
+      lo = offset;
+      lo_sample = d->frame_sample;
+    }
+    else
+      hi = mid;
+  }
+
+  restart(d,lo,lo_sample);
+}
+
+static int flac_seek(void *decoder,wlong offset)
+/* moves to the given offset in the decoded stream, by restarting at the frame that holds it, and decoding that -
+ * or by just decoding up to it, if it is only a few frames ahead
+ */
+{
+  flac_decoder *d = (flac_decoder *)decoder;
+  wlong data_size = (wlong)(d->total_samples * d->block_align);
+  uint64_t sample,next_sample;
+
+  if (d->failed || offset > CANONICAL_HEADER_SIZE + data_size)
+    return -1;
+
+  if (offset < CANONICAL_HEADER_SIZE) {
+    restart(d,d->first_frame,0);
+    memcpy(d->out,d->header,CANONICAL_HEADER_SIZE);
+    d->out_len = CANONICAL_HEADER_SIZE;
+    d->out_pos = (int)offset;
+    return 0;
+  }
+
+  /* the very end is the end of the last frame */
+  sample = (offset - CANONICAL_HEADER_SIZE - ((offset - CANONICAL_HEADER_SIZE == data_size) ? 1 : 0)) / d->block_align;
+
+  if (d->out_samples > 0 && sample >= d->out_sample && sample < d->out_sample + d->out_samples) {
+    d->out_pos = (int)(offset - CANONICAL_HEADER_SIZE - d->out_sample * d->block_align);
+    return 0;
+  }
+
+  next_sample = d->total_samples - d->samples_left;
+
+  if (sample < next_sample || sample >= next_sample + FLAC_SEEK_DECODE_AHEAD * (uint64_t)d->max_block_size)
+    find_start_frame(d,sample);
+
+  while (0 == d->out_samples || sample >= d->out_sample + d->out_samples) {
+    if (0 == d->samples_left || !next_frame(d)) {
+      d->failed = TRUE;
+      return -1;
+    }
+  }
+
+  d->out_pos = (int)(offset - CANONICAL_HEADER_SIZE - d->out_sample * d->block_align);
+
+  return 0;
+}
+
+static int flac_close(void *decoder)
+{
+  flac_decoder *d = (flac_decoder *)decoder;
+  int ch;
+
+  if (d->map)
+    munmap(d->map,d->map_size);
+
+  for (ch=0;ch<FLAC_MAX_CHANNELS;ch++)
+    st_free(d->samples[ch]);
+
+  st_free(d->out);
+  st_free(d->filename);
+  st_free(d);
+
+  return 0;
+}
+
+bool flac_decode_supported(int channels,int bits_per_sample)
+{
+#ifndef HAVE_CODEC_STREAMS
+  return FALSE;
+#endif
+
+  return (channels >= 1 && channels <= FLAC_MAX_CHANNELS &&
+          (8 == bits_per_sample || 16 == bits_per_sample || 24 == bits_per_sample));
+}
+
+static bool read_streaminfo(flac_decoder *d,wave_info *info)
+/* checks the stream's metadata, leaving d->pos at the first frame */
+{
+  unsigned char *si;
+  uint64_t total_samples,data_size;
+  size_t offset,length;
+  int last,type,min_block_size;
+
+  if (d->size < 4 + 4 + FLAC_STREAMINFO_SIZE || tagcmp(d->data,(unsigned char *)FLAC_MAGIC))
+    return FALSE;
+
+  offset = 4;
+
+  do {
+    if (offset + 4 > d->size)
+      return FALSE;
+
+    last = d->data[offset] & 0x80;
+    type = d->data[offset] & 0x7f;
+    length = ((size_t)d->data[offset+1] << 16) | ((size_t)d->data[offset+2] << 8) | d->data[offset+3];
+
+    if (4 == offset && (FLAC_METADATA_STREAMINFO != type || FLAC_STREAMINFO_SIZE != length))
+      return FALSE;
+
+    if (FLAC_METADATA_SEEKTABLE == type && offset + 4 + length <= d->size) {
+      d->seek_table = d->data + offset + 4;
+      d->seek_points = (int)(length / FLAC_SEEKPOINT_SIZE);
+    }
+
+    offset += 4 + length;
+  } while (!last);
+
+  if (offset > d->size)
+    return FALSE;
+
+  d->first_frame = offset;
+  d->pos = (uint64_t)offset * 8;
+
+  si = d->data + 8;
+
+  min_block_size = (si[0] << 8) | si[1];
+  d->max_block_size = (si[2] << 8) | si[3];
+  d->samples_per_sec = ((wlong)si[10] << 12) | ((wlong)si[11] << 4) | (si[12] >> 4);
+  d->channels = ((si[12] >> 1) & 0x07) + 1;
+  d->bits_per_sample = (((si[12] & 0x01) << 4) | (si[13] >> 4)) + 1;
+  total_samples = ((uint64_t)(si[13] & 0x0f) << 32) | uchar_to_ulong_be(si + 14);
+
+  if (d->max_block_size < 16 || d->max_block_size < min_block_size || 0 == d->samples_per_sec || 0 == total_samples)
+    return FALSE;
+
+  if (!flac_decode_supported(d->channels,d->bits_per_sample))
+    return FALSE;
+
+  data_size = total_samples * d->channels * (d->bits_per_sample / 8);
+
+  /* leave room for the header, and a possible pad byte */
+  if (data_size > 0xffffffffUL - CANONICAL_HEADER_SIZE)
+    return FALSE;
+
+  d->total_samples = total_samples;
+  d->samples_left = total_samples;
+  d->block_align = d->channels * (d->bits_per_sample / 8);
+  d->pad_byte = (data_size & 1) ? TRUE : FALSE;
+
+  info->wave_format = WAVE_FORMAT_PCM;
+  info->channels = d->channels;
+  info->samples_per_sec = d->samples_per_sec;
+  info->bits_per_sample = d->bits_per_sample;
+  info->block_align = d->channels * (d->bits_per_sample / 8);
+  info->avg_bytes_per_sec = info->samples_per_sec * info->block_align;
+  info->data_size = (wlong)data_size;
+  info->chunk_size = CANONICAL_HEADER_SIZE - 8 + info->data_size + (info->data_size & 1);
+
+  return TRUE;
+}
+
+FILE *flac_decode_open(char *filename)
+/* opens a FLAC file for decoding in-process.  returns NULL if it can't be decoded this way, in which
+ * case the caller should fall back to the external decoder, which will report any real problems.
+ */
+{
+  flac_decoder *d;
+  wave_info info;
+  struct stat sz;
+  unsigned long tag_size;
+  int fd,ch;
+
+  if (!crc_tables_built)
+    build_crc_tables();
+
+  if (NULL == (d = calloc(1,sizeof(flac_decoder))))
+    return NULL;
+
+  if (NULL == (d->filename = strdup(filename)))
+    goto fail;
+
+  if ((fd = open(filename,O_RDONLY)) < 0)
+    goto fail;
+
+  if (fstat(fd,&sz) || sz.st_size < 4 || (uint64_t)sz.st_size != (uint64_t)(size_t)sz.st_size) {
+    close(fd);
+    goto fail;
+  }
+
+  d->map_size = (size_t)sz.st_size;
+  d->map = mmap(NULL,d->map_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+
+  if (MAP_FAILED == d->map) {
+    d->map = NULL;
+    goto fail;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  madvise(d->map,d->map_size,MADV_SEQUENTIAL);
+#endif
+
+  d->data = d->map;
+  d->size = d->map_size;
+
+  if (d->size >= sizeof(id3v2_header) && (tag_size = parse_id3v2_header(d->data))) {
+    tag_size += sizeof(id3v2_header);
+    if (tag_size >= d->size)
+      goto fail;
+    d->data += tag_size;
+    d->size -= tag_size;
+  }
+
+  memset(&info,0,sizeof(info));
+
+  if (!read_streaminfo(d,&info))
+    goto fail;
+
+  for (ch=0;ch<d->channels;ch++) {
+    if (NULL == (d->samples[ch] = malloc(d->max_block_size * sizeof(int32_t))))
+      goto fail;
+  }
+
+  if (NULL == (d->out = malloc(max(d->max_block_size * info.block_align,CANONICAL_HEADER_SIZE))))
+    goto fail;
+
+  make_canonical_header(d->header,&info);
+  memcpy(d->out,d->header,CANONICAL_HEADER_SIZE);
+  d->out_pos = 0;
+  d->out_len = CANONICAL_HEADER_SIZE;
+
+  return open_seekable_decoder_stream(d,flac_read,flac_seek,flac_close);
+
+fail:
+  flac_close(d);
+  return NULL;
+}
+
+/* encoder */
+
+#define FLAC_BLOCK_SIZE            4096
+#define FLAC_MAX_FIXED_ORDER       4
+#define FLAC_MAX_ENCODE_LPC_ORDER  8
+#define FLAC_MAX_PARTITION_ORDER   6
+#define FLAC_MAX_RICE_PARAM        30
+#define FLAC_MAX_THREADS           64
+#define FLAC_FRAMES_PER_THREAD     4      /* frames in a batch, per encoding thread */
+#define FLAC_SEEKPOINT_INTERVAL    10     /* seconds between seek points */
+#define FLAC_PADDING_SIZE          8192
+
+#define FLAC_SUBFRAME_CONSTANT     0
+#define FLAC_SUBFRAME_VERBATIM     1
+#define FLAC_SUBFRAME_FIXED        8
+#define FLAC_SUBFRAME_LPC          32
+
+/* residuals must fit in 31 bits once folded for Rice coding */
+#define FLAC_MAX_RESIDUAL          ((1L << 30) - 1)
+
+typedef struct _flac_bitwriter {
+  unsigned char *buf;
+  size_t         size;
+  size_t         len;                /* whole bytes in buf */
+  uint64_t       acc;                /* bits not yet in buf */
+  int            bits;
+  bool           failed;
+} flac_bitwriter;
+
+typedef struct _flac_subframe {
+  int            type;
+  int            order;
+  int            wasted;
+  int            bits;               /* sample size, less any wasted bits */
+  int            precision;
+  int            shift;
+  int32_t        coefs[FLAC_MAX_ENCODE_LPC_ORDER];
+  int            partition_order;
+  int            params[1 << FLAC_MAX_PARTITION_ORDER];
+  int32_t       *signal;             /* samples, less any wasted bits */
+  int32_t       *residual;           /* indexed like signal, starting at order */
+  uint64_t       size;               /* estimated size, in bits */
+} flac_subframe;
+
+typedef struct _flac_workspace {
+  int32_t       *input[FLAC_MAX_CHANNELS];     /* side and mid channels */
+  int32_t       *signal[FLAC_MAX_CHANNELS];
+  int32_t       *residual[FLAC_MAX_CHANNELS];
+  int32_t       *trial;
+  int32_t        coefs[FLAC_MAX_ENCODE_LPC_ORDER];
+  double        *window;
+  double        *windowed;
+  int            window_size;
+  flac_subframe  sub[FLAC_MAX_CHANNELS];
+} flac_workspace;
+
+typedef struct _flac_frame {
+  int            block_size;
+  uint32_t       number;
+  int32_t       *pcm[FLAC_MAX_CHANNELS];
+  flac_bitwriter out;
+} flac_frame;
+
+typedef struct _flac_batch {
+  int32_t       *pcm[FLAC_MAX_CHANNELS];
+  int            samples;            /* samples per channel collected so far */
+  int            num_frames;
+  flac_frame    *frames;
+} flac_batch;
+
+typedef struct _flac_thread {
+  struct _flac_encoder *encoder;
+  flac_workspace *ws;
+  pthread_t      id;
+  bool           running;
+} flac_thread;
+
+typedef struct _flac_encoder {
+  char          *filename;
+  FILE          *out;
+  bool           started;
+  bool           failed;
+
+  int            channels;
+  int            bits_per_sample;
+  int            block_align;
+  wlong          samples_per_sec;
+  unsigned char  partial[FLAC_MAX_CHANNELS * 3];   /* a sample split between writes */
+  int            partial_len;
+
+  struct md5_ctx md5;
+  uint64_t       total_samples;
+  uint32_t       next_frame_number;
+  uint64_t       frame_bytes;        /* bytes of frames written so far */
+  uint32_t       min_frame_size;
+  uint32_t       max_frame_size;
+  unsigned char *seektable;
+  long           seektable_offset;
+  int            num_seekpoints;
+  int            next_seekpoint;
+
+  flac_batch     batches[2];
+  int            filling;            /* index of the batch being filled */
+  int            batch_size;         /* in samples per channel */
+  int            frames_per_batch;
+
+  flac_workspace *ws;                /* for encoding without threads */
+  flac_thread   *threads;
+  int            num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  flac_batch    *encoding;           /* batch handed to the threads, if any */
+  int            next_frame;
+  int            frames_done;
+  bool           quit;
+} flac_encoder;
+
+/* bit writer */
+
+static bool reserve_bytes(flac_bitwriter *bw,size_t bytes)
+{
+  unsigned char *buf;
+  size_t size;
+
+  if (bw->len + bytes <= bw->size)
+    return TRUE;
+
+  size = max(bw->size * 2,bw->len + bytes);
+
+  if (NULL == (buf = realloc(bw->buf,size))) {
+    bw->failed = TRUE;
+    return FALSE;
+  }
+
+  bw->buf = buf;
+  bw->size = size;
+
+  return TRUE;
+}
+
+static void put_bits(flac_bitwriter *bw,uint32_t v,int bits)
+/* writes the low bits of v - up to 32 of them */
+{
+  uint32_t word;
+
+  if (bits < 32)
+    v &= ((uint32_t)1 << bits) - 1;
+
+  bw->acc = (bw->acc << bits) | v;
+  bw->bits += bits;
+
+  if (bw->bits < 32)
+    return;
+
+  bw->bits -= 32;
+
+  if (!reserve_bytes(bw,4))
+    return;
+
+  word = (uint32_t)(bw->acc >> bw->bits);
+  bw->buf[bw->len++] = (unsigned char)(word >> 24);
+  bw->buf[bw->len++] = (unsigned char)(word >> 16);
+  bw->buf[bw->len++] = (unsigned char)(word >> 8);
+  bw->buf[bw->len++] = (unsigned char)word;
+}
+
+static void flush_bits(flac_bitwriter *bw)
+/* zero-pads to a byte boundary, and moves everything into buf */
+{
+  if (bw->bits & 7)
+    put_bits(bw,0,8 - (bw->bits & 7));
+
+  while (bw->bits >= 8) {
+    bw->bits -= 8;
+    if (reserve_bytes(bw,1))
+      bw->buf[bw->len++] = (unsigned char)(bw->acc >> bw->bits);
+  }
+}
+
+static void put_rice(flac_bitwriter *bw,uint32_t u,int k)
+{
+  uint32_t q = u >> k;
+
+  while (q >= 32) {
+    put_bits(bw,0,32);
+    q -= 32;
+  }
+
+  if (q + 1 + k <= 32) {
+    put_bits(bw,((uint32_t)1 << k) | (u & (((uint32_t)1 << k) - 1)),q + 1 + k);
+  }
+  else {
+    put_bits(bw,1,q + 1);
+    put_bits(bw,u,k);
+  }
+}
+
+static uint32_t fold(int32_t r)
+/* maps signed residuals to unsigned ones: 0, -1, 1, -2, 2 ... */
+{
+  return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+/* analysis */
+
+static void fixed_residual(int32_t *s,int32_t *res,int block_size,int order)
+{
+  int i;
+
+  switch (order) {
+    case 0:
+      for (i=0;i<block_size;i++)
+        res[i] = s[i];
+      break;
+    case 1:
+      for (i=1;i<block_size;i++)
+        res[i] = s[i] - s[i-1];
+      break;
+    case 2:
+      for (i=2;i<block_size;i++)
+        res[i] = s[i] - 2 * s[i-1] + s[i-2];
+      break;
+    case 3:
+      for (i=3;i<block_size;i++)
+        res[i] = s[i] - 3 * (s[i-1] - s[i-2]) - s[i-3];
+      break;
+    default:
+      for (i=4;i<block_size;i++)
+        res[i] = s[i] - 4 * (s[i-1] + s[i-3]) + 6 * s[i-2] + s[i-4];
+      break;
+  }
+}
+
+static bool lpc_residual(int32_t *s,int32_t *res,int block_size,int32_t *coefs,int order,int shift)
+/* returns FALSE if a residual is too large to be coded */
+{
+  int i,j;
+  int64_t sum,r;
+
+  for (i=order;i<block_size;i++) {
+    sum = 0;
+    for (j=0;j<order;j++)
+      sum += (int64_t)coefs[j] * s[i-1-j];
+
+    r = s[i] - (sum >> shift);
+    if (r > FLAC_MAX_RESIDUAL || r < -FLAC_MAX_RESIDUAL)
+      return FALSE;
+
+    res[i] = (int32_t)r;
+  }
+
+  return TRUE;
+}
+
+static void build_window(double *w,int n)
+/* Tukey window, tapering a quarter of the block at each end */
+{
+  int i,taper = n / 4;
+
+  for (i=0;i<n;i++)
+    w[i] = 1.0;
+
+  for (i=0;i<taper;i++)
+    w[i] = w[n-1-i] = 0.5 - 0.5 * cos(3.14159265358979323846 * i / taper);
+}
+
+static int compute_lpc(flac_workspace *ws,int32_t *s,int block_size,double lpc[][FLAC_MAX_ENCODE_LPC_ORDER])
+/* works out predictor coefficients for each order, using Levinson-Durbin recursion on the autocorrelation
+ * of the windowed signal.  returns the highest usable order, or 0 if there is none.
+ */
+{
+  double autoc[FLAC_MAX_ENCODE_LPC_ORDER+1],a[FLAC_MAX_ENCODE_LPC_ORDER],err,r,tmp,sum;
+  int i,j,lag;
+
+  if (ws->window_size != block_size) {
+    build_window(ws->window,block_size);
+    ws->window_size = block_size;
+  }
+
+  for (i=0;i<block_size;i++)
+    ws->windowed[i] = s[i] * ws->window[i];
+
+  for (lag=0;lag<=FLAC_MAX_ENCODE_LPC_ORDER;lag++) {
+    sum = 0.0;
+    for (i=lag;i<block_size;i++)
+      sum += ws->windowed[i] * ws->windowed[i-lag];
+    autoc[lag] = sum;
+  }
+
+  if (autoc[0] <= 0.0)
+    return 0;
+
+  err = autoc[0];
+
+  for (i=0;i<FLAC_MAX_ENCODE_LPC_ORDER;i++) {
+    r = -autoc[i+1];
+    for (j=0;j<i;j++)
+      r -= a[j] * autoc[i-j];
+    r /= err;
+
+    a[i] = r;
+    for (j=0;j<(i>>1);j++) {
+      tmp = a[j];
+      a[j] += r * a[i-1-j];
+      a[i-1-j] += r * tmp;
+    }
+    if (i & 1)
+      a[j] += a[j] * r;
+
+    err *= (1.0 - r * r);
+
+    for (j=0;j<=i;j++)
+      lpc[i][j] = -a[j];
+
+    if (err <= 0.0)
+      return i + 1;
+  }
+
+  return FLAC_MAX_ENCODE_LPC_ORDER;
+}
+
+static bool quantize_lpc(double *lpc,int order,int precision,int32_t *coefs,int *shift)
+/* rounds coefficients to precision bits, carrying the rounding error along */
+{
+  double cmax = 0.0,error = 0.0;
+  int i,exponent;
+  long q,qmax = (1L << (precision - 1)) - 1;
+
+  for (i=0;i<order;i++)
+    if (fabs(lpc[i]) > cmax)
+      cmax = fabs(lpc[i]);
+
+  if (cmax <= 0.0)
+    return FALSE;
+
+  frexp(cmax,&exponent);
+
+  if ((*shift = precision - 1 - exponent) > 15)
+    *shift = 15;
+  else if (*shift < 0)
+    return FALSE;
+
+  for (i=0;i<order;i++) {
+    error += lpc[i] * (1 << *shift);
+    q = (long)floor(error + 0.5);
+    if (q > qmax)
+      q = qmax;
+    else if (q < -qmax - 1)
+      q = -qmax - 1;
+    error -= q;
+    coefs[i] = (int32_t)q;
+  }
+
+  return TRUE;
+}
+
+static uint64_t rice_partition_bits(uint64_t sum,int count,int *param)
+/* estimates the best Rice parameter for a partition from the sum of its folded residuals */
+{
+  uint64_t bits,best;
+  int k = 0;
+
+  while (k < FLAC_MAX_RICE_PARAM && ((uint64_t)count << (k + 1)) < sum)
+    k++;
+
+  best = (uint64_t)count * (k + 1) + (sum >> k);
+
+  if (k > 0 && (bits = (uint64_t)count * k + (sum >> (k - 1))) < best) {
+    best = bits;
+    k--;
+  }
+
+  *param = k;
+
+  return best;
+}
+
+static uint64_t rice_bits(int32_t *res,int block_size,int order,int *best_order,int *best_params)
+/* picks the partition order and Rice parameters for a residual, returning its estimated size in bits */
+{
+  uint64_t sums[FLAC_MAX_PARTITION_ORDER+1][1 << FLAC_MAX_PARTITION_ORDER];
+  uint64_t bits,best = ~(uint64_t)0,sum;
+  int params[1 << FLAC_MAX_PARTITION_ORDER];
+  int max_order,po,p,i,start,end,partition_size;
+  bool wide;
+
+  max_order = FLAC_MAX_PARTITION_ORDER;
+  while (max_order > 0 && ((block_size & ((1 << max_order) - 1)) || (block_size >> max_order) <= order))
+    max_order--;
+
+  partition_size = block_size >> max_order;
+
+  for (p=0;p<(1<<max_order);p++) {
+    start = max(p * partition_size,order);
+    end = (p + 1) * partition_size;
+    sum = 0;
+    for (i=start;i<end;i++)
+      sum += fold(res[i]);
+    sums[max_order][p] = sum;
+  }
+
+  for (po=max_order-1;po>=0;po--)
+    for (p=0;p<(1<<po);p++)
+      sums[po][p] = sums[po+1][2*p] + sums[po+1][2*p+1];
+
+  for (po=0;po<=max_order;po++) {
+    partition_size = block_size >> po;
+    bits = 0;
+    wide = FALSE;
+
+    for (p=0;p<(1<<po);p++) {
+      bits += rice_partition_bits(sums[po][p],partition_size - ((0 == p) ? order : 0),&params[p]);
+      if (params[p] > 14)
+        wide = TRUE;
+    }
+
+    bits += 2 + 4 + (1 << po) * ((wide) ? 5 : 4);
+
+    if (bits < best) {
+      best = bits;
+      *best_order = po;
+      memcpy(best_params,params,(1 << po) * sizeof(int));
+    }
+  }
+
+  return best;
+}
+
+static bool try_residual(flac_workspace *ws,int c,int block_size,int type,int order,uint64_t overhead)
+/* keeps the residual in ws->trial as channel c's encoding, if it is smaller than the best one so far */
+{
+  flac_subframe *sub = &ws->sub[c];
+  int params[1 << FLAC_MAX_PARTITION_ORDER];
+  int partition_order = 0;
+  uint64_t size;
+  int32_t *tmp;
+
+  size = overhead + rice_bits(ws->trial,block_size,order,&partition_order,params);
+
+  if (size >= sub->size)
+    return FALSE;
+
+  sub->type = type;
+  sub->order = order;
+  sub->size = size;
+  sub->partition_order = partition_order;
+  memcpy(sub->params,params,(1 << partition_order) * sizeof(int));
+
+  tmp = ws->residual[c];
+  ws->residual[c] = ws->trial;
+  ws->trial = tmp;
+  sub->residual = ws->residual[c];
+
+  return TRUE;
+}
+
+static void plan_subframe(flac_workspace *ws,int c,int32_t *in,int block_size,int bits)
+/* finds the smallest encoding of a channel */
+{
+  flac_subframe *sub = &ws->sub[c];
+  double lpc[FLAC_MAX_ENCODE_LPC_ORDER][FLAC_MAX_ENCODE_LPC_ORDER];
+  uint32_t mask = 0;
+  uint64_t overhead;
+  int32_t *s;
+  int i,order,lpc_orders,precision,shift;
+  bool constant = TRUE;
+
+  for (i=0;i<block_size;i++) {
+    mask |= (uint32_t)in[i];
+    if (in[i] != in[0])
+      constant = FALSE;
+  }
+
+  sub->signal = in;
+  sub->wasted = 0;
+  sub->bits = bits;
+  sub->order = 0;
+
+  if (constant) {
+    sub->type = FLAC_SUBFRAME_CONSTANT;
+    sub->size = 8 + bits;
+    return;
+  }
+
+  /* low bits that are zero in every sample needn't be coded */
+  while (!(mask & 1)) {
+    mask >>= 1;
+    sub->wasted++;
+  }
+
+  if (sub->wasted) {
+    s = ws->signal[c];
+    for (i=0;i<block_size;i++)
+      s[i] = in[i] >> sub->wasted;
+    sub->signal = s;
+    sub->bits -= sub->wasted;
+  }
+
+  s = sub->signal;
+  bits = sub->bits;
+  overhead = 8 + sub->wasted;
+
+  sub->type = FLAC_SUBFRAME_VERBATIM;
+  sub->size = overhead + (uint64_t)block_size * bits;
+
+  for (order=0;order<=FLAC_MAX_FIXED_ORDER && order<block_size;order++) {
+    fixed_residual(s,ws->trial,block_size,order);
+    try_residual(ws,c,block_size,FLAC_SUBFRAME_FIXED,order,overhead + order * bits);
+  }
+
+  if (block_size <= FLAC_MAX_ENCODE_LPC_ORDER || 0 == (lpc_orders = compute_lpc(ws,s,block_size,lpc)))
+    return;
+
+  precision = (bits < 16) ? max(5,2 + bits / 2) : 12;
+
+  for (order=1;order<=lpc_orders;order++) {
+    if (!quantize_lpc(lpc[order-1],order,precision,ws->coefs,&shift) ||
+        !lpc_residual(s,ws->trial,block_size,ws->coefs,order,shift))
+      continue;
+
+    if (try_residual(ws,c,block_size,FLAC_SUBFRAME_LPC,order,overhead + order * bits + 4 + 5 + order * precision)) {
+      sub->precision = precision;
+      sub->shift = shift;
+      memcpy(sub->coefs,ws->coefs,order * sizeof(int32_t));
+    }
+  }
+}
+
+/* frame writing */
+
+static void write_residual(flac_bitwriter *bw,flac_subframe *sub,int block_size)
+{
+  int p,i,k,end,param_bits = 4;
+
+  for (p=0;p<(1<<sub->partition_order);p++)
+    if (sub->params[p] > 14)
+      param_bits = 5;
+
+  put_bits(bw,(5 == param_bits) ? 1 : 0,2);
+  put_bits(bw,sub->partition_order,4);
+
+  i = sub->order;
+
+  for (p=0;p<(1<<sub->partition_order);p++) {
+    k = sub->params[p];
+    put_bits(bw,k,param_bits);
+
+    end = (p + 1) * (block_size >> sub->partition_order);
+    for (;i<end;i++)
+      put_rice(bw,fold(sub->residual[i]),k);
+  }
+}
+
+static void write_subframe(flac_bitwriter *bw,flac_subframe *sub,int block_size)
+{
+  int i,code;
+
+  switch (sub->type) {
+    case FLAC_SUBFRAME_FIXED: code = FLAC_SUBFRAME_FIXED + sub->order; break;
+    case FLAC_SUBFRAME_LPC:   code = FLAC_SUBFRAME_LPC + sub->order - 1; break;
+    default:                  code = sub->type; break;
+  }
+
+  put_bits(bw,(code << 1) | ((sub->wasted) ? 1 : 0),8);
+
+  /* wasted bits count, unary coded less one */
+  if (sub->wasted)
+    put_bits(bw,1,sub->wasted);
+
+  switch (sub->type) {
+    case FLAC_SUBFRAME_CONSTANT:
+      put_bits(bw,(uint32_t)sub->signal[0],sub->bits);
+      break;
+    case FLAC_SUBFRAME_VERBATIM:
+      for (i=0;i<block_size;i++)
+        put_bits(bw,(uint32_t)sub->signal[i],sub->bits);
+      break;
+    default:
+      for (i=0;i<sub->order;i++)
+        put_bits(bw,(uint32_t)sub->signal[i],sub->bits);
+
+      if (FLAC_SUBFRAME_LPC == sub->type) {
+        put_bits(bw,sub->precision - 1,4);
+        put_bits(bw,sub->shift,5);
+        for (i=0;i<sub->order;i++)
+          put_bits(bw,(uint32_t)sub->coefs[i],sub->precision);
+      }
+
+      write_residual(bw,sub,block_size);
+      break;
+  }
+}
+
+static void write_frame_header(flac_bitwriter *bw,flac_encoder *e,flac_frame *f,int assignment)
+{
+  static const wlong rates[12] = {0,88200,176400,192000,8000,16000,22050,24000,32000,44100,48000,96000};
+  int block_size_code,rate_code = 0,size_code,i,bytes;
+  uint32_t n = f->number;
+
+  if (FLAC_BLOCK_SIZE == f->block_size)
+    block_size_code = 12;
+  else
+    block_size_code = (f->block_size <= 256) ? 6 : 7;
+
+  for (i=1;i<12;i++)
+    if (rates[i] == e->samples_per_sec)
+      rate_code = i;
+
+  if (0 == rate_code) {
+    if (0 == e->samples_per_sec % 1000 && e->samples_per_sec <= 255000)
+      rate_code = 12;
+    else if (e->samples_per_sec <= 65535)
+      rate_code = 13;
+    else if (0 == e->samples_per_sec % 10 && e->samples_per_sec <= 655350)
+      rate_code = 14;
+  }
+
+  switch (e->bits_per_sample) {
+    case 8:  size_code = 1; break;
+    case 16: size_code = 4; break;
+    default: size_code = 6; break;
+  }
+
+  put_bits(bw,0xfff8,16);
+  put_bits(bw,block_size_code,4);
+  put_bits(bw,rate_code,4);
+  put_bits(bw,assignment,4);
+  put_bits(bw,size_code,3);
+  put_bits(bw,0,1);
+
+  /* frame number, UTF-8 style */
+  if (n < 0x80) {
+    put_bits(bw,n,8);
+  }
+  else {
+    for (bytes=2;bytes<6 && n>=((uint32_t)1 << (5 * bytes + 1));bytes++)
+      ;
+    put_bits(bw,(0xff00 >> bytes) | (n >> (6 * (bytes - 1))),8);
+    for (i=bytes-2;i>=0;i--)
+      put_bits(bw,0x80 | ((n >> (6 * i)) & 0x3f),8);
+  }
+
+  if (6 == block_size_code)
+    put_bits(bw,f->block_size - 1,8);
+  else if (7 == block_size_code)
+    put_bits(bw,f->block_size - 1,16);
+
+  if (12 == rate_code)
+    put_bits(bw,e->samples_per_sec / 1000,8);
+  else if (13 == rate_code)
+    put_bits(bw,e->samples_per_sec,16);
+  else if (14 == rate_code)
+    put_bits(bw,e->samples_per_sec / 10,16);
+
+  flush_bits(bw);
+
+  if (!bw->failed)
+    put_bits(bw,crc8(bw->buf,bw->len),8);
+}
+
+static void encode_frame(flac_encoder *e,flac_workspace *ws,flac_frame *f)
+{
+  flac_bitwriter *bw = &f->out;
+  int32_t *left,*right,*side,*mid;
+  int n = f->block_size,bits = e->bits_per_sample;
+  int ch,i,assignment,chosen[FLAC_MAX_CHANNELS];
+  uint64_t size;
+
+  bw->len = 0;
+  bw->bits = 0;
+  bw->acc = 0;
+  bw->failed = FALSE;
+
+  if (2 == e->channels) {
+    left = f->pcm[0];
+    right = f->pcm[1];
+    side = ws->input[2];
+    mid = ws->input[3];
+
+    for (i=0;i<n;i++) {
+      side[i] = left[i] - right[i];
+      mid[i] = (left[i] + right[i]) >> 1;
+    }
+
+    plan_subframe(ws,0,left,n,bits);
+    plan_subframe(ws,1,right,n,bits);
+    plan_subframe(ws,2,side,n,bits + 1);
+    plan_subframe(ws,3,mid,n,bits);
+
+    assignment = 1;
+    chosen[0] = 0;
+    chosen[1] = 1;
+    size = ws->sub[0].size + ws->sub[1].size;
+
+    if (ws->sub[0].size + ws->sub[2].size < size) {
+      assignment = FLAC_CHANNELS_LEFT_SIDE;
+      chosen[1] = 2;
+      size = ws->sub[0].size + ws->sub[2].size;
+    }
+
+    if (ws->sub[2].size + ws->sub[1].size < size) {
+      assignment = FLAC_CHANNELS_RIGHT_SIDE;
+      chosen[0] = 2;
+      chosen[1] = 1;
+      size = ws->sub[2].size + ws->sub[1].size;
+    }
+
+    if (ws->sub[3].size + ws->sub[2].size < size) {
+      assignment = FLAC_CHANNELS_MID_SIDE;
+      chosen[0] = 3;
+      chosen[1] = 2;
+    }
+  }
+  else {
+    for (ch=0;ch<e->channels;ch++) {
+      plan_subframe(ws,ch,f->pcm[ch],n,bits);
+      chosen[ch] = ch;
+    }
+    assignment = e->channels - 1;
+  }
+
+  write_frame_header(bw,e,f,assignment);
+
+  for (ch=0;ch<e->channels;ch++)
+    write_subframe(bw,&ws->sub[chosen[ch]],n);
+
+  flush_bits(bw);
+
+  if (!bw->failed) {
+    put_bits(bw,crc16(bw->buf,bw->len),16);
+    flush_bits(bw);
+  }
+}
+
+/* encoding threads */
+
+static void free_workspace(flac_workspace *);
+
+static void *encoding_thread(void *arg)
+{
+  flac_thread *t = (flac_thread *)arg;
+  flac_encoder *e = t->encoder;
+  flac_batch *b;
+  int i;
+
+  pthread_mutex_lock(&e->lock);
+
+  for (;;) {
+    while (!e->quit && (NULL == e->encoding || e->next_frame >= e->encoding->num_frames))
+      pthread_cond_wait(&e->work,&e->lock);
+
+    if (e->quit)
+      break;
+
+    b = e->encoding;
+    i = e->next_frame++;
+
+    pthread_mutex_unlock(&e->lock);
+
+    encode_frame(e,t->ws,&b->frames[i]);
+
+    pthread_mutex_lock(&e->lock);
+
+    if (++e->frames_done == b->num_frames)
+      pthread_cond_signal(&e->done);
+  }
+
+  pthread_mutex_unlock(&e->lock);
+
+  return NULL;
+}
+
+static void start_batch(flac_encoder *e,flac_batch *b)
+/* hands a batch to the encoding threads - or, without any, encodes it right away */
+{
+  int i;
+
+  if (0 == e->num_threads) {
+    for (i=0;i<b->num_frames;i++)
+      encode_frame(e,e->ws,&b->frames[i]);
+    e->encoding = b;
+    return;
+  }
+
+  pthread_mutex_lock(&e->lock);
+  e->encoding = b;
+  e->next_frame = 0;
+  e->frames_done = 0;
+  pthread_cond_broadcast(&e->work);
+  pthread_mutex_unlock(&e->lock);
+}
+
+static flac_batch *finish_batch(flac_encoder *e)
+/* waits for the batch being encoded, if any, and returns it */
+{
+  flac_batch *b;
+
+  if (0 == e->num_threads) {
+    b = e->encoding;
+    e->encoding = NULL;
+    return b;
+  }
+
+  pthread_mutex_lock(&e->lock);
+  while (e->encoding && e->frames_done < e->encoding->num_frames)
+    pthread_cond_wait(&e->done,&e->lock);
+  b = e->encoding;
+  e->encoding = NULL;
+  pthread_mutex_unlock(&e->lock);
+
+  return b;
+}
+
+static void stop_threads(flac_encoder *e)
+{
+  int i;
+
+  if (0 == e->num_threads)
+    return;
+
+  pthread_mutex_lock(&e->lock);
+  e->quit = TRUE;
+  pthread_cond_broadcast(&e->work);
+  pthread_mutex_unlock(&e->lock);
+
+  for (i=0;i<e->num_threads;i++) {
+    if (e->threads[i].running)
+      pthread_join(e->threads[i].id,NULL);
+    free_workspace(e->threads[i].ws);
+  }
+
+  pthread_mutex_destroy(&e->lock);
+  pthread_cond_destroy(&e->work);
+  pthread_cond_destroy(&e->done);
+
+  e->num_threads = 0;
+}
+
+static flac_workspace *new_workspace()
+{
+  flac_workspace *ws;
+  int ch;
+
+  if (NULL == (ws = calloc(1,sizeof(flac_workspace))))
+    return NULL;
+
+  for (ch=0;ch<FLAC_MAX_CHANNELS;ch++) {
+    if (NULL == (ws->input[ch] = malloc(FLAC_BLOCK_SIZE * sizeof(int32_t))) ||
+        NULL == (ws->signal[ch] = malloc(FLAC_BLOCK_SIZE * sizeof(int32_t))) ||
+        NULL == (ws->residual[ch] = malloc(FLAC_BLOCK_SIZE * sizeof(int32_t))))
+      return ws;
+  }
+
+  ws->trial = malloc(FLAC_BLOCK_SIZE * sizeof(int32_t));
+  ws->window = malloc(FLAC_BLOCK_SIZE * sizeof(double));
+  ws->windowed = malloc(FLAC_BLOCK_SIZE * sizeof(double));
+
+  return ws;
+}
+
+static bool workspace_ok(flac_workspace *ws)
+{
+  return (ws && ws->input[FLAC_MAX_CHANNELS-1] && ws->signal[FLAC_MAX_CHANNELS-1] &&
+          ws->residual[FLAC_MAX_CHANNELS-1] && ws->trial && ws->window && ws->windowed);
+}
+
+static void free_workspace(flac_workspace *ws)
+{
+  int ch;
+
+  if (NULL == ws)
+    return;
+
+  for (ch=0;ch<FLAC_MAX_CHANNELS;ch++) {
+    st_free(ws->input[ch]);
+    st_free(ws->signal[ch]);
+    st_free(ws->residual[ch]);
+  }
+
+  st_free(ws->trial);
+  st_free(ws->window);
+  st_free(ws->windowed);
+  st_free(ws);
+}
+
+static bool start_threads(flac_encoder *e,int wanted)
+/* starts the encoding threads - if only one is wanted, frames are encoded in this thread instead */
+{
+  int i;
+
+  if (wanted < 2)
+    return workspace_ok(e->ws = new_workspace());
+
+  if (NULL == (e->threads = calloc(wanted,sizeof(flac_thread))))
+    return FALSE;
+
+  pthread_mutex_init(&e->lock,NULL);
+  pthread_cond_init(&e->work,NULL);
+  pthread_cond_init(&e->done,NULL);
+
+  e->num_threads = wanted;
+
+  for (i=0;i<wanted;i++) {
+    e->threads[i].encoder = e;
+    if (!workspace_ok(e->threads[i].ws = new_workspace()))
+      return FALSE;
+    if (pthread_create(&e->threads[i].id,NULL,encoding_thread,&e->threads[i]))
+      return FALSE;
+    e->threads[i].running = TRUE;
+  }
+
+  st_debug2("encoding FLAC file with %d threads: [%s]",wanted,e->filename);
+
+  return TRUE;
+}
+
+/* output */
+
+static void put_be(unsigned char *p,uint64_t v,int bytes)
+{
+  while (bytes--) {
+    p[bytes] = (unsigned char)v;
+    v >>= 8;
+  }
+}
+
+static void make_streaminfo(flac_encoder *e,unsigned char *si,unsigned char *md5sum)
+{
+  memset(si,0,FLAC_STREAMINFO_SIZE);
+
+  put_be(si,FLAC_BLOCK_SIZE,2);
+  put_be(si + 2,FLAC_BLOCK_SIZE,2);
+  put_be(si + 4,e->min_frame_size,3);
+  put_be(si + 7,e->max_frame_size,3);
+
+  /* 20 bits of sample rate, 3 bits of (channels - 1), 5 bits of (bits/sample - 1), 36 bits of total samples */
+  put_be(si + 10,((uint64_t)e->samples_per_sec << 44) | ((uint64_t)(e->channels - 1) << 41) |
+                 ((uint64_t)(e->bits_per_sample - 1) << 36) | (e->total_samples & 0xfffffffffULL),8);
+
+  if (md5sum)
+    memcpy(si + 18,md5sum,16);
+}
+
+static void put_metadata_header(FILE *out,int type,uint32_t length)
+{
+  unsigned char buf[4];
+
+  buf[0] = (unsigned char)type;
+  put_be(buf + 1,length,3);
+  fwrite(buf,1,4,out);
+}
+
+static void write_metadata(flac_encoder *e,uint64_t expected_samples)
+/* writes the metadata blocks, leaving room for the seek points and STREAMINFO to be filled in later */
+{
+  static const char vendor[] = PACKAGE " " RELEASE;
+  unsigned char buf[FLAC_STREAMINFO_SIZE],zeros[FLAC_PADDING_SIZE];
+  uint64_t interval;
+  int i;
+
+  interval = (uint64_t)e->samples_per_sec * FLAC_SEEKPOINT_INTERVAL;
+  e->num_seekpoints = (int)((expected_samples + interval - 1) / interval);
+
+  if (e->num_seekpoints > 0 && NULL != (e->seektable = malloc(e->num_seekpoints * FLAC_SEEKPOINT_SIZE))) {
+    /* placeholders, for points past the end of a stream that turns out shorter than its header said */
+    for (i=0;i<e->num_seekpoints;i++) {
+      memset(e->seektable + i * FLAC_SEEKPOINT_SIZE,0xff,8);
+      memset(e->seektable + i * FLAC_SEEKPOINT_SIZE + 8,0,FLAC_SEEKPOINT_SIZE - 8);
+    }
+  }
+  else {
+    e->num_seekpoints = 0;
+  }
+
+  fwrite(FLAC_MAGIC,1,4,e->out);
+
+  put_metadata_header(e->out,FLAC_METADATA_STREAMINFO,FLAC_STREAMINFO_SIZE);
+  make_streaminfo(e,buf,NULL);
+  fwrite(buf,1,FLAC_STREAMINFO_SIZE,e->out);
+
+  if (e->num_seekpoints) {
+    put_metadata_header(e->out,FLAC_METADATA_SEEKTABLE,e->num_seekpoints * FLAC_SEEKPOINT_SIZE);
+    e->seektable_offset = ftell(e->out);
+    fwrite(e->seektable,FLAC_SEEKPOINT_SIZE,e->num_seekpoints,e->out);
+  }
+
+  /* vendor string, then no comments - all lengths are little-endian here */
+  put_metadata_header(e->out,FLAC_METADATA_VORBIS_COMMENT,4 + strlen(vendor) + 4);
+  ulong_to_uchar_le(buf,strlen(vendor));
+  fwrite(buf,1,4,e->out);
+  fwrite(vendor,1,strlen(vendor),e->out);
+  ulong_to_uchar_le(buf,0);
+  fwrite(buf,1,4,e->out);
+
+  memset(zeros,0,FLAC_PADDING_SIZE);
+  put_metadata_header(e->out,FLAC_METADATA_LAST | FLAC_METADATA_PADDING,FLAC_PADDING_SIZE);
+  fwrite(zeros,1,FLAC_PADDING_SIZE,e->out);
+}
+
+static void write_batch(flac_encoder *e)
+/* writes out the frames of the batch being encoded, once they're done */
+{
+  flac_batch *b;
+  flac_frame *f;
+  unsigned char *sp;
+  uint64_t interval;
+  int i;
+
+  if (NULL == (b = finish_batch(e)))
+    return;
+
+  interval = (uint64_t)e->samples_per_sec * FLAC_SEEKPOINT_INTERVAL;
+
+  for (i=0;i<b->num_frames;i++) {
+    f = &b->frames[i];
+
+    if (f->out.failed) {
+      e->failed = TRUE;
+      continue;
+    }
+
+    /* a seek point goes to the frame holding its target sample */
+    while (e->next_seekpoint < e->num_seekpoints && e->next_seekpoint * interval < e->total_samples + f->block_size) {
+      sp = e->seektable + e->next_seekpoint * FLAC_SEEKPOINT_SIZE;
+      put_be(sp,e->total_samples,8);
+      put_be(sp + 8,e->frame_bytes,8);
+      put_be(sp + 16,f->block_size,2);
+      e->next_seekpoint++;
+    }
+
+    if (f->out.len != fwrite(f->out.buf,1,f->out.len,e->out))
+      e->failed = TRUE;
+
+    if (0 == e->min_frame_size || f->out.len < e->min_frame_size)
+      e->min_frame_size = (uint32_t)f->out.len;
+    if (f->out.len > e->max_frame_size)
+      e->max_frame_size = (uint32_t)f->out.len;
+
+    e->frame_bytes += f->out.len;
+    e->total_samples += f->block_size;
+  }
+
+  b->samples = 0;
+}
+
+static void flush_batch(flac_encoder *e)
+/* starts encoding the batch that was being filled, once the previous one is written out */
+{
+  flac_batch *b = &e->batches[e->filling];
+  flac_frame *f;
+  int i,ch;
+
+  if (0 == b->samples)
+    return;
+
+  write_batch(e);
+
+  b->num_frames = (b->samples + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE;
+
+  for (i=0;i<b->num_frames;i++) {
+    f = &b->frames[i];
+    f->number = e->next_frame_number++;
+    f->block_size = min(FLAC_BLOCK_SIZE,b->samples - i * FLAC_BLOCK_SIZE);
+    for (ch=0;ch<e->channels;ch++)
+      f->pcm[ch] = b->pcm[ch] + i * FLAC_BLOCK_SIZE;
+  }
+
+  start_batch(e,b);
+
+  e->filling ^= 1;
+}
+
+static void add_samples(flac_encoder *e,unsigned char *p,int samples)
+/* converts whole WAVE samples into the batch being filled */
+{
+  flac_batch *b;
+  int i,ch,n;
+
+  while (samples > 0) {
+    b = &e->batches[e->filling];
+    n = min(samples,e->batch_size - b->samples);
+
+    for (i=b->samples;i<b->samples+n;i++) {
+      for (ch=0;ch<e->channels;ch++) {
+        switch (e->bits_per_sample) {
+          case 8:
+            b->pcm[ch][i] = (int32_t)p[0] - 128;
+            break;
+          case 16:
+            b->pcm[ch][i] = (int16_t)(p[0] | (p[1] << 8));
+            break;
+          default:
+            b->pcm[ch][i] = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+            break;
+        }
+        p += e->bits_per_sample / 8;
+      }
+    }
+
+    b->samples += n;
+    samples -= n;
+
+    if (b->samples == e->batch_size)
+      flush_batch(e);
+  }
+}
+
+static void add_data(flac_encoder *e,unsigned char *buf,wlong len)
+{
+  unsigned char md5buf[BUF_SIZE];
+  wlong i,n,whole;
+
+  /* the MD5 signature covers signed samples, so 8-bit data has to be converted first */
+  if (8 == e->bits_per_sample) {
+    for (i=0;i<len;i+=n) {
+      n = min(len - i,BUF_SIZE);
+      memcpy(md5buf,buf + i,n);
+      for (whole=0;whole<n;whole++)
+        md5buf[whole] ^= 0x80;
+      md5_process_bytes(md5buf,n,&e->md5);
+    }
+  }
+  else {
+    md5_process_bytes(buf,len,&e->md5);
+  }
+
+  if (e->partial_len) {
+    n = min(len,e->block_align - e->partial_len);
+    memcpy(e->partial + e->partial_len,buf,n);
+    e->partial_len += n;
+    buf += n;
+    len -= n;
+
+    if (e->partial_len < e->block_align)
+      return;
+
+    add_samples(e,e->partial,1);
+    e->partial_len = 0;
+  }
+
+  whole = len / e->block_align;
+  add_samples(e,buf,whole);
+
+  e->partial_len = len - whole * e->block_align;
+  memcpy(e->partial,buf + whole * e->block_align,e->partial_len);
+}
+
+static bool start_encoding(flac_encoder *e,wlong data_size)
+{
+  int ch,b,threads;
+
+  threads = job_threads(FLAC_MAX_THREADS);
+
+  e->frames_per_batch = FLAC_FRAMES_PER_THREAD * threads;
+  e->batch_size = FLAC_BLOCK_SIZE * e->frames_per_batch;
+
+  for (b=0;b<2;b++) {
+    if (NULL == (e->batches[b].frames = calloc(e->frames_per_batch,sizeof(flac_frame))))
+      return FALSE;
+    for (ch=0;ch<e->channels;ch++)
+      if (NULL == (e->batches[b].pcm[ch] = malloc(e->batch_size * sizeof(int32_t))))
+        return FALSE;
+  }
+
+  if (!start_threads(e,threads))
+    return FALSE;
+
+  md5_init_ctx(&e->md5);
+
+  write_metadata(e,data_size / e->block_align);
+
+  return TRUE;
+}
+
+static int flac_start(void *encoder,codec_wave_format *wf)
+{
+  flac_encoder *e = (flac_encoder *)encoder;
+
+  if (WAVE_FORMAT_PCM != wf->format || wf->channels < 1 || wf->channels > FLAC_MAX_CHANNELS ||
+      (8 != wf->bits_per_sample && 16 != wf->bits_per_sample && 24 != wf->bits_per_sample) ||
+      wf->block_align != wf->channels * (wf->bits_per_sample / 8) ||
+      wf->samples_per_sec < 1 || wf->samples_per_sec > 655350)
+  {
+    fclose(e->out);
+    e->out = NULL;
+    remove_file(e->filename);
+    return 0;
+  }
+
+  e->channels = wf->channels;
+  e->bits_per_sample = wf->bits_per_sample;
+  e->block_align = wf->block_align;
+  e->samples_per_sec = wf->samples_per_sec;
+  e->started = TRUE;
+
+  if (!start_encoding(e,wf->data_size)) {
+    e->failed = TRUE;
+    return -1;
+  }
+
+  return 1;
+}
+
+static int flac_write(void *encoder,unsigned char *buf,int size)
+{
+  flac_encoder *e = (flac_encoder *)encoder;
+
+  if (e->failed)
+    return -1;
+
+  add_data(e,buf,size);
+
+  return (e->failed) ? -1 : size;
+}
+
+static int flac_finish(void *encoder)
+{
+  flac_encoder *e = (flac_encoder *)encoder;
+  unsigned char streaminfo[FLAC_STREAMINFO_SIZE],md5sum[16];
+  int retval = 0,b,i;
+
+  if (e->started) {
+    if (!e->failed) {
+      flush_batch(e);
+      write_batch(e);
+    }
+
+    if (!e->failed) {
+      md5_finish_ctx(&e->md5,md5sum);
+      make_streaminfo(e,streaminfo,md5sum);
+
+      if (fseek(e->out,8,SEEK_SET) || FLAC_STREAMINFO_SIZE != fwrite(streaminfo,1,FLAC_STREAMINFO_SIZE,e->out))
+        e->failed = TRUE;
+
+      if (e->num_seekpoints && (fseek(e->out,e->seektable_offset,SEEK_SET) ||
+          (size_t)e->num_seekpoints != fwrite(e->seektable,FLAC_SEEKPOINT_SIZE,e->num_seekpoints,e->out)))
+        e->failed = TRUE;
+    }
+  }
+
+  stop_threads(e);
+
+  if (e->out && fclose(e->out))
+    e->failed = TRUE;
+
+  if (e->failed) {
+    st_warning("error while writing FLAC file: [%s]",e->filename);
+    retval = EOF;
+  }
+
+  for (b=0;b<2;b++) {
+    if (e->batches[b].frames)
+      for (i=0;i<e->frames_per_batch;i++)
+        st_free(e->batches[b].frames[i].out.buf);
+    st_free(e->batches[b].frames);
+    for (i=0;i<FLAC_MAX_CHANNELS;i++)
+      st_free(e->batches[b].pcm[i]);
+  }
+
+  free_workspace(e->ws);
+  st_free(e->threads);
+  st_free(e->seektable);
+  st_free(e->filename);
+  st_free(e);
+
+  return retval;
+}
+
+FILE *flac_encode_open(char *filename,FILE *(*fallback)(char *,proc_info *))
+/* creates a FLAC file, to be encoded in-process from the WAVE data written to the returned stream.  WAVE data
+ * that can't be encoded this way is passed on to the stream returned by fallback(), which launches the helper.
+ */
+{
+  flac_encoder *e;
+
+  if (!crc_tables_built)
+    build_crc_tables();
+
+  if (NULL == (e = calloc(1,sizeof(flac_encoder))))
+    return NULL;
+
+  if (NULL == (e->filename = strdup(filename)) || NULL == (e->out = fopen(filename,"wb"))) {
+    st_free(e->filename);
+    st_free(e);
+    return NULL;
+  }
+
+  return open_wave_encoder_stream(e,filename,flac_start,flac_write,flac_finish,fallback);
+}
@@ -0,0 +1,1443 @@
+/*  codec_shn.c - in-process Shorten codec
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * A Shorten file is a stream of commands, each either a block of samples for
+ * the next channel, verbatim bytes (the original file's header), or a change
+ * of block size or bit shift.  The decoder maps the file into memory, and runs
+ * the commands as the stream returned by shn_decode_open() is read, sending
+ * verbatim bytes as-is, just like 'shorten -x'.
+ *
+ * Decoding can be resumed at any block boundary given the bit position, the
+ * last few samples and the running means of each channel - which is what the
+ * entries of the seek table that 'shorten' appends to its files hold.  So the
+ * decoder stream can seek, using the seek table if there is one, and decoding
+ * from the start of the audio otherwise.
+ *
+ * The encoder writes version 2 files with the same defaults as 'shorten':
+ * blocks of 256 samples, each coded with whichever of the fixed polynomial
+ * predictors suits it best, and a seek table at the end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "shdtool.h"
+#include "codec.h"
+
+#define SHN_MAGIC             "ajkg"
+#define SHN_VERSION           2           /* written by the encoder */
+#define SHN_MAX_VERSION       3
+#define SHN_BITSTREAM_OFFSET  5
+
+/* bitstream definitions from shorten.h */
+#define SHN_ULONGSIZE             2
+#define SHN_TYPESIZE              4
+#define SHN_CHANSIZE              0
+#define SHN_LPCQSIZE              2
+#define SHN_NSKIPSIZE             1
+#define SHN_XBYTESIZE             7
+#define SHN_ENERGYSIZE            3
+#define SHN_BITSHIFTSIZE          2
+#define SHN_FNSIZE                2
+#define SHN_LPCQUANT              5
+#define SHN_VERBATIM_CKSIZE_SIZE  5
+#define SHN_VERBATIM_BYTE_SIZE    8
+#define SHN_VERBATIM_CHUNK_MAX    256
+#define SHN_NWRAP                 3
+
+#define SHN_FN_DIFF0      0
+#define SHN_FN_DIFF1      1
+#define SHN_FN_DIFF2      2
+#define SHN_FN_DIFF3      3
+#define SHN_FN_QUIT       4
+#define SHN_FN_BLOCKSIZE  5
+#define SHN_FN_BITSHIFT   6
+#define SHN_FN_QLPC       7
+#define SHN_FN_ZERO       8
+#define SHN_FN_VERBATIM   9
+
+#define SHN_TYPE_S8       1
+#define SHN_TYPE_U8       2
+#define SHN_TYPE_S16HL    3
+#define SHN_TYPE_U16HL    4
+#define SHN_TYPE_S16LH    5
+#define SHN_TYPE_U16LH    6
+
+#define SHN_DEFAULT_BLOCK_SIZE  256
+#define SHN_DEFAULT_V0NMEAN     0
+#define SHN_DEFAULT_V2NMEAN     4
+
+/* limits on what the decoder accepts, well beyond anything 'shorten' writes */
+#define SHN_MAX_CHANNELS        32
+#define SHN_MAX_BLOCK_SIZE      65536
+#define SHN_MAX_LPC_ORDER       64
+#define SHN_MAX_NMEAN           64
+#define SHN_MAX_UNARY           (1 << 24)
+
+/* seek tables, as appended by 'shorten' 3.x */
+#define SHN_SEEK_HEADER_MAGIC   "SEEK"
+#define SHN_SEEK_TRAILER_MAGIC  "SHNAMPSK"
+#define SHN_SEEK_HEADER_SIZE    12
+#define SHN_SEEK_TRAILER_SIZE   12
+#define SHN_SEEK_ENTRY_SIZE     80
+#define SHN_SEEK_REVISION       1
+#define SHN_SEEK_RESOLUTION     25600       /* sample frames between entries */
+#define SHN_SEEK_MAX_CHANNELS   2
+#define SHN_SEEK_MAX_NMEAN      4
+#define SHN_SEEK_BUFFER_SIZE    512         /* the read buffer that entries describe the position of */
+
+#define SHN_ENCODER_BUF_SIZE    65536
+
+typedef struct _shn_decoder {
+  char          *filename;
+  unsigned char *map;
+  size_t         map_size;
+  unsigned char *data;               /* the Shorten stream, past any ID3v2 tag */
+  size_t         size;               /* up to the seek table, if any */
+  uint64_t       pos;                /* bit position in data */
+  bool           overrun;
+
+  int            version;
+  int            ftype;
+  int            channels;
+  int            bytes_per_sample;
+  int            default_blocksize;
+  int            blocksize;
+  int            maxnlpc;
+  int            nmean;
+  int            nwrap;
+  int            bitshift;
+  int32_t        mean_init;
+  int32_t       *samples;            /* each channel's block, preceded by nwrap samples of history */
+  int32_t       *offsets;            /* each channel's last nmean block means */
+  int32_t        qlpc[SHN_MAX_LPC_ORDER];
+  int            chan;               /* channel of the next block */
+  wlong          sample;             /* sample frame of the next block */
+
+  unsigned char *header;             /* the verbatim bytes before the audio */
+  int            header_len;
+  uint64_t       audio_pos;          /* bit position of the first command after them */
+  bool           seekable;
+  int            block_align;
+  wlong          data_size;
+  unsigned char *seek_table;
+  int            seek_entries;
+
+  unsigned char *out;
+  int            out_size;
+  int            out_pos;
+  int            out_len;
+  wlong          out_start;          /* stream offset of out[0] */
+  wlong          out_sample;         /* first sample frame in out, if it holds samples */
+  int            out_frames;
+  bool           done;
+  bool           failed;
+} shn_decoder;
+
+typedef struct _shn_seek_point {
+  wlong          sample;
+  uint64_t       pos;
+  int32_t        history[SHN_SEEK_MAX_CHANNELS][SHN_NWRAP];
+  int32_t        offsets[SHN_SEEK_MAX_CHANNELS][SHN_SEEK_MAX_NMEAN];
+} shn_seek_point;
+
+typedef struct _shn_encoder {
+  char          *filename;
+  FILE          *out;
+  bool           started;
+  bool           failed;
+  int            ftype;
+  int            channels;
+  int            bytes_per_sample;
+  int32_t       *samples;            /* as for the decoder */
+  int32_t       *offsets;
+  int            chan;               /* channel of the next sample */
+  int            frames;             /* sample frames collected for the next block */
+  wlong          total_frames;
+  wlong          data_bytes;
+  unsigned char  partial[2];         /* a sample split between writes */
+  int            partial_len;
+
+  uint64_t       acc;
+  int            acc_bits;
+  uint64_t       bits;               /* written so far, from the start of the file */
+  unsigned char *buf;
+  int            buf_len;
+
+  shn_seek_point *seek_points;
+  int            seek_count;
+  int            seek_alloc;
+} shn_encoder;
+
+/* shared between the decoder and encoder */
+
+static uint32_t get_le16(unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get_le32(unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t get_be32(unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void put_le16(unsigned char *p,uint32_t v)
+{
+  p[0] = (unsigned char)(v & 0xff);
+  p[1] = (unsigned char)((v >> 8) & 0xff);
+}
+
+static void put_le32(unsigned char *p,uint32_t v)
+{
+  put_le16(p,v & 0xffff);
+  put_le16(p + 2,v >> 16);
+}
+
+static int count_bits(uint32_t v)
+{
+  int n = 0;
+
+  while (v) {
+    v >>= 1;
+    n++;
+  }
+
+  return n;
+}
+
+static int32_t mean_offset(int32_t *offset,int nmean,int version,int bitshift)
+/* the value DIFF0 blocks are coded relative to - the average of the last few block means */
+{
+  int64_t sum;
+  int i;
+
+  if (0 == nmean)
+    return offset[0];
+
+  sum = (version < 2) ? 0 : nmean / 2;
+
+  for (i=0;i<nmean;i++)
+    sum += offset[i];
+
+  if (version < 2)
+    return (int32_t)(sum / nmean);
+
+  /* this rounds nothing, but it is what 'shorten' does */
+  return (0 == bitshift) ? (int32_t)(sum / nmean) : (int32_t)(((sum / nmean) >> (bitshift - 1)) >> 1);
+}
+
+static void finish_block(int32_t *x,int n,int32_t *offset,int nmean,int nwrap,int version,int bitshift)
+/* updates the running means, and keeps the end of the block as history for the next one */
+{
+  int64_t sum;
+  int i;
+
+  if (nmean > 0) {
+    sum = (version < 2) ? 0 : n / 2;
+
+    for (i=0;i<n;i++)
+      sum += x[i];
+
+    for (i=1;i<nmean;i++)
+      offset[i - 1] = offset[i];
+
+    offset[nmean - 1] = (version < 2) ? (int32_t)(sum / n) : (int32_t)((sum / n) * ((int64_t)1 << bitshift));
+  }
+
+  /* in this order, since blocks can be shorter than the history */
+  for (i=-nwrap;i<0;i++)
+    x[i] = x[i + n];
+}
+
+static int32_t type_mean(int ftype)
+{
+  switch (ftype) {
+    case SHN_TYPE_U8:
+      return 0x80;
+    case SHN_TYPE_U16HL:
+    case SHN_TYPE_U16LH:
+      return 0x8000;
+  }
+
+  return 0;
+}
+
+/* bit reader */
+
+static int count_leading_zeros(uint64_t v)
+{
+#if defined(__GNUC__)
+  return __builtin_clzll(v);
+#else
+  int n = 0;
+
+  while (!(v & ((uint64_t)1 << 63))) {
+    v <<= 1;
+    n++;
+  }
+
+  return n;
+#endif
+}
+
+static uint64_t peek_64(shn_decoder *d)
+/* returns the next 64 bits (zero-filled past the end of data), starting at the byte holding the current bit */
+{
+  size_t byte = (size_t)(d->pos >> 3);
+  unsigned char *p = d->data + byte;
+  uint64_t v = 0;
+  int i;
+
+  if (byte + 8 <= d->size)
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+
+  for (i=0;i<8;i++)
+    v = (v << 8) | ((byte + i < d->size) ? d->data[byte + i] : 0);
+
+  return v;
+}
+
+static uint32_t get_bits(shn_decoder *d,int bits)
+/* reads an unsigned value of up to 32 bits */
+{
+  uint64_t v;
+
+  if (0 == bits)
+    return 0;
+
+  if (d->pos + bits > (uint64_t)d->size * 8) {
+    d->overrun = TRUE;
+    return 0;
+  }
+
+  v = peek_64(d) << (d->pos & 7);
+  d->pos += bits;
+
+  return (uint32_t)(v >> (64 - bits));
+}
+
+static uint32_t get_uvar(shn_decoder *d,int nbin)
+/* reads a Rice-coded value: a unary-coded high part, followed by nbin low bits */
+{
+  uint64_t v;
+  uint32_t zeros = 0;
+  int skip,lz;
+
+  for (;;) {
+    if (d->pos >= (uint64_t)d->size * 8 || zeros > SHN_MAX_UNARY) {
+      d->overrun = TRUE;
+      return 0;
+    }
+
+    skip = (int)(d->pos & 7);
+    v = peek_64(d) << skip;
+
+    if (v) {
+      lz = count_leading_zeros(v);
+      d->pos += lz + 1;
+      zeros += lz;
+      break;
+    }
+
+    d->pos += 64 - skip;
+    zeros += 64 - skip;
+  }
+
+  if (0 == nbin)
+    return zeros;
+
+  return (uint32_t)(((uint64_t)zeros << nbin) | get_bits(d,nbin));
+}
+
+static int32_t get_var(shn_decoder *d,int nbin)
+/* reads a signed value, whose sign is kept in the lowest bit */
+{
+  uint32_t u = get_uvar(d,nbin + 1);
+
+  return (u & 1) ? (int32_t)~(u >> 1) : (int32_t)(u >> 1);
+}
+
+static uint32_t get_uint(shn_decoder *d,int nbin)
+/* version 0 files store header values with a fixed Rice parameter, later versions store the parameter first */
+{
+  uint32_t nbits;
+
+  if (0 == d->version)
+    return get_uvar(d,nbin);
+
+  if ((nbits = get_uvar(d,SHN_ULONGSIZE)) > 32) {
+    d->overrun = TRUE;
+    return 0;
+  }
+
+  return get_uvar(d,(int)nbits);
+}
+
+/* decoder */
+
+static bool make_room(shn_decoder *d,int bytes)
+{
+  unsigned char *out;
+
+  if (bytes <= d->out_size)
+    return TRUE;
+
+  if (NULL == (out = realloc(d->out,bytes)))
+    return FALSE;
+
+  d->out = out;
+  d->out_size = bytes;
+
+  return TRUE;
+}
+
+static int32_t *channel_samples(shn_decoder *d,int chan)
+{
+  return d->samples + chan * (d->default_blocksize + d->nwrap) + d->nwrap;
+}
+
+static bool decode_block(shn_decoder *d,int cmd)
+/* decodes a block of the current channel */
+{
+  int32_t *x = channel_samples(d,d->chan),*offset = d->offsets + d->chan * max(1,d->nmean);
+  int32_t coffset,resn = 0;
+  int64_t sum;
+  int n = d->blocksize,nlpc,i,j;
+
+  if (SHN_FN_ZERO != cmd) {
+    resn = (int32_t)get_uvar(d,SHN_ENERGYSIZE);
+
+    /* version 0 counted the parameter differently */
+    if (0 == d->version)
+      resn--;
+
+    if (resn < 0 || resn > 31)
+      return FALSE;
+  }
+
+  coffset = mean_offset(offset,d->nmean,d->version,d->bitshift);
+
+  switch (cmd) {
+    case SHN_FN_ZERO:
+      for (i=0;i<n;i++)
+        x[i] = 0;
+      break;
+    case SHN_FN_DIFF0:
+      for (i=0;i<n;i++)
+        x[i] = get_var(d,resn) + coffset;
+      break;
+    case SHN_FN_DIFF1:
+      for (i=0;i<n;i++)
+        x[i] = get_var(d,resn) + x[i - 1];
+      break;
+    case SHN_FN_DIFF2:
+      for (i=0;i<n;i++)
+        x[i] = get_var(d,resn) + (2 * x[i - 1] - x[i - 2]);
+      break;
+    case SHN_FN_DIFF3:
+      for (i=0;i<n;i++)
+        x[i] = get_var(d,resn) + 3 * (x[i - 1] - x[i - 2]) + x[i - 3];
+      break;
+    case SHN_FN_QLPC:
+      if ((nlpc = (int)get_uvar(d,SHN_LPCQSIZE)) > d->nwrap)
+        return FALSE;
+
+      for (i=0;i<nlpc;i++)
+        d->qlpc[i] = get_var(d,SHN_LPCQUANT);
+
+      for (i=0;i<nlpc;i++)
+        x[i - nlpc] -= coffset;
+
+      for (i=0;i<n;i++) {
+        sum = (d->version > 1) ? (1 << SHN_LPCQUANT) : 0;
+        for (j=0;j<nlpc;j++)
+          sum += (int64_t)d->qlpc[j] * x[i - j - 1];
+        x[i] = get_var(d,resn) + (int32_t)(sum >> SHN_LPCQUANT);
+      }
+
+      if (coffset)
+        for (i=0;i<n;i++)
+          x[i] += coffset;
+      break;
+  }
+
+  finish_block(x,n,offset,d->nmean,d->nwrap,d->version,d->bitshift);
+
+  if (d->bitshift)
+    for (i=0;i<n;i++)
+      x[i] = (int32_t)((uint32_t)x[i] << d->bitshift);
+
+  return TRUE;
+}
+
+static void store_block(shn_decoder *d)
+/* interleaves the block just decoded in every channel into the output, in the original file's sample format */
+{
+  unsigned char *p = d->out;
+  int32_t v;
+  int i,c;
+
+  for (i=0;i<d->blocksize;i++) {
+    for (c=0;c<d->channels;c++) {
+      v = channel_samples(d,c)[i];
+
+      switch (d->ftype) {
+        case SHN_TYPE_S8:
+        case SHN_TYPE_U8:
+          *p++ = (unsigned char)(v & 0xff);
+          break;
+        case SHN_TYPE_S16HL:
+        case SHN_TYPE_U16HL:
+          *p++ = (unsigned char)((v >> 8) & 0xff);
+          *p++ = (unsigned char)(v & 0xff);
+          break;
+        default:
+          *p++ = (unsigned char)(v & 0xff);
+          *p++ = (unsigned char)((v >> 8) & 0xff);
+          break;
+      }
+    }
+  }
+
+  d->out_len = (int)(p - d->out);
+}
+
+static bool read_verbatim(shn_decoder *d,unsigned char **buf,int *len,int *size)
+/* appends the contents of a verbatim command to buf, which holds size bytes */
+{
+  unsigned char *p;
+  uint32_t n,i;
+
+  n = get_uvar(d,SHN_VERBATIM_CKSIZE_SIZE);
+
+  if (d->overrun || n > (uint32_t)(d->size - (size_t)(d->pos >> 3)))
+    return FALSE;
+
+  if (*len + (int)n > *size) {
+    if (NULL == (p = realloc(*buf,*len + n)))
+      return FALSE;
+    *buf = p;
+    *size = *len + (int)n;
+  }
+
+  for (i=0;i<n;i++)
+    (*buf)[*len + i] = (unsigned char)get_uvar(d,SHN_VERBATIM_BYTE_SIZE);
+
+  *len += (int)n;
+
+  return !d->overrun;
+}
+
+static int floor_log2(uint32_t v)
+{
+  return count_bits(v) - 1;
+}
+
+static bool next_chunk(shn_decoder *d)
+/* runs commands up to the next thing to send - a block in every channel, or verbatim bytes - which is left
+ * in d->out.  d->done is set at the end of the stream.
+ */
+{
+  uint32_t cmd,val;
+  wlong offset;
+
+  d->out_start += d->out_len;
+  d->out_pos = d->out_len = 0;
+  d->out_frames = 0;
+
+  for (;;) {
+    offset = (wlong)(d->pos >> 3);
+    cmd = get_uvar(d,SHN_FNSIZE);
+
+    if (d->overrun)
+      break;
+
+    switch (cmd) {
+      case SHN_FN_QUIT:
+        d->done = TRUE;
+        return TRUE;
+
+      case SHN_FN_BLOCKSIZE:
+        val = get_uint(d,floor_log2(d->blocksize));
+        if (0 == val || val > (uint32_t)d->default_blocksize)
+          goto corrupt;
+        d->blocksize = (int)val;
+        break;
+
+      case SHN_FN_BITSHIFT:
+        if ((val = get_uvar(d,SHN_BITSHIFTSIZE)) > 31)
+          goto corrupt;
+        d->bitshift = (int)val;
+        break;
+
+      case SHN_FN_VERBATIM:
+        if (!read_verbatim(d,&d->out,&d->out_len,&d->out_size)) {
+          if (d->overrun)
+            break;
+          goto corrupt;
+        }
+        if (d->out_len > 0)
+          return TRUE;
+        continue;
+
+      case SHN_FN_ZERO:
+      case SHN_FN_DIFF0:
+      case SHN_FN_DIFF1:
+      case SHN_FN_DIFF2:
+      case SHN_FN_DIFF3:
+      case SHN_FN_QLPC:
+        if ((SHN_FN_QLPC == cmd && 0 == d->maxnlpc) || !decode_block(d,(int)cmd))
+          goto corrupt;
+
+        if (d->overrun)
+          break;
+
+        if (++d->chan < d->channels)
+          continue;
+
+        d->chan = 0;
+        store_block(d);
+        d->out_sample = d->sample;
+        d->out_frames = d->blocksize;
+        d->sample += d->blocksize;
+        return TRUE;
+
+      default:
+        goto corrupt;
+    }
+
+    if (d->overrun)
+      break;
+  }
+
+  st_warning("Shorten stream ended early: [%s]",d->filename);
+  return FALSE;
+
+corrupt:
+  st_warning("corrupt Shorten command at byte %lu of file: [%s]",offset,d->filename);
+  return FALSE;
+}
+
+static void restart(shn_decoder *d,uint64_t pos,wlong sample,int bitshift)
+/* resumes decoding at a block boundary, with no history - the caller fills that in if it knows it */
+{
+  int c,i;
+
+  d->pos = pos;
+  d->overrun = FALSE;
+  d->sample = sample;
+  d->bitshift = bitshift;
+  d->blocksize = d->default_blocksize;
+  d->chan = 0;
+
+  for (c=0;c<d->channels;c++) {
+    for (i=-d->nwrap;i<0;i++)
+      channel_samples(d,c)[i] = 0;
+    for (i=0;i<max(1,d->nmean);i++)
+      d->offsets[c * max(1,d->nmean) + i] = d->mean_init;
+  }
+
+  d->out_start = d->header_len + sample * d->block_align;
+  d->out_pos = d->out_len = 0;
+  d->out_frames = 0;
+  d->done = FALSE;
+}
+
+static bool restore_seek_point(shn_decoder *d,unsigned char *e)
+/* resumes decoding at a seek table entry, which describes where 'shorten' had read up to in terms of its
+ * 512-byte read buffer, and the 32-bit word it was taking bits from
+ */
+{
+  uint64_t byte;
+  int bits,c,i;
+
+  byte = (uint64_t)get_le32(e + 8) + get_le16(e + 14);
+  bits = (int)get_le16(e + 16);
+
+  if (bits > 32 || byte < SHN_BITSTREAM_OFFSET || 0 != (byte - SHN_BITSTREAM_OFFSET) % 4 || byte > d->size ||
+      byte * 8 - bits < d->audio_pos || (bits > 0 && get_be32(d->data + byte - 4) != get_le32(e + 18)) ||
+      get_le16(e + 22) > 31)
+    return FALSE;
+
+  restart(d,byte * 8 - bits,get_le32(e),(int)get_le16(e + 22));
+
+  for (c=0;c<d->channels;c++) {
+    for (i=0;i<SHN_NWRAP;i++)
+      channel_samples(d,c)[-1 - i] = (int32_t)get_le32(e + 24 + 12 * c + 4 * i);
+    for (i=0;i<max(1,d->nmean);i++)
+      d->offsets[c * max(1,d->nmean) + i] = (int32_t)get_le32(e + 48 + 16 * c + 4 * i);
+  }
+
+  return TRUE;
+}
+
+static int find_seek_point(shn_decoder *d,wlong sample)
+/* returns the last seek table entry at or before the given sample frame, or -1 if there isn't one */
+{
+  int lo = 0,hi = d->seek_entries - 1,mid,found = -1;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+
+    if ((wlong)get_le32(d->seek_table + mid * SHN_SEEK_ENTRY_SIZE) <= sample) {
+      found = mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+
+  return found;
+}
+
+static int shn_read(void *decoder,unsigned char *buf,int size)
+{
+  shn_decoder *d = (shn_decoder *)decoder;
+  int bytes,copied = 0;
+
+  while (copied < size) {
+    if (d->out_pos == d->out_len) {
+      if (d->failed || d->done)
+        break;
+
+      if (!next_chunk(d)) {
+        d->failed = TRUE;
+        break;
+      }
+
+      continue;
+    }
+
+    bytes = min(size - copied,d->out_len - d->out_pos);
+    memcpy(buf + copied,d->out + d->out_pos,bytes);
+    d->out_pos += bytes;
+    copied += bytes;
+  }
+
+  if (0 == copied && d->failed)
+    return -1;
+
+  return copied;
+}
+
+static int shn_seek(void *decoder,wlong offset)
+/* moves to the given offset in the decoded stream, by restarting at the nearest seek table entry before it, or
+ * at the start of the audio if need be, and decoding up to it - or by just decoding up to it, if it is ahead
+ */
+{
+  shn_decoder *d = (shn_decoder *)decoder;
+  wlong sample,entry_sample = 0;
+  int entry;
+
+  if (!d->seekable || d->failed)
+    return -1;
+
+  if (offset < (wlong)d->header_len) {
+    restart(d,d->audio_pos,0,0);
+    memcpy(d->out,d->header,d->header_len);
+    d->out_start = 0;
+    d->out_len = d->header_len;
+    d->out_pos = (int)offset;
+    return 0;
+  }
+
+  if (offset - d->header_len > d->data_size)
+    return -1;
+
+  /* the very end is the end of the last block */
+  sample = (offset - d->header_len - ((offset - d->header_len == d->data_size) ? 1 : 0)) / d->block_align;
+
+  if (d->out_frames > 0 && sample >= d->out_sample && sample < d->out_sample + d->out_frames) {
+    d->out_pos = (int)(offset - d->out_start);
+    return 0;
+  }
+
+  if ((entry = find_seek_point(d,sample)) >= 0)
+    entry_sample = get_le32(d->seek_table + entry * SHN_SEEK_ENTRY_SIZE);
+
+  if (sample < d->sample || entry_sample > d->sample || d->done) {
+    if (entry < 0 || !restore_seek_point(d,d->seek_table + entry * SHN_SEEK_ENTRY_SIZE)) {
+      if (entry >= 0) {
+        st_debug1("ignoring seek table that doesn't match the audio in file: [%s]",d->filename);
+        d->seek_entries = 0;
+      }
+      restart(d,d->audio_pos,0,0);
+    }
+  }
+
+  while (0 == d->out_frames || sample >= d->out_sample + d->out_frames) {
+    if (d->done || !next_chunk(d)) {
+      d->failed = TRUE;
+      return -1;
+    }
+  }
+
+  /* verbatim bytes in the middle of the audio would throw the offsets out */
+  if (d->out_start != d->header_len + d->out_sample * d->block_align) {
+    d->failed = TRUE;
+    return -1;
+  }
+
+  d->out_pos = (int)(offset - d->out_start);
+
+  return 0;
+}
+
+static int shn_close(void *decoder)
+{
+  shn_decoder *d = (shn_decoder *)decoder;
+
+  if (d->map)
+    munmap(d->map,d->map_size);
+
+  st_free(d->samples);
+  st_free(d->offsets);
+  st_free(d->header);
+  st_free(d->out);
+  st_free(d->filename);
+  st_free(d);
+
+  return 0;
+}
+
+static bool map_file(shn_decoder *d)
+{
+  struct stat sz;
+  unsigned long tag_size;
+  int fd;
+
+  if ((fd = open(d->filename,O_RDONLY)) < 0)
+    return FALSE;
+
+  if (fstat(fd,&sz) || sz.st_size < SHN_BITSTREAM_OFFSET || (uint64_t)sz.st_size != (uint64_t)(size_t)sz.st_size) {
+    close(fd);
+    return FALSE;
+  }
+
+  d->map_size = (size_t)sz.st_size;
+  d->map = mmap(NULL,d->map_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+
+  if (MAP_FAILED == d->map) {
+    d->map = NULL;
+    return FALSE;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  madvise(d->map,d->map_size,MADV_SEQUENTIAL);
+#endif
+
+  d->data = d->map;
+  d->size = d->map_size;
+
+  /* 'shorten' skips ID3v2 tags too */
+  if (d->size > sizeof(id3v2_header) && (tag_size = parse_id3v2_header(d->map)) > 0) {
+    if (tag_size + sizeof(id3v2_header) >= d->size)
+      return FALSE;
+    d->data += tag_size + sizeof(id3v2_header);
+    d->size -= tag_size + sizeof(id3v2_header);
+  }
+
+  return TRUE;
+}
+
+static void find_seek_table(shn_decoder *d)
+/* looks for a seek table at the end of the file, and leaves it out of the stream if there is one */
+{
+  unsigned char *trailer,*header;
+  uint32_t table_size;
+
+  if (d->size < SHN_BITSTREAM_OFFSET + SHN_SEEK_HEADER_SIZE + SHN_SEEK_TRAILER_SIZE)
+    return;
+
+  trailer = d->data + d->size - SHN_SEEK_TRAILER_SIZE;
+
+  if (memcmp(trailer + 4,SHN_SEEK_TRAILER_MAGIC,strlen(SHN_SEEK_TRAILER_MAGIC)))
+    return;
+
+  table_size = get_le32(trailer);
+
+  if (table_size < SHN_SEEK_HEADER_SIZE + SHN_SEEK_TRAILER_SIZE || table_size > d->size - SHN_BITSTREAM_OFFSET ||
+      0 != (table_size - SHN_SEEK_HEADER_SIZE - SHN_SEEK_TRAILER_SIZE) % SHN_SEEK_ENTRY_SIZE)
+    return;
+
+  header = d->data + d->size - table_size;
+
+  if (tagcmp(header,(unsigned char *)SHN_SEEK_HEADER_MAGIC))
+    return;
+
+  d->size -= table_size;
+
+  /* only the history and means of two channels fit, and just three samples of history */
+  if (d->channels > SHN_SEEK_MAX_CHANNELS || d->nmean > SHN_SEEK_MAX_NMEAN || d->nwrap > SHN_NWRAP)
+    return;
+
+  d->seek_table = header + SHN_SEEK_HEADER_SIZE;
+  d->seek_entries = (int)((table_size - SHN_SEEK_HEADER_SIZE - SHN_SEEK_TRAILER_SIZE) / SHN_SEEK_ENTRY_SIZE);
+
+  st_debug2("found Shorten seek table with %d entries in file: [%s]",d->seek_entries,d->filename);
+}
+
+static bool read_stream_header(shn_decoder *d)
+/* reads the parameters at the start of the stream, and the verbatim bytes that follow them */
+{
+  uint32_t nskip,i,cmd;
+  uint64_t pos;
+  wave_info info;
+  int header_size = 0;
+
+  if (tagcmp(d->data,(unsigned char *)SHN_MAGIC) || d->data[4] > SHN_MAX_VERSION)
+    return FALSE;
+
+  d->version = d->data[4];
+  d->pos = SHN_BITSTREAM_OFFSET * 8;
+
+  d->ftype = (int)get_uint(d,SHN_TYPESIZE);
+  d->channels = (int)get_uint(d,SHN_CHANSIZE);
+  d->default_blocksize = SHN_DEFAULT_BLOCK_SIZE;
+  d->nmean = (d->version < 2) ? SHN_DEFAULT_V0NMEAN : SHN_DEFAULT_V2NMEAN;
+
+  if (d->version > 0) {
+    d->default_blocksize = (int)get_uint(d,floor_log2(SHN_DEFAULT_BLOCK_SIZE));
+    d->maxnlpc = (int)get_uint(d,SHN_LPCQSIZE);
+    d->nmean = (int)get_uint(d,0);
+    nskip = get_uint(d,SHN_NSKIPSIZE);
+
+    if (d->overrun || nskip > HEADER_CACHE_SIZE || NULL == (d->header = malloc(nskip + 1)))
+      return FALSE;
+
+    header_size = (int)nskip + 1;
+
+    /* bytes that preceded the audio, in files made by 'shorten -d' */
+    for (i=0;i<nskip;i++)
+      d->header[d->header_len++] = (unsigned char)get_uvar(d,SHN_XBYTESIZE);
+  }
+
+  /* only PCM - not the u-law and A-law types */
+  if (d->overrun || d->ftype < SHN_TYPE_S8 || d->ftype > SHN_TYPE_U16LH || d->channels < 1 ||
+      d->channels > SHN_MAX_CHANNELS || d->default_blocksize < 1 || d->default_blocksize > SHN_MAX_BLOCK_SIZE ||
+      d->maxnlpc > SHN_MAX_LPC_ORDER || d->nmean > SHN_MAX_NMEAN)
+    return FALSE;
+
+  d->bytes_per_sample = (d->ftype <= SHN_TYPE_U8) ? 1 : 2;
+  d->block_align = d->channels * d->bytes_per_sample;
+  d->nwrap = max(SHN_NWRAP,d->maxnlpc);
+  d->mean_init = type_mean(d->ftype);
+
+  for (;;) {
+    pos = d->pos;
+    cmd = get_uvar(d,SHN_FNSIZE);
+
+    if (d->overrun)
+      return FALSE;
+
+    if (SHN_FN_VERBATIM != cmd) {
+      d->pos = pos;
+      break;
+    }
+
+    if (!read_verbatim(d,&d->header,&d->header_len,&header_size))
+      return FALSE;
+  }
+
+  d->audio_pos = d->pos;
+
+  if (NULL == (d->samples = calloc(d->channels * (d->default_blocksize + d->nwrap),sizeof(int32_t))) ||
+      NULL == (d->offsets = calloc(d->channels * max(1,d->nmean),sizeof(int32_t))) ||
+      !make_room(d,max(d->header_len,d->default_blocksize * d->block_align)))
+    return FALSE;
+
+  /* offsets in the stream can only be worked out if the header describes the samples that follow it */
+  memset(&info,0,sizeof(info));
+  info.filename = d->filename;
+
+  if (d->header_len > 0 && probe_wav_header(&info,d->header,d->header_len) && info.block_align == d->block_align &&
+      info.bits_per_sample == d->bytes_per_sample * 8 && info.header_size == d->header_len && info.data_size > 0)
+  {
+    d->seekable = TRUE;
+    d->data_size = info.data_size;
+  }
+
+  return TRUE;
+}
+
+FILE *shn_decode_open(char *filename)
+/* opens a Shorten file for decoding in-process.  returns NULL if it can't be decoded this way, in which case
+ * the caller should fall back to the external decoder, which will report any real problems.
+ */
+{
+  shn_decoder *d;
+
+#ifndef HAVE_CODEC_STREAMS
+  return NULL;
+#endif
+
+  if (NULL == (d = calloc(1,sizeof(shn_decoder))))
+    return NULL;
+
+  if (NULL == (d->filename = strdup(filename)) || !map_file(d) || !read_stream_header(d))
+    goto fail;
+
+  if (d->seekable)
+    find_seek_table(d);
+
+  restart(d,d->audio_pos,0,0);
+
+  memcpy(d->out,d->header,d->header_len);
+  d->out_start = 0;
+  d->out_len = d->header_len;
+
+  return open_seekable_decoder_stream(d,shn_read,shn_seek,shn_close);
+
+fail:
+  shn_close(d);
+  return NULL;
+}
+
+/* bit writer */
+
+static void flush_bits(shn_encoder *e)
+{
+  if (e->buf_len > 0 && (size_t)e->buf_len != fwrite(e->buf,1,e->buf_len,e->out))
+    e->failed = TRUE;
+
+  e->buf_len = 0;
+}
+
+static void put_bits(shn_encoder *e,uint32_t v,int bits)
+/* writes up to 32 bits */
+{
+  if (0 == bits)
+    return;
+
+  e->acc = (e->acc << bits) | (v & (uint32_t)(0xffffffffUL >> (32 - bits)));
+  e->acc_bits += bits;
+  e->bits += bits;
+
+  while (e->acc_bits >= 8) {
+    e->acc_bits -= 8;
+    e->buf[e->buf_len++] = (unsigned char)(e->acc >> e->acc_bits);
+  }
+
+  if (e->buf_len >= SHN_ENCODER_BUF_SIZE)
+    flush_bits(e);
+}
+
+static void put_uvar(shn_encoder *e,uint32_t v,int nbin)
+{
+  uint32_t zeros = (nbin < 32) ? v >> nbin : 0;
+
+  if (zeros + 1 + nbin <= 32) {
+    put_bits(e,(1UL << nbin) | (v & (uint32_t)((1ULL << nbin) - 1)),(int)zeros + 1 + nbin);
+    return;
+  }
+
+  for (;zeros>=32;zeros-=32)
+    put_bits(e,0,32);
+
+  put_bits(e,1,(int)zeros + 1);
+  put_bits(e,v,nbin);
+}
+
+static void put_var(shn_encoder *e,int32_t v,int nbin)
+{
+  put_uvar(e,(v < 0) ? ((uint32_t)~v << 1) | 1 : (uint32_t)v << 1,nbin + 1);
+}
+
+static void put_uint(shn_encoder *e,uint32_t v)
+{
+  int nbits = count_bits(v);
+
+  put_uvar(e,(uint32_t)nbits,SHN_ULONGSIZE);
+  put_uvar(e,v,nbits);
+}
+
+/* encoder */
+
+static int32_t *encoder_samples(shn_encoder *e,int chan)
+{
+  return e->samples + chan * (SHN_DEFAULT_BLOCK_SIZE + SHN_NWRAP) + SHN_NWRAP;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+  return (v < 0) ? ((uint32_t)~v << 1) | 1 : (uint32_t)v << 1;
+}
+
+static int32_t residual(int32_t *x,int i,int order,int32_t coffset)
+{
+  switch (order) {
+    case 0:
+      return x[i] - coffset;
+    case 1:
+      return x[i] - x[i - 1];
+    case 2:
+      return x[i] - (2 * x[i - 1] - x[i - 2]);
+  }
+
+  return x[i] - (3 * (x[i - 1] - x[i - 2]) + x[i - 3]);
+}
+
+static void encode_block(shn_encoder *e,int chan,int n)
+/* codes a block of one channel with whichever fixed predictor, and Rice parameter, give the fewest bits */
+{
+  int32_t *x = encoder_samples(e,chan),*offset = e->offsets + chan * SHN_DEFAULT_V2NMEAN;
+  int32_t coffset;
+  uint64_t sums[4],cost,best_cost = 0;
+  int order,resn,best_order = 0,best_resn = 0,i;
+  bool silent = TRUE;
+
+  coffset = mean_offset(offset,SHN_DEFAULT_V2NMEAN,SHN_VERSION,0);
+
+  for (order=0;order<4;order++)
+    sums[order] = 0;
+
+  for (i=0;i<n;i++) {
+    if (x[i])
+      silent = FALSE;
+    for (order=0;order<4;order++)
+      sums[order] += zigzag(residual(x,i,order,coffset));
+  }
+
+  if (silent) {
+    put_uvar(e,SHN_FN_ZERO,SHN_FNSIZE);
+  }
+  else {
+    /* a good enough estimate of the cost, without going through the residual again for each parameter */
+    for (order=0;order<4;order++) {
+      for (resn=0;resn<31;resn++) {
+        cost = (uint64_t)n * (resn + 2) + (sums[order] >> (resn + 1));
+        if ((0 == order && 0 == resn) || cost < best_cost) {
+          best_cost = cost;
+          best_order = order;
+          best_resn = resn;
+        }
+      }
+    }
+
+    put_uvar(e,SHN_FN_DIFF0 + best_order,SHN_FNSIZE);
+    put_uvar(e,best_resn,SHN_ENERGYSIZE);
+
+    for (i=0;i<n;i++)
+      put_var(e,residual(x,i,best_order,coffset),best_resn);
+  }
+
+  finish_block(x,n,offset,SHN_DEFAULT_V2NMEAN,SHN_NWRAP,SHN_VERSION,0);
+}
+
+static void add_seek_point(shn_encoder *e)
+/* remembers the state a decoder would need to start here - the rest of the entry can only be filled in once
+ * the file is complete
+ */
+{
+  shn_seek_point *sp;
+  int c,i;
+
+  if (e->seek_count == e->seek_alloc) {
+    if (NULL == (sp = realloc(e->seek_points,(e->seek_alloc + 256) * sizeof(shn_seek_point)))) {
+      e->failed = TRUE;
+      return;
+    }
+    e->seek_points = sp;
+    e->seek_alloc += 256;
+  }
+
+  sp = e->seek_points + e->seek_count++;
+  memset(sp,0,sizeof(shn_seek_point));
+
+  sp->sample = e->total_frames;
+  sp->pos = e->bits;
+
+  for (c=0;c<e->channels;c++) {
+    for (i=0;i<SHN_NWRAP;i++)
+      sp->history[c][i] = encoder_samples(e,c)[-1 - i];
+    for (i=0;i<SHN_DEFAULT_V2NMEAN;i++)
+      sp->offsets[c][i] = e->offsets[c * SHN_DEFAULT_V2NMEAN + i];
+  }
+}
+
+static void encode_frames(shn_encoder *e)
+{
+  int c;
+
+  if (e->frames < SHN_DEFAULT_BLOCK_SIZE) {
+    put_uvar(e,SHN_FN_BLOCKSIZE,SHN_FNSIZE);
+    put_uint(e,(uint32_t)e->frames);
+  }
+
+  for (c=0;c<e->channels;c++)
+    encode_block(e,c,e->frames);
+
+  e->total_frames += e->frames;
+  e->frames = 0;
+
+  if (e->channels <= SHN_SEEK_MAX_CHANNELS && 0 == e->total_frames % SHN_SEEK_RESOLUTION)
+    add_seek_point(e);
+}
+
+static void put_verbatim(shn_encoder *e,unsigned char *p,int len)
+{
+  int n,i;
+
+  for (;len>0;len-=n,p+=n) {
+    n = min(len,SHN_VERBATIM_CHUNK_MAX);
+
+    put_uvar(e,SHN_FN_VERBATIM,SHN_FNSIZE);
+    put_uvar(e,(uint32_t)n,SHN_VERBATIM_CKSIZE_SIZE);
+
+    for (i=0;i<n;i++)
+      put_uvar(e,p[i],SHN_VERBATIM_BYTE_SIZE);
+  }
+}
+
+static int shn_start(void *encoder,codec_wave_format *wf)
+{
+  shn_encoder *e = (shn_encoder *)encoder;
+  int c,i;
+
+  if (WAVE_FORMAT_PCM != wf->format || wf->channels < 1 || wf->channels > SHN_MAX_CHANNELS ||
+      (8 != wf->bits_per_sample && 16 != wf->bits_per_sample) || wf->block_align != wf->channels * (wf->bits_per_sample / 8) ||
+      wf->header_size > HEADER_CACHE_SIZE)
+  {
+    fclose(e->out);
+    e->out = NULL;
+    remove_file(e->filename);
+    return 0;
+  }
+
+  e->channels = wf->channels;
+  e->bytes_per_sample = wf->bits_per_sample / 8;
+
+  /* what 'shorten' uses for WAVE data */
+  e->ftype = (1 == e->bytes_per_sample) ? SHN_TYPE_U8 : SHN_TYPE_S16LH;
+  e->started = TRUE;
+
+  if (NULL == (e->samples = calloc(e->channels * (SHN_DEFAULT_BLOCK_SIZE + SHN_NWRAP),sizeof(int32_t))) ||
+      NULL == (e->offsets = malloc(e->channels * SHN_DEFAULT_V2NMEAN * sizeof(int32_t))) ||
+      NULL == (e->buf = malloc(SHN_ENCODER_BUF_SIZE + 8)))
+  {
+    e->failed = TRUE;
+    return -1;
+  }
+
+  for (c=0;c<e->channels;c++)
+    for (i=0;i<SHN_DEFAULT_V2NMEAN;i++)
+      e->offsets[c * SHN_DEFAULT_V2NMEAN + i] = type_mean(e->ftype);
+
+  for (i=0;i<4;i++)
+    put_bits(e,(uint32_t)SHN_MAGIC[i],8);
+  put_bits(e,SHN_VERSION,8);
+
+  put_uint(e,(uint32_t)e->ftype);
+  put_uint(e,(uint32_t)e->channels);
+  put_uint(e,SHN_DEFAULT_BLOCK_SIZE);
+  put_uint(e,0);
+  put_uint(e,SHN_DEFAULT_V2NMEAN);
+  put_uint(e,0);
+
+  put_verbatim(e,wf->header,wf->header_size);
+
+  if (e->channels <= SHN_SEEK_MAX_CHANNELS)
+    add_seek_point(e);
+
+  flush_bits(e);
+
+  return (e->failed) ? -1 : 1;
+}
+
+static int shn_write(void *encoder,unsigned char *buf,int size)
+{
+  shn_encoder *e = (shn_encoder *)encoder;
+  int32_t v;
+  int i;
+
+  e->data_bytes += size;
+
+  for (i=0;i<size;i++) {
+    e->partial[e->partial_len++] = buf[i];
+
+    if (e->partial_len < e->bytes_per_sample)
+      continue;
+
+    e->partial_len = 0;
+
+    if (1 == e->bytes_per_sample)
+      v = e->partial[0];
+    else
+      v = (int16_t)(e->partial[0] | (e->partial[1] << 8));
+
+    encoder_samples(e,e->chan)[e->frames] = v;
+
+    if (++e->chan < e->channels)
+      continue;
+
+    e->chan = 0;
+
+    if (++e->frames == SHN_DEFAULT_BLOCK_SIZE)
+      encode_frames(e);
+  }
+
+  return (e->failed) ? -1 : size;
+}
+
+static void write_seek_table(shn_encoder *e)
+/* appends a seek table, with the positions described the way 'shorten' keeps track of them while decoding:
+ * the start of the last 512-byte chunk it read, how far into it it is, and the 32-bit word it is taking bits from
+ */
+{
+  unsigned char *table,*p,word[4];
+  uint64_t file_size,bits,words,chunk,chunk_start,chunk_offset,chunk_len;
+  int table_size,i,c,j;
+
+  file_size = e->bits / 8;
+  table_size = SHN_SEEK_HEADER_SIZE + e->seek_count * SHN_SEEK_ENTRY_SIZE + SHN_SEEK_TRAILER_SIZE;
+
+  if (NULL == (table = calloc(1,table_size))) {
+    e->failed = TRUE;
+    return;
+  }
+
+  tagcpy(table,(unsigned char *)SHN_SEEK_HEADER_MAGIC);
+  put_le32(table + 4,SHN_SEEK_REVISION);
+  put_le32(table + 8,(uint32_t)file_size);
+
+  for (i=0;i<e->seek_count;i++) {
+    p = table + SHN_SEEK_HEADER_SIZE + i * SHN_SEEK_ENTRY_SIZE;
+
+    bits = e->seek_points[i].pos - SHN_BITSTREAM_OFFSET * 8;
+    words = (bits + 31) / 32;
+
+    chunk = (words > 0) ? (words * 4 - 1) / SHN_SEEK_BUFFER_SIZE : 0;
+    chunk_start = SHN_BITSTREAM_OFFSET + chunk * SHN_SEEK_BUFFER_SIZE;
+    chunk_offset = words * 4 - chunk * SHN_SEEK_BUFFER_SIZE;
+    chunk_len = (words > 0) ? min(SHN_SEEK_BUFFER_SIZE,file_size - chunk_start) : 0;
+
+    put_le32(p,(uint32_t)e->seek_points[i].sample);
+    put_le32(p + 4,(uint32_t)(chunk_start + chunk_offset - ((words * 32 > bits) ? 4 : 0)));
+    put_le32(p + 8,(uint32_t)chunk_start);
+    put_le16(p + 12,(uint32_t)(chunk_len - chunk_offset));
+    put_le16(p + 14,(uint32_t)chunk_offset);
+    put_le16(p + 16,(uint32_t)(words * 32 - bits));
+
+    if (words > 0) {
+      if (fseeko(e->out,(off_t)(chunk_start + chunk_offset - 4),SEEK_SET) || 4 != fread(word,1,4,e->out)) {
+        e->failed = TRUE;
+        break;
+      }
+      put_le32(p + 18,get_be32(word));
+    }
+
+    for (c=0;c<e->channels;c++) {
+      for (j=0;j<SHN_NWRAP;j++)
+        put_le32(p + 24 + 12 * c + 4 * j,(uint32_t)e->seek_points[i].history[c][j]);
+      for (j=0;j<SHN_DEFAULT_V2NMEAN;j++)
+        put_le32(p + 48 + 16 * c + 4 * j,(uint32_t)e->seek_points[i].offsets[c][j]);
+    }
+  }
+
+  p = table + table_size - SHN_SEEK_TRAILER_SIZE;
+  put_le32(p,(uint32_t)table_size);
+  memcpy(p + 4,SHN_SEEK_TRAILER_MAGIC,strlen(SHN_SEEK_TRAILER_MAGIC));
+
+  if (!e->failed && (fseeko(e->out,0,SEEK_END) || (size_t)table_size != fwrite(table,1,table_size,e->out)))
+    e->failed = TRUE;
+
+  st_free(table);
+}
+
+static int shn_finish(void *encoder)
+{
+  shn_encoder *e = (shn_encoder *)encoder;
+  unsigned char pad = 0;
+  int retval = 0;
+
+  if (e->started && !e->failed) {
+    /* a stray partial sample frame can't be coded, so it is dropped */
+    if (e->chan || e->partial_len)
+      st_debug1("dropping partial sample frame at end of Shorten file: [%s]",e->filename);
+
+    if (e->frames > 0)
+      encode_frames(e);
+
+    /* 'shorten' keeps the pad byte after an odd-sized data chunk */
+    if (e->data_bytes & 1)
+      put_verbatim(e,&pad,1);
+
+    put_uvar(e,SHN_FN_QUIT,SHN_FNSIZE);
+
+    /* pad to a 32-bit word */
+    put_bits(e,0,(int)((32 - (e->bits - SHN_BITSTREAM_OFFSET * 8) % 32) % 32));
+    flush_bits(e);
+
+    if (!e->failed && e->channels <= SHN_SEEK_MAX_CHANNELS) {
+      if (fflush(e->out))
+        e->failed = TRUE;
+      else
+        write_seek_table(e);
+    }
+  }
+
+  if (e->out && fclose(e->out))
+    e->failed = TRUE;
+
+  if (e->failed) {
+    st_warning("error while writing Shorten file: [%s]",e->filename);
+    retval = EOF;
+  }
+
+  st_free(e->seek_points);
+  st_free(e->samples);
+  st_free(e->offsets);
+  st_free(e->buf);
+  st_free(e->filename);
+  st_free(e);
+
+  return retval;
+}
+
+FILE *shn_encode_open(char *filename,FILE *(*fallback)(char *,proc_info *))
+/* creates a Shorten file, with a seek table, from the WAVE data written to the returned stream.  WAVE data that
+ * isn't 8- or 16-bit PCM is passed on to the stream returned by fallback(), which launches the helper.
+ */
+{
+  shn_encoder *e;
+
+  if (NULL == (e = calloc(1,sizeof(shn_encoder))))
+    return NULL;
+
+  /* opened for reading too, since the seek table needs words that were written earlier */
+  if (NULL == (e->filename = strdup(filename)) || NULL == (e->out = fopen(filename,"w+b"))) {
+    st_free(e->filename);
+    st_free(e);
+    return NULL;
+  }
+
+  return open_wave_encoder_stream(e,filename,shn_start,shn_write,shn_finish,fallback);
+}
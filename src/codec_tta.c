@@ -0,0 +1,1093 @@
+/*  codec_tta.c - in-process TTA codec
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * A TTA1 file is a header, a table of frame sizes, and frames of about a
+ * second each, which are coded independently: every frame starts the
+ * predictor, adaptive filter and Rice coder of each channel afresh.  So the
+ * decoder, which maps the file into memory and decodes one frame at a time as
+ * the stream returned by tta_decode_open() is read, can seek by jumping to
+ * the frame it needs.  Unlike 'ttaenc', it decodes only what is read.
+ *
+ * The encoder writes the header and a placeholder frame table up front, based
+ * on the length given in the WAVE header, and fills the table in at the end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "shdtool.h"
+#include "codec.h"
+
+#define TTA_MAGIC            "TTA1"
+#define TTA_HEADER_SIZE      22
+#define TTA_FORMAT_SIMPLE    1
+#define TTA_MAX_CHANNELS     8
+#define TTA_MAX_UNARY        (1 << 24)
+
+#define TTA_ENCODER_BUF_SIZE 65536
+
+typedef struct _tta_channel {
+  int32_t  qm[8];                   /* adaptive filter */
+  int32_t  dx[8];
+  int32_t  dl[8];
+  int32_t  error;
+  uint32_t k0;                      /* Rice coder */
+  uint32_t k1;
+  uint32_t sum0;
+  uint32_t sum1;
+  int32_t  last;                    /* fixed predictor */
+} tta_channel;
+
+typedef struct _tta_decoder {
+  char          *filename;
+  unsigned char *map;
+  size_t         map_size;
+  unsigned char *data;              /* the TTA1 header, past any ID3v2 tag */
+  size_t         size;
+  uint64_t       pos;               /* bit position in data */
+  uint64_t       end;               /* bit position where the current frame's CRC starts, as far as we know */
+  bool           overrun;
+
+  int            channels;
+  int            bytes_per_sample;
+  int            block_align;
+  int            shift;
+  wlong          samples;
+  wlong          frame_len;
+  wlong          frames;
+  size_t        *frame_offsets;     /* from the frame table, if it checks out */
+  wlong          frame;             /* the next frame to decode */
+  size_t         frame_pos;         /* where it starts */
+  tta_channel    ch[TTA_MAX_CHANNELS];
+
+  unsigned char  header[CANONICAL_HEADER_SIZE];
+  wlong          data_size;
+  unsigned char *out;
+  int            out_pos;
+  int            out_len;
+  wlong          out_start;         /* stream offset of out[0] */
+  wlong          out_frame;         /* the frame in out, or -1 if it holds the header or pad byte */
+  bool           pad_sent;
+  bool           failed;
+} tta_decoder;
+
+typedef struct _tta_encoder {
+  char          *filename;
+  FILE          *out;
+  bool           started;
+  bool           failed;
+  int            channels;
+  int            bytes_per_sample;
+  int            block_align;
+  int            shift;
+  wlong          samples_per_sec;
+  wlong          frame_len;
+  wlong          expected_frames;
+  wlong          samples;
+  tta_channel    ch[TTA_MAX_CHANNELS];
+
+  int32_t       *frame;             /* interleaved samples of the next frame */
+  wlong          frame_samples;
+  unsigned char  partial[TTA_MAX_CHANNELS * 3];   /* a sample frame split between writes */
+  int            partial_len;
+
+  unsigned char *buf;               /* the frame being coded */
+  size_t         buf_size;
+  size_t         buf_len;
+  uint64_t       acc;
+  int            acc_bits;
+
+  uint32_t      *frame_sizes;
+  wlong          frames;
+  wlong          frames_alloc;
+} tta_encoder;
+
+static uint32_t crc32_table[256];
+static bool crc_table_built = FALSE;
+
+static void build_crc_table()
+{
+  uint32_t crc;
+  int i,j;
+
+  for (i=0;i<256;i++) {
+    crc = (uint32_t)i;
+    for (j=0;j<8;j++)
+      crc = (crc & 1) ? ((crc >> 1) ^ 0xedb88320) : (crc >> 1);
+    crc32_table[i] = crc;
+  }
+
+  crc_table_built = TRUE;
+}
+
+static uint32_t crc32(unsigned char *buf,size_t len)
+{
+  uint32_t crc = 0xffffffff;
+
+  while (len--)
+    crc = crc32_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+  return crc ^ 0xffffffff;
+}
+
+static uint32_t get_le16(unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get_le32(unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le16(unsigned char *p,uint32_t v)
+{
+  p[0] = (unsigned char)(v & 0xff);
+  p[1] = (unsigned char)((v >> 8) & 0xff);
+}
+
+static void put_le32(unsigned char *p,uint32_t v)
+{
+  put_le16(p,v & 0xffff);
+  put_le16(p + 2,v >> 16);
+}
+
+/* shared between the decoder and encoder */
+
+static int filter_shift(int bytes_per_sample)
+{
+  return (2 == bytes_per_sample) ? 9 : 10;
+}
+
+static wlong frame_length(wlong samples_per_sec)
+{
+  return 256 * samples_per_sec / 245;
+}
+
+static void reset_channels(tta_channel *ch,int channels)
+/* every frame starts from scratch */
+{
+  int c;
+
+  memset(ch,0,channels * sizeof(tta_channel));
+
+  for (c=0;c<channels;c++) {
+    ch[c].k0 = ch[c].k1 = 10;
+    ch[c].sum0 = ch[c].sum1 = (uint32_t)1 << 14;
+  }
+}
+
+static int32_t run_filter(tta_channel *ch,int shift,int32_t in,bool encode)
+/* the adaptive filter - which takes its prediction off a sample when encoding, and adds it back when decoding.
+ * its arithmetic wraps around like that of the reference implementation, which relies on 32-bit overflow.
+ */
+{
+  int32_t *qm = ch->qm,*dx = ch->dx,*dl = ch->dl,sample;
+  uint32_t sum = (uint32_t)1 << (shift - 1);
+  int i;
+
+  if (ch->error < 0)
+    for (i=0;i<8;i++)
+      qm[i] -= dx[i];
+  else if (ch->error > 0)
+    for (i=0;i<8;i++)
+      qm[i] += dx[i];
+
+  for (i=0;i<8;i++)
+    sum += (uint32_t)dl[i] * (uint32_t)qm[i];
+
+  dx[0] = dx[1]; dx[1] = dx[2]; dx[2] = dx[3]; dx[3] = dx[4];
+  dl[0] = dl[1]; dl[1] = dl[2]; dl[2] = dl[3]; dl[3] = dl[4];
+
+  dx[4] = ((dl[4] >> 30) | 1);
+  dx[5] = ((dl[5] >> 30) | 2) & ~1;
+  dx[6] = ((dl[6] >> 30) | 2) & ~1;
+  dx[7] = ((dl[7] >> 30) | 4) & ~3;
+
+  if (encode) {
+    sample = in;
+    in = (int32_t)((uint32_t)in - (uint32_t)((int32_t)sum >> shift));
+    ch->error = in;
+  }
+  else {
+    ch->error = in;
+    in = (int32_t)((uint32_t)in + (uint32_t)((int32_t)sum >> shift));
+    sample = in;
+  }
+
+  dl[4] = -dl[5];
+  dl[5] = -dl[6];
+  dl[6] = sample - dl[7];
+  dl[7] = sample;
+  dl[5] += dl[6];
+  dl[4] += dl[5];
+
+  return in;
+}
+
+static int32_t predict(int32_t last,int bytes_per_sample)
+/* the fixed first-order predictor */
+{
+  int k = (1 == bytes_per_sample) ? 4 : 5;
+
+  return (int32_t)(((int64_t)last * ((1 << k) - 1)) >> k);
+}
+
+static void adapt(uint32_t *sum,uint32_t *k,uint32_t value)
+/* tracks the average size of values, to pick the Rice parameter for the next one */
+{
+  *sum += value - (*sum >> 4);
+
+  if (*k > 0 && *sum < ((uint32_t)1 << (*k + 4)))
+    (*k)--;
+  else if (*k < 27 && *sum > ((uint32_t)1 << (*k + 5)))
+    (*k)++;
+}
+
+/* bit reader - TTA packs bits starting from the least significant one */
+
+static uint64_t peek_64(tta_decoder *d)
+/* returns the next 64 bits (zero-filled past the end of data), starting at the byte holding the current bit */
+{
+  size_t byte = (size_t)(d->pos >> 3);
+  unsigned char *p = d->data + byte;
+  uint64_t v = 0;
+  int i;
+
+  if (byte + 8 <= d->size)
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+
+  for (i=7;i>=0;i--)
+    v = (v << 8) | ((byte + i < d->size) ? p[i] : 0);
+
+  return v;
+}
+
+static int count_trailing_ones(uint64_t v)
+{
+#if defined(__GNUC__)
+  return (~v) ? __builtin_ctzll(~v) : 64;
+#else
+  int n = 0;
+
+  while (v & 1) {
+    v >>= 1;
+    n++;
+  }
+
+  return n;
+#endif
+}
+
+static uint32_t get_bits(tta_decoder *d,int bits)
+/* reads up to 32 bits */
+{
+  uint64_t v;
+
+  if (0 == bits)
+    return 0;
+
+  if (d->pos + bits > d->end) {
+    d->overrun = TRUE;
+    return 0;
+  }
+
+  v = peek_64(d) >> (d->pos & 7);
+  d->pos += bits;
+
+  return (uint32_t)(v & (((uint64_t)1 << bits) - 1));
+}
+
+static uint32_t get_unary(tta_decoder *d)
+/* counts one bits up to, and including, the next zero bit */
+{
+  uint32_t ones = 0;
+  uint64_t v;
+  int skip,n;
+
+  for (;;) {
+    if (d->pos >= d->end || ones > TTA_MAX_UNARY) {
+      d->overrun = TRUE;
+      return 0;
+    }
+
+    skip = (int)(d->pos & 7);
+    v = peek_64(d) >> skip;
+    n = count_trailing_ones(v);
+
+    if (n < 64 - skip) {
+      d->pos += n + 1;
+      return ones + n;
+    }
+
+    d->pos += 64 - skip;
+    ones += 64 - skip;
+  }
+}
+
+/* decoder */
+
+static int32_t decode_value(tta_decoder *d,tta_channel *ch)
+{
+  uint32_t unary,value,k;
+
+  unary = get_unary(d);
+
+  if (0 == unary) {
+    k = ch->k0;
+    value = get_bits(d,(int)k);
+  }
+  else {
+    k = ch->k1;
+    value = ((unary - 1) << k) + get_bits(d,(int)k);
+    adapt(&ch->sum1,&ch->k1,value);
+    value += (uint32_t)1 << ch->k0;
+  }
+
+  adapt(&ch->sum0,&ch->k0,value);
+
+  return (value & 1) ? (int32_t)((value >> 1) + 1) : -(int32_t)(value >> 1);
+}
+
+static bool decode_frame(tta_decoder *d)
+/* decodes the next frame into d->out */
+{
+  int32_t s[TTA_MAX_CHANNELS],v;
+  unsigned char *p = d->out;
+  wlong i,count;
+  size_t frame_end;
+  int c;
+
+  count = (d->frame == d->frames - 1) ? d->samples - d->frame * d->frame_len : d->frame_len;
+
+  /* the frame table says where the frame ends - without it, we find out by decoding it */
+  if (d->frame_offsets)
+    frame_end = d->frame_offsets[d->frame + 1] - 4;
+  else
+    frame_end = (d->size >= 4) ? d->size - 4 : 0;
+
+  if (d->frame_pos >= frame_end) {
+    st_warning("TTA stream ended %lu samples early: [%s]",(unsigned long)(d->samples - d->frame * d->frame_len),d->filename);
+    return FALSE;
+  }
+
+  d->pos = (uint64_t)d->frame_pos * 8;
+  d->end = (uint64_t)frame_end * 8;
+  d->overrun = FALSE;
+
+  reset_channels(d->ch,d->channels);
+
+  for (i=0;i<count;i++) {
+    for (c=0;c<d->channels;c++) {
+      v = run_filter(&d->ch[c],d->shift,decode_value(d,&d->ch[c]),FALSE);
+      v += predict(d->ch[c].last,d->bytes_per_sample);
+      d->ch[c].last = v;
+      s[c] = v;
+    }
+
+    /* undo the difference coding between channels */
+    if (d->channels > 1) {
+      s[d->channels - 1] += s[d->channels - 2] / 2;
+      for (c=d->channels-2;c>=0;c--)
+        s[c] = s[c + 1] - s[c];
+    }
+
+    for (c=0;c<d->channels;c++) {
+      switch (d->bytes_per_sample) {
+        case 1:
+          *p++ = (unsigned char)((s[c] + 0x80) & 0xff);
+          break;
+        case 2:
+          *p++ = (unsigned char)(s[c] & 0xff);
+          *p++ = (unsigned char)((s[c] >> 8) & 0xff);
+          break;
+        default:
+          *p++ = (unsigned char)(s[c] & 0xff);
+          *p++ = (unsigned char)((s[c] >> 8) & 0xff);
+          *p++ = (unsigned char)((s[c] >> 16) & 0xff);
+          break;
+      }
+    }
+
+    if (d->overrun)
+      break;
+  }
+
+  if (d->overrun) {
+    if (d->frame_offsets)
+      st_warning("TTA frame %lu runs past its end, so the file is damaged: [%s]",(unsigned long)d->frame,d->filename);
+    else
+      st_warning("TTA stream ended %lu samples early: [%s]",(unsigned long)(d->samples - d->frame * d->frame_len - i),d->filename);
+    return FALSE;
+  }
+
+  frame_end = (size_t)((d->pos + 7) >> 3);
+
+  /* like 'ttaenc', carry on past frames that fail their CRC check */
+  if (frame_end + 4 > d->size || crc32(d->data + d->frame_pos,frame_end - d->frame_pos) != get_le32(d->data + frame_end))
+    st_warning("TTA frame %lu failed its CRC check in file: [%s]",(unsigned long)d->frame,d->filename);
+
+  d->frame_pos = (d->frame_offsets) ? d->frame_offsets[d->frame + 1] : frame_end + 4;
+  d->out_frame = d->frame++;
+  d->out_pos = 0;
+  d->out_len = (int)(count * d->block_align);
+
+  return TRUE;
+}
+
+static bool next_chunk(tta_decoder *d)
+{
+  d->out_start += d->out_len;
+
+  if (d->frame < d->frames)
+    return decode_frame(d);
+
+  /* the pad byte after an odd-sized data chunk */
+  d->out[0] = 0;
+  d->out_pos = 0;
+  d->out_len = 1;
+  d->out_frame = -1;
+  d->pad_sent = TRUE;
+
+  return TRUE;
+}
+
+static bool finished(tta_decoder *d)
+{
+  return d->frame >= d->frames && (d->pad_sent || !(d->data_size & 1));
+}
+
+static int tta_read(void *decoder,unsigned char *buf,int size)
+{
+  tta_decoder *d = (tta_decoder *)decoder;
+  int bytes,copied = 0;
+
+  while (copied < size) {
+    if (d->out_pos == d->out_len) {
+      if (d->failed || finished(d))
+        break;
+
+      if (!next_chunk(d)) {
+        d->failed = TRUE;
+        break;
+      }
+    }
+
+    bytes = min(size - copied,d->out_len - d->out_pos);
+    memcpy(buf + copied,d->out + d->out_pos,bytes);
+    d->out_pos += bytes;
+    copied += bytes;
+  }
+
+  if (0 == copied && d->failed)
+    return -1;
+
+  return copied;
+}
+
+static void send_header(tta_decoder *d)
+{
+  memcpy(d->out,d->header,CANONICAL_HEADER_SIZE);
+  d->out_start = 0;
+  d->out_pos = 0;
+  d->out_len = CANONICAL_HEADER_SIZE;
+  d->out_frame = -1;
+  d->frame = 0;
+  d->frame_pos = (d->frame_offsets) ? d->frame_offsets[0] : TTA_HEADER_SIZE + (size_t)d->frames * 4 + 4;
+  d->pad_sent = FALSE;
+}
+
+static int tta_seek(void *decoder,wlong offset)
+/* frames are independent, so any of them can be decoded straight away - provided the frame table says where
+ * it is.  without the table, only offsets ahead of the current frame can be reached.
+ */
+{
+  tta_decoder *d = (tta_decoder *)decoder;
+  wlong frame;
+
+  if (d->failed || offset > CANONICAL_HEADER_SIZE + d->data_size)
+    return -1;
+
+  if (offset < CANONICAL_HEADER_SIZE) {
+    if (!d->frame_offsets && d->frame > 0)
+      return -1;
+    send_header(d);
+    d->out_pos = (int)offset;
+    return 0;
+  }
+
+  /* the very end is the end of the last frame */
+  frame = (offset - CANONICAL_HEADER_SIZE - ((offset - CANONICAL_HEADER_SIZE == d->data_size) ? 1 : 0)) /
+          d->block_align / d->frame_len;
+
+  if (frame >= d->frames)
+    frame = d->frames - 1;
+
+  if (d->out_frame != frame) {
+    if (d->frame_offsets) {
+      d->frame = frame;
+      d->frame_pos = d->frame_offsets[frame];
+    }
+    else if (frame < d->frame)
+      return -1;
+
+    while (d->frame <= frame) {
+      if (!decode_frame(d)) {
+        d->failed = TRUE;
+        return -1;
+      }
+    }
+
+    d->pad_sent = FALSE;
+  }
+
+  d->out_start = CANONICAL_HEADER_SIZE + frame * d->frame_len * d->block_align;
+  d->out_pos = (int)(offset - d->out_start);
+
+  return 0;
+}
+
+static int tta_close(void *decoder)
+{
+  tta_decoder *d = (tta_decoder *)decoder;
+
+  if (d->map)
+    munmap(d->map,d->map_size);
+
+  st_free(d->frame_offsets);
+  st_free(d->out);
+  st_free(d->filename);
+  st_free(d);
+
+  return 0;
+}
+
+static bool map_file(tta_decoder *d)
+{
+  struct stat sz;
+  unsigned long tag_size;
+  int fd;
+
+  if ((fd = open(d->filename,O_RDONLY)) < 0)
+    return FALSE;
+
+  if (fstat(fd,&sz) || sz.st_size < TTA_HEADER_SIZE || (uint64_t)sz.st_size != (uint64_t)(size_t)sz.st_size) {
+    close(fd);
+    return FALSE;
+  }
+
+  d->map_size = (size_t)sz.st_size;
+  d->map = mmap(NULL,d->map_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+
+  if (MAP_FAILED == d->map) {
+    d->map = NULL;
+    return FALSE;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  madvise(d->map,d->map_size,MADV_SEQUENTIAL);
+#endif
+
+  d->data = d->map;
+  d->size = d->map_size;
+
+  if (d->size > sizeof(id3v2_header) && (tag_size = parse_id3v2_header(d->map)) > 0) {
+    if (tag_size + sizeof(id3v2_header) + TTA_HEADER_SIZE > d->size)
+      return FALSE;
+    d->data += tag_size + sizeof(id3v2_header);
+    d->size -= tag_size + sizeof(id3v2_header);
+  }
+
+  return TRUE;
+}
+
+static void read_frame_table(tta_decoder *d)
+/* works out where each frame starts, if the frame table is intact */
+{
+  unsigned char *table = d->data + TTA_HEADER_SIZE;
+  size_t table_size = (size_t)d->frames * 4,pos;
+  wlong i;
+
+  if (TTA_HEADER_SIZE + table_size + 4 > d->size || crc32(table,table_size) != get_le32(table + table_size)) {
+    st_debug1("TTA frame table is damaged, so the stream can't seek: [%s]",d->filename);
+    return;
+  }
+
+  if (NULL == (d->frame_offsets = malloc(((size_t)d->frames + 1) * sizeof(size_t))))
+    return;
+
+  pos = TTA_HEADER_SIZE + table_size + 4;
+
+  for (i=0;i<d->frames;i++) {
+    d->frame_offsets[i] = pos;
+    pos += get_le32(table + i * 4);
+
+    if (pos > d->size || get_le32(table + i * 4) < 4) {
+      st_debug1("TTA frame table doesn't match the file, so the stream can't seek: [%s]",d->filename);
+      st_free(d->frame_offsets);
+      d->frame_offsets = NULL;
+      return;
+    }
+  }
+
+  d->frame_offsets[d->frames] = pos;
+}
+
+bool tta_decode_supported(int channels,int bits_per_sample)
+{
+#ifdef HAVE_CODEC_STREAMS
+  return (channels >= 1 && channels <= TTA_MAX_CHANNELS && (8 == bits_per_sample || 16 == bits_per_sample || 24 == bits_per_sample));
+#else
+  return FALSE;
+#endif
+}
+
+FILE *tta_decode_open(char *filename)
+/* opens a TTA file for decoding in-process.  returns NULL if it can't be decoded this way - encrypted files, for
+ * one - in which case the caller should fall back to the external decoder, which will report any real problems.
+ */
+{
+  tta_decoder *d;
+  wave_info info;
+  unsigned char *h;
+  int bits_per_sample;
+
+#ifndef HAVE_CODEC_STREAMS
+  return NULL;
+#endif
+
+  if (!crc_table_built)
+    build_crc_table();
+
+  if (NULL == (d = calloc(1,sizeof(tta_decoder))))
+    return NULL;
+
+  if (NULL == (d->filename = strdup(filename)) || !map_file(d))
+    goto fail;
+
+  h = d->data;
+
+  if (tagcmp(h,(unsigned char *)TTA_MAGIC) || TTA_FORMAT_SIMPLE != get_le16(h + 4))
+    goto fail;
+
+  if (crc32(h,TTA_HEADER_SIZE - 4) != get_le32(h + TTA_HEADER_SIZE - 4)) {
+    st_debug1("TTA header failed its CRC check: [%s]",filename);
+    goto fail;
+  }
+
+  d->channels = (int)get_le16(h + 6);
+  bits_per_sample = (int)get_le16(h + 8);
+  d->samples = get_le32(h + 14);
+
+  if (!tta_decode_supported(d->channels,bits_per_sample) || 0 == (d->frame_len = frame_length(get_le32(h + 10))))
+    goto fail;
+
+  memset(&info,0,sizeof(info));
+  info.filename = d->filename;
+
+  if (!probe_canonical_header(&info,(wshort)d->channels,(wshort)bits_per_sample,get_le32(h + 10),d->samples))
+    goto fail;
+
+  make_canonical_header(d->header,&info);
+
+  d->bytes_per_sample = bits_per_sample / 8;
+  d->block_align = d->channels * d->bytes_per_sample;
+  d->shift = filter_shift(d->bytes_per_sample);
+  d->data_size = info.data_size;
+  d->frames = (d->samples + d->frame_len - 1) / d->frame_len;
+
+  if (TTA_HEADER_SIZE + (uint64_t)d->frames * 4 + 4 > d->size)
+    goto fail;
+
+  read_frame_table(d);
+
+  if (NULL == (d->out = malloc(max((size_t)d->frame_len * d->block_align,CANONICAL_HEADER_SIZE))))
+    goto fail;
+
+  send_header(d);
+
+  return open_seekable_decoder_stream(d,tta_read,tta_seek,tta_close);
+
+fail:
+  tta_close(d);
+  return NULL;
+}
+
+/* encoder */
+
+static bool make_room(tta_encoder *e,size_t bytes)
+{
+  unsigned char *buf;
+  size_t size;
+
+  if (e->buf_len + bytes <= e->buf_size)
+    return TRUE;
+
+  size = max(e->buf_size * 2,e->buf_len + bytes);
+
+  if (NULL == (buf = realloc(e->buf,size))) {
+    e->failed = TRUE;
+    return FALSE;
+  }
+
+  e->buf = buf;
+  e->buf_size = size;
+
+  return TRUE;
+}
+
+static void put_bits(tta_encoder *e,uint32_t v,int bits)
+/* writes up to 32 bits, once make_room() has made sure they fit */
+{
+  e->acc |= (uint64_t)v << e->acc_bits;
+  e->acc_bits += bits;
+
+  while (e->acc_bits >= 8) {
+    e->buf[e->buf_len++] = (unsigned char)(e->acc & 0xff);
+    e->acc >>= 8;
+    e->acc_bits -= 8;
+  }
+}
+
+static bool put_value(tta_encoder *e,tta_channel *ch,int32_t v)
+{
+  uint32_t value,unary,k;
+
+  value = (v > 0) ? ((uint32_t)v << 1) - 1 : (uint32_t)0 - ((uint32_t)v << 1);
+
+  k = ch->k0;
+  adapt(&ch->sum0,&ch->k0,value);
+
+  if (value >= ((uint32_t)1 << k)) {
+    value -= (uint32_t)1 << k;
+    k = ch->k1;
+    adapt(&ch->sum1,&ch->k1,value);
+    unary = 1 + (value >> k);
+  }
+  else
+    unary = 0;
+
+  if (!make_room(e,unary / 8 + 16))
+    return FALSE;
+
+  for (;unary>=32;unary-=32)
+    put_bits(e,0xffffffff,32);
+
+  /* the unary part ends with a zero bit */
+  put_bits(e,((uint32_t)1 << unary) - 1,(int)unary + 1);
+
+  if (k)
+    put_bits(e,value & (uint32_t)(((uint64_t)1 << k) - 1),(int)k);
+
+  return TRUE;
+}
+
+static void encode_frame(tta_encoder *e)
+/* codes the buffered samples as a frame, and writes it out */
+{
+  int32_t *s,diff,pred,v;
+  uint32_t *sizes;
+  wlong i;
+  int c;
+
+  if (e->frames == e->frames_alloc) {
+    if (NULL == (sizes = realloc(e->frame_sizes,(size_t)(e->frames_alloc * 2) * sizeof(uint32_t)))) {
+      e->failed = TRUE;
+      return;
+    }
+    e->frame_sizes = sizes;
+    e->frames_alloc *= 2;
+  }
+
+  reset_channels(e->ch,e->channels);
+
+  e->buf_len = 0;
+  e->acc = 0;
+  e->acc_bits = 0;
+
+  for (i=0;i<e->frame_samples && !e->failed;i++) {
+    s = e->frame + i * e->channels;
+    diff = 0;
+
+    for (c=0;c<e->channels;c++) {
+      /* each channel but the last is coded as its difference from the next one */
+      if (c < e->channels - 1)
+        v = diff = s[c + 1] - s[c];
+      else
+        v = s[c] - diff / 2;
+
+      pred = predict(e->ch[c].last,e->bytes_per_sample);
+      e->ch[c].last = v;
+
+      if (!put_value(e,&e->ch[c],run_filter(&e->ch[c],e->shift,v - pred,TRUE)))
+        break;
+    }
+  }
+
+  if (e->failed || !make_room(e,5))
+    return;
+
+  /* pad to a byte, then the frame's CRC */
+  if (e->acc_bits)
+    put_bits(e,0,8 - e->acc_bits);
+
+  put_le32(e->buf + e->buf_len,crc32(e->buf,e->buf_len));
+  e->buf_len += 4;
+
+  if (e->buf_len != fwrite(e->buf,1,e->buf_len,e->out)) {
+    e->failed = TRUE;
+    return;
+  }
+
+  e->frame_sizes[e->frames++] = (uint32_t)e->buf_len;
+  e->samples += e->frame_samples;
+  e->frame_samples = 0;
+}
+
+static size_t data_offset(wlong frames)
+{
+  return TTA_HEADER_SIZE + (size_t)frames * 4 + 4;
+}
+
+static bool write_header(tta_encoder *e,wlong samples,wlong frames)
+/* writes the header and frame table at the start of the file, with the frame sizes known so far */
+{
+  unsigned char *h;
+  size_t size = data_offset(frames);
+  wlong i;
+  bool ok;
+
+  if (NULL == (h = calloc(1,size)))
+    return FALSE;
+
+  tagcpy(h,(unsigned char *)TTA_MAGIC);
+  put_le16(h + 4,TTA_FORMAT_SIMPLE);
+  put_le16(h + 6,(uint32_t)e->channels);
+  put_le16(h + 8,(uint32_t)e->bytes_per_sample * 8);
+  put_le32(h + 10,(uint32_t)e->samples_per_sec);
+  put_le32(h + 14,(uint32_t)samples);
+  put_le32(h + 18,crc32(h,TTA_HEADER_SIZE - 4));
+
+  for (i=0;i<min(frames,e->frames);i++)
+    put_le32(h + TTA_HEADER_SIZE + i * 4,e->frame_sizes[i]);
+  put_le32(h + size - 4,crc32(h + TTA_HEADER_SIZE,(size_t)frames * 4));
+
+  ok = (0 == fseeko(e->out,0,SEEK_SET) && size == fwrite(h,1,size,e->out));
+
+  st_free(h);
+
+  return ok;
+}
+
+static bool move_frames(tta_encoder *e,off_t from,off_t to,off_t len)
+/* moves the frames written so far, when the data turned out not to be as long as the WAVE header said */
+{
+  off_t done,n;
+
+  for (done=0;done<len;done+=n) {
+    n = min(len - done,(off_t)TTA_ENCODER_BUF_SIZE);
+
+    /* front to back when moving down, back to front when moving up */
+    if (to < from) {
+      if (fseeko(e->out,from + done,SEEK_SET) || (size_t)n != fread(e->buf,1,(size_t)n,e->out) ||
+          fseeko(e->out,to + done,SEEK_SET) || (size_t)n != fwrite(e->buf,1,(size_t)n,e->out))
+        return FALSE;
+    }
+    else {
+      if (fseeko(e->out,from + len - done - n,SEEK_SET) || (size_t)n != fread(e->buf,1,(size_t)n,e->out) ||
+          fseeko(e->out,to + len - done - n,SEEK_SET) || (size_t)n != fwrite(e->buf,1,(size_t)n,e->out))
+        return FALSE;
+    }
+  }
+
+  if (fflush(e->out) || (to < from && ftruncate(fileno(e->out),to + len)))
+    return FALSE;
+
+  return TRUE;
+}
+
+static int tta_start(void *encoder,codec_wave_format *wf)
+{
+  tta_encoder *e = (tta_encoder *)encoder;
+  wlong samples;
+
+  if (WAVE_FORMAT_PCM != wf->format || wf->channels < 1 || wf->channels > TTA_MAX_CHANNELS ||
+      (8 != wf->bits_per_sample && 16 != wf->bits_per_sample && 24 != wf->bits_per_sample) ||
+      wf->block_align != wf->channels * (wf->bits_per_sample / 8) || 0 == frame_length(wf->samples_per_sec))
+  {
+    fclose(e->out);
+    e->out = NULL;
+    remove_file(e->filename);
+    return 0;
+  }
+
+  e->channels = wf->channels;
+  e->bytes_per_sample = wf->bits_per_sample / 8;
+  e->block_align = wf->block_align;
+  e->shift = filter_shift(e->bytes_per_sample);
+  e->samples_per_sec = wf->samples_per_sec;
+  e->frame_len = frame_length(wf->samples_per_sec);
+  e->started = TRUE;
+
+  /* the frame table is sized from the WAVE header, and filled in at the end */
+  samples = wf->data_size / wf->block_align;
+  e->expected_frames = (samples + e->frame_len - 1) / e->frame_len;
+  e->frames_alloc = max(e->expected_frames,1);
+  e->buf_size = TTA_ENCODER_BUF_SIZE;
+
+  if (NULL == (e->frame = malloc((size_t)(e->frame_len * e->channels) * sizeof(int32_t))) ||
+      NULL == (e->frame_sizes = malloc((size_t)e->frames_alloc * sizeof(uint32_t))) ||
+      NULL == (e->buf = malloc(e->buf_size)))
+  {
+    e->failed = TRUE;
+    return -1;
+  }
+
+  if (!write_header(e,samples,e->expected_frames)) {
+    e->failed = TRUE;
+    return -1;
+  }
+
+  return 1;
+}
+
+static int32_t get_sample(unsigned char *p,int bytes_per_sample)
+{
+  switch (bytes_per_sample) {
+    case 1:
+      return (int32_t)p[0] - 0x80;
+    case 2:
+      return (int16_t)(p[0] | (p[1] << 8));
+    default:
+      return ((int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24)) >> 8;
+  }
+}
+
+static void add_sample_frame(tta_encoder *e,unsigned char *p)
+{
+  int32_t *s = e->frame + e->frame_samples * e->channels;
+  int c;
+
+  for (c=0;c<e->channels;c++,p+=e->bytes_per_sample)
+    s[c] = get_sample(p,e->bytes_per_sample);
+
+  if (++e->frame_samples == e->frame_len)
+    encode_frame(e);
+}
+
+static int tta_write(void *encoder,unsigned char *buf,int size)
+{
+  tta_encoder *e = (tta_encoder *)encoder;
+  int n,total = size;
+
+  if (e->partial_len) {
+    n = min(size,e->block_align - e->partial_len);
+    memcpy(e->partial + e->partial_len,buf,n);
+    e->partial_len += n;
+    buf += n;
+    size -= n;
+
+    if (e->partial_len < e->block_align)
+      return total;
+
+    add_sample_frame(e,e->partial);
+    e->partial_len = 0;
+  }
+
+  for (;size>=e->block_align && !e->failed;size-=e->block_align,buf+=e->block_align)
+    add_sample_frame(e,buf);
+
+  e->partial_len = size;
+  memcpy(e->partial,buf,size);
+
+  return (e->failed) ? -1 : total;
+}
+
+static int tta_finish(void *encoder)
+{
+  tta_encoder *e = (tta_encoder *)encoder;
+  off_t len = 0;
+  wlong i;
+  int retval = 0;
+
+  if (e->started && !e->failed) {
+    /* a stray partial sample frame can't be coded, so it is dropped */
+    if (e->partial_len)
+      st_debug1("dropping partial sample frame at end of TTA file: [%s]",e->filename);
+
+    if (e->frame_samples > 0)
+      encode_frame(e);
+
+    if (!e->failed && e->frames != e->expected_frames) {
+      for (i=0;i<e->frames;i++)
+        len += e->frame_sizes[i];
+
+      if (!move_frames(e,(off_t)data_offset(e->expected_frames),(off_t)data_offset(e->frames),len))
+        e->failed = TRUE;
+    }
+
+    if (!e->failed && !write_header(e,e->samples,e->frames))
+      e->failed = TRUE;
+  }
+
+  if (e->out && fclose(e->out))
+    e->failed = TRUE;
+
+  if (e->failed) {
+    st_warning("error while writing TTA file: [%s]",e->filename);
+    retval = EOF;
+  }
+
+  st_free(e->frame_sizes);
+  st_free(e->frame);
+  st_free(e->buf);
+  st_free(e->filename);
+  st_free(e);
+
+  return retval;
+}
+
+FILE *tta_encode_open(char *filename,FILE *(*fallback)(char *,proc_info *))
+/* creates a TTA file from the WAVE data written to the returned stream.  WAVE data that isn't 8-, 16- or 24-bit
+ * PCM is passed on to the stream returned by fallback(), which launches the helper.
+ */
+{
+  tta_encoder *e;
+
+  if (!crc_table_built)
+    build_crc_table();
+
+  if (NULL == (e = calloc(1,sizeof(tta_encoder))))
+    return NULL;
+
+  /* opened for reading too, in case the frames have to be moved to make room for a different frame table */
+  if (NULL == (e->filename = strdup(filename)) || NULL == (e->out = fopen(filename,"w+b"))) {
+    st_free(e->filename);
+    st_free(e);
+    return NULL;
+  }
+
+  return open_wave_encoder_stream(e,filename,tta_start,tta_write,tta_finish,fallback);
+}
@@ -0,0 +1,219 @@
+/*  codec_wave.c - WAVE input for in-process encoders
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Modes write a WAVE header followed by the data chunk to an encoder.  The
+ * stream returned by open_wave_encoder_stream() collects that header, and
+ * once it has seen the start of the data chunk, asks the encoder whether it
+ * can handle the audio.  If so, the encoder gets just the contents of the data
+ * chunk from then on.  If not, the header and everything after it goes to the
+ * helper program instead, exactly as if it had been launched in the first place.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "shdtool.h"
+#include "codec.h"
+
+/* how far into the WAVE header to look for the data chunk */
+#define MAX_WAVE_HEADER_SIZE 65536
+
+typedef struct _wave_encoder {
+  void          *codec;
+  char          *filename;
+  int          (*start_func)(void *,codec_wave_format *);
+  int          (*write_func)(void *,unsigned char *,int);
+  int          (*close_func)(void *);
+  FILE        *(*fallback)(char *,proc_info *);
+
+  unsigned char *header;
+  int            header_len;
+  bool           started;
+  wlong          data_left;
+
+  FILE          *helper;
+  proc_info      helper_proc;
+} wave_encoder;
+
+static int parse_wave_format(unsigned char *h,int len,codec_wave_format *wf)
+/* looks for the data chunk in the WAVE header collected so far.  returns the offset of its contents,
+ * 0 if more of the header is needed, or -1 if this isn't a WAVE header that describes the audio.
+ */
+{
+  unsigned long offset,chunk_size;
+
+  if (len < 12)
+    return 0;
+
+  if (tagcmp(h,(unsigned char *)WAVE_RIFF) || tagcmp(h + 8,(unsigned char *)WAVE_WAVE))
+    return -1;
+
+  for (offset=12;offset+8<=(unsigned long)len;offset+=8+chunk_size+(chunk_size&1)) {
+    chunk_size = uchar_to_ulong_le(h + offset + 4);
+
+    if (!tagcmp(h + offset,(unsigned char *)WAVE_DATA)) {
+      if (0 == wf->bits_per_sample)
+        return -1;
+      wf->data_size = chunk_size;
+      return (int)offset + 8;
+    }
+
+    if (tagcmp(h + offset,(unsigned char *)WAVE_FMT))
+      continue;
+
+    if (chunk_size < 16)
+      return -1;
+
+    if (offset + 8 + chunk_size > (unsigned long)len)
+      return 0;
+
+    wf->format = uchar_to_ushort_le(h + offset + 8);
+    wf->channels = uchar_to_ushort_le(h + offset + 10);
+    wf->samples_per_sec = uchar_to_ulong_le(h + offset + 12);
+    wf->block_align = uchar_to_ushort_le(h + offset + 20);
+    wf->bits_per_sample = uchar_to_ushort_le(h + offset + 22);
+
+    /* an extensible header describing plain PCM with no padding bits is as good as a plain one */
+    if (WAVE_FORMAT_EXTENSIBLE == wf->format && chunk_size >= 40 && wf->bits_per_sample == uchar_to_ushort_le(h + offset + 26))
+      wf->format = uchar_to_ushort_le(h + offset + 32);
+
+    if (0 == wf->bits_per_sample)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int start_helper(wave_encoder *w,unsigned char *rest,int rest_len)
+/* hands the file over to the helper program, along with the header collected so far */
+{
+  if (NULL == (w->helper = w->fallback(w->filename,&w->helper_proc)))
+    return -1;
+
+  if (w->header_len > 0 && (size_t)w->header_len != fwrite(w->header,1,w->header_len,w->helper))
+    return -1;
+
+  if (rest_len > 0 && (size_t)rest_len != fwrite(rest,1,rest_len,w->helper))
+    return -1;
+
+  return 0;
+}
+
+static int wave_encoder_write(void *encoder,unsigned char *buf,int size)
+{
+  wave_encoder *w = (wave_encoder *)encoder;
+  codec_wave_format wf;
+  unsigned char *header;
+  int offset,n,data_offset = 0;
+  wlong data_len;
+
+  if (w->helper)
+    return ((size_t)size == fwrite(buf,1,size,w->helper)) ? size : -1;
+
+  if (!w->started) {
+    n = min(size,MAX_WAVE_HEADER_SIZE - w->header_len);
+
+    if (NULL == (header = realloc(w->header,w->header_len + n)))
+      return -1;
+
+    memcpy(header + w->header_len,buf,n);
+    w->header = header;
+    w->header_len += n;
+
+    memset(&wf,0,sizeof(wf));
+
+    if ((offset = parse_wave_format(w->header,w->header_len,&wf)) < 0 || (0 == offset && MAX_WAVE_HEADER_SIZE == w->header_len))
+      return (start_helper(w,buf + n,size - n) < 0) ? -1 : size;
+
+    if (0 == offset)
+      return size;
+
+    wf.header = w->header;
+    wf.header_size = offset;
+
+    switch (w->start_func(w->codec,&wf)) {
+      case 0:
+        return (start_helper(w,buf + n,size - n) < 0) ? -1 : size;
+      case 1:
+        break;
+      default:
+        return -1;
+    }
+
+    w->started = TRUE;
+    w->data_left = wf.data_size;
+
+    /* the part of this buffer that followed the header - of which only the first n bytes were collected */
+    data_offset = n - (w->header_len - offset);
+  }
+
+  /* anything past the data chunk, such as a pad byte or trailing chunks, isn't audio */
+  data_len = min((wlong)(size - data_offset),w->data_left);
+  w->data_left -= data_len;
+
+  if (data_len > 0 && w->write_func(w->codec,buf + data_offset,(int)data_len) < 0)
+    return -1;
+
+  return size;
+}
+
+static int wave_encoder_close(void *encoder)
+{
+  wave_encoder *w = (wave_encoder *)encoder;
+  int retval;
+
+  if (w->helper)
+    close_output(w->helper,w->helper_proc);
+
+  retval = w->close_func(w->codec);
+
+  st_free(w->header);
+  st_free(w->filename);
+  st_free(w);
+
+  return retval;
+}
+
+FILE *open_wave_encoder_stream(void *codec,char *filename,int (*start_func)(void *,codec_wave_format *),
+                               int (*write_func)(void *,unsigned char *,int),int (*close_func)(void *),
+                               FILE *(*fallback)(char *,proc_info *))
+/* wraps an in-process encoder for filename in a stream that takes WAVE data.  start_func is given the audio
+ * format once the header has been read, and returns 1 to go ahead, -1 on error, or 0 if the encoder can't
+ * handle it - after removing anything it created - in which case fallback() launches the helper instead.
+ * write_func then gets the contents of the data chunk, and close_func is always called exactly once.
+ * on failure, the encoder is closed, and NULL is returned.
+ */
+{
+  wave_encoder *w;
+
+  if (NULL == (w = calloc(1,sizeof(wave_encoder))) || NULL == (w->filename = strdup(filename))) {
+    if (w)
+      st_free(w);
+    close_func(codec);
+    return NULL;
+  }
+
+  w->codec = codec;
+  w->start_func = start_func;
+  w->write_func = write_func;
+  w->close_func = close_func;
+  w->fallback = fallback;
+  w->helper_proc.pid = NO_CHILD_PID;
+
+  return open_encoder_stream(w,wave_encoder_write,wave_encoder_close);
+}
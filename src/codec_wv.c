@@ -0,0 +1,1708 @@
+/*  codec_wv.c - in-process WavPack decoder
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * The decoder maps the .wv file, and its .wvc correction file if there is one,
+ * into memory, and decodes one frame of blocks at a time as the stream returned
+ * by wv_decode_open() is read.  Only version 4 integer data is handled - older
+ * files, floating point or DSD audio, and hybrid files of more than 24 bits are
+ * left to 'wvunpack'.  The stream starts with the original RIFF header if the encoder
+ * stored one, otherwise with a canonical header, which is what 'wvunpack' sends.
+ * Like 'wvunpack', the decoder reports blocks that fail their CRC check, but
+ * carries on decoding.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "shdtool.h"
+#include "codec.h"
+
+#define WV_MAGIC              "wvpk"
+#define WV_HEADER_SIZE        32
+#define WV_MIN_VERSION        0x402
+#define WV_MAX_VERSION        0x410
+#define WV_SCAN_SIZE          (1024*1024)   /* like WavPack, look through the first 1 meg for a block */
+#define WV_MAX_CHANNELS       32
+#define WV_MAX_BLOCK_SAMPLES  (1 << 20)
+
+/* block header flags */
+#define BYTES_STORED          3
+#define MONO_FLAG             4
+#define HYBRID_FLAG           8
+#define JOINT_STEREO          0x10
+#define HYBRID_SHAPE          0x40
+#define FLOAT_DATA            0x80
+#define INT32_DATA            0x100
+#define HYBRID_BITRATE        0x200
+#define HYBRID_BALANCE        0x400
+#define INITIAL_BLOCK         0x800
+#define FINAL_BLOCK           0x1000
+#define SHIFT_LSB             13
+#define SHIFT_MASK            (0x1fL << SHIFT_LSB)
+#define SRATE_LSB             23
+#define SRATE_MASK            (0xfL << SRATE_LSB)
+#define NEW_SHAPING           0x20000000
+#define FALSE_STEREO          0x40000000
+#define DSD_FLAG              0x80000000
+#define MONO_DATA             (MONO_FLAG | FALSE_STEREO)
+
+/* metadata sub-block ids */
+#define ID_UNIQUE             0x3f
+#define ID_OPTIONAL_DATA      0x20
+#define ID_ODD_SIZE           0x40
+#define ID_LARGE              0x80
+#define ID_DUMMY              0x0
+#define ID_ENCODER_INFO       0x1
+#define ID_DECORR_TERMS       0x2
+#define ID_DECORR_WEIGHTS     0x3
+#define ID_DECORR_SAMPLES     0x4
+#define ID_ENTROPY_VARS       0x5
+#define ID_HYBRID_PROFILE     0x6
+#define ID_SHAPING_WEIGHTS    0x7
+#define ID_INT32_INFO         0x9
+#define ID_WV_BITSTREAM       0xa
+#define ID_WVC_BITSTREAM      0xb
+#define ID_WVX_BITSTREAM      0xc
+#define ID_CHANNEL_INFO       0xd
+#define ID_RIFF_HEADER        0x21
+#define ID_SAMPLE_RATE        0x27
+
+#define MAX_NTERMS            16
+#define MAX_TERM              8
+
+/* entropy coder constants */
+#define LIMIT_ONES            16              /* most 1s sent for a value before an escape code */
+#define SLS                   8               /* time constant of the hybrid bitrate's slow level */
+#define SLO                   (1 << (SLS - 1))
+#define DIV0                  128             /* time constants of the three median breakpoints */
+#define DIV1                  64
+#define DIV2                  32
+#define WORD_EOF              ((int32_t)0x80000000)
+
+static const wlong sample_rates[] = { 6000, 8000, 9600, 11025, 12000, 16000, 22050,
+  24000, 32000, 44100, 48000, 64000, 88200, 96000, 192000 };
+
+/* fractional parts of 2^(x/256) and log2(1 + x/256), scaled by 256 */
+static const unsigned char exp2_table[256] = {
+  0x00, 0x01, 0x01, 0x02, 0x03, 0x03, 0x04, 0x05, 0x06, 0x06, 0x07, 0x08, 0x08, 0x09, 0x0a, 0x0b,
+  0x0b, 0x0c, 0x0d, 0x0e, 0x0e, 0x0f, 0x10, 0x10, 0x11, 0x12, 0x13, 0x13, 0x14, 0x15, 0x16, 0x16,
+  0x17, 0x18, 0x19, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1d, 0x1e, 0x1f, 0x20, 0x20, 0x21, 0x22, 0x23,
+  0x24, 0x24, 0x25, 0x26, 0x27, 0x28, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+  0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3a, 0x3b, 0x3c, 0x3d,
+  0x3e, 0x3f, 0x40, 0x41, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x48, 0x49, 0x4a, 0x4b,
+  0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a,
+  0x5b, 0x5c, 0x5d, 0x5e, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+  0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+  0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x87, 0x88, 0x89, 0x8a,
+  0x8b, 0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b,
+  0x9c, 0x9d, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad,
+  0xaf, 0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0,
+  0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc8, 0xc9, 0xca, 0xcb, 0xcd, 0xce, 0xcf, 0xd0, 0xd2, 0xd3, 0xd4,
+  0xd6, 0xd7, 0xd8, 0xd9, 0xdb, 0xdc, 0xdd, 0xde, 0xe0, 0xe1, 0xe2, 0xe4, 0xe5, 0xe6, 0xe8, 0xe9,
+  0xea, 0xec, 0xed, 0xee, 0xf0, 0xf1, 0xf2, 0xf4, 0xf5, 0xf6, 0xf8, 0xf9, 0xfa, 0xfc, 0xfd, 0xff
+};
+
+static const unsigned char log2_table[256] = {
+  0x00, 0x01, 0x03, 0x04, 0x06, 0x07, 0x09, 0x0a, 0x0b, 0x0d, 0x0e, 0x10, 0x11, 0x12, 0x14, 0x15,
+  0x16, 0x18, 0x19, 0x1a, 0x1c, 0x1d, 0x1e, 0x20, 0x21, 0x22, 0x24, 0x25, 0x26, 0x28, 0x29, 0x2a,
+  0x2c, 0x2d, 0x2e, 0x2f, 0x31, 0x32, 0x33, 0x34, 0x36, 0x37, 0x38, 0x39, 0x3b, 0x3c, 0x3d, 0x3e,
+  0x3f, 0x41, 0x42, 0x43, 0x44, 0x45, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4d, 0x4e, 0x4f, 0x50, 0x51,
+  0x52, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63,
+  0x64, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x74, 0x75,
+  0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85,
+  0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95,
+  0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4,
+  0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb0, 0xb1, 0xb2, 0xb2,
+  0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0xc0,
+  0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcb, 0xcc, 0xcd, 0xce,
+  0xcf, 0xd0, 0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd8, 0xd9, 0xda, 0xdb,
+  0xdc, 0xdc, 0xdd, 0xde, 0xdf, 0xe0, 0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe4, 0xe5, 0xe6, 0xe7, 0xe7,
+  0xe8, 0xe9, 0xea, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xee, 0xef, 0xf0, 0xf1, 0xf1, 0xf2, 0xf3, 0xf4,
+  0xf4, 0xf5, 0xf6, 0xf7, 0xf7, 0xf8, 0xf9, 0xf9, 0xfa, 0xfb, 0xfc, 0xfc, 0xfd, 0xfe, 0xff, 0xff
+};
+
+typedef struct _wv_bitstream {
+  unsigned char *ptr;
+  unsigned char *end;
+  uint64_t       acc;                /* bits not used yet, the next one in the least significant bit */
+  int            bits;               /* how many of them there are */
+  bool           overrun;            /* set when a read went past the end of the data */
+} wv_bitstream;
+
+typedef struct _wv_decorr_pass {
+  int            term;
+  int            delta;
+  int32_t        weight_A;
+  int32_t        weight_B;
+  int32_t        samples_A[MAX_TERM];
+  int32_t        samples_B[MAX_TERM];
+} wv_decorr_pass;
+
+typedef struct _wv_entropy {
+  uint32_t       median[3];
+  uint32_t       slow_level;
+  uint32_t       error_limit;
+  uint32_t       bitrate_acc;
+  uint32_t       bitrate_delta;
+} wv_entropy;
+
+/* everything needed to decode one block - none of it carries over to the next */
+typedef struct _wv_block {
+  int            version;
+  uint32_t       flags;
+  int            num_terms;
+  wv_decorr_pass passes[MAX_NTERMS];
+  wv_entropy     c[2];
+  uint32_t       zeros_acc;
+  bool           holding_zero;
+  bool           holding_one;
+  int32_t        error[2];           /* noise shaping state, only used with a correction file */
+  int32_t        shaping_acc[2];
+  int32_t        shaping_delta[2];
+  int            int32_sent_bits;    /* how 32-bit samples were reduced to fit the coder */
+  int            int32_zeros;
+  int            int32_ones;
+  int            int32_dups;
+  uint32_t       wvx_crc;
+  bool           have_entropy_vars;
+  bool           have_wv_bits;
+  bool           have_wvc_bits;
+  bool           have_wvx_bits;
+  wv_bitstream   wv;
+  wv_bitstream   wvc;
+  wv_bitstream   wvx;                /* low bits of 32-bit samples that the coder didn't get */
+} wv_block;
+
+typedef struct _wv_decoder {
+  char          *filename;
+  unsigned char *map;                /* the whole .wv file */
+  size_t         map_size;
+  size_t         pos;                /* offset of the next block */
+  unsigned char *wvc_map;            /* the whole .wvc file, if there is one */
+  size_t         wvc_size;
+  size_t         wvc_pos;
+
+  int            channels;
+  int            bytes_per_sample;
+  int            block_align;
+  wlong          samples_left;
+
+  wv_block       block;
+  int32_t       *buffer;             /* one block's samples, interleaved if stereo */
+  int32_t       *corrections;        /* and the corrections for them */
+  int            buffer_samples;
+
+  unsigned char *out;                /* WAVE header or data waiting to be read */
+  int            out_size;
+  int            out_pos;
+  int            out_len;
+  bool           pad_byte;           /* odd-sized data chunk still needs its pad byte */
+  bool           failed;
+} wv_decoder;
+
+static uint32_t get_le16(unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get_le32(unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int count_bits(uint32_t v)
+/* returns the number of bits needed to hold v */
+{
+#if defined(__GNUC__)
+  return v ? 32 - __builtin_clz(v) : 0;
+#else
+  int n = 0;
+
+  while (v) {
+    v >>= 1;
+    n++;
+  }
+
+  return n;
+#endif
+}
+
+static int count_trailing_ones(uint64_t v)
+{
+#if defined(__GNUC__)
+  return (~v) ? __builtin_ctzll(~v) : 64;
+#else
+  int n = 0;
+
+  while (n < 64 && (v & 1)) {
+    v >>= 1;
+    n++;
+  }
+
+  return n;
+#endif
+}
+
+/* log arithmetic used to store the coder's state compactly */
+
+static int32_t wp_exp2s(int log)
+{
+  uint32_t value;
+
+  if (log < 0)
+    return -wp_exp2s(-log);
+
+  value = exp2_table[log & 0xff] | 0x100;
+
+  if ((log >>= 8) <= 9)
+    return (int32_t)(value >> (9 - log));
+
+  return (int32_t)(value << ((log - 9) & 0x1f));
+}
+
+static int wp_log2(uint32_t avalue)
+{
+  int dbits;
+
+  if ((avalue += avalue >> 9) < (1 << 8)) {
+    dbits = count_bits(avalue);
+    return (dbits << 8) + log2_table[(avalue << (9 - dbits)) & 0xff];
+  }
+
+  dbits = count_bits(avalue);
+  return (dbits << 8) + log2_table[(avalue >> (dbits - 9)) & 0xff];
+}
+
+static int32_t restore_weight(signed char weight)
+{
+  int32_t result = (int32_t)weight << 3;
+
+  if (result > 0)
+    result += (result + 64) >> 7;
+
+  return result;
+}
+
+static int32_t exp2s_le16(unsigned char *p)
+{
+  return wp_exp2s((int16_t)get_le16(p));
+}
+
+/* bit reader - WavPack packs bits starting with the least significant bit of each byte */
+
+static void bs_open(wv_bitstream *bs,unsigned char *data,size_t size)
+{
+  bs->ptr = data;
+  bs->end = data + size;
+  bs->acc = 0;
+  bs->bits = 0;
+  bs->overrun = FALSE;
+}
+
+static void bs_fill(wv_bitstream *bs)
+{
+  while (bs->bits <= 56 && bs->ptr < bs->end) {
+    bs->acc |= (uint64_t)*bs->ptr++ << bs->bits;
+    bs->bits += 8;
+  }
+}
+
+static uint32_t bs_get_bits(wv_bitstream *bs,int n)
+/* reads up to 32 bits, the first one ending up in the least significant bit */
+{
+  uint32_t v;
+
+  if (bs->bits < n) {
+    bs_fill(bs);
+
+    if (bs->bits < n) {
+      /* the accumulator is zero-filled past the end of the data */
+      bs->overrun = TRUE;
+      bs->bits = n;
+    }
+  }
+
+  v = (uint32_t)(bs->acc & (((uint64_t)1 << n) - 1));
+  bs->acc >>= n;
+  bs->bits -= n;
+
+  return v;
+}
+
+static int bs_get_bit(wv_bitstream *bs)
+{
+  int bit;
+
+  if (0 == bs->bits) {
+    bs_fill(bs);
+
+    if (0 == bs->bits) {
+      bs->overrun = TRUE;
+      return 0;
+    }
+  }
+
+  bit = (int)(bs->acc & 1);
+  bs->acc >>= 1;
+  bs->bits--;
+
+  return bit;
+}
+
+static int bs_count_ones(wv_bitstream *bs,int limit)
+/* counts 1 bits up to, and including, the next 0 bit - but stops after limit 1 bits */
+{
+  int ones = 0,run;
+
+  for (;;) {
+    if (0 == bs->bits) {
+      bs_fill(bs);
+
+      if (0 == bs->bits) {
+        bs->overrun = TRUE;
+        return limit;
+      }
+    }
+
+    run = count_trailing_ones(bs->acc);
+
+    if (ones + run >= limit) {
+      run = limit - ones;
+      bs->acc >>= run;
+      bs->bits -= run;
+      return limit;
+    }
+
+    if (run < bs->bits) {
+      bs->acc >>= run;
+      bs->acc >>= 1;
+      bs->bits -= run + 1;
+      return ones + run;
+    }
+
+    ones += bs->bits;
+    bs->acc = 0;
+    bs->bits = 0;
+  }
+}
+
+static uint32_t bs_get_elias(wv_bitstream *bs,bool *eof)
+/* reads a count sent as the number of bits it needs, in unary, followed by all but its top bit */
+{
+  int cbits;
+
+  if (33 == (cbits = bs_count_ones(bs,33))) {
+    *eof = TRUE;
+    return 0;
+  }
+
+  if (cbits < 2)
+    return (uint32_t)cbits;
+
+  return bs_get_bits(bs,cbits - 1) | ((uint32_t)1 << (cbits - 1));
+}
+
+static uint32_t read_code(wv_bitstream *bs,uint32_t maxcode)
+/* reads a value from 0 to maxcode, sent with one bit less when it's small enough */
+{
+  int bitcount = count_bits(maxcode);
+  uint32_t extras,code;
+
+  if (0 == bitcount)
+    return 0;
+
+  extras = (uint32_t)(((uint64_t)1 << bitcount) - maxcode - 1);
+  code = bs_get_bits(bs,bitcount - 1);
+
+  if (code >= extras) {
+    code = (code << 1) - extras;
+    if (bs_get_bit(bs))
+      code++;
+  }
+
+  return code;
+}
+
+/* entropy decoder */
+
+#define GET_MED(c,med) (((c)->median[med] >> 4) + 1)
+
+#define INC_MED0(c) ((c)->median[0] += (((c)->median[0] + DIV0) / DIV0) * 5)
+#define DEC_MED0(c) ((c)->median[0] -= (((c)->median[0] + (DIV0-2)) / DIV0) * 2)
+#define INC_MED1(c) ((c)->median[1] += (((c)->median[1] + DIV1) / DIV1) * 5)
+#define DEC_MED1(c) ((c)->median[1] -= (((c)->median[1] + (DIV1-2)) / DIV1) * 2)
+#define INC_MED2(c) ((c)->median[2] += (((c)->median[2] + DIV2) / DIV2) * 5)
+#define DEC_MED2(c) ((c)->median[2] -= (((c)->median[2] + (DIV2-2)) / DIV2) * 2)
+
+static uint32_t limit_from_bitrate(int slow_log,int bitrate)
+{
+  if (slow_log - bitrate > -0x100)
+    return (uint32_t)wp_exp2s(slow_log - bitrate + 0x100);
+
+  return 0;
+}
+
+static void update_error_limit(wv_block *b)
+/* works out how coarsely the hybrid lossy stream sends the next sample on each channel */
+{
+  int bitrate_0,bitrate_1,slow_log_0,slow_log_1,balance;
+
+  bitrate_0 = (int)((b->c[0].bitrate_acc += b->c[0].bitrate_delta) >> 16);
+
+  if (b->flags & MONO_DATA) {
+    if (b->flags & HYBRID_BITRATE)
+      b->c[0].error_limit = limit_from_bitrate((int)((b->c[0].slow_level + SLO) >> SLS),bitrate_0);
+    else
+      b->c[0].error_limit = (uint32_t)wp_exp2s(bitrate_0);
+
+    return;
+  }
+
+  bitrate_1 = (int)((b->c[1].bitrate_acc += b->c[1].bitrate_delta) >> 16);
+
+  if (!(b->flags & HYBRID_BITRATE)) {
+    b->c[0].error_limit = (uint32_t)wp_exp2s(bitrate_0);
+    b->c[1].error_limit = (uint32_t)wp_exp2s(bitrate_1);
+    return;
+  }
+
+  slow_log_0 = (int)((b->c[0].slow_level + SLO) >> SLS);
+  slow_log_1 = (int)((b->c[1].slow_level + SLO) >> SLS);
+
+  if (b->flags & HYBRID_BALANCE) {
+    balance = (slow_log_1 - slow_log_0 + bitrate_1 + 1) >> 1;
+
+    if (balance > bitrate_0) {
+      bitrate_1 = bitrate_0 * 2;
+      bitrate_0 = 0;
+    }
+    else if (-balance > bitrate_0) {
+      bitrate_0 = bitrate_0 * 2;
+      bitrate_1 = 0;
+    }
+    else {
+      bitrate_1 = bitrate_0 + balance;
+      bitrate_0 = bitrate_0 - balance;
+    }
+  }
+
+  b->c[0].error_limit = limit_from_bitrate(slow_log_0,bitrate_0);
+  b->c[1].error_limit = limit_from_bitrate(slow_log_1,bitrate_1);
+}
+
+static int32_t get_word(wv_block *b,int chan,int32_t *correction)
+/* reads the next residual for the given channel, along with its correction if there is a .wvc file.
+ * returns WORD_EOF if the bitstream is corrupt.
+ */
+{
+  wv_entropy *c = b->c + chan;
+  uint32_t ones_count,low,mid,high,value;
+  bool eof = FALSE;
+  int sign;
+
+  *correction = 0;
+
+  /* long runs of zeros are sent as a count, once both channels have settled down to silence */
+  if (!(b->c[0].median[0] & ~1) && !b->holding_zero && !b->holding_one && !(b->c[1].median[0] & ~1)) {
+    if (b->zeros_acc) {
+      if (--b->zeros_acc) {
+        c->slow_level -= (c->slow_level + SLO) >> SLS;
+        return 0;
+      }
+    }
+    else {
+      b->zeros_acc = bs_get_elias(&b->wv,&eof);
+
+      if (eof)
+        return WORD_EOF;
+
+      if (b->zeros_acc) {
+        c->slow_level -= (c->slow_level + SLO) >> SLS;
+        memset(b->c[0].median,0,sizeof(b->c[0].median));
+        memset(b->c[1].median,0,sizeof(b->c[1].median));
+        return 0;
+      }
+    }
+  }
+
+  if (b->holding_zero) {
+    ones_count = 0;
+    b->holding_zero = FALSE;
+  }
+  else {
+    ones_count = (uint32_t)bs_count_ones(&b->wv,LIMIT_ONES + 1);
+
+    if (ones_count >= LIMIT_ONES) {
+      if (LIMIT_ONES + 1 == ones_count)
+        return WORD_EOF;
+
+      ones_count = bs_get_elias(&b->wv,&eof) + LIMIT_ONES;
+
+      if (eof)
+        return WORD_EOF;
+    }
+
+    if (b->holding_one) {
+      b->holding_one = (ones_count & 1) ? TRUE : FALSE;
+      ones_count = (ones_count >> 1) + 1;
+    }
+    else {
+      b->holding_one = (ones_count & 1) ? TRUE : FALSE;
+      ones_count >>= 1;
+    }
+
+    b->holding_zero = !b->holding_one;
+  }
+
+  if ((b->flags & HYBRID_FLAG) && 0 == chan)
+    update_error_limit(b);
+
+  /* the number of 1s says which band between the medians the value lies in */
+  if (0 == ones_count) {
+    low = 0;
+    high = GET_MED(c,0) - 1;
+    DEC_MED0(c);
+  }
+  else {
+    low = GET_MED(c,0);
+    INC_MED0(c);
+
+    if (1 == ones_count) {
+      high = low + GET_MED(c,1) - 1;
+      DEC_MED1(c);
+    }
+    else {
+      low += GET_MED(c,1);
+      INC_MED1(c);
+
+      if (2 == ones_count) {
+        high = low + GET_MED(c,2) - 1;
+        DEC_MED2(c);
+      }
+      else {
+        low += (ones_count - 2) * GET_MED(c,2);
+        high = low + GET_MED(c,2) - 1;
+        INC_MED2(c);
+      }
+    }
+  }
+
+  low &= 0x7fffffff;
+  high &= 0x7fffffff;
+
+  if (low > high)
+    high = low;
+
+  mid = (high + low + 1) >> 1;
+
+  /* lossless, the value is sent exactly - hybrid, only until it's within the error limit */
+  if (!c->error_limit)
+    mid = read_code(&b->wv,high - low) + low;
+  else {
+    while (high - low > c->error_limit) {
+      if (bs_get_bit(&b->wv)) {
+        low = mid;
+        mid = (high + low + 1) >> 1;
+      }
+      else {
+        high = mid - 1;
+        mid = (high + low + 1) >> 1;
+      }
+    }
+  }
+
+  sign = bs_get_bit(&b->wv);
+
+  if (b->have_wvc_bits && c->error_limit) {
+    value = read_code(&b->wvc,high - low) + low;
+    *correction = sign ? (int32_t)(mid - value) : (int32_t)(value - mid);
+  }
+
+  if (b->flags & HYBRID_BITRATE)
+    c->slow_level = c->slow_level - ((c->slow_level + SLO) >> SLS) + wp_log2(mid);
+
+  return sign ? ~(int32_t)mid : (int32_t)mid;
+}
+
+/* decorrelation */
+
+static int32_t apply_weight(int32_t weight,int32_t sample)
+{
+  return (int32_t)(((int64_t)weight * sample + 512) >> 10);
+}
+
+static int32_t update_weight(int32_t weight,int delta,int32_t source,int32_t result)
+{
+  if (source && result)
+    weight += ((source ^ result) < 0) ? -delta : delta;
+
+  return weight;
+}
+
+static int32_t update_weight_clip(int32_t weight,int delta,int32_t source,int32_t result)
+{
+  if (source && result) {
+    if ((source ^ result) < 0) {
+      if ((weight -= delta) < -1024)
+        weight = -1024;
+    }
+    else {
+      if ((weight += delta) > 1024)
+        weight = 1024;
+    }
+  }
+
+  return weight;
+}
+
+static void rotate_samples(int32_t *samples,int m)
+/* puts the history back in order after a pass that didn't end on a multiple of MAX_TERM */
+{
+  int32_t temp[MAX_TERM];
+  int k;
+
+  memcpy(temp,samples,sizeof(temp));
+
+  for (k=0;k<MAX_TERM;k++,m++)
+    samples[k] = temp[m & (MAX_TERM - 1)];
+}
+
+static void decorr_mono_pass(wv_decorr_pass *dpp,int32_t *buffer,int samples)
+{
+  int32_t *bptr,*eptr = buffer + samples;
+  int32_t weight_A = dpp->weight_A,sam_A;
+  int m,k;
+
+  switch (dpp->term) {
+    case 17:
+      for (bptr=buffer;bptr<eptr;bptr++) {
+        sam_A = 2 * dpp->samples_A[0] - dpp->samples_A[1];
+        dpp->samples_A[1] = dpp->samples_A[0];
+        dpp->samples_A[0] = apply_weight(weight_A,sam_A) + bptr[0];
+        weight_A = update_weight(weight_A,dpp->delta,sam_A,bptr[0]);
+        bptr[0] = dpp->samples_A[0];
+      }
+      break;
+
+    case 18:
+      for (bptr=buffer;bptr<eptr;bptr++) {
+        sam_A = (3 * dpp->samples_A[0] - dpp->samples_A[1]) >> 1;
+        dpp->samples_A[1] = dpp->samples_A[0];
+        dpp->samples_A[0] = apply_weight(weight_A,sam_A) + bptr[0];
+        weight_A = update_weight(weight_A,dpp->delta,sam_A,bptr[0]);
+        bptr[0] = dpp->samples_A[0];
+      }
+      break;
+
+    default:
+      for (m=0,k=dpp->term&(MAX_TERM-1),bptr=buffer;bptr<eptr;bptr++) {
+        sam_A = dpp->samples_A[m];
+        dpp->samples_A[k] = apply_weight(weight_A,sam_A) + bptr[0];
+        weight_A = update_weight(weight_A,dpp->delta,sam_A,bptr[0]);
+        bptr[0] = dpp->samples_A[k];
+        m = (m + 1) & (MAX_TERM - 1);
+        k = (k + 1) & (MAX_TERM - 1);
+      }
+
+      if (m)
+        rotate_samples(dpp->samples_A,m);
+      break;
+  }
+
+  dpp->weight_A = weight_A;
+}
+
+static void decorr_stereo_pass(wv_decorr_pass *dpp,int32_t *buffer,int samples)
+{
+  int32_t *bptr,*eptr = buffer + samples * 2;
+  int32_t weight_A = dpp->weight_A,weight_B = dpp->weight_B,sam_A,sam_B;
+  int m,k;
+
+  switch (dpp->term) {
+    case 17:
+      for (bptr=buffer;bptr<eptr;bptr+=2) {
+        sam_A = 2 * dpp->samples_A[0] - dpp->samples_A[1];
+        dpp->samples_A[1] = dpp->samples_A[0];
+        dpp->samples_A[0] = apply_weight(weight_A,sam_A) + bptr[0];
+        weight_A = update_weight(weight_A,dpp->delta,sam_A,bptr[0]);
+        bptr[0] = dpp->samples_A[0];
+
+        sam_B = 2 * dpp->samples_B[0] - dpp->samples_B[1];
+        dpp->samples_B[1] = dpp->samples_B[0];
+        dpp->samples_B[0] = apply_weight(weight_B,sam_B) + bptr[1];
+        weight_B = update_weight(weight_B,dpp->delta,sam_B,bptr[1]);
+        bptr[1] = dpp->samples_B[0];
+      }
+      break;
+
+    case 18:
+      for (bptr=buffer;bptr<eptr;bptr+=2) {
+        sam_A = (3 * dpp->samples_A[0] - dpp->samples_A[1]) >> 1;
+        dpp->samples_A[1] = dpp->samples_A[0];
+        dpp->samples_A[0] = apply_weight(weight_A,sam_A) + bptr[0];
+        weight_A = update_weight(weight_A,dpp->delta,sam_A,bptr[0]);
+        bptr[0] = dpp->samples_A[0];
+
+        sam_B = (3 * dpp->samples_B[0] - dpp->samples_B[1]) >> 1;
+        dpp->samples_B[1] = dpp->samples_B[0];
+        dpp->samples_B[0] = apply_weight(weight_B,sam_B) + bptr[1];
+        weight_B = update_weight(weight_B,dpp->delta,sam_B,bptr[1]);
+        bptr[1] = dpp->samples_B[0];
+      }
+      break;
+
+    /* negative terms decorrelate each channel against the other */
+    case -1:
+      for (bptr=buffer;bptr<eptr;bptr+=2) {
+        sam_A = bptr[0] + apply_weight(weight_A,dpp->samples_A[0]);
+        weight_A = update_weight_clip(weight_A,dpp->delta,dpp->samples_A[0],bptr[0]);
+        bptr[0] = sam_A;
+        dpp->samples_A[0] = bptr[1] + apply_weight(weight_B,sam_A);
+        weight_B = update_weight_clip(weight_B,dpp->delta,sam_A,bptr[1]);
+        bptr[1] = dpp->samples_A[0];
+      }
+      break;
+
+    case -2:
+      for (bptr=buffer;bptr<eptr;bptr+=2) {
+        sam_B = bptr[1] + apply_weight(weight_B,dpp->samples_B[0]);
+        weight_B = update_weight_clip(weight_B,dpp->delta,dpp->samples_B[0],bptr[1]);
+        bptr[1] = sam_B;
+        dpp->samples_B[0] = bptr[0] + apply_weight(weight_A,sam_B);
+        weight_A = update_weight_clip(weight_A,dpp->delta,sam_B,bptr[0]);
+        bptr[0] = dpp->samples_B[0];
+      }
+      break;
+
+    case -3:
+      for (bptr=buffer;bptr<eptr;bptr+=2) {
+        sam_A = bptr[0] + apply_weight(weight_A,dpp->samples_A[0]);
+        weight_A = update_weight_clip(weight_A,dpp->delta,dpp->samples_A[0],bptr[0]);
+        sam_B = bptr[1] + apply_weight(weight_B,dpp->samples_B[0]);
+        weight_B = update_weight_clip(weight_B,dpp->delta,dpp->samples_B[0],bptr[1]);
+        bptr[0] = dpp->samples_B[0] = sam_A;
+        bptr[1] = dpp->samples_A[0] = sam_B;
+      }
+      break;
+
+    default:
+      for (m=0,k=dpp->term&(MAX_TERM-1),bptr=buffer;bptr<eptr;bptr+=2) {
+        sam_A = dpp->samples_A[m];
+        dpp->samples_A[k] = apply_weight(weight_A,sam_A) + bptr[0];
+        weight_A = update_weight(weight_A,dpp->delta,sam_A,bptr[0]);
+        bptr[0] = dpp->samples_A[k];
+
+        sam_B = dpp->samples_B[m];
+        dpp->samples_B[k] = apply_weight(weight_B,sam_B) + bptr[1];
+        weight_B = update_weight(weight_B,dpp->delta,sam_B,bptr[1]);
+        bptr[1] = dpp->samples_B[k];
+
+        m = (m + 1) & (MAX_TERM - 1);
+        k = (k + 1) & (MAX_TERM - 1);
+      }
+
+      if (m) {
+        rotate_samples(dpp->samples_A,m);
+        rotate_samples(dpp->samples_B,m);
+      }
+      break;
+  }
+
+  dpp->weight_A = weight_A;
+  dpp->weight_B = weight_B;
+}
+
+static void apply_corrections(wv_block *b,int32_t *buffer,int32_t *corrections,int count,int stride)
+/* adds the .wvc file's corrections to the lossy samples, undoing any noise shaping the encoder applied */
+{
+  int32_t temp;
+  int i,ch,shaping_weight;
+
+  for (i=0;i<count;i++) {
+    ch = i % stride;
+
+    if (!(b->flags & HYBRID_SHAPE)) {
+      buffer[i] += corrections[i];
+      continue;
+    }
+
+    shaping_weight = (b->shaping_acc[ch] += b->shaping_delta[ch]) >> 16;
+    temp = -apply_weight(shaping_weight,b->error[ch]);
+
+    if ((b->flags & NEW_SHAPING) && shaping_weight < 0 && temp) {
+      if (temp == b->error[ch])
+        temp = (temp < 0) ? temp + 1 : temp - 1;
+
+      b->error[ch] = temp - corrections[i];
+    }
+    else
+      b->error[ch] = -corrections[i];
+
+    buffer[i] += corrections[i] - temp;
+  }
+}
+
+/* block metadata */
+
+static bool read_decorr_terms(wv_block *b,unsigned char *data,int len)
+{
+  wv_decorr_pass *dpp;
+  int i;
+
+  if (len > MAX_NTERMS)
+    return FALSE;
+
+  b->num_terms = len;
+
+  /* terms are stored in the reverse of the order they're applied in when decoding */
+  for (i=0;i<len;i++) {
+    dpp = &b->passes[len - 1 - i];
+    dpp->term = (int)(data[i] & 0x1f) - 5;
+    dpp->delta = (data[i] >> 5) & 0x7;
+
+    if (!dpp->term || dpp->term < -3 || (dpp->term > MAX_TERM && dpp->term < 17) || dpp->term > 18 ||
+        ((b->flags & MONO_DATA) && dpp->term < 0))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static bool read_decorr_weights(wv_block *b,unsigned char *data,int len)
+{
+  int termcnt,i;
+
+  termcnt = (b->flags & MONO_DATA) ? len : len / 2;
+
+  if (termcnt > b->num_terms)
+    return FALSE;
+
+  for (i=b->num_terms-1;i>=0&&termcnt>0;i--,termcnt--) {
+    b->passes[i].weight_A = restore_weight((signed char)*data++);
+    if (!(b->flags & MONO_DATA))
+      b->passes[i].weight_B = restore_weight((signed char)*data++);
+  }
+
+  return TRUE;
+}
+
+static bool read_decorr_samples(wv_block *b,unsigned char *data,int len)
+{
+  unsigned char *end = data + len;
+  wv_decorr_pass *dpp;
+  int stereo = (b->flags & MONO_DATA) ? 0 : 1;
+  int i,m;
+
+  if (0x402 == b->version && (b->flags & HYBRID_FLAG)) {
+    if (data + 2 + stereo * 2 > end)
+      return FALSE;
+
+    b->error[0] = exp2s_le16(data);
+    data += 2;
+
+    if (stereo) {
+      b->error[1] = exp2s_le16(data);
+      data += 2;
+    }
+  }
+
+  for (i=b->num_terms-1;i>=0&&data<end;i--) {
+    dpp = &b->passes[i];
+
+    if (dpp->term > MAX_TERM) {
+      if (data + 4 + stereo * 4 > end)
+        return FALSE;
+
+      dpp->samples_A[0] = exp2s_le16(data);
+      dpp->samples_A[1] = exp2s_le16(data + 2);
+      data += 4;
+
+      if (stereo) {
+        dpp->samples_B[0] = exp2s_le16(data);
+        dpp->samples_B[1] = exp2s_le16(data + 2);
+        data += 4;
+      }
+    }
+    else if (dpp->term < 0) {
+      if (data + 4 > end)
+        return FALSE;
+
+      dpp->samples_A[0] = exp2s_le16(data);
+      dpp->samples_B[0] = exp2s_le16(data + 2);
+      data += 4;
+    }
+    else {
+      if (data + dpp->term * (2 + stereo * 2) > end)
+        return FALSE;
+
+      for (m=0;m<dpp->term;m++) {
+        dpp->samples_A[m] = exp2s_le16(data);
+        data += 2;
+
+        if (stereo) {
+          dpp->samples_B[m] = exp2s_le16(data);
+          data += 2;
+        }
+      }
+    }
+  }
+
+  return (data == end);
+}
+
+static bool read_entropy_vars(wv_block *b,unsigned char *data,int len)
+{
+  int ch,i;
+
+  if (len != ((b->flags & MONO_DATA) ? 6 : 12))
+    return FALSE;
+
+  for (ch=0;ch<len/6;ch++)
+    for (i=0;i<3;i++)
+      b->c[ch].median[i] = (uint32_t)wp_exp2s((int)get_le16(data + ch * 6 + i * 2));
+
+  b->have_entropy_vars = TRUE;
+
+  return TRUE;
+}
+
+static bool read_hybrid_profile(wv_block *b,unsigned char *data,int len)
+{
+  unsigned char *end = data + len;
+  int channels = (b->flags & MONO_DATA) ? 1 : 2;
+  int ch;
+
+  if (b->flags & HYBRID_BITRATE) {
+    if (data + channels * 2 > end)
+      return FALSE;
+
+    for (ch=0;ch<channels;ch++,data+=2)
+      b->c[ch].slow_level = (uint32_t)wp_exp2s((int)get_le16(data));
+  }
+
+  if (data + channels * 2 > end)
+    return FALSE;
+
+  for (ch=0;ch<channels;ch++,data+=2)
+    b->c[ch].bitrate_acc = get_le16(data) << 16;
+
+  if (data < end) {
+    if (data + channels * 2 != end)
+      return FALSE;
+
+    for (ch=0;ch<channels;ch++,data+=2)
+      b->c[ch].bitrate_delta = (uint32_t)exp2s_le16(data);
+  }
+
+  return TRUE;
+}
+
+static bool read_shaping_info(wv_block *b,unsigned char *data,int len)
+{
+  int channels = (b->flags & MONO_DATA) ? 1 : 2;
+  int ch;
+
+  if (2 == len) {
+    b->shaping_acc[0] = restore_weight((signed char)data[0]) << 16;
+    b->shaping_acc[1] = restore_weight((signed char)data[1]) << 16;
+    return TRUE;
+  }
+
+  if (len < channels * 4)
+    return FALSE;
+
+  for (ch=0;ch<channels;ch++,data+=4) {
+    b->error[ch] = exp2s_le16(data);
+    b->shaping_acc[ch] = exp2s_le16(data + 2);
+  }
+
+  if (len == channels * 6)
+    for (ch=0;ch<channels;ch++,data+=2)
+      b->shaping_delta[ch] = exp2s_le16(data);
+
+  return TRUE;
+}
+
+static bool read_int32_info(wv_block *b,unsigned char *data,int len)
+{
+  if (4 != len || data[0] > 31 || data[1] > 31 || data[2] > 31 || data[3] > 31)
+    return FALSE;
+
+  b->int32_sent_bits = data[0];
+  b->int32_zeros = data[1];
+  b->int32_ones = data[2];
+  b->int32_dups = data[3];
+
+  return TRUE;
+}
+
+static unsigned char *next_metadata(unsigned char *p,unsigned char *end,int *id,unsigned char **data,int *len)
+/* splits off the metadata sub-block at p, returning a pointer to the one after it, or NULL if it doesn't fit */
+{
+  size_t size;
+
+  if (p + 2 > end)
+    return NULL;
+
+  *id = p[0];
+
+  if (p[0] & ID_LARGE) {
+    if (p + 4 > end)
+      return NULL;
+    size = ((size_t)p[1] | ((size_t)p[2] << 8) | ((size_t)p[3] << 16)) * 2;
+    p += 4;
+  }
+  else {
+    size = (size_t)p[1] * 2;
+    p += 2;
+  }
+
+  if (size > (size_t)(end - p))
+    return NULL;
+
+  *data = p;
+  *len = (int)size - ((*id & ID_ODD_SIZE) ? 1 : 0);
+
+  if (*len < 0)
+    return NULL;
+
+  return p + size;
+}
+
+static bool read_metadata(wv_block *b,unsigned char *block,bool correction_file)
+{
+  unsigned char *p,*end,*data;
+  int id,len;
+  bool ok;
+
+  end = block + 8 + get_le32(block + 4);
+
+  for (p=block+WV_HEADER_SIZE;p<end;) {
+    if (NULL == (p = next_metadata(p,end,&id,&data,&len)))
+      return FALSE;
+
+    switch (id & ID_UNIQUE) {
+      case ID_DUMMY:
+      case ID_ENCODER_INFO:
+      case ID_CHANNEL_INFO:
+        ok = TRUE;
+        break;
+      case ID_DECORR_TERMS:
+        ok = read_decorr_terms(b,data,len);
+        break;
+      case ID_DECORR_WEIGHTS:
+        ok = read_decorr_weights(b,data,len);
+        break;
+      case ID_DECORR_SAMPLES:
+        ok = read_decorr_samples(b,data,len);
+        break;
+      case ID_ENTROPY_VARS:
+        ok = read_entropy_vars(b,data,len);
+        break;
+      case ID_HYBRID_PROFILE:
+        ok = read_hybrid_profile(b,data,len);
+        break;
+      case ID_SHAPING_WEIGHTS:
+        ok = read_shaping_info(b,data,len);
+        break;
+      case ID_INT32_INFO:
+        ok = read_int32_info(b,data,len);
+        break;
+      case ID_WV_BITSTREAM:
+        if ((ok = !correction_file)) {
+          bs_open(&b->wv,data,len);
+          b->have_wv_bits = TRUE;
+        }
+        break;
+      case ID_WVC_BITSTREAM:
+        if ((ok = correction_file)) {
+          bs_open(&b->wvc,data,len);
+          b->have_wvc_bits = TRUE;
+        }
+        break;
+      case ID_WVX_BITSTREAM:
+        if ((ok = (!correction_file && len > 4 && !(len & 1)))) {
+          b->wvx_crc = get_le32(data);
+          bs_open(&b->wvx,data + 4,len - 4);
+          b->have_wvx_bits = TRUE;
+        }
+        break;
+      default:
+        /* anything else (floating point data, DSD audio) is beyond us */
+        ok = (id & ID_OPTIONAL_DATA) ? TRUE : FALSE;
+        break;
+    }
+
+    if (!ok)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* blocks and frames */
+
+static unsigned char *find_block(unsigned char *data,size_t size,size_t *pos)
+/* returns the block at *pos and moves past it, or returns NULL if there isn't a valid block there */
+{
+  unsigned char *block = data + *pos;
+  uint32_t block_size,version;
+
+  if (*pos + WV_HEADER_SIZE > size || tagcmp(block,(unsigned char *)WV_MAGIC))
+    return NULL;
+
+  block_size = get_le32(block + 4);
+  version = get_le16(block + 8);
+
+  if (block_size < WV_HEADER_SIZE - 8 || (block_size & 1) || block_size - (WV_HEADER_SIZE - 8) > size - *pos - WV_HEADER_SIZE ||
+      version < WV_MIN_VERSION || version > WV_MAX_VERSION)
+    return NULL;
+
+  *pos += 8 + block_size;
+
+  return block;
+}
+
+static bool block_supported(unsigned char *block)
+{
+  uint32_t flags = get_le32(block + 24);
+
+  if (flags & (FLOAT_DATA | DSD_FLAG))
+    return FALSE;
+
+  /* lossy 32-bit samples need rescaling that 'wvunpack' is better placed to get right */
+  return (!(flags & HYBRID_FLAG) || (flags & BYTES_STORED) < 3);
+}
+
+static int block_channels(uint32_t flags)
+{
+  return (flags & MONO_FLAG) ? 1 : 2;
+}
+
+static bool restore_int32(wv_block *b,int32_t *buffer,int count)
+/* restores the bits that were taken off 32-bit samples before they were coded, returning FALSE if the extra
+ * bits that were sent separately fail their CRC check
+ */
+{
+  uint32_t crc = 0xffffffff;
+  int32_t v;
+  int i;
+
+  if (!b->have_wvx_bits && (b->int32_sent_bits || !(b->int32_zeros + b->int32_ones + b->int32_dups)))
+    return (0 == b->int32_sent_bits);
+
+  for (i=0;i<count;i++) {
+    v = buffer[i];
+
+    if (b->have_wvx_bits) {
+      v = (int32_t)(((uint32_t)v << b->int32_sent_bits) | bs_get_bits(&b->wvx,b->int32_sent_bits));
+      crc = crc * 9 + (v & 0xffff) * 3 + (((uint32_t)v >> 16) & 0xffff);
+    }
+
+    if (b->int32_zeros)
+      v = (int32_t)((uint32_t)v << b->int32_zeros);
+    else if (b->int32_ones)
+      v = (int32_t)(((uint32_t)v + 1) << b->int32_ones) - 1;
+    else if (b->int32_dups)
+      v = (int32_t)(((uint32_t)v + (v & 1)) << b->int32_dups) - (v & 1);
+
+    buffer[i] = v;
+  }
+
+  return (!b->have_wvx_bits || (crc == b->wvx_crc && !b->wvx.overrun));
+}
+
+static void store_samples(wv_decoder *d,int32_t *buffer,int samples,int channel,uint32_t flags)
+/* scales one block's decoded samples, and stores them as WAVE data in the given channel(s) of d->out */
+{
+  unsigned char *p;
+  int shift = (int)((flags & SHIFT_MASK) >> SHIFT_LSB);
+  int stride = (flags & MONO_DATA) ? 1 : 2;
+  int copies = (flags & FALSE_STEREO) ? 2 : 1;
+  int32_t v,min_value,max_value;
+  int i,ch,n;
+
+  max_value = (int32_t)(((int64_t)1 << (d->bytes_per_sample * 8 - 1)) - 1);
+  min_value = -max_value - 1;
+
+  for (i=0;i<samples;i++) {
+    for (ch=0;ch<stride*copies;ch++) {
+      v = buffer[i * stride + ch % stride];
+
+      /* lossy samples can overshoot */
+      if (flags & HYBRID_FLAG) {
+        if (v < (min_value >> shift))
+          v = min_value >> shift;
+        else if (v > (max_value >> shift))
+          v = max_value >> shift;
+      }
+
+      v = (int32_t)((uint32_t)v << shift);
+
+      p = d->out + (i * d->channels + channel + ch) * d->bytes_per_sample;
+
+      if (1 == d->bytes_per_sample) {
+        *p = (unsigned char)(v + 128);
+        continue;
+      }
+
+      for (n=0;n<d->bytes_per_sample;n++)
+        *p++ = (unsigned char)(v >> (n * 8));
+    }
+  }
+}
+
+static bool decode_block(wv_decoder *d,unsigned char *block,unsigned char *wvc_block,int samples,int channel)
+{
+  wv_block *b = &d->block;
+  int32_t *buffer = d->buffer,*corrections = d->corrections;
+  uint32_t crc = 0xffffffff,expected_crc;
+  int i,count,stride;
+
+  memset(b,0,sizeof(wv_block));
+
+  b->version = (int)get_le16(block + 8);
+  b->flags = get_le32(block + 24);
+
+  if ((b->flags & BYTES_STORED) + 1 != (uint32_t)d->bytes_per_sample || !block_supported(block))
+    return FALSE;
+
+  if (!read_metadata(b,block,FALSE) || !b->have_wv_bits || !b->have_entropy_vars)
+    return FALSE;
+
+  if (wvc_block && !read_metadata(b,wvc_block,TRUE))
+    return FALSE;
+
+  expected_crc = get_le32((b->have_wvc_bits ? wvc_block : block) + 28);
+
+  stride = (b->flags & MONO_DATA) ? 1 : 2;
+  count = samples * stride;
+
+  for (i=0;i<count;i++) {
+    if (WORD_EOF == (buffer[i] = get_word(b,i % stride,corrections + i)))
+      return FALSE;
+  }
+
+  if (b->wv.overrun || b->wvc.overrun)
+    return FALSE;
+
+  for (i=0;i<b->num_terms;i++) {
+    if (1 == stride)
+      decorr_mono_pass(&b->passes[i],buffer,samples);
+    else
+      decorr_stereo_pass(&b->passes[i],buffer,samples);
+  }
+
+  if (b->have_wvc_bits)
+    apply_corrections(b,buffer,corrections,count,stride);
+
+  if (2 == stride && (b->flags & JOINT_STEREO)) {
+    for (i=0;i<count;i+=2)
+      buffer[i] += (buffer[i+1] -= (buffer[i] >> 1));
+  }
+
+  for (i=0;i<count;i++)
+    crc = crc * 3 + (uint32_t)buffer[i];
+
+  if ((b->flags & INT32_DATA) && !restore_int32(b,buffer,count))
+    crc = ~expected_crc;
+
+  if (crc != expected_crc)
+    st_warning("CRC error in WavPack block at byte %lu of file: [%s]",(unsigned long)(block - d->map),d->filename);
+
+  store_samples(d,buffer,samples,channel,b->flags);
+
+  return TRUE;
+}
+
+static bool make_room(wv_decoder *d,int samples)
+/* makes sure a frame of this many samples fits in the buffers */
+{
+  int32_t *p;
+  unsigned char *out;
+
+  if (samples <= d->buffer_samples)
+    return TRUE;
+
+  if (NULL == (p = realloc(d->buffer,samples * 2 * sizeof(int32_t))))
+    return FALSE;
+  d->buffer = p;
+
+  if (NULL == (p = realloc(d->corrections,samples * 2 * sizeof(int32_t))))
+    return FALSE;
+  d->corrections = p;
+
+  if (samples * d->block_align > d->out_size) {
+    if (NULL == (out = realloc(d->out,samples * d->block_align)))
+      return FALSE;
+    d->out = out;
+    d->out_size = samples * d->block_align;
+  }
+
+  d->buffer_samples = samples;
+
+  return TRUE;
+}
+
+static unsigned char *correction_block(wv_decoder *d,unsigned char *block)
+/* returns the .wvc block matching a hybrid block, or NULL if there isn't one */
+{
+  unsigned char *wvc_block;
+
+  do {
+    if (NULL == (wvc_block = find_block(d->wvc_map,d->wvc_size,&d->wvc_pos)))
+      return NULL;
+  } while (0 == get_le32(wvc_block + 20));
+
+  /* the low 32 bits of the block index, and the byte above them */
+  if (get_le32(wvc_block + 16) != get_le32(block + 16) || wvc_block[10] != block[10])
+    return NULL;
+
+  return wvc_block;
+}
+
+static bool next_frame(wv_decoder *d)
+{
+  unsigned char *block,*wvc_block;
+  uint32_t flags,samples = 0,block_samples;
+  size_t offset;
+  int channel = 0;
+
+  do {
+    offset = d->pos;
+
+    if (NULL == (block = find_block(d->map,d->map_size,&d->pos))) {
+      st_warning("WavPack stream ended %lu samples early in file: [%s]",(unsigned long)d->samples_left,d->filename);
+      return FALSE;
+    }
+
+    block_samples = get_le32(block + 20);
+    flags = get_le32(block + 24);
+
+    /* blocks without audio just carry metadata */
+    if (0 == block_samples)
+      continue;
+
+    if (0 == channel) {
+      if (!(flags & INITIAL_BLOCK) || block_samples > WV_MAX_BLOCK_SAMPLES || !make_room(d,(int)block_samples))
+        goto corrupt;
+      samples = block_samples;
+    }
+    else if (block_samples != samples)
+      goto corrupt;
+
+    if (channel + block_channels(flags) > d->channels)
+      goto corrupt;
+
+    wvc_block = NULL;
+
+    if (d->wvc_map && (flags & HYBRID_FLAG) && NULL == (wvc_block = correction_block(d,block))) {
+      st_warning("correction file does not match WavPack block at byte %lu of file: [%s]",(unsigned long)offset,d->filename);
+      return FALSE;
+    }
+
+    if (!decode_block(d,block,wvc_block,(int)samples,channel))
+      goto corrupt;
+
+    channel += block_channels(flags);
+  } while (0 == block_samples || !(flags & FINAL_BLOCK));
+
+  if (channel != d->channels)
+    goto corrupt;
+
+  if (samples > d->samples_left)
+    samples = d->samples_left;
+
+  d->samples_left -= samples;
+  d->out_pos = 0;
+  d->out_len = (int)samples * d->block_align;
+
+  return TRUE;
+
+corrupt:
+  st_warning("corrupt WavPack block at byte %lu of file: [%s]",(unsigned long)offset,d->filename);
+  return FALSE;
+}
+
+static int wv_read(void *decoder,unsigned char *buf,int size)
+{
+  wv_decoder *d = (wv_decoder *)decoder;
+  int bytes,copied = 0;
+
+  while (copied < size) {
+    if (d->out_pos == d->out_len) {
+      if (d->failed)
+        break;
+
+      if (0 == d->samples_left) {
+        if (!d->pad_byte)
+          break;
+        d->out[0] = 0;
+        d->out_pos = 0;
+        d->out_len = 1;
+        d->pad_byte = FALSE;
+      }
+      else if (!next_frame(d)) {
+        d->failed = TRUE;
+        break;
+      }
+    }
+
+    bytes = min(size - copied,d->out_len - d->out_pos);
+    memcpy(buf + copied,d->out + d->out_pos,bytes);
+    d->out_pos += bytes;
+    copied += bytes;
+  }
+
+  if (0 == copied && d->failed)
+    return -1;
+
+  return copied;
+}
+
+static int wv_close(void *decoder)
+{
+  wv_decoder *d = (wv_decoder *)decoder;
+
+  if (d->map)
+    munmap(d->map,d->map_size);
+
+  if (d->wvc_map)
+    munmap(d->wvc_map,d->wvc_size);
+
+  st_free(d->buffer);
+  st_free(d->corrections);
+  st_free(d->out);
+  st_free(d->filename);
+  st_free(d);
+
+  return 0;
+}
+
+static bool map_file(char *filename,unsigned char **map,size_t *size)
+{
+  struct stat sz;
+  int fd;
+
+  if ((fd = open(filename,O_RDONLY)) < 0)
+    return FALSE;
+
+  if (fstat(fd,&sz) || sz.st_size < WV_HEADER_SIZE || (uint64_t)sz.st_size != (uint64_t)(size_t)sz.st_size) {
+    close(fd);
+    return FALSE;
+  }
+
+  *size = (size_t)sz.st_size;
+  *map = mmap(NULL,*size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+
+  if (MAP_FAILED == *map) {
+    *map = NULL;
+    return FALSE;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  madvise(*map,*size,MADV_SEQUENTIAL);
+#endif
+
+  return TRUE;
+}
+
+static bool find_first_block(unsigned char *data,size_t size,size_t *pos)
+{
+  size_t i;
+
+  for (i=0;i+WV_HEADER_SIZE<=size&&i<WV_SCAN_SIZE;i++) {
+    if (!tagcmp(data + i,(unsigned char *)WV_MAGIC)) {
+      *pos = i;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static bool find_metadata(unsigned char *block,int wanted,unsigned char **data,int *len)
+{
+  unsigned char *p,*end;
+  int id;
+
+  end = block + 8 + get_le32(block + 4);
+
+  for (p=block+WV_HEADER_SIZE;p&&p<end;) {
+    p = next_metadata(p,end,&id,data,len);
+
+    if (p && (id & ID_UNIQUE) == wanted)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static bool read_stream_info(wv_decoder *d,wave_info *info,unsigned char **riff_header,int *riff_header_len)
+/* gathers the stream's properties from the first frame, leaving d->pos at its first block */
+{
+  unsigned char *block,*first = NULL,*data;
+  uint32_t flags = 0,total_samples;
+  size_t pos;
+  wlong samples_per_sec;
+  int bytes = 0,shift = 0,srate_index,len;
+  uint64_t data_size;
+
+  if (!find_first_block(d->map,d->map_size,&d->pos))
+    return FALSE;
+
+  pos = d->pos;
+  d->channels = 0;
+
+  do {
+    if (NULL == (block = find_block(d->map,d->map_size,&pos)) || !block_supported(block))
+      return FALSE;
+
+    if (0 == get_le32(block + 20))
+      continue;
+
+    flags = get_le32(block + 24);
+
+    if (NULL == first) {
+      if (!(flags & INITIAL_BLOCK))
+        return FALSE;
+      first = block;
+      bytes = (int)(flags & BYTES_STORED) + 1;
+      shift = (int)((flags & SHIFT_MASK) >> SHIFT_LSB);
+    }
+    else if ((int)(flags & BYTES_STORED) + 1 != bytes)
+      return FALSE;
+
+    d->channels += block_channels(flags);
+  } while (NULL == first || !(flags & FINAL_BLOCK));
+
+  /* the top byte of a 40-bit total is stored separately - WAVE headers can't describe anything that long anyway */
+  total_samples = get_le32(first + 12);
+
+  if (0xffffffff == total_samples || 0 == total_samples || 0 != first[11] || d->channels > WV_MAX_CHANNELS)
+    return FALSE;
+
+  flags = get_le32(first + 24);
+  srate_index = (int)((flags & SRATE_MASK) >> SRATE_LSB);
+
+  if (srate_index < (int)(sizeof(sample_rates)/sizeof(sample_rates[0])))
+    samples_per_sec = sample_rates[srate_index];
+  else if (find_metadata(first,ID_SAMPLE_RATE,&data,&len) && 3 == len)
+    samples_per_sec = (wlong)data[0] | ((wlong)data[1] << 8) | ((wlong)data[2] << 16);
+  else
+    return FALSE;
+
+  d->bytes_per_sample = bytes;
+  d->block_align = d->channels * bytes;
+  d->samples_left = (wlong)total_samples;
+
+  data_size = (uint64_t)total_samples * d->block_align;
+
+  /* leave room for the header, and a possible pad byte */
+  if (data_size > 0xffffffffUL - CANONICAL_HEADER_SIZE)
+    return FALSE;
+
+  d->pad_byte = (data_size & 1) ? TRUE : FALSE;
+
+  /* send the original header if there is one, as long as it describes what we're about to decode */
+  if (find_metadata(first,ID_RIFF_HEADER,&data,&len)) {
+    if (!probe_wav_header(info,data,len) || info->channels != d->channels || info->block_align != d->block_align ||
+        info->data_size != (wlong)data_size)
+      return FALSE;
+
+    *riff_header = data;
+    *riff_header_len = len;
+
+    return TRUE;
+  }
+
+  info->wave_format = WAVE_FORMAT_PCM;
+  info->channels = d->channels;
+  info->samples_per_sec = samples_per_sec;
+  info->bits_per_sample = bytes * 8 - shift;
+  info->block_align = d->block_align;
+  info->avg_bytes_per_sec = info->samples_per_sec * info->block_align;
+  info->data_size = (wlong)data_size;
+  info->chunk_size = CANONICAL_HEADER_SIZE - 8 + info->data_size + (info->data_size & 1);
+
+  *riff_header = NULL;
+  *riff_header_len = 0;
+
+  return TRUE;
+}
+
+FILE *wv_decode_open(char *filename,char *wvc_filename)
+/* opens a WavPack file, along with its correction file if wvc_filename isn't NULL, for decoding in-process.
+ * returns NULL if it can't be decoded this way, in which case the caller should fall back to the external
+ * decoder, which will report any real problems.
+ */
+{
+  wv_decoder *d;
+  wave_info info;
+  unsigned char *riff_header;
+  int riff_header_len,header_len;
+
+#ifndef HAVE_CODEC_STREAMS
+  return NULL;
+#endif
+
+  if (NULL == (d = calloc(1,sizeof(wv_decoder))))
+    return NULL;
+
+  if (NULL == (d->filename = strdup(filename)) || !map_file(filename,&d->map,&d->map_size))
+    goto fail;
+
+  if (wvc_filename) {
+    if (!map_file(wvc_filename,&d->wvc_map,&d->wvc_size) || !find_first_block(d->wvc_map,d->wvc_size,&d->wvc_pos))
+      goto fail;
+  }
+
+  memset(&info,0,sizeof(info));
+  info.filename = d->filename;
+
+  if (!read_stream_info(d,&info,&riff_header,&riff_header_len))
+    goto fail;
+
+  header_len = riff_header ? riff_header_len : CANONICAL_HEADER_SIZE;
+
+  if (NULL == (d->out = malloc(header_len)))
+    goto fail;
+
+  d->out_size = header_len;
+
+  if (riff_header)
+    memcpy(d->out,riff_header,riff_header_len);
+  else
+    make_canonical_header(d->out,&info);
+
+  d->out_pos = 0;
+  d->out_len = header_len;
+
+  return open_decoder_stream(d,wv_read,wv_close);
+
+fail:
+  wv_close(d);
+  return NULL;
+}
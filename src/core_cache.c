@@ -0,0 +1,570 @@
+/*  core_cache.c - persistent cache of input file probe results
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * The probe cache is a single file holding a fixed-size header followed by an
+ * open-addressed hash table of fixed-size entries, so that it can be mapped
+ * into memory as-is.  Entries are found by device and inode number, and are
+ * only used when the file's size and modification time still match - a file
+ * that changed simply misses, and its entry is overwritten after the next probe.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "shdtool.h"
+
+#define PROBE_CACHE_MAGIC     "STPROBE"
+#define PROBE_CACHE_VERSION   1
+#define PROBE_CACHE_MIN_SLOTS 65536
+#define PROBE_CACHE_MAX_PROBE 32
+
+#define PROBE_CACHE_DIR       ".cache/shdtool"
+#define PROBE_CACHE_FILE      "probe.db"
+
+#define ENTRY_USED            (0x00000001)
+#define ENTRY_FILE_HAS_ID3V2  (0x00000002)
+#define ENTRY_STREAM_HAS_ID3V2 (0x00000004)
+#define ENTRY_HEADER_PROBED   (0x00000008)
+
+#ifdef __APPLE__
+#define st_mtime_nsec(s) ((s)->st_mtimespec.tv_nsec)
+#else
+#define st_mtime_nsec(s) ((s)->st_mtim.tv_nsec)
+#endif
+
+typedef struct _probe_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint32_t num_slots;
+  uint32_t num_entries;
+} probe_cache_header;
+
+typedef struct _probe_cache_entry {
+  /* key */
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t  mtime_sec;
+  uint32_t mtime_nsec;
+
+  uint32_t flags;
+  uint32_t checksum;
+
+  /* which format module handled the file, and how it was decoded */
+  char     format[16];
+  uint32_t decoder_sig;
+
+  /* values filled out by verify_wav_header() */
+  uint32_t header_size;
+  uint32_t reserved;
+  int64_t  extra_riff_size;
+  uint16_t channels;
+  uint16_t block_align;
+  uint16_t bits_per_sample;
+  uint16_t wave_format;
+  uint64_t samples_per_sec;
+  uint64_t avg_bytes_per_sec;
+  uint64_t rate;
+  uint64_t length;
+  uint64_t data_size;
+  uint64_t padded_data_size;
+  uint64_t total_size;
+  uint64_t chunk_size;
+  uint64_t problems;
+  uint64_t id3v2_tag_size;
+  double   exact_length;
+} probe_cache_entry;
+
+static int cache_fd = -1;
+static probe_cache_header *cache_header = NULL;
+static probe_cache_entry *cache_entries = NULL;
+static size_t cache_map_size = 0;
+static bool cache_failed = FALSE;
+static char cache_filename[FILENAME_SIZE];
+
+static uint32_t fnv1a(uint32_t hash,unsigned char *data,size_t len)
+{
+  size_t i;
+
+  for (i=0;i<len;i++) {
+    hash ^= data[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+static uint32_t entry_checksum(probe_cache_entry *e)
+/* checksum over everything except the checksum itself, so torn writes from concurrent runs are ignored */
+{
+  uint32_t hash = 2166136261U;
+
+  hash = fnv1a(hash,(unsigned char *)e,offsetof(probe_cache_entry,checksum));
+  hash = fnv1a(hash,(unsigned char *)e + offsetof(probe_cache_entry,format),sizeof(probe_cache_entry) - offsetof(probe_cache_entry,format));
+
+  return hash | 1;
+}
+
+static uint32_t decoder_signature(format_module *fm)
+/* a decoder given with -i or ST_<FORMAT>_DEC may produce different output, so entries record which one was used */
+{
+  uint32_t hash = 2166136261U;
+
+  if (fm->decoder)
+    hash = fnv1a(hash,(unsigned char *)fm->decoder,strlen(fm->decoder));
+
+  hash = fnv1a(hash,(unsigned char *)"",1);
+
+  if (fm->decoder_args)
+    hash = fnv1a(hash,(unsigned char *)fm->decoder_args,strlen(fm->decoder_args));
+
+  return hash;
+}
+
+static uint32_t home_slot(uint64_t dev,uint64_t ino,uint32_t num_slots)
+{
+  uint64_t h;
+
+  h = (ino * 0x9E3779B97F4A7C15ULL) ^ (dev * 0xC2B2AE3D27D4EB4FULL);
+  h ^= h >> 29;
+
+  return (uint32_t)(h % num_slots);
+}
+
+static void cache_fail(char *msg)
+{
+  st_warning("%s [%s] -- disabling probe cache: [%s]",msg,strerror(errno),cache_filename);
+  cache_failed = TRUE;
+
+  probe_cache_close();
+}
+
+static bool make_cache_dir(char *path)
+/* creates every missing directory leading up to the cache file */
+{
+  char dir[FILENAME_SIZE],*p;
+
+  strcpy(dir,path);
+
+  for (p=dir+1;*p;p++) {
+    if (PATHSEPCHAR != *p)
+      continue;
+
+    *p = 0;
+    if (mkdir(dir,0755) && EEXIST != errno)
+      return FALSE;
+    *p = PATHSEPCHAR;
+  }
+
+  return TRUE;
+}
+
+static bool valid_header(probe_cache_header *hdr,off_t size)
+{
+  return (!memcmp(hdr->magic,PROBE_CACHE_MAGIC,sizeof(PROBE_CACHE_MAGIC)) && PROBE_CACHE_VERSION == hdr->version &&
+          sizeof(probe_cache_entry) == hdr->entry_size && hdr->num_slots > 0 &&
+          size == sizeof(probe_cache_header) + (off_t)hdr->num_slots * sizeof(probe_cache_entry));
+}
+
+static void unmap_cache()
+{
+  if (cache_header) {
+    munmap((void *)cache_header,cache_map_size);
+    cache_header = NULL;
+    cache_entries = NULL;
+  }
+
+  if (-1 != cache_fd) {
+    close(cache_fd);
+    cache_fd = -1;
+  }
+}
+
+static probe_cache_header *map_file(int fd,uint32_t num_slots)
+{
+  probe_cache_header *hdr;
+
+  cache_map_size = sizeof(probe_cache_header) + (size_t)num_slots * sizeof(probe_cache_entry);
+
+  if (MAP_FAILED == (hdr = mmap(NULL,cache_map_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0)))
+    return NULL;
+
+  return hdr;
+}
+
+static bool rebuild_cache(uint32_t num_slots)
+/* builds a new table with the given number of slots beside the current file, copies over every valid
+ * entry from the current table (if any), and renames it into place.  the current file is never resized,
+ * so other processes that still have it mapped just keep reading the old table.
+ */
+{
+  char tmpname[FILENAME_SIZE];
+  int fd;
+  size_t old_size = cache_map_size;
+  probe_cache_header *hdr;
+  probe_cache_entry *entries,*e;
+  uint32_t i,j,slot;
+
+  st_snprintf(tmpname,FILENAME_SIZE,"%s.XXXXXX",cache_filename);
+
+  if (-1 == (fd = mkstemp(tmpname)))
+    return FALSE;
+
+  if (fchmod(fd,0644) || ftruncate(fd,sizeof(probe_cache_header) + (off_t)num_slots * sizeof(probe_cache_entry)) ||
+      NULL == (hdr = map_file(fd,num_slots)))
+  {
+    cache_map_size = old_size;
+    close(fd);
+    unlink(tmpname);
+    return FALSE;
+  }
+
+  memcpy(hdr->magic,PROBE_CACHE_MAGIC,sizeof(PROBE_CACHE_MAGIC));
+  hdr->version = PROBE_CACHE_VERSION;
+  hdr->entry_size = sizeof(probe_cache_entry);
+  hdr->num_slots = num_slots;
+  hdr->num_entries = 0;
+
+  entries = (probe_cache_entry *)(hdr + 1);
+
+  for (i=0;cache_header && i<cache_header->num_slots;i++) {
+    e = &cache_entries[i];
+
+    if (!(e->flags & ENTRY_USED) || entry_checksum(e) != e->checksum)
+      continue;
+
+    slot = home_slot(e->dev,e->ino,num_slots);
+
+    for (j=0;j<PROBE_CACHE_MAX_PROBE;j++) {
+      if (!(entries[(slot + j) % num_slots].flags & ENTRY_USED))
+        break;
+    }
+
+    if (j < PROBE_CACHE_MAX_PROBE) {
+      entries[(slot + j) % num_slots] = *e;
+      hdr->num_entries++;
+    }
+  }
+
+  /* hold the lock on the new file until the caller is done with it */
+  flock(fd,LOCK_EX);
+
+  if (rename(tmpname,cache_filename)) {
+    munmap((void *)hdr,cache_map_size);
+    cache_map_size = old_size;
+    close(fd);
+    unlink(tmpname);
+    return FALSE;
+  }
+
+  if (cache_header)
+    munmap((void *)cache_header,old_size);
+
+  close(cache_fd);
+
+  cache_fd = fd;
+  cache_header = hdr;
+  cache_entries = entries;
+
+  st_debug1("created probe cache with %lu slots: [%s]",(unsigned long)num_slots,cache_filename);
+
+  return TRUE;
+}
+
+static bool map_cache()
+/* maps the open cache file, replacing it if it is empty or was written by an incompatible version */
+{
+  struct stat sz;
+  probe_cache_header hdr;
+
+  if (fstat(cache_fd,&sz))
+    return FALSE;
+
+  if (sz.st_size < sizeof(probe_cache_header) || sizeof(probe_cache_header) != pread(cache_fd,&hdr,sizeof(probe_cache_header),0) ||
+      !valid_header(&hdr,sz.st_size))
+  {
+    if (sz.st_size > 0)
+      st_debug1("discarding probe cache in unknown format: [%s]",cache_filename);
+
+    return rebuild_cache(PROBE_CACHE_MIN_SLOTS);
+  }
+
+  if (NULL == (cache_header = map_file(cache_fd,hdr.num_slots)))
+    return FALSE;
+
+  cache_entries = (probe_cache_entry *)(cache_header + 1);
+
+  st_debug1("using probe cache with %lu of %lu slots filled: [%s]",(unsigned long)cache_header->num_entries,(unsigned long)cache_header->num_slots,cache_filename);
+
+  return TRUE;
+}
+
+static bool reopen_cache()
+/* opens (or reopens) the cache file by name, and maps it */
+{
+  unmap_cache();
+
+  if (-1 == (cache_fd = open(cache_filename,O_RDWR|O_CREAT,0644)))
+    return FALSE;
+
+  flock(cache_fd,LOCK_EX);
+
+  if (!map_cache())
+    return FALSE;
+
+  flock(cache_fd,LOCK_UN);
+
+  return TRUE;
+}
+
+static bool open_cache()
+{
+  char *env,*home;
+
+  if (cache_header)
+    return TRUE;
+
+  if (cache_failed || !st_priv.use_probe_cache)
+    return FALSE;
+
+  if ((env = scan_env(PROBE_CACHE_ENV)))
+    st_snprintf(cache_filename,FILENAME_SIZE,"%s",env);
+  else if ((home = scan_env("HOME")))
+    st_snprintf(cache_filename,FILENAME_SIZE,"%s%c" PROBE_CACHE_DIR "%c" PROBE_CACHE_FILE,home,PATHSEPCHAR,PATHSEPCHAR);
+  else {
+    st_warning("could not determine probe cache location -- set %s or HOME",PROBE_CACHE_ENV);
+    cache_failed = TRUE;
+    return FALSE;
+  }
+
+  if (!make_cache_dir(cache_filename)) {
+    cache_fail("could not create directory for probe cache");
+    return FALSE;
+  }
+
+  if (!reopen_cache()) {
+    cache_fail("could not open probe cache");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static bool lock_cache()
+/* locks the cache for writing, switching to a newer file if another process replaced it since we mapped it */
+{
+  struct stat cur,named;
+
+  for (;;) {
+    if (flock(cache_fd,LOCK_EX) || fstat(cache_fd,&cur))
+      return FALSE;
+
+    if (stat(cache_filename,&named) || (cur.st_dev == named.st_dev && cur.st_ino == named.st_ino))
+      return TRUE;
+
+    if (!reopen_cache())
+      return FALSE;
+  }
+}
+
+static probe_cache_entry *find_slot(uint64_t dev,uint64_t ino,bool for_store)
+/* returns the slot holding this file, or when storing, the slot it should be stored in */
+{
+  uint32_t i,slot,num_slots;
+  probe_cache_entry *e,*empty = NULL;
+
+  num_slots = cache_header->num_slots;
+  slot = home_slot(dev,ino,num_slots);
+
+  for (i=0;i<PROBE_CACHE_MAX_PROBE;i++) {
+    e = &cache_entries[(slot + i) % num_slots];
+
+    if (!(e->flags & ENTRY_USED)) {
+      if (!empty)
+        empty = e;
+      /* entries are never removed, so the probe sequence for this file ends here */
+      break;
+    }
+
+    if (e->dev == dev && e->ino == ino)
+      return e;
+  }
+
+  if (!for_store)
+    return NULL;
+
+  /* probe window is full - evict the entry in the home slot */
+  return (empty) ? empty : &cache_entries[slot];
+}
+
+bool probe_cache_lookup(wave_info *info,struct stat *sz)
+/* fills out info from the probe cache if it holds an entry for the current version of this file */
+{
+  probe_cache_entry e,*slot;
+  format_module *fm = NULL;
+  int i;
+
+  /* lookups go without the lock - a stale table only means a miss, and damaged entries fail their checksum */
+  if (!open_cache())
+    return FALSE;
+
+  if (NULL == (slot = find_slot((uint64_t)sz->st_dev,(uint64_t)sz->st_ino,FALSE)))
+    return FALSE;
+
+  /* copy it out before checking it, since another process may be rewriting this slot */
+  e = *slot;
+
+  if (entry_checksum(&e) != e.checksum) {
+    st_debug1("ignoring damaged probe cache entry for file: [%s]",info->filename);
+    return FALSE;
+  }
+
+  if (e.size != (uint64_t)sz->st_size || e.mtime_sec != (int64_t)sz->st_mtime || e.mtime_nsec != (uint32_t)st_mtime_nsec(sz)) {
+    st_debug1("probe cache entry is out of date for file: [%s]",info->filename);
+    return FALSE;
+  }
+
+  e.format[sizeof(e.format)-1] = 0;
+
+  for (i=0;st_formats[i];i++) {
+    if (!strcmp(st_formats[i]->name,e.format)) {
+      fm = st_formats[i];
+      break;
+    }
+  }
+
+  if (NULL == fm || !fm->supports_input || e.decoder_sig != decoder_signature(fm)) {
+    st_debug1("probe cache entry was made with a different decoder for file: [%s]",info->filename);
+    return FALSE;
+  }
+
+  info->input_format = fm;
+  info->file_has_id3v2_tag = (e.flags & ENTRY_FILE_HAS_ID3V2) ? TRUE : FALSE;
+  info->stream_has_id3v2_tag = (e.flags & ENTRY_STREAM_HAS_ID3V2) ? TRUE : FALSE;
+  info->header_probed = (e.flags & ENTRY_HEADER_PROBED) ? TRUE : FALSE;
+  info->id3v2_tag_size = (wlong)e.id3v2_tag_size;
+  info->header_size = (wint)e.header_size;
+  info->extra_riff_size = (long)e.extra_riff_size;
+  info->channels = (wshort)e.channels;
+  info->block_align = (wshort)e.block_align;
+  info->bits_per_sample = (wshort)e.bits_per_sample;
+  info->wave_format = (wshort)e.wave_format;
+  info->samples_per_sec = (wlong)e.samples_per_sec;
+  info->avg_bytes_per_sec = (wlong)e.avg_bytes_per_sec;
+  info->rate = (wlong)e.rate;
+  info->length = (wlong)e.length;
+  info->data_size = (wlong)e.data_size;
+  info->padded_data_size = (wlong)e.padded_data_size;
+  info->total_size = (wlong)e.total_size;
+  info->chunk_size = (wlong)e.chunk_size;
+  info->problems = (unsigned long)e.problems;
+  info->exact_length = e.exact_length;
+
+  /* m:ss depends on command-line options, so it is never cached */
+  length_to_str(info);
+
+  st_debug1("using cached [%s] probe results for file: [%s]",fm->name,info->filename);
+
+  return TRUE;
+}
+
+void probe_cache_store(wave_info *info,struct stat *sz)
+/* records the probe results for this version of the file */
+{
+  probe_cache_entry e,*slot;
+  bool is_new;
+
+  if (!open_cache())
+    return;
+
+  memset((void *)&e,0,sizeof(probe_cache_entry));
+
+  e.dev = (uint64_t)sz->st_dev;
+  e.ino = (uint64_t)sz->st_ino;
+  e.size = (uint64_t)sz->st_size;
+  e.mtime_sec = (int64_t)sz->st_mtime;
+  e.mtime_nsec = (uint32_t)st_mtime_nsec(sz);
+
+  e.flags = ENTRY_USED;
+  if (info->file_has_id3v2_tag)
+    e.flags |= ENTRY_FILE_HAS_ID3V2;
+  if (info->stream_has_id3v2_tag)
+    e.flags |= ENTRY_STREAM_HAS_ID3V2;
+  if (info->header_probed)
+    e.flags |= ENTRY_HEADER_PROBED;
+
+  strncpy(e.format,info->input_format->name,sizeof(e.format)-1);
+  e.decoder_sig = decoder_signature(info->input_format);
+
+  e.header_size = (uint32_t)info->header_size;
+  e.extra_riff_size = (int64_t)info->extra_riff_size;
+  e.channels = (uint16_t)info->channels;
+  e.block_align = (uint16_t)info->block_align;
+  e.bits_per_sample = (uint16_t)info->bits_per_sample;
+  e.wave_format = (uint16_t)info->wave_format;
+  e.samples_per_sec = (uint64_t)info->samples_per_sec;
+  e.avg_bytes_per_sec = (uint64_t)info->avg_bytes_per_sec;
+  e.rate = (uint64_t)info->rate;
+  e.length = (uint64_t)info->length;
+  e.data_size = (uint64_t)info->data_size;
+  e.padded_data_size = (uint64_t)info->padded_data_size;
+  e.total_size = (uint64_t)info->total_size;
+  e.chunk_size = (uint64_t)info->chunk_size;
+  e.problems = (uint64_t)info->problems;
+  e.id3v2_tag_size = (uint64_t)info->id3v2_tag_size;
+  e.exact_length = info->exact_length;
+
+  e.checksum = entry_checksum(&e);
+
+  if (!lock_cache()) {
+    cache_fail("could not lock probe cache");
+    return;
+  }
+
+  /* keep the table at most half full, so probe sequences stay short */
+  if (cache_header->num_entries >= cache_header->num_slots / 2 && !rebuild_cache(cache_header->num_slots * 2)) {
+    cache_fail("could not grow probe cache");
+    return;
+  }
+
+  slot = find_slot(e.dev,e.ino,TRUE);
+
+  is_new = !(slot->flags & ENTRY_USED);
+
+  *slot = e;
+
+  if (is_new)
+    cache_header->num_entries++;
+
+  flock(cache_fd,LOCK_UN);
+}
+
+void probe_cache_close()
+{
+  unmap_cache();
+}
@@ -0,0 +1,213 @@
+/*  core_codec.c - public functions for in-process codecs
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* fopencookie() needs this - which is also why this lives apart from the other core functions, and
+ * doesn't include shdtool.h, since _GNU_SOURCE changes the prototype of basename() in string.h
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/types.h>
+#include "config.h"
+#include "format.h"
+#include "codec.h"
+
+typedef struct _codec_stream {
+  void *codec;
+  int (*read_func)(void *,unsigned char *,int);
+  int (*write_func)(void *,unsigned char *,int);
+  int (*seek_func)(void *,wlong);
+  int (*close_func)(void *);
+  wlong pos;
+} codec_stream;
+
+#ifdef HAVE_CODEC_STREAMS
+static int codec_stream_seek_to(codec_stream *cs,long long offset,int whence)
+/* moves cs->pos, and the codec along with it - returns 0 on success, or -1 if the codec can't get there */
+{
+  if (SEEK_CUR == whence)
+    offset += (long long)cs->pos;
+  else if (SEEK_SET != whence)
+    return -1;
+
+  if (offset < 0)
+    return -1;
+
+  if ((wlong)offset != cs->pos) {
+    if (cs->seek_func(cs->codec,(wlong)offset))
+      return -1;
+    cs->pos = (wlong)offset;
+  }
+
+  return 0;
+}
+#endif
+
+#if defined(HAVE_FOPENCOOKIE)
+static ssize_t codec_stream_read(void *cookie,char *buf,size_t size)
+{
+  codec_stream *cs = (codec_stream *)cookie;
+  int bytes;
+
+  if ((bytes = cs->read_func(cs->codec,(unsigned char *)buf,(size > INT_MAX) ? INT_MAX : (int)size)) > 0)
+    cs->pos += bytes;
+
+  return bytes;
+}
+
+static int codec_stream_seek(void *cookie,off64_t *offset,int whence)
+{
+  codec_stream *cs = (codec_stream *)cookie;
+
+  if (codec_stream_seek_to(cs,(long long)*offset,whence))
+    return -1;
+
+  *offset = (off64_t)cs->pos;
+
+  return 0;
+}
+
+static ssize_t codec_stream_write(void *cookie,const char *buf,size_t size)
+{
+  codec_stream *cs = (codec_stream *)cookie;
+  int bytes;
+
+  /* fopencookie() wants 0, not -1, on errors */
+  bytes = cs->write_func(cs->codec,(unsigned char *)buf,(size > INT_MAX) ? INT_MAX : (int)size);
+
+  return (bytes < 0) ? 0 : bytes;
+}
+#elif defined(HAVE_FUNOPEN)
+static int codec_stream_read(void *cookie,char *buf,int size)
+{
+  codec_stream *cs = (codec_stream *)cookie;
+  int bytes;
+
+  if ((bytes = cs->read_func(cs->codec,(unsigned char *)buf,size)) > 0)
+    cs->pos += bytes;
+
+  return bytes;
+}
+
+static fpos_t codec_stream_seek(void *cookie,fpos_t offset,int whence)
+{
+  codec_stream *cs = (codec_stream *)cookie;
+
+  if (codec_stream_seek_to(cs,(long long)offset,whence))
+    return -1;
+
+  return (fpos_t)cs->pos;
+}
+
+static int codec_stream_write(void *cookie,const char *buf,int size)
+{
+  codec_stream *cs = (codec_stream *)cookie;
+
+  return cs->write_func(cs->codec,(unsigned char *)buf,size);
+}
+#endif
+
+#ifdef HAVE_CODEC_STREAMS
+static int codec_stream_close(void *cookie)
+{
+  codec_stream *cs = (codec_stream *)cookie;
+  int retval;
+
+  retval = cs->close_func(cs->codec);
+  st_free(cs);
+
+  return retval;
+}
+#endif
+
+static FILE *open_codec_stream(void *codec,int (*read_func)(void *,unsigned char *,int),
+                               int (*write_func)(void *,unsigned char *,int),int (*seek_func)(void *,wlong),
+                               int (*close_func)(void *))
+{
+#ifdef HAVE_CODEC_STREAMS
+  codec_stream *cs;
+  FILE *f;
+#ifdef HAVE_FOPENCOOKIE
+  cookie_io_functions_t funcs;
+#endif
+
+  if (NULL == (cs = malloc(sizeof(codec_stream)))) {
+    close_func(codec);
+    return NULL;
+  }
+
+  cs->codec = codec;
+  cs->read_func = read_func;
+  cs->write_func = write_func;
+  cs->seek_func = seek_func;
+  cs->close_func = close_func;
+  cs->pos = 0;
+
+#ifdef HAVE_FOPENCOOKIE
+  funcs.read = (read_func) ? codec_stream_read : NULL;
+  funcs.write = (write_func) ? codec_stream_write : NULL;
+  funcs.seek = (seek_func) ? codec_stream_seek : NULL;
+  funcs.close = codec_stream_close;
+
+  f = fopencookie(cs,(read_func) ? "rb" : "wb",funcs);
+#else
+  f = funopen(cs,(read_func) ? codec_stream_read : NULL,(write_func) ? codec_stream_write : NULL,
+              (seek_func) ? codec_stream_seek : NULL,codec_stream_close);
+#endif
+
+  if (NULL == f) {
+    codec_stream_close(cs);
+    return NULL;
+  }
+
+  return f;
+#else
+  close_func(codec);
+  return NULL;
+#endif
+}
+
+FILE *open_decoder_stream(void *codec,int (*read_func)(void *,unsigned char *,int),int (*close_func)(void *))
+/* wraps an in-process decoder in a stream that can be read just like a decoder's pipe.  read_func returns the
+ * number of bytes it placed in the buffer, 0 at the end of the stream or -1 on error.  on failure, the decoder
+ * is closed, and NULL is returned.
+ */
+{
+  return open_codec_stream(codec,read_func,NULL,NULL,close_func);
+}
+
+FILE *open_seekable_decoder_stream(void *codec,int (*read_func)(void *,unsigned char *,int),int (*seek_func)(void *,wlong),
+                                   int (*close_func)(void *))
+/* as for open_decoder_stream(), for a decoder that can also move to any offset in its output.  seek_func returns
+ * 0 once the next read_func call will start there, or -1 if the offset can't be reached.  fseeko() and ftello()
+ * then work on the stream, although SEEK_END isn't supported.
+ */
+{
+  return open_codec_stream(codec,read_func,NULL,seek_func,close_func);
+}
+
+FILE *open_encoder_stream(void *codec,int (*write_func)(void *,unsigned char *,int),int (*close_func)(void *))
+/* wraps an in-process encoder in a stream that can be written just like an encoder's pipe.  write_func returns
+ * the number of bytes it consumed, or -1 on error.  close_func finishes the output file, and returns 0 if all
+ * went well, or EOF otherwise, which fclose() passes on.  on failure, the encoder is closed, and NULL is returned.
+ */
+{
+  return open_codec_stream(codec,NULL,write_func,NULL,close_func);
+}
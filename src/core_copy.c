@@ -0,0 +1,109 @@
+/*  core_copy.c - copying data between files in the kernel
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* copy_file_range() and splice() need this - see core_codec.c for why this doesn't include shdtool.h */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "config.h"
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SPLICE
+#include <fcntl.h>
+#include <stdio_ext.h>
+#endif
+#include "format.h"
+
+unsigned long copy_n_bytes_in_kernel(FILE *in,FILE *out,unsigned long bytes)
+/* copies up to 'bytes' bytes from 'in' to 'out' without passing them through user space, if each is a regular file
+ * or a pipe and the system allows it.  between regular files, copy_file_range() can even share extents on filesystems
+ * that support it; anything involving a pipe (e.g. decoder to encoder) is spliced.  both streams are left positioned
+ * after the bytes copied, and the number copied is returned.
+ */
+{
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE) || defined(HAVE_SPLICE)
+  struct stat st_in,st_out;
+  off_t off_in = 0,off_out = 0;
+  ssize_t copied = -1;
+  bool in_is_pipe,out_is_pipe;
+  unsigned long total_bytes_copied = 0;
+
+  if (0 == bytes || -1 == fileno(in) || -1 == fileno(out))
+    return 0;
+
+  if (0 != fstat(fileno(in),&st_in) || 0 != fstat(fileno(out),&st_out))
+    return 0;
+
+  in_is_pipe = S_ISFIFO(st_in.st_mode);
+  out_is_pipe = S_ISFIFO(st_out.st_mode);
+
+  if ((!in_is_pipe && !S_ISREG(st_in.st_mode)) || (!out_is_pipe && !S_ISREG(st_out.st_mode)))
+    return 0;
+
+#ifdef HAVE_SPLICE
+  /* stdio can't be asked how much it has read ahead of a pipe, so only unbuffered ones are spliced from */
+  if (in_is_pipe && __fbufsize(in) > 1)
+    return 0;
+#else
+  if (in_is_pipe || out_is_pipe)
+    return 0;
+#endif
+
+  /* anything stdio is holding on to for the output has to reach it first */
+  if (0 != fflush(out) || (!in_is_pipe && -1 == (off_in = ftello(in))) || (!out_is_pipe && -1 == (off_out = ftello(out))))
+    return 0;
+
+  if (in_is_pipe || out_is_pipe) {
+#ifdef HAVE_SPLICE
+    while (total_bytes_copied < bytes && (copied = splice(fileno(in),in_is_pipe ? NULL : &off_in,fileno(out),out_is_pipe ? NULL : &off_out,
+                                                          bytes - total_bytes_copied,SPLICE_F_MOVE|SPLICE_F_MORE)) > 0)
+      total_bytes_copied += (unsigned long)copied;
+#endif
+  }
+  else {
+#ifdef HAVE_COPY_FILE_RANGE
+    while (total_bytes_copied < bytes && (copied = copy_file_range(fileno(in),&off_in,fileno(out),&off_out,bytes - total_bytes_copied,0)) > 0)
+      total_bytes_copied += (unsigned long)copied;
+#endif
+
+#ifdef HAVE_SENDFILE
+    /* copy_file_range() can't be used everywhere (e.g. across filesystems on older kernels) - sendfile() writes at the
+     * output's file offset, so that has to be put in place first
+     */
+    if (-1 == copied && 0 == total_bytes_copied && off_out == lseek(fileno(out),off_out,SEEK_SET)) {
+      while (total_bytes_copied < bytes && (copied = sendfile(fileno(out),fileno(in),&off_in,bytes - total_bytes_copied)) > 0) {
+        total_bytes_copied += (unsigned long)copied;
+        off_out += copied;
+      }
+    }
+#endif
+  }
+
+  /* bring stdio's idea of both positions in line with where the kernel left them */
+  if ((!in_is_pipe && 0 != fseeko(in,off_in,SEEK_SET)) || (!out_is_pipe && 0 != fseeko(out,off_out,SEEK_SET)))
+    st_error("could not reposition files after copying %lu bytes in the kernel",total_bytes_copied);
+
+  return total_bytes_copied;
+#else
+  return 0;
+#endif
+}
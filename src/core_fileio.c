@@ -17,10 +17,15 @@
  */
 
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "shdtool.h"
 
 CVSID("$Id: core_fileio.c,v 1.44 2009/03/11 17:18:01 jason Exp $")
 
+/* how much to have the kernel copy at a time, so that progress is still shown */
+#define KERNEL_XFER_SIZE 8388608
+
 int read_n_bytes(FILE *in,unsigned char *buf,int num,progress_info *proginfo)
 /* reads the specified number of bytes from the file descriptor 'in' into buf */
 {
@@ -60,7 +65,7 @@ int write_n_bytes(FILE *out,unsigned char *buf,int num,progress_info *proginfo)
 }
 
 unsigned long transfer_n_bytes_internal(FILE *in,FILE *out1,FILE *out2,unsigned long bytes,progress_info *proginfo)
-/* transfers 'bytes' bytes from file descriptor 'in' to file descriptor 'out' */
+/* transfers 'bytes' bytes from file descriptor 'in' to file descriptor 'out' - in the kernel when each is a regular file or a pipe */
 {
   unsigned char buf[XFER_SIZE];
   int bytes_to_xfer,
@@ -68,7 +73,22 @@ unsigned long transfer_n_bytes_internal(FILE *in,FILE *out1,FILE *out2,unsigned
       actual_bytes_written1,
       actual_bytes_written2;
   unsigned long total_bytes_to_xfer = bytes,
-                total_bytes_xfered = 0;
+                total_bytes_xfered = 0,
+                bytes_copied;
+
+  /* whatever the kernel doesn't copy (if anything) goes through the buffer, which also reports truncated files */
+  while (!out2 && total_bytes_to_xfer > 0) {
+    bytes_to_xfer = min(total_bytes_to_xfer,KERNEL_XFER_SIZE);
+    bytes_copied = copy_n_bytes_in_kernel(in,out1,(unsigned long)bytes_to_xfer);
+    if (proginfo && bytes_copied > 0) {
+      proginfo->bytes_written += bytes_copied;
+      prog_update(proginfo);
+    }
+    total_bytes_xfered += bytes_copied;
+    total_bytes_to_xfer -= bytes_copied;
+    if (bytes_copied != (unsigned long)bytes_to_xfer)
+      break;
+  }
 
   while (total_bytes_to_xfer > 0) {
     bytes_to_xfer = min(total_bytes_to_xfer,XFER_SIZE);
@@ -84,6 +104,55 @@ unsigned long transfer_n_bytes_internal(FILE *in,FILE *out1,FILE *out2,unsigned
   return total_bytes_xfered;
 }
 
+unsigned long skip_n_bytes(FILE *in,unsigned long bytes,progress_info *proginfo)
+/* skips 'bytes' bytes of file descriptor 'in' - by seeking if it is a regular file or a decoder stream that can seek,
+ * otherwise by reading and discarding them
+ */
+{
+  unsigned char buf[XFER_SIZE];
+  struct stat sz;
+  off_t pos;
+  int bytes_to_skip,
+      actual_bytes_read;
+  unsigned long total_bytes_to_skip = bytes,
+                total_bytes_skipped = 0;
+
+  if (0 == fstat(fileno(in),&sz) && S_ISREG(sz.st_mode) && -1 != (pos = ftello(in))) {
+    /* don't seek past the end, so that truncated files are still noticed */
+    if ((off_t)bytes > sz.st_size - pos) {
+      st_debug1("tried to skip %lu bytes, but only %lu remain -- possible truncated/corrupt file",bytes,(unsigned long)(sz.st_size - pos));
+      bytes = (sz.st_size > pos) ? (unsigned long)(sz.st_size - pos) : 0;
+    }
+
+    if (0 == fseeko(in,(off_t)bytes,SEEK_CUR)) {
+      if (proginfo) {
+        proginfo->bytes_written += bytes;
+        prog_update(proginfo);
+      }
+      return bytes;
+    }
+  }
+  else if (-1 == fileno(in) && -1 != (pos = ftello(in)) && 0 == fseeko(in,pos + (off_t)bytes,SEEK_SET)) {
+    /* an in-process decoder that can seek - it refuses to go past the end, so truncated files are still noticed */
+    if (proginfo) {
+      proginfo->bytes_written += bytes;
+      prog_update(proginfo);
+    }
+    return bytes;
+  }
+
+  while (total_bytes_to_skip > 0) {
+    bytes_to_skip = min(total_bytes_to_skip,XFER_SIZE);
+    actual_bytes_read = read_n_bytes(in,buf,bytes_to_skip,proginfo);
+    total_bytes_skipped += (unsigned long)actual_bytes_read;
+    if (actual_bytes_read != bytes_to_skip)
+      break;
+    total_bytes_to_skip -= bytes_to_skip;
+  }
+
+  return total_bytes_skipped;
+}
+
 int write_padding(FILE *out,int bytes,progress_info *proginfo)
 /* writes the specified number of zero bytes to the file descriptor given */
 {
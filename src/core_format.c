@@ -17,6 +17,7 @@
  */
 
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -32,6 +33,16 @@ CVSID("$Id: core_format.c,v 1.44 2009/03/11 17:18:01 jason Exp $")
 #define spawn_input_fd(a,b,c,d,e)  spawn(a,b,c,d,CHILD_INPUT,e)
 #define spawn_output_fd(a,b,c,d,e) spawn(a,b,c,d,CHILD_OUTPUT,e)
 
+#define MAX_MAGIC_FORMATS 64
+#define MAX_MAGIC_OFFSETS 16
+
+/* formats identified by a magic string, bucketed by the first byte of that string */
+static format_module *magic_formats[MAX_MAGIC_FORMATS];
+static int magic_bucket[257];
+static int magic_offsets[MAX_MAGIC_OFFSETS];
+static int num_magic_offsets = 0;
+static bool magic_table_built = FALSE;
+
 static void get_quoted_arg_list(child_args *process_args,char *arg_list)
 {
   int i;
@@ -210,6 +221,12 @@ static void spawn(child_args *process_args,FILE **readpipe,FILE **writepipe,proc
       SETBINARY_IN(*readpipe);
       SETBINARY_OUT(*writepipe);
 
+#ifdef HAVE_SPLICE
+      /* decoder output may be spliced straight from the pipe, so stdio mustn't read ahead of it */
+      if (CHILD_INPUT == child_type)
+        setvbuf(*readpipe,NULL,_IONBF,0);
+#endif
+
       break;
     }
 
@@ -370,42 +387,169 @@ int tagcmp(unsigned char *got,unsigned char *expected)
   return 0;
 }
 
-bool check_for_magic(char *filename,char *magic,int offset)
+static void build_magic_table()
+/* sorts the format modules that define a magic string into buckets keyed by the first byte of that string */
 {
-  FILE *file;
-  int magiclen, bytes, bytes_to_discard;
-  unsigned char buf[XFER_SIZE];
+  int i,c,num_formats,counts[256];
 
-  if (NULL == magic || !strcmp(magic,""))
-    return FALSE;
+  if (magic_table_built)
+    return;
 
-  if (offset < 0)
-    return FALSE;
+  memset((void *)counts,0,sizeof(counts));
+  num_magic_offsets = 0;
+  num_formats = 0;
 
-  if (NULL == (file = open_input(filename)))
-    return FALSE;
+  for (i=0;st_formats[i];i++) {
+    if (!st_formats[i]->supports_input || st_formats[i]->is_our_file)
+      continue;
 
-  magiclen = strlen(magic);
+    if (NULL == st_formats[i]->magic || !strcmp(st_formats[i]->magic,"") || st_formats[i]->magic_offset < 0)
+      continue;
+
+    if (num_formats >= MAX_MAGIC_FORMATS)
+      st_error("too many format modules define magic strings -- limit is %d",MAX_MAGIC_FORMATS);
+
+    counts[(unsigned char)st_formats[i]->magic[0]]++;
+    num_formats++;
+
+    for (c=0;c<num_magic_offsets;c++) {
+      if (magic_offsets[c] == st_formats[i]->magic_offset)
+        break;
+    }
+
+    if (c == num_magic_offsets) {
+      if (num_magic_offsets >= MAX_MAGIC_OFFSETS)
+        st_error("too many distinct magic string offsets -- limit is %d",MAX_MAGIC_OFFSETS);
+      magic_offsets[num_magic_offsets++] = st_formats[i]->magic_offset;
+    }
+  }
 
-  bytes_to_discard = offset;
+  magic_bucket[0] = 0;
+  for (c=0;c<256;c++)
+    magic_bucket[c+1] = magic_bucket[c] + counts[c];
 
-  /* skip to magic header */
-  while (bytes_to_discard > 0) {
-    bytes = min(bytes_to_discard,XFER_SIZE);
-    if (bytes!= fread(buf,1,bytes,file)) {
-      fclose(file);
-      return FALSE;
+  /* fill buckets in st_formats[] order, so that earlier formats still take precedence */
+  memset((void *)counts,0,sizeof(counts));
+
+  for (i=0;st_formats[i];i++) {
+    if (!st_formats[i]->supports_input || st_formats[i]->is_our_file)
+      continue;
+
+    if (NULL == st_formats[i]->magic || !strcmp(st_formats[i]->magic,"") || st_formats[i]->magic_offset < 0)
+      continue;
+
+    c = (unsigned char)st_formats[i]->magic[0];
+    magic_formats[magic_bucket[c] + counts[c]] = st_formats[i];
+    counts[c]++;
+  }
+
+  st_debug2("built magic string lookup table for %d format modules at %d distinct offsets",num_formats,num_magic_offsets);
+
+  magic_table_built = TRUE;
+}
+
+static void match_magic(sniff_buffer *sb)
+/* finds all format modules whose magic strings are present in the sniff buffer */
+{
+  int i,j,c,offset;
+
+  build_magic_table();
+
+  sb->num_magic_matches = 0;
+
+  for (i=0;i<num_magic_offsets;i++) {
+    offset = magic_offsets[i];
+
+    if (offset >= sb->size)
+      continue;
+
+    c = sb->data[offset];
+
+    for (j=magic_bucket[c];j<magic_bucket[c+1];j++) {
+      if (magic_formats[j]->magic_offset != offset)
+        continue;
+
+      if (!check_for_magic(sb,magic_formats[j]->magic,offset))
+        continue;
+
+      if (sb->num_magic_matches < MAX_MAGIC_MATCHES)
+        sb->magic_matches[sb->num_magic_matches++] = magic_formats[j];
     }
-    bytes_to_discard -= bytes;
   }
+}
+
+bool sniff_open(sniff_buffer *sb,char *filename)
+/* opens a file, skips past any ID3v2 tag, and reads the beginning of the file into the sniff buffer */
+{
+  sb->filename = filename;
+  sb->size = 0;
+  sb->num_magic_matches = 0;
 
-  /* read magic header */
-  if (magiclen != fread(buf,1,magiclen,file)) {
-    fclose(file);
+  if (NULL == (sb->file = open_input_internal(filename,&sb->file_has_id3v2_tag,&sb->id3v2_tag_size))) {
+    st_warning("encountered error [%s] while opening file: [%s]",strerror(errno),filename);
     return FALSE;
   }
 
-  fclose(file);
+  sb->size = (int)fread(sb->data,1,SNIFF_SIZE,sb->file);
+
+  match_magic(sb);
+
+  return TRUE;
+}
+
+void sniff_close(sniff_buffer *sb)
+{
+  if (sb->file) {
+    fclose(sb->file);
+    sb->file = NULL;
+  }
+}
+
+int sniff_read(sniff_buffer *sb,long offset,unsigned char *buf,int bytes)
+/* reads up to 'bytes' bytes at 'offset' past the end of any ID3v2 tag.  requests that fall within
+ * the sniff buffer are served from memory - the file is only touched when a format needs to look
+ * further into it than SNIFF_SIZE bytes.
+ */
+{
+  int from_buffer = 0;
+
+  if (offset < 0 || bytes <= 0)
+    return 0;
+
+  if (offset < sb->size) {
+    from_buffer = min(bytes,sb->size - (int)offset);
+    memcpy(buf,sb->data + offset,from_buffer);
+  }
+
+  /* a short sniff buffer means the file ended there */
+  if (from_buffer == bytes || sb->size < SNIFF_SIZE || NULL == sb->file)
+    return from_buffer;
+
+  offset += from_buffer;
+
+  st_debug2("reading %d bytes beyond the sniff buffer at offset %ld of file: [%s]",bytes - from_buffer,offset,sb->filename);
+
+  if (fseek(sb->file,(long)sb->id3v2_tag_size + offset,SEEK_SET))
+    return from_buffer;
+
+  return from_buffer + (int)fread(buf + from_buffer,1,bytes - from_buffer,sb->file);
+}
+
+bool check_for_magic(sniff_buffer *sb,char *magic,int offset)
+{
+  int magiclen;
+  unsigned char buf[BUF_SIZE];
+
+  if (NULL == magic || !strcmp(magic,""))
+    return FALSE;
+
+  if (offset < 0)
+    return FALSE;
+
+  magiclen = strlen(magic);
+
+  if (magiclen > BUF_SIZE || magiclen != sniff_read(sb,offset,buf,magiclen))
+    return FALSE;
 
   if (!tagcmp(buf,(unsigned char *)magic))
     return TRUE;
@@ -413,6 +557,18 @@ bool check_for_magic(char *filename,char *magic,int offset)
   return FALSE;
 }
 
+bool sniff_magic_matches(sniff_buffer *sb,format_module *fm)
+{
+  int i;
+
+  for (i=0;i<sb->num_magic_matches;i++) {
+    if (sb->magic_matches[i] == fm)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
 format_module *find_format(char *fmtname)
 {
   int i;
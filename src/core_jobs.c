@@ -0,0 +1,322 @@
+/*  core_jobs.c - processing several input files at once
+ *  Copyright (C) 2026  shdtool contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * With -j N, each input file is handed to a forked worker process, and up to
+ * N workers run at once, each with its own decoder and encoder children.  A
+ * worker's stdout and stderr go to temporary files, which are copied to the
+ * real stdout and stderr in input order once the worker is done - so output
+ * looks just like a sequential run, and progress lines never interleave.
+ * Modes that keep running totals pass each file's contribution back to the
+ * parent with job_send_result().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include "shdtool.h"
+
+/* worker exit codes - anything else means the worker died, or called st_error() */
+#define JOB_EXIT_SUCCESS 0
+#define JOB_EXIT_FAILURE 2
+
+/* how many finished jobs may wait for an earlier, slower one before no more are started */
+#define JOB_WINDOW_FACTOR 4
+
+typedef enum {
+  JOB_FREE,
+  JOB_RUNNING,
+  JOB_DONE
+} job_states;
+
+typedef struct _job {
+  int    state;
+  pid_t  pid;
+  int    status;
+  FILE  *out;        /* worker's stdout */
+  FILE  *err;        /* worker's stderr */
+  FILE  *results;    /* results sent with job_send_result() */
+} job;
+
+static void (*merge_func)(unsigned char *,int) = NULL;
+static FILE *job_results = NULL;
+static int jobs_at_once = 1;
+static long processors = 1;
+static pthread_once_t processors_counted = PTHREAD_ONCE_INIT;
+
+void job_send_result(unsigned char *data,int size)
+/* hands data describing the current file to the mode's merge function - directly when running
+ * sequentially, otherwise by way of the parent process, which merges results in input order
+ */
+{
+  if (NULL == job_results) {
+    if (merge_func)
+      merge_func(data,size);
+    return;
+  }
+
+  if (1 != fwrite(&size,sizeof(size),1,job_results) || (size > 0 && 1 != fwrite(data,size,1,job_results)))
+    st_error("could not save results for parent process");
+}
+
+static void copy_job_file(FILE *from,FILE *to)
+{
+  char buf[BUF_SIZE];
+  size_t bytes;
+
+  rewind(from);
+
+  while ((bytes = fread(buf,1,BUF_SIZE,from)) > 0)
+    fwrite(buf,1,bytes,to);
+
+  fflush(to);
+}
+
+static void merge_job_results(FILE *results)
+{
+  unsigned char *data;
+  int size;
+
+  rewind(results);
+
+  while (1 == fread(&size,sizeof(size),1,results)) {
+    if (size < 0 || NULL == (data = malloc(size + 1)))
+      st_error("could not allocate %d bytes for results from worker process",size);
+
+    if (size > 0 && 1 != fread(data,size,1,results))
+      st_error("could not read results from worker process");
+
+    if (merge_func)
+      merge_func(data,size);
+
+    st_free(data);
+  }
+}
+
+static void close_job(job *j)
+{
+  fclose(j->out);
+  fclose(j->err);
+  fclose(j->results);
+
+  j->state = JOB_FREE;
+}
+
+static void start_job(job *j,bool (*process_file)(char *),char *filename)
+{
+  bool success;
+
+  if (NULL == (j->out = tmpfile()) || NULL == (j->err = tmpfile()) || NULL == (j->results = tmpfile()))
+    st_error("could not create temporary files for worker process: [%s]",strerror(errno));
+
+  /* don't let the worker inherit (and later repeat) anything still sitting in our buffers */
+  fflush(stdout);
+  fflush(stderr);
+
+  switch ((j->pid = fork())) {
+    case -1:
+      st_error("error while forking worker process: [%s]",strerror(errno));
+      break;
+
+    case 0:
+      dup2(fileno(j->out),STDOUT_FILENO);
+      dup2(fileno(j->err),STDERR_FILENO);
+
+      job_results = j->results;
+
+      success = process_file(filename);
+
+      close_parked_input_stream();
+      probe_cache_close();
+
+      fflush(stdout);
+      fflush(stderr);
+      fflush(job_results);
+
+      _exit(success ? JOB_EXIT_SUCCESS : JOB_EXIT_FAILURE);
+      break;
+
+    default:
+      st_debug2("started worker process %d for file: [%s]",(int)j->pid,filename);
+      j->state = JOB_RUNNING;
+      break;
+  }
+}
+
+static bool wait_for_job(job *jobs,int num_jobs)
+/* waits for any running job to finish, returns FALSE if none are running */
+{
+  pid_t pid;
+  int i,status;
+
+  for (;;) {
+    if (-1 == (pid = wait(&status))) {
+      if (EINTR == errno)
+        continue;
+      return FALSE;
+    }
+
+    for (i=0;i<num_jobs;i++) {
+      if (JOB_RUNNING == jobs[i].state && pid == jobs[i].pid) {
+        jobs[i].state = JOB_DONE;
+        jobs[i].status = status;
+        return TRUE;
+      }
+    }
+  }
+}
+
+static bool run_parallel(bool (*process_file)(char *))
+{
+  job *jobs;
+  char *filename = NULL;
+  int num_jobs,running,next_start,next_report;
+  bool success = TRUE,fatal = FALSE,more_files = TRUE;
+
+  num_jobs = st_priv.jobs * JOB_WINDOW_FACTOR;
+
+  if (NULL == (jobs = calloc(num_jobs,sizeof(job))))
+    st_error("could not allocate memory for %d jobs",num_jobs);
+
+  /* workers can't ask questions, since none of them has the terminal to itself */
+  if (st_priv.mode->creates_files && CLOBBER_ACTION_ASK == st_priv.clobber_action) {
+    st_warning("cannot ask about overwriting files when running several jobs at once - existing files will be left alone (use -O to change this)");
+    st_priv.clobber_action = CLOBBER_ACTION_NEVER;
+  }
+
+  /* a stream left open by a pre-scan belongs to this process, not the workers */
+  close_parked_input_stream();
+
+  /* workers inherit this, so that they share the processors */
+  set_jobs_at_once(st_priv.jobs);
+
+  running = next_start = next_report = 0;
+
+  while (more_files || next_report != next_start) {
+    /* start as many jobs as we're allowed, as long as there are free slots */
+    while (more_files && !fatal && running < st_priv.jobs && JOB_FREE == jobs[next_start % num_jobs].state) {
+      if (NULL == (filename = input_get_filename())) {
+        more_files = FALSE;
+        break;
+      }
+
+      start_job(&jobs[next_start % num_jobs],process_file,filename);
+      next_start++;
+      running++;
+    }
+
+    if (fatal)
+      more_files = FALSE;
+
+    /* report finished jobs in the order they were started */
+    while (next_report != next_start && JOB_DONE == jobs[next_report % num_jobs].state) {
+      job *j = &jobs[next_report % num_jobs];
+
+      copy_job_file(j->out,stdout);
+      copy_job_file(j->err,stderr);
+
+      if (WIFEXITED(j->status) && JOB_EXIT_SUCCESS == WEXITSTATUS(j->status)) {
+        merge_job_results(j->results);
+      }
+      else if (WIFEXITED(j->status) && JOB_EXIT_FAILURE == WEXITSTATUS(j->status)) {
+        merge_job_results(j->results);
+        success = FALSE;
+      }
+      else {
+        /* a sequential run would have stopped here, so start nothing new, but let the others finish */
+        fatal = TRUE;
+        success = FALSE;
+        if (WIFSIGNALED(j->status))
+          st_warning("worker process %d was killed by signal %d",(int)j->pid,WTERMSIG(j->status));
+      }
+
+      close_job(j);
+      next_report++;
+    }
+
+    if (0 == running)
+      continue;
+
+    if (!wait_for_job(jobs,num_jobs))
+      st_error("lost track of worker processes: [%s]",strerror(errno));
+
+    running--;
+  }
+
+  st_free(jobs);
+
+  set_jobs_at_once(1);
+
+  if (fatal)
+    exit(ST_EXIT_ERROR);
+
+  return success;
+}
+
+int job_limit()
+/* returns the number of jobs that may run at once, as given with -j */
+{
+  return st_priv.jobs;
+}
+
+void set_jobs_at_once(int jobs)
+/* records how many jobs are actually running at once - input files handed to workers, or tracks that split mode
+ * encodes side by side - for job_threads() to share the processors among
+ */
+{
+  jobs_at_once = max(jobs,1);
+}
+
+static void count_processors()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  processors = max(sysconf(_SC_NPROCESSORS_ONLN),1);
+#endif
+}
+
+int job_threads(int max_threads)
+/* returns how many threads a job may use, up to max_threads: the processors, divided among the jobs running at
+ * once.  a mode that ends up handling files one at a time, despite -j, gets all of them.
+ */
+{
+  pthread_once(&processors_counted,count_processors);
+
+  return (int)min(max(processors / jobs_at_once,1),max_threads);
+}
+
+bool run_input_jobs(bool (*process_file)(char *),void (*merge_result)(unsigned char *,int))
+/* calls process_file() on every input file - one after the other, or up to st_priv.jobs at a time */
+{
+  char *filename;
+  bool success = TRUE;
+
+  merge_func = merge_result;
+
+  if (st_priv.jobs > 1)
+    return run_parallel(process_file);
+
+  while ((filename = input_get_filename())) {
+    success = (process_file(filename) && success);
+  }
+
+  return success;
+}
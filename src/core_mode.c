@@ -32,6 +32,13 @@ CVSID("$Id: core_mode.c,v 1.88 2009/03/30 05:55:33 jason Exp $")
 
 global_opts st_ops;
 
+/* input stream left open by new_wave_info(), waiting to be reused by open_input_stream() */
+static wave_info *parked_info = NULL;
+static FILE *parked_input = NULL;
+static proc_info parked_input_proc;
+static format_module *parked_input_format = NULL;
+static char parked_filename[FILENAME_SIZE];
+
 /* private functions */
 
 #define parse_input_args_cmd(a,b)   parse_args(a,b,FALSE,ARGSRC_CMDLINE)
@@ -594,10 +601,33 @@ FILE *open_input_stream_fmt(format_module *fmt,char *infile,proc_info *pinfo)
 }
 
 bool open_input_stream(wave_info *info)
-/* opens an input stream, and if it contains an ID3v2 tag, skips past it */
+/* opens an input stream, and if it contains an ID3v2 tag, skips past it.  the first few bytes
+ * of the stream are read here, so callers must read the WAVE header with read_header_bytes()
+ * or discard_header() rather than directly from info->input.
+ */
 {
   unsigned long bytes_to_read,tag_size;
   unsigned char tmp[BUF_SIZE];
+  wlong probed_data_size;
+
+  /* reuse the stream that was verified by new_wave_info(), if it is still waiting for us */
+  if (parked_input && info == parked_info && info->input_format == parked_input_format &&
+      !strcmp(info->filename,parked_filename) && info->header_cached == info->header_size)
+  {
+    st_debug1("reusing already-open input stream for file: [%s]",info->filename);
+
+    info->input = parked_input;
+    info->input_proc = parked_input_proc;
+    info->header_cache_pos = 0;
+
+    parked_input = NULL;
+    parked_info = NULL;
+
+    return TRUE;
+  }
+
+  info->header_cached = 0;
+  info->header_cache_pos = 0;
 
   if (info->file_has_id3v2_tag) {
     if (info->input_format->decoder)
@@ -611,8 +641,12 @@ bool open_input_stream(wave_info *info)
     return FALSE;
   }
 
-  /* check for ID3v2 tag on input stream */
-  if ((tag_size = check_for_id3v2_tag(info->input))) {
+  /* check for ID3v2 tag on input stream - the bytes read here are kept as the start of the WAVE header */
+  info->header_cached = fread(info->header_cache,1,sizeof(id3v2_header),info->input);
+
+  if (sizeof(id3v2_header) == info->header_cached && (tag_size = parse_id3v2_header(info->header_cache))) {
+    info->header_cached = 0;
+
     if (!info->stream_has_id3v2_tag) {
       if (info->input_format->decoder)
         st_debug1("discarding ID3v2 tag detected in input stream generated by decoder [%s] from file: [%s]",info->input_format->decoder,info->filename);
@@ -642,18 +676,88 @@ bool open_input_stream(wave_info *info)
       tag_size -= bytes_to_read;
     }
   }
-  else {
-    close_input_stream(info);
 
-    if (NULL == (info->input = open_input_stream_fmt(info->input_format,info->filename,&info->input_proc))) {
-      st_warning("could not reopen file for streaming input: [%s]",info->filename);
+  /* info read from the file's own header has not been checked against what the decoder sends yet */
+  if (info->header_probed) {
+    probed_data_size = info->data_size;
+
+    info->header_probed = FALSE;
+    info->problems = 0;
+
+    if (!verify_input_stream(info)) {
+      close_input_stream(info);
+      info->input = NULL;
       return FALSE;
     }
+
+    if (info->data_size != probed_data_size)
+      st_debug1("decoder sent %lu bytes of audio data instead of the %lu bytes described by the header of file: [%s]",
+        info->data_size,probed_data_size,info->filename);
+
+    /* the mode will read the header again, which requires all of it to be cached */
+    if (info->header_cached != info->header_size) {
+      st_debug1("WAVE header too large to cache, reopening input stream for file: [%s]",info->filename);
+      close_input_stream(info);
+      info->input = NULL;
+      return open_input_stream(info);
+    }
+
+    info->header_cache_pos = 0;
   }
 
   return TRUE;
 }
 
+void park_input_stream(wave_info *info)
+/* keeps a verified input stream open, so that the next open_input_stream() on the same file can reuse it */
+{
+  close_parked_input_stream();
+
+  if (NULL == info->input)
+    return;
+
+  /* the stream can only be reused if the whole header it consumed is cached */
+  if (info->header_cached != info->header_size || info->header_cache_pos != info->header_size) {
+    st_debug1("WAVE header too large to cache, closing input stream for file: [%s]",info->filename);
+    close_input_stream(info);
+    info->input = NULL;
+    return;
+  }
+
+  parked_info = info;
+  parked_input = info->input;
+  parked_input_proc = info->input_proc;
+  parked_input_format = info->input_format;
+  strcpy(parked_filename,info->filename);
+
+  info->input = NULL;
+}
+
+void close_parked_input_stream()
+/* closes the input stream kept open by park_input_stream(), if it was never reused */
+{
+  if (NULL == parked_input)
+    return;
+
+  close_and_wait(parked_input,&parked_input_proc,CHILD_INPUT,parked_input_format);
+
+  parked_input = NULL;
+  parked_info = NULL;
+}
+
+void close_stale_parked_input_stream(char *filename)
+/* closes the parked input stream if it belongs to a file other than the given one, which means the mode has
+ * moved on without reopening it
+ */
+{
+  if (NULL == parked_input || !strcmp(filename,parked_filename))
+    return;
+
+  st_debug1("closing unused input stream for file: [%s]",parked_filename);
+
+  close_parked_input_stream();
+}
+
 void remove_file(char *filename)
 {
   struct stat sz;
@@ -702,11 +806,31 @@ bool files_are_identical(char *file1,char *file2)
   return TRUE;
 }
 
+void check_null_pad(wave_info *info)
+/* reads the byte after an odd-sized data chunk from info->input, which must be positioned just past the data, and
+ * records whether it is a NULL pad byte.  modes that read all of the data anyway call this, so that
+ * odd_sized_data_chunk_is_null_padded() doesn't have to make a pass of its own.
+ */
+{
+  unsigned char nullpad = 1;
+
+  /* without extra RIFF chunks, the answer comes from the sizes alone */
+  if (!PROB_ODD_SIZED_DATA(info) || info->extra_riff_size <= 0 || NULL_PAD_UNKNOWN != info->null_pad)
+    return;
+
+  if (1 != read_n_bytes(info->input,&nullpad,1,NULL))
+    nullpad = 1;
+
+  info->null_pad = (0 == nullpad) ? NULL_PAD_PRESENT : NULL_PAD_ABSENT;
+
+  st_debug1("odd-sized data chunk is%s padded with a NULL byte in file: [%s]",(0==nullpad)?"":" not",info->filename);
+}
+
 bool odd_sized_data_chunk_is_null_padded(wave_info *info)
 /* function to determine whether odd-sized data chunks are NULL-padded to an even length */
 {
-  FILE *devnull;
-  unsigned char nullpad[BUF_SIZE];
+  unsigned char buf[BUF_SIZE];
+  int bytes_to_discard,bytes;
 
   if (!PROB_ODD_SIZED_DATA(info))
     return TRUE;
@@ -718,42 +842,31 @@ bool odd_sized_data_chunk_is_null_padded(wave_info *info)
   if (0 == info->extra_riff_size)
     return TRUE;
 
-  /* it's odd-sized, and has extra RIFF chunks, so we'll have to make a pass through it to know for sure.
-   * most modes don't need to do this, but ones that update chunk sizes on existing files need to know whether
-   * it's padded in order to calculate the correct chunk size (currently this includes pad and strip modes).
+  /* it's odd-sized, and has extra RIFF chunks, so the byte after the data has to be looked at - unless a pass
+   * through the data already did.  getting there is a seek for WAVE files and for in-process decoders that can
+   * seek; only other decoders have to send all of the data again.
    */
+  if (NULL_PAD_UNKNOWN == info->null_pad) {
+    if (!open_input_stream(info))
+      return FALSE;
 
-  if (NULL == (devnull = open_output(NULLDEVICE))) {
-    return FALSE;
-  }
-
-  if (!open_input_stream(info)) {
-    fclose(devnull);
-    return FALSE;
-  }
-
-  st_debug1("scanning WAVE contents to determine whether odd-sized data chunk is padded with a NULL byte per RIFF specs");
+    st_debug1("skipping WAVE data to determine whether odd-sized data chunk is padded with a NULL byte per RIFF specs");
 
-  if (info->header_size + info->data_size != transfer_n_bytes(info->input,devnull,info->header_size + info->data_size,NULL)) {
-    fclose(devnull);
-    close_input_stream(info);
-    return FALSE;
-  }
+    for (bytes_to_discard=info->header_size;bytes_to_discard>0;bytes_to_discard-=bytes) {
+      bytes = min(bytes_to_discard,BUF_SIZE);
+      if (bytes != read_header_bytes(info,buf,bytes)) {
+        close_input_stream(info);
+        return FALSE;
+      }
+    }
 
-  nullpad[0] = 1;
+    if (info->data_size == skip_n_bytes(info->input,info->data_size,NULL))
+      check_null_pad(info);
 
-  if (0 == read_n_bytes(info->input,nullpad,1,NULL)) {
-    fclose(devnull);
     close_input_stream(info);
-    return FALSE;
   }
 
-  fclose(devnull);
-  close_input_stream(info);
-
-  st_debug1("odd-sized data chunk is%s padded with a NULL byte in file: [%s]",(0==nullpad[0])?"":" not",info->filename);
-
-  return (0 == nullpad[0]) ? TRUE : FALSE;
+  return (NULL_PAD_PRESENT == info->null_pad) ? TRUE : FALSE;
 }
 
 void st_snprintf(char *dest,int maxlen,char *formatstr, ...)
@@ -866,7 +979,8 @@ int close_and_wait(FILE *fd,proc_info *pinfo,int child_type,format_module *fm)
      * la   :  'la' decodes entire file no matter what, every time the input file is opened (see above).
      * aiff :  'sox' takes progressively longer as the input file becomes larger.
      * bonk :  'bonk' decodes entire file no matter what, every time the input file is opened (see above).
-     * tta  :  'ttaenc' decodes entire file no matter what, every time the input file is opened (see above).
+     * tta  :  'ttaenc' decodes entire file no matter what, every time the input file is opened (see above).  only
+     *         applies when it is named as the decoder, since files are otherwise decoded in-process.
      */
 
     if (fm) {
@@ -1181,6 +1295,9 @@ int st_getopt(int argc,char **argv,char *mode_opts)
 
   /* handle global options before mode options */
   switch (opt) {
+    case 'C':
+      st_priv.use_probe_cache = TRUE;
+      break;
     case 'D':
       st_priv.debug_level++;
       break;
@@ -1227,6 +1344,12 @@ int st_getopt(int argc,char **argv,char *mode_opts)
         st_help("format does not support input: [%s]",input_format->name);
       parse_input_args_cmd(input_format,optarg);
       break;
+    case 'j':
+      if (NULL == optarg)
+        st_help("missing number of jobs");
+      if ((st_priv.jobs = is_numeric((unsigned char *)optarg)) < 1)
+        st_help("number of jobs must be a positive integer: [%s]",optarg);
+      break;
     case 'q':
       st_priv.suppress_stderr = TRUE;
       break;
@@ -1304,7 +1427,7 @@ void discard_header(wave_info *info)
   if (NULL == (header = malloc(info->header_size * sizeof(unsigned char))))
     st_error("could not allocate %d bytes for WAVE header",info->header_size);
 
-  if (read_n_bytes(info->input,header,info->header_size,NULL) != info->header_size)
+  if (read_header_bytes(info,header,info->header_size) != info->header_size)
     st_error("error while discarding %d-byte header from file: [%s]",info->header_size,info->filename);
 
   st_free(header);
@@ -1345,6 +1468,7 @@ void st_global_usage()
 {
   st_info("Global options:\n");
   st_info("\n");
+  st_info("  -C      cache file information between runs (location: $%s or ~/.cache/shdtool/probe.db)\n",PROBE_CACHE_ENV);
   st_info("  -D      print debugging information (each one increases debugging level)\n");
   st_info("  -F file get input filenames from file, instead of command line or terminal\n");
   st_info("  -H      print times in h:mm:ss.{ff,nnn} format, instead of m:ss.{ff,nnn}\n");
@@ -1358,6 +1482,7 @@ void st_global_usage()
   }
   st_info("  -i fmt  specify input file format decoder and/or arguments.\n");
   st_info("          format is:  \"fmt decoder [arg1 ... argN (%s = filename)]\"\n",FILENAME_PLACEHOLDER);
+  st_info("  -j num  process up to num files (or split tracks) at once, where possible\n");
   if (st_priv.mode->creates_files) {
     st_info("  -o fmt  specify output file format, extension, encoder and/or arguments.\n");
     st_info("          format is:  \"fmt [ext=abc] [encoder [arg1 ... argN (%s = filename)]]\"\n",FILENAME_PLACEHOLDER);
@@ -336,6 +336,8 @@ static void globals_init(char *program)
   st_priv.suppress_warnings = FALSE;
   st_priv.suppress_stderr = FALSE;
   st_priv.screen_dirty = FALSE;
+  st_priv.use_probe_cache = FALSE;
+  st_priv.jobs = 1;
 
   st_input.type = INPUT_CMDLINE;
   st_input.filename_source = NULLDEVICE;
@@ -365,5 +367,10 @@ int main(int argc,char **argv)
   /* parse command line */
   success = parse_main(argc,argv);
 
+  /* close any input stream that was verified but never reused */
+  close_parked_input_stream();
+
+  probe_cache_close();
+
   return (success) ? ST_EXIT_SUCCESS : ST_EXIT_ERROR;
 }
@@ -24,13 +24,10 @@
 
 CVSID("$Id: core_wave.c,v 1.112 2009/03/11 17:18:01 jason Exp $")
 
-bool is_valid_file(wave_info *info)
+bool is_valid_file(wave_info *info,struct stat *sz)
 /* determines whether the given filename (info->filename) is a regular file, and is readable */
 {
-  struct stat sz;
-  FILE *f;
-
-  if (stat(info->filename,&sz)) {
+  if (stat(info->filename,sz)) {
     if (errno == ENOENT)
       st_warning("cannot open non-existent file: [%s]",info->filename);
     else if (errno == EACCES)
@@ -45,34 +42,27 @@ bool is_valid_file(wave_info *info)
       st_warning("encountered system error [%s] while opening file: [%s]",strerror(errno),info->filename);
     return FALSE;
   }
-  if (!S_ISREG(sz.st_mode)) {
-    if (S_ISDIR(sz.st_mode))
+  if (!S_ISREG(sz->st_mode)) {
+    if (S_ISDIR(sz->st_mode))
       st_warning("cannot open directory: [%s]",info->filename);
-    else if (S_ISCHR(sz.st_mode))
+    else if (S_ISCHR(sz->st_mode))
       st_warning("cannot open character device: [%s]",info->filename);
-    else if (S_ISBLK(sz.st_mode))
+    else if (S_ISBLK(sz->st_mode))
       st_warning("cannot open block device: [%s]",info->filename);
-    else if (S_ISFIFO(sz.st_mode))
+    else if (S_ISFIFO(sz->st_mode))
       st_warning("cannot open named pipe: [%s]",info->filename);
 #ifndef WIN32
 #ifdef S_ISSOCK
-    else if (S_ISSOCK(sz.st_mode))
+    else if (S_ISSOCK(sz->st_mode))
       st_warning("cannot open socket: [%s]",info->filename);
 #endif
-    else if (S_ISLNK(sz.st_mode))
+    else if (S_ISLNK(sz->st_mode))
       st_warning("cannot open symbolic link: [%s]",info->filename);
 #endif
     return FALSE;
   }
 
-  info->actual_size = (wlong)sz.st_size;
-
-  if (NULL == (f = fopen(info->filename,"rb"))) {
-    st_warning("encountered error [%s] while opening file: [%s]",strerror(errno),info->filename);
-    return FALSE;
-  }
-
-  fclose(f);
+  info->actual_size = (wlong)sz->st_size;
 
   return TRUE;
 }
@@ -92,16 +82,93 @@ bool do_header_kluges(unsigned char *header,wave_info *info)
   return retval;
 }
 
+int read_header_bytes(wave_info *info,unsigned char *buf,int num)
+/* reads num header bytes, handing out any bytes already cached in info->header_cache before reading
+ * from info->input.  bytes read from the stream are appended to the cache while it still lines up
+ * with the beginning of the header, so that a verified stream can later be handed to a mode as-is.
+ */
+{
+  int cached,read;
+
+  cached = 0;
+
+  if (info->header_cache_pos < info->header_cached) {
+    cached = min(num,(int)(info->header_cached - info->header_cache_pos));
+    memcpy(buf,info->header_cache + info->header_cache_pos,cached);
+    info->header_cache_pos += cached;
+  }
+
+  if (cached == num || NULL == info->input)
+    return cached;
+
+  read = fread(buf + cached,1,num - cached,info->input);
+
+  if (info->header_cache_pos == info->header_cached && info->header_cached + read <= HEADER_CACHE_SIZE) {
+    memcpy(info->header_cache + info->header_cached,buf + cached,read);
+    info->header_cached += read;
+  }
+
+  info->header_cache_pos += read;
+
+  return cached + read;
+}
+
+static bool read_header_tag(wave_info *info,unsigned char *tag)
+{
+  return (4 == read_header_bytes(info,tag,4));
+}
+
+static bool read_header_le_long(wave_info *info,unsigned long *le_val)
+{
+  unsigned char buf[4];
+
+  if (4 != read_header_bytes(info,buf,4))
+    return FALSE;
+
+  *le_val = uchar_to_ulong_le(buf);
+
+  return TRUE;
+}
+
+static bool read_header_le_short(wave_info *info,unsigned short *le_val)
+{
+  unsigned char buf[2];
+
+  if (2 != read_header_bytes(info,buf,2))
+    return FALSE;
+
+  *le_val = uchar_to_ushort_le(buf);
+
+  return TRUE;
+}
+
+static bool skip_header_bytes(wave_info *info,unsigned long bytes)
+/* skips over a chunk in the header a block at a time - decoder pipes may be unbuffered (see spawn()), where every
+ * read is a system call
+ */
+{
+  unsigned char buf[BUF_SIZE];
+  int chunk;
+
+  while (bytes > 0) {
+    chunk = (int)min(bytes,BUF_SIZE);
+    if (read_header_bytes(info,buf,chunk) != chunk)
+      return FALSE;
+    bytes -= chunk;
+  }
+
+  return TRUE;
+}
+
 bool verify_wav_header_internal(wave_info *info,bool verbose)
 /* verifies that data coming in on the file descriptor info->input describes a valid WAVE header */
 {
-  unsigned long le_long=0,bytes;
-  unsigned char buf[2];
+  unsigned long le_long=0;
   unsigned char tag[4];
   int header_len = 0;
 
   /* look for "RIFF" in header */
-  if (!read_tag(info->input,tag) || tagcmp(tag,(unsigned char *)WAVE_RIFF)) {
+  if (!read_header_tag(info,tag) || tagcmp(tag,(unsigned char *)WAVE_RIFF)) {
     if (verbose) {
       if (!tagcmp(tag,(unsigned char *)AIFF_FORM)) {
         st_warning("encountered unsupported AIFF data while processing file: [%s]",info->filename);
@@ -114,13 +181,13 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
     return FALSE;
   }
 
-  if (!read_le_long(info->input,&info->chunk_size)) {
+  if (!read_header_le_long(info,&info->chunk_size)) {
     st_warning("could not read chunk size from WAVE header while processing file: [%s]",info->filename);
     return FALSE;
   }
 
   /* look for "WAVE" in header */
-  if (!read_tag(info->input,tag) || tagcmp(tag,(unsigned char *)WAVE_WAVE)) {
+  if (!read_header_tag(info,tag) || tagcmp(tag,(unsigned char *)WAVE_WAVE)) {
     st_warning("WAVE header is missing WAVE tag while processing file: [%s]",info->filename);
     return FALSE;
   }
@@ -130,7 +197,7 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
   st_debug1("showing RIFF chunks in file: [%s]",info->filename);
 
   for (;;) {
-    if (!read_tag(info->input,tag) || !read_le_long(info->input,&le_long)) {
+    if (!read_header_tag(info,tag) || !read_header_le_long(info,&le_long)) {
       st_warning("reached end of file while looking for fmt tag while processing file: [%s]",info->filename);
       return FALSE;
     }
@@ -142,14 +209,9 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
     if (!tagcmp(tag,(unsigned char *)WAVE_FMT))
       break;
 
-    bytes = le_long;
-
-    while (bytes > 0) {
-      if (fread(buf,1,1,info->input) != 1) {
-        st_warning("reached end of file when jumping ahead %lu bytes during search for fmt tag while processing file: [%s]",info->filename,le_long);
-        return FALSE;
-      }
-      bytes--;
+    if (!skip_header_bytes(info,le_long)) {
+      st_warning("reached end of file when jumping ahead %lu bytes during search for fmt tag while processing file: [%s]",le_long,info->filename);
+      return FALSE;
     }
 
     header_len += le_long;
@@ -161,7 +223,7 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
   }
 
   /* now we read the juicy stuff */
-  if (!read_le_short(info->input,&info->wave_format)) {
+  if (!read_header_le_short(info,&info->wave_format)) {
     st_warning("reached end of file while reading format while processing file: [%s]",info->filename);
     return FALSE;
   }
@@ -175,27 +237,27 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
       return FALSE;
   }
 
-  if (!read_le_short(info->input,&info->channels)) {
+  if (!read_header_le_short(info,&info->channels)) {
     st_warning("reached end of file reading channels while processing file: [%s]",info->filename);
     return FALSE;
   }
 
-  if (!read_le_long(info->input,&info->samples_per_sec)) {
+  if (!read_header_le_long(info,&info->samples_per_sec)) {
     st_warning("reached end of file reading samples/sec while processing file: [%s]",info->filename);
     return FALSE;
   }
 
-  if (!read_le_long(info->input,&info->avg_bytes_per_sec)) {
+  if (!read_header_le_long(info,&info->avg_bytes_per_sec)) {
     st_warning("reached end of file reading average bytes/sec while processing file: [%s]",info->filename);
     return FALSE;
   }
 
-  if (!read_le_short(info->input,&info->block_align)) {
+  if (!read_header_le_short(info,&info->block_align)) {
     st_warning("reached end of file reading block align while processing file: [%s]",info->filename);
     return FALSE;
   }
 
-  if (!read_le_short(info->input,&info->bits_per_sample)) {
+  if (!read_header_le_short(info,&info->bits_per_sample)) {
     st_warning("reached end of file reading bits/sample while processing file: [%s]",info->filename);
     return FALSE;
   }
@@ -205,13 +267,9 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
   le_long -= 16;
 
   if (le_long) {
-    bytes = le_long;
-    while (bytes > 0) {
-      if (fread(buf,1,1,info->input) != 1) {
-        st_warning("reached end of file jumping ahead %lu bytes while processing file: [%s]",le_long,info->filename);
-        return FALSE;
-      }
-      bytes--;
+    if (!skip_header_bytes(info,le_long)) {
+      st_warning("reached end of file jumping ahead %lu bytes while processing file: [%s]",le_long,info->filename);
+      return FALSE;
     }
     header_len += le_long;
   }
@@ -219,7 +277,7 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
   /* now let's look for the data chunk.  Following the string "data" is the
      length of the following WAVE data. */
   for (;;) {
-    if (!read_tag(info->input,tag) || !read_le_long(info->input,&le_long)) {
+    if (!read_header_tag(info,tag) || !read_header_le_long(info,&le_long)) {
       st_warning("reached end of file looking for data tag while processing file: [%s]",info->filename);
       return FALSE;
     }
@@ -231,14 +289,9 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
     if (!tagcmp(tag,(unsigned char *)WAVE_DATA))
       break;
 
-    bytes = le_long;
-
-    while (bytes > 0) {
-      if (fread(buf,1,1,info->input) != 1) {
-        st_warning("reached end of file jumping ahead %lu bytes when looking for data tag while processing file: [%s]",le_long,info->filename);
-        return FALSE;
-      }
-      bytes--;
+    if (!skip_header_bytes(info,le_long)) {
+      st_warning("reached end of file jumping ahead %lu bytes when looking for data tag while processing file: [%s]",le_long,info->filename);
+      return FALSE;
     }
 
     header_len += le_long;
@@ -309,6 +362,112 @@ bool verify_wav_header_internal(wave_info *info,bool verbose)
   return TRUE;
 }
 
+bool verify_input_stream(wave_info *info)
+/* makes sure that a freshly opened input stream is sending data, and that the data begins with a valid
+ * WAVE header.  the header bytes stay cached, so the header can be read again with read_header_bytes().
+ */
+{
+  unsigned char buf[1];
+  char msg[BUF_SIZE],tmp[BUF_SIZE];
+
+  /* make sure we can read data from the output format (primarily to ensure the decoder is sending us data) */
+  if (1 != read_header_bytes(info,buf,1)) {
+    st_snprintf(msg,BUF_SIZE,"failed to read data from input file using format: [%s]\n",info->input_format->name);
+
+    st_snprintf(tmp,BUF_SIZE,"+ you may not have permission to read file: [%s]\n",info->filename);
+    strcat(msg,tmp);
+
+    if (info->input_format->decoder) {
+      st_snprintf(tmp,BUF_SIZE,"+ arguments may be incorrect for decoder: [%s]\n",info->input_format->decoder);
+      strcat(msg,tmp);
+
+      strcat(msg,"+ verify that the decoder is installed and in your PATH\n");
+
+      if (info->file_has_id3v2_tag) {
+        strcat(msg,"+ removing the ID3v2 tag from this file may fix this\n");
+      }
+    }
+
+    strcat(msg,"+ this file may be unsupported, truncated or corrupt");
+
+    st_warning(msg);
+
+    return FALSE;
+  }
+
+  /* the byte read above is still cached, so rewind to the beginning of the header */
+  info->header_cache_pos = 0;
+
+  /* finally, make sure a proper WAVE header is being sent on the same stream */
+  return verify_wav_header(info);
+}
+
+bool probe_wav_header(wave_info *info,unsigned char *header,int header_len)
+/* fills out info from a copy of the WAVE header that the decoder will send, taken from the input file itself */
+{
+  bool verified,suppress_warnings;
+
+  if (header_len <= 0 || header_len > HEADER_CACHE_SIZE || info->input)
+    return FALSE;
+
+  memcpy(info->header_cache,header,header_len);
+  info->header_cached = header_len;
+  info->header_cache_pos = 0;
+  info->problems = 0;
+
+  /* any complaints about this header will be repeated when falling back to the decoder, so keep quiet here */
+  suppress_warnings = st_priv.suppress_warnings;
+  st_priv.suppress_warnings = TRUE;
+
+  verified = verify_wav_header(info);
+
+  st_priv.suppress_warnings = suppress_warnings;
+
+  /* nothing was read from a stream, so there is nothing for open_input_stream() to reuse */
+  info->header_cached = 0;
+  info->header_cache_pos = 0;
+
+  if (!verified)
+    return FALSE;
+
+  info->header_probed = TRUE;
+
+  return TRUE;
+}
+
+bool probe_canonical_header(wave_info *info,wshort channels,wshort bits_per_sample,wlong samples_per_sec,wlong samples)
+/* fills out info as if the decoder had sent a canonical WAVE header for audio with the given properties */
+{
+  unsigned char header[CANONICAL_HEADER_SIZE];
+  wlong bytes_per_sample,data_size;
+
+  if (0 == channels || 0 == bits_per_sample || 0 == samples_per_sec || 0 == samples)
+    return FALSE;
+
+  bytes_per_sample = ((wlong)bits_per_sample + 7) / 8;
+
+  /* the data size must fit in the 32-bit size fields of the header, pad byte and all */
+  if (samples > (0xffffffffUL - CANONICAL_HEADER_SIZE) / channels / bytes_per_sample)
+    return FALSE;
+
+  data_size = samples * channels * bytes_per_sample;
+
+  info->wave_format = WAVE_FORMAT_PCM;
+  info->channels = channels;
+  info->bits_per_sample = bits_per_sample;
+  info->samples_per_sec = samples_per_sec;
+  info->block_align = (wshort)(channels * bytes_per_sample);
+  info->avg_bytes_per_sec = samples_per_sec * info->block_align;
+  info->data_size = data_size;
+  info->chunk_size = data_size + CANONICAL_HEADER_SIZE - 8;
+  if (PROB_ODD_SIZED_DATA(info))
+    info->chunk_size++;
+
+  make_canonical_header(header,info);
+
+  return probe_wav_header(info,header,CANONICAL_HEADER_SIZE);
+}
+
 wave_info *new_wave_info(char *filename)
 /* if filename is NULL, return a fresh wave_info struct with all data zero'd out.
  * Otherwise, check that the file referenced by filename exists, is readable, and
@@ -317,10 +476,12 @@ wave_info *new_wave_info(char *filename)
  */
 {
   int i,bytes;
-  FILE *f;
   wave_info *info;
+  sniff_buffer sniff;
+  struct stat sz;
   unsigned char buf[8];
-  char msg[BUF_SIZE],tmp[BUF_SIZE];
+
+  sniff.file = NULL;
 
   if (NULL == (info = malloc(sizeof(wave_info)))) {
     st_warning("could not allocate memory for WAVE info struct");
@@ -335,9 +496,25 @@ wave_info *new_wave_info(char *filename)
 
   info->filename = filename;
 
-  if (!is_valid_file(info))
+  /* a stream parked for an earlier file would otherwise stay open (along with its decoder) until a later file
+   * is decoded, which may never happen
+   */
+  close_stale_parked_input_stream(filename);
+
+  if (!is_valid_file(info,&sz))
+    goto invalid_wave_data;
+
+  /* an unchanged file that was probed on an earlier run needs neither sniffing nor decoding */
+  if (st_priv.use_probe_cache && probe_cache_lookup(info,&sz))
+    return info;
+
+  /* read the beginning of the file once, and let every format module look at that */
+  if (!sniff_open(&sniff,info->filename))
     goto invalid_wave_data;
 
+  info->file_has_id3v2_tag = sniff.file_has_id3v2_tag;
+  info->id3v2_tag_size = sniff.id3v2_tag_size;
+
   /* check which format module (if any) handles this file */
   for (i=0;st_formats[i];i++) {
     if (!st_formats[i]->supports_input)
@@ -345,70 +522,54 @@ wave_info *new_wave_info(char *filename)
 
     if (st_formats[i]->is_our_file) {
       /* format defines its own checking function - use it */
-      if (!st_formats[i]->is_our_file(info->filename))
+      if (!st_formats[i]->is_our_file(&sniff))
         continue;
     }
     else {
       /* otherwise, check for format-defined magic string at a predefined offset (if defined) */
-      if (!check_for_magic(info->filename,st_formats[i]->magic,st_formats[i]->magic_offset))
+      if (!sniff_magic_matches(&sniff,st_formats[i]))
         continue;
     }
 
     /* found a format that claims to handle this file */
     info->input_format = st_formats[i];
 
-    /* check if file contains an ID3v2 tag, and set flag accordingly */
-    if (NULL == (f = open_input_internal(info->filename,&info->file_has_id3v2_tag,&info->id3v2_tag_size))) {
-      st_warning("open failed while setting ID3v2 flag for file: [%s]",info->filename);
-      goto invalid_wave_data;
-    }
-
-    fclose(f);
-
-    /* make sure the file can be opened by the output format - this skips over any ID3v2 tags in the stream */
-    if (!open_input_stream(info)) {
-      st_debug1("input file could not be opened for streaming input by format: [%s]",st_formats[i]->name);
-      goto invalid_wave_data;
-    }
-
-    /* make sure we can read data from the output format (primarily to ensure the decoder is sending us data) */
-    if (1 != fread(&buf,1,1,info->input)) {
-      st_snprintf(msg,BUF_SIZE,"failed to read data from input file using format: [%s]\n",info->input_format->name);
+    /* formats that describe the audio in their own header don't need a decoder until a mode reads PCM data */
+    if (st_formats[i]->probe_func) {
+      if (st_formats[i]->probe_func(&sniff,info)) {
+        st_debug1("read WAVE info from [%s] header without decoding file: [%s]",st_formats[i]->name,info->filename);
 
-      st_snprintf(tmp,BUF_SIZE,"+ you may not have permission to read file: [%s]\n",info->filename);
-      strcat(msg,tmp);
+        sniff_close(&sniff);
 
-      if (info->input_format->decoder) {
-        st_snprintf(tmp,BUF_SIZE,"+ arguments may be incorrect for decoder: [%s]\n",info->input_format->decoder);
-        strcat(msg,tmp);
+        if (st_priv.use_probe_cache)
+          probe_cache_store(info,&sz);
 
-        strcat(msg,"+ verify that the decoder is installed and in your PATH\n");
-
-        if (info->file_has_id3v2_tag) {
-          strcat(msg,"+ removing the ID3v2 tag from this file may fix this\n");
-        }
+        return info;
       }
 
-      strcat(msg,"+ this file may be unsupported, truncated or corrupt");
-
-      st_warning(msg);
+      st_debug1("could not read WAVE info from [%s] header, decoding file instead: [%s]",st_formats[i]->name,info->filename);
 
-      goto invalid_wave_data;
+      info->header_probed = FALSE;
+      info->problems = 0;
     }
 
-    close_input_stream(info);
-    info->input = NULL;
+    sniff_close(&sniff);
 
-    /* reopen as input stream - this skips over any ID3v2 tags in the stream */
-    if (!open_input_stream(info))
+    /* open the input stream - this skips over any ID3v2 tags in the stream */
+    if (!open_input_stream(info)) {
+      st_debug1("input file could not be opened for streaming input by format: [%s]",st_formats[i]->name);
       goto invalid_wave_data;
+    }
 
-    /* finally, make sure a proper WAVE header is being sent */
-    if (!verify_wav_header(info))
+    /* make sure a proper WAVE header is being sent on the input stream */
+    if (!verify_input_stream(info))
       goto invalid_wave_data;
 
-    close_input_stream(info);
-    info->input = NULL;
+    if (st_priv.use_probe_cache)
+      probe_cache_store(info,&sz);
+
+    /* keep the stream open, positioned just past the header, for the mode's first pass */
+    park_input_stream(info);
 
     /* success */
     return info;
@@ -418,25 +579,23 @@ wave_info *new_wave_info(char *filename)
 
   st_warning("none of the builtin format modules handle input file: [%s]",info->filename);
 
-  if ((f = open_input_internal(info->filename,&info->file_has_id3v2_tag,&info->id3v2_tag_size))) {
-    bytes = read_n_bytes(f,buf,4,NULL);
-    buf[bytes] = 0;
-
-    for (i=0;i<bytes;i++) {
-      if (!isprint((unsigned char)buf[i]))
-        buf[i] = '?';
-    }
-
-    if (info->file_has_id3v2_tag)
-      st_debug1("after skipping %d-byte ID3v2 tag, found %d-byte magic header 0x%08X [%s] in file: [%s]",info->id3v2_tag_size,i,uchar_to_ulong_be(buf),buf,info->filename);
-    else
-      st_debug1("found %d-byte magic header 0x%08X [%s] in file: [%s]",i,uchar_to_ulong_be(buf),buf,info->filename);
+  bytes = sniff_read(&sniff,0,buf,4);
+  buf[bytes] = 0;
 
-    fclose(f);
+  for (i=0;i<bytes;i++) {
+    if (!isprint((unsigned char)buf[i]))
+      buf[i] = '?';
   }
 
+  if (info->file_has_id3v2_tag)
+    st_debug1("after skipping %d-byte ID3v2 tag, found %d-byte magic header 0x%08X [%s] in file: [%s]",info->id3v2_tag_size,i,uchar_to_ulong_be(buf),buf,info->filename);
+  else
+    st_debug1("found %d-byte magic header 0x%08X [%s] in file: [%s]",i,uchar_to_ulong_be(buf),buf,info->filename);
+
 invalid_wave_data:
 
+  sniff_close(&sniff);
+
   if (info) {
     if (info->input) {
       close_input_stream(info);
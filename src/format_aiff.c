@@ -16,17 +16,25 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <string.h>
 #include "format.h"
+#include "convert.h"
+#include "codec.h"
 
 CVSID("$Id: format_aiff.c,v 1.80 2009/03/11 17:18:01 jason Exp $")
 
 #define SOX "sox"
 
+static char default_decoder[] = SOX;
 static char default_decoder_args[] = "-t aiff " FILENAME_PLACEHOLDER " -t wav -";
+static char default_encoder[] = SOX;
 static char default_encoder_args[] = "-t wav - -t aiff " FILENAME_PLACEHOLDER;
 
-static bool is_our_file(char *);
+static bool is_our_file(sniff_buffer *);
+static FILE *open_for_input(char *,proc_info *);
+static FILE *open_for_output(char *,proc_info *);
 static bool input_header_kluge(unsigned char *,wave_info *);
+static bool probe_header(sniff_buffer *,wave_info *);
 
 format_module format_aiff = {
   "aiff",
@@ -42,45 +50,113 @@ format_module format_aiff = {
   NULL,
   0,
   "aiff",
-  SOX,
+  default_decoder,
   default_decoder_args,
-  SOX,
+  default_encoder,
   default_encoder_args,
   is_our_file,
+  open_for_input,
+  open_for_output,
   NULL,
   NULL,
-  NULL,
-  NULL,
-  input_header_kluge
+  input_header_kluge,
+  probe_header
 };
 
-static bool parse_aiff_header(char *filename,unsigned long *samples,unsigned short *channels,unsigned short *bits_per_sample)
-/* generic function to parse an AIFF header and store certain values contained therein */
+static bool native_decoding()
+/* files are read in-process, unless a decoder was named with -i or in the environment */
 {
-  FILE *f;
-  unsigned long be_long = 0;
-  unsigned short be_short = 0;
-  unsigned char tag[4];
-  bool is_compressed = FALSE;
+  return (format_aiff.decoder == default_decoder);
+}
+
+static bool native_encoding()
+/* files are written in-process, unless an encoder was named with -o or in the environment */
+{
+  return (format_aiff.encoder == default_encoder);
+}
+
+static bool sniff_be_long(sniff_buffer *sb,long *pos,unsigned long *be_long)
+{
+  unsigned char buf[4];
+
+  if (4 != sniff_read(sb,*pos,buf,4))
+    return FALSE;
+
+  *pos += 4;
+
+  if (be_long)
+    *be_long = uchar_to_ulong_be(buf);
+
+  return TRUE;
+}
+
+static bool sniff_be_short(sniff_buffer *sb,long *pos,unsigned short *be_short)
+{
+  unsigned char buf[2];
+
+  if (2 != sniff_read(sb,*pos,buf,2))
+    return FALSE;
+
+  *pos += 2;
 
-  *samples = 0;
-  *channels = 0;
-  *bits_per_sample = 0;
+  if (be_short)
+    *be_short = uchar_to_ushort_be(buf);
 
-  if (NULL == (f = open_input(filename)))
+  return TRUE;
+}
+
+static bool sniff_tag(sniff_buffer *sb,long *pos,unsigned char *tag)
+{
+  if (4 != sniff_read(sb,*pos,tag,4))
     return FALSE;
 
+  *pos += 4;
+
+  return TRUE;
+}
+
+static wlong extended_to_rate(unsigned char *p)
+/* converts an 80-bit IEEE 754 extended precision sample rate to the nearest whole number, or 0 if out of range */
+{
+  unsigned long mantissa;
+  int exponent,shift;
+
+  exponent = ((p[0] & 0x7f) << 8) | p[1];
+  mantissa = uchar_to_ulong_be(p + 2);
+
+  /* only the top 32 bits of the mantissa matter for any rate that fits in 32 bits */
+  shift = 16383 + 31 - exponent;
+
+  if ((p[0] & 0x80) || shift < 0 || shift > 31)
+    return 0;
+
+  if (0 == shift)
+    return mantissa;
+
+  return (mantissa >> shift) + ((mantissa >> (shift - 1)) & 1);
+}
+
+static bool parse_aiff_header(sniff_buffer *sb,aiff_header *ah)
+/* generic function to parse an AIFF header and store certain values contained therein */
+{
+  unsigned long be_long = 0,ssnd_offset = 0;
+  unsigned char tag[4],rate[10];
+  bool is_compressed = FALSE;
+  long pos = 0,comm;
+
+  memset(ah,0,sizeof(aiff_header));
+
   /* look for FORM header */
-  if (!read_tag(f,tag) || tagcmp(tag,(unsigned char *)AIFF_FORM))
-    goto invalid_aiff_header;
+  if (!sniff_tag(sb,&pos,tag) || tagcmp(tag,(unsigned char *)AIFF_FORM))
+    return FALSE;
 
   /* skip FORM chunk size, read in FORM type */
-  if (!read_be_long(f,&be_long) || !read_tag(f,tag))
-    goto invalid_aiff_header;
+  if (!sniff_be_long(sb,&pos,&be_long) || !sniff_tag(sb,&pos,tag))
+    return FALSE;
 
   /* if FORM type is not AIFF or AIFC, bail out */
   if (tagcmp(tag,(unsigned char *)AIFF_FORM_TYPE_AIFF) && tagcmp(tag,(unsigned char *)AIFF_FORM_TYPE_AIFC))
-    goto invalid_aiff_header;
+    return FALSE;
 
   if (!tagcmp(tag,(unsigned char *)AIFF_FORM_TYPE_AIFC))
     is_compressed = TRUE;
@@ -88,51 +164,129 @@ static bool parse_aiff_header(char *filename,unsigned long *samples,unsigned sho
   /* now let's check AIFC compression type - it's in the COMM chunk */
   while (1) {
     /* read chunk id */
-    if (!read_tag(f,tag))
-      goto invalid_aiff_header;
+    if (!sniff_tag(sb,&pos,tag))
+      return FALSE;
 
     if (!tagcmp(tag,(unsigned char *)AIFF_COMM))
       break;
 
-    /* not COMM, so read size of this chunk and skip it */
-    if (!read_be_long(f,&be_long) || fseek(f,(long)be_long,SEEK_CUR))
-      goto invalid_aiff_header;
+    /* not COMM, so read size of this chunk and skip it, along with its pad byte */
+    if (!sniff_be_long(sb,&pos,&be_long))
+      return FALSE;
+
+    pos += (long)(be_long + (be_long & 1));
   }
 
-  /* now read channels, samples, and bits/sample from COMM chunk */
-  if (!read_be_long(f,&be_long) || !read_be_short(f,channels) ||
-      !read_be_long(f,samples) || !read_be_short(f,bits_per_sample) ||
-      !read_be_long(f,&be_long) || !read_be_long(f,&be_long) ||
-      !read_be_short(f,&be_short))
+  /* now read channels, samples, bits/sample and sample rate from COMM chunk */
+  if (!sniff_be_long(sb,&pos,&be_long))
+    return FALSE;
+
+  comm = pos;
+
+  if (!sniff_be_short(sb,&pos,&ah->channels) || !sniff_be_long(sb,&pos,&ah->samples) ||
+      !sniff_be_short(sb,&pos,&ah->bits_per_sample) || 10 != sniff_read(sb,pos,rate,10))
   {
-    goto invalid_aiff_header;
+    return FALSE;
   }
 
+  pos += 10;
+
+  ah->samples_per_sec = extended_to_rate(rate);
+
   if (is_compressed) {
-    if (!read_tag(f,tag))
-      goto invalid_aiff_header;
+    if (!sniff_tag(sb,&pos,tag))
+      return FALSE;
 
     if (tagcmp(tag,(unsigned char *)AIFF_COMPRESSION_NONE) && tagcmp(tag,(unsigned char *)AIFF_COMPRESSION_SOWT)) {
       st_debug1("found unsupported AIFF-C compression type [%c%c%c%c]",tag[0],tag[1],tag[2],tag[3]);
-      goto invalid_aiff_header;
+      return FALSE;
+    }
+
+    if (!tagcmp(tag,(unsigned char *)AIFF_COMPRESSION_SOWT))
+      ah->little_endian = TRUE;
+  }
+
+  /* finally, find where the sound data starts - if that fails, the file is left to the helper */
+  pos = comm + (long)(be_long + (be_long & 1));
+
+  while (sniff_tag(sb,&pos,tag) && sniff_be_long(sb,&pos,&be_long)) {
+    if (!tagcmp(tag,(unsigned char *)AIFF_SSND)) {
+      if (sniff_be_long(sb,&pos,&ssnd_offset) && sniff_be_long(sb,&pos,NULL))
+        ah->data_offset = pos + (long)ssnd_offset;
+      break;
     }
+
+    pos += (long)(be_long + (be_long & 1));
   }
 
-  fclose(f);
   return TRUE;
+}
+
+static bool is_our_file(sniff_buffer *sb)
+{
+  aiff_header ah;
+
+  return parse_aiff_header(sb,&ah);
+}
+
+static bool probe_header(sniff_buffer *sb,wave_info *info)
+/* reads the audio properties from the COMM chunk, if the file can be read in-process */
+{
+  aiff_header ah;
+
+  if (!native_decoding() || !parse_aiff_header(sb,&ah) || !aiff_decode_supported(&ah))
+    return FALSE;
+
+  return probe_canonical_header(info,ah.channels,ah.bits_per_sample,ah.samples_per_sec,ah.samples);
+}
+
+static FILE *open_for_input(char *filename,proc_info *pinfo)
+{
+  aiff_header ah;
+  sniff_buffer sb;
+  FILE *input;
+
+  if (native_decoding() && sniff_open(&sb,filename)) {
+    if (parse_aiff_header(&sb,&ah) && aiff_decode_supported(&ah) &&
+        0 == fseek(sb.file,(long)sb.id3v2_tag_size + ah.data_offset,SEEK_SET))
+    {
+      /* the decoder takes over the file */
+      input = sb.file;
+      sb.file = NULL;
+      sniff_close(&sb);
+
+      if ((input = aiff_decode_open(input,&ah))) {
+        pinfo->pid = NO_CHILD_PID;
+        return input;
+      }
+    }
+    else {
+      sniff_close(&sb);
+    }
 
-invalid_aiff_header:
+    st_debug1("can't read file in-process, falling back to [%s]: [%s]",format_aiff.decoder,filename);
+  }
+
+  return launch_input(&format_aiff,filename,pinfo);
+}
 
-  fclose(f);
-  return FALSE;
+static FILE *launch_encoder(char *filename,proc_info *pinfo)
+{
+  st_debug1("can't write file in-process, falling back to [%s]: [%s]",format_aiff.encoder,filename);
+
+  return launch_output(&format_aiff,filename,pinfo);
 }
 
-static bool is_our_file(char *filename)
+static FILE *open_for_output(char *filename,proc_info *pinfo)
 {
-  unsigned long be_long=0;
-  unsigned short be_short=0;
+  if (!native_encoding())
+    return launch_output(&format_aiff,filename,pinfo);
+
+  if (!clobber_check(filename))
+    return NULL;
 
-  return parse_aiff_header(filename,&be_long,&be_short,&be_short);
+  pinfo->pid = NO_CHILD_PID;
+  return aiff_encode_open(filename,launch_encoder);
 }
 
 static bool input_header_kluge(unsigned char *header,wave_info *info)
@@ -141,14 +295,26 @@ static bool input_header_kluge(unsigned char *header,wave_info *info)
  * COMM chunk.
  */
 {
-  unsigned long samples = 0;
-  unsigned short channels = 0,bits_per_sample = 0;
+  aiff_header ah;
+  sniff_buffer sb;
+  bool parsed;
+
+  /* the in-process reader sends an exact header already */
+  if (NO_CHILD_PID == info->input_proc.pid)
+    return TRUE;
+
+  if (!sniff_open(&sb,info->filename))
+    return FALSE;
+
+  parsed = parse_aiff_header(&sb,&ah);
+
+  sniff_close(&sb);
 
-  if (!parse_aiff_header(info->filename,&samples,&channels,&bits_per_sample))
+  if (!parsed)
     return FALSE;
 
   /* set proper data size */
-  info->data_size = channels * samples * (bits_per_sample/8);
+  info->data_size = ah.channels * ah.samples * (ah.bits_per_sample/8);
 
   st_debug1("adjusting data size to: %lu",info->data_size);
 
@@ -17,6 +17,8 @@
  */
 
 #include "format.h"
+#include "convert.h"
+#include "codec.h"
 
 CVSID("$Id: format_alac.c,v 1.39 2009/03/11 17:18:01 jason Exp $")
 
@@ -24,8 +26,39 @@ CVSID("$Id: format_alac.c,v 1.39 2009/03/11 17:18:01 jason Exp $")
 
 #define ALAC_MAGIC "M4A "
 
+#define MP4_ATOM_FTYP "ftyp"
+
+#define MP4_ATOM_MOOV "moov"
+#define MP4_ATOM_TRAK "trak"
+#define MP4_ATOM_MDIA "mdia"
+#define MP4_ATOM_MINF "minf"
+#define MP4_ATOM_STBL "stbl"
+#define MP4_ATOM_STSD "stsd"
+#define MP4_ATOM_STTS "stts"
+#define MP4_ATOM_ALAC "alac"
+
+/* offsets within an 'alac' sample description, counted from the start of the entry */
+#define ALAC_ENTRY_CHANNELS     24
+#define ALAC_ENTRY_SAMPLE_SIZE  26
+#define ALAC_ENTRY_SAMPLE_RATE  32
+#define ALAC_ENTRY_SIZE         36
+
+/* offsets within the 'alac' magic cookie that follows the sample description, counted from its contents */
+#define ALAC_COOKIE_BIT_DEPTH   9
+#define ALAC_COOKIE_CHANNELS    13
+#define ALAC_COOKIE_SAMPLE_RATE 24
+#define ALAC_COOKIE_SIZE        28
+
+/* longest file type atom looked at for an M4A brand */
+#define MP4_FTYP_MAX_SIZE       64
+
+static char default_decoder[] = ALAC;
 static char default_decoder_args[] = FILENAME_PLACEHOLDER;
 
+static bool is_our_file(sniff_buffer *);
+static FILE *open_for_input(char *,proc_info *);
+static bool probe_header(sniff_buffer *,wave_info *);
+
 /*
  * in theory, the ffmpeg commands below should work, but currently it seems that
  * incorrect data sizes are written when encoding or decoding over pipes...
@@ -49,17 +82,195 @@ format_module format_alac = {
   TRUE,
   FALSE,
   "-",
-  ALAC_MAGIC,
-  8,
+  NULL,
+  0,
   "m4a",
-  ALAC,
+  default_decoder,
   default_decoder_args,
   NULL,
   NULL,
+  is_our_file,
+  open_for_input,
   NULL,
   NULL,
   NULL,
   NULL,
-  NULL,
-  NULL
+  probe_header
 };
+
+static bool native_decoding()
+/* files are decoded in-process, unless a decoder was named with -i or in the environment */
+{
+  return (format_alac.decoder == default_decoder);
+}
+
+static FILE *open_for_input(char *filename,proc_info *pinfo)
+{
+  FILE *input;
+
+  if (native_decoding()) {
+    if ((input = alac_decode_open(filename))) {
+      pinfo->pid = NO_CHILD_PID;
+      return input;
+    }
+
+    st_debug1("can't decode file in-process, falling back to [%s]: [%s]",format_alac.decoder,filename);
+  }
+
+  return launch_input(&format_alac,filename,pinfo);
+}
+
+static bool is_our_file(sniff_buffer *sb)
+/* checks for a file type atom with the M4A brand, either as the major brand or as one of the compatible brands
+ * that files from tools other than iTunes tend to list it among
+ */
+{
+  unsigned char buf[MP4_FTYP_MAX_SIZE];
+  unsigned long size,pos;
+
+  if (8 != sniff_read(sb,0,buf,8) || tagcmp(buf+4,(unsigned char *)MP4_ATOM_FTYP))
+    return FALSE;
+
+  size = min(uchar_to_ulong_be(buf),MP4_FTYP_MAX_SIZE);
+
+  if (size < 12 || (int)size != sniff_read(sb,0,buf,(int)size))
+    return FALSE;
+
+  if (!tagcmp(buf+8,(unsigned char *)ALAC_MAGIC))
+    return TRUE;
+
+  /* the compatible brands follow the minor version */
+  for (pos=16;pos+4<=size;pos+=4) {
+    if (!tagcmp(buf+pos,(unsigned char *)ALAC_MAGIC))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static bool find_atom(sniff_buffer *sb,long start,long end,char *type,long *contents,long *contents_end)
+/* finds the first atom of the given type between start and end, and returns where its contents begin and end */
+{
+  unsigned char buf[16];
+  unsigned long size;
+  long pos,header_size;
+
+  for (pos=start;pos+8<=end;pos+=(long)size) {
+    if (8 != sniff_read(sb,pos,buf,8))
+      return FALSE;
+
+    size = uchar_to_ulong_be(buf);
+    header_size = 8;
+
+    if (1 == size) {
+      /* 64-bit atom size - anything that actually needs it is far too large for a WAVE file */
+      if (8 != sniff_read(sb,pos+8,buf+8,8) || uchar_to_ulong_be(buf+8))
+        return FALSE;
+
+      size = uchar_to_ulong_be(buf+12);
+      header_size = 16;
+    }
+    else if (0 == size) {
+      /* atom extends to the end of its container */
+      size = (unsigned long)(end - pos);
+    }
+
+    if (size < (unsigned long)header_size || size > (unsigned long)(end - pos))
+      return FALSE;
+
+    if (!tagcmp(buf+4,(unsigned char *)type)) {
+      *contents = pos + header_size;
+      *contents_end = pos + (long)size;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static bool find_atom_path(sniff_buffer *sb,long start,long end,char **path,long *contents,long *contents_end)
+/* follows a NULL-terminated list of nested atom types down from the given container */
+{
+  for (;*path;path++) {
+    if (!find_atom(sb,start,end,*path,&start,&end))
+      return FALSE;
+  }
+
+  *contents = start;
+  *contents_end = end;
+
+  return TRUE;
+}
+
+static bool probe_header(sniff_buffer *sb,wave_info *info)
+/* finds the ALAC track in the MP4 container, and reads its channels, bits/sample and sample rate from the
+ * sample description, and its length in samples from the time-to-sample table
+ */
+{
+  static char *stsd_path[] = { MP4_ATOM_MDIA, MP4_ATOM_MINF, MP4_ATOM_STBL, MP4_ATOM_STSD, NULL };
+  static char *stts_path[] = { MP4_ATOM_MDIA, MP4_ATOM_MINF, MP4_ATOM_STBL, MP4_ATOM_STTS, NULL };
+  unsigned char entry[ALAC_ENTRY_SIZE],buf[ALAC_COOKIE_SIZE];
+  long file_end,moov,moov_end,trak,trak_end,atom,atom_end,cookie,cookie_end;
+  unsigned long entries,i;
+  wlong samples,samples_per_sec;
+  wshort channels,bits_per_sample;
+
+  file_end = (long)(info->actual_size - info->id3v2_tag_size);
+
+  if (!find_atom(sb,0,file_end,MP4_ATOM_MOOV,&moov,&moov_end))
+    return FALSE;
+
+  /* look for the first track described by an 'alac' sample entry */
+  for (trak=moov;find_atom(sb,trak,moov_end,MP4_ATOM_TRAK,&trak,&trak_end);trak=trak_end) {
+    if (!find_atom_path(sb,trak,trak_end,stsd_path,&atom,&atom_end) || atom + 8 + ALAC_ENTRY_SIZE > atom_end)
+      continue;
+
+    /* skip version/flags and entry count to get to the first sample entry */
+    atom += 8;
+
+    if (ALAC_ENTRY_SIZE != sniff_read(sb,atom,entry,ALAC_ENTRY_SIZE) || tagcmp(entry+4,(unsigned char *)MP4_ATOM_ALAC))
+      continue;
+
+    channels = uchar_to_ushort_be(entry+ALAC_ENTRY_CHANNELS);
+    bits_per_sample = uchar_to_ushort_be(entry+ALAC_ENTRY_SAMPLE_SIZE);
+    samples_per_sec = uchar_to_ushort_be(entry+ALAC_ENTRY_SAMPLE_RATE);
+
+    /* the magic cookie has the authoritative values, and isn't limited to 16-bit sample rates */
+    if (find_atom(sb,atom+ALAC_ENTRY_SIZE,atom+(long)uchar_to_ulong_be(entry),MP4_ATOM_ALAC,&cookie,&cookie_end) &&
+        cookie + ALAC_COOKIE_SIZE <= cookie_end && ALAC_COOKIE_SIZE == sniff_read(sb,cookie,buf,ALAC_COOKIE_SIZE))
+    {
+      bits_per_sample = buf[ALAC_COOKIE_BIT_DEPTH];
+      channels = buf[ALAC_COOKIE_CHANNELS];
+      samples_per_sec = uchar_to_ulong_be(buf+ALAC_COOKIE_SAMPLE_RATE);
+    }
+
+    if (native_decoding()) {
+      if (!alac_decode_supported(channels,bits_per_sample))
+        return FALSE;
+    }
+    else if (channels > 2 || (8 != bits_per_sample && 16 != bits_per_sample && 24 != bits_per_sample))
+      return FALSE;
+
+    /* total the time-to-sample table */
+    if (!find_atom_path(sb,trak,trak_end,stts_path,&atom,&atom_end) || 8 != sniff_read(sb,atom,buf,8))
+      return FALSE;
+
+    entries = uchar_to_ulong_be(buf+4);
+
+    if (entries > (unsigned long)(atom_end - atom - 8) / 8)
+      return FALSE;
+
+    samples = 0;
+
+    for (i=0;i<entries;i++) {
+      if (8 != sniff_read(sb,atom+8+(long)i*8,buf,8))
+        return FALSE;
+
+      samples += uchar_to_ulong_be(buf) * uchar_to_ulong_be(buf+4);
+    }
+
+    return probe_canonical_header(info,channels,bits_per_sample,samples_per_sec,samples);
+  }
+
+  return FALSE;
+}
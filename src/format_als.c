@@ -50,5 +50,6 @@ format_module format_als = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
@@ -17,6 +17,8 @@
  */
 
 #include "format.h"
+#include "convert.h"
+#include "codec.h"
 
 CVSID("$Id: format_ape.c,v 1.54 2009/03/11 17:18:01 jason Exp $")
 
@@ -24,10 +26,27 @@ CVSID("$Id: format_ape.c,v 1.54 2009/03/11 17:18:01 jason Exp $")
 
 #define MAC_MAGIC "MAC "
 
+/* files from version 3.98 on begin with a descriptor, followed by the header */
+#define APE_DESCRIPTOR_VERSION    3980
+#define APE_DESCRIPTOR_SIZE       52
+#define APE_HEADER_SIZE           24
+#define APE_OLD_HEADER_SIZE       32
+
+#define APE_FLAG_8_BIT            0x0001
+#define APE_FLAG_HAS_PEAK_LEVEL   0x0004
+#define APE_FLAG_24_BIT           0x0008
+#define APE_FLAG_HAS_SEEK_ELEMENTS 0x0010
+#define APE_FLAG_CREATE_WAV_HEADER 0x0020
+
+#define APE_COMPRESSION_EXTRA_HIGH 4000
+
+static char default_decoder[] = MAC;
 static char default_decoder_args[] = FILENAME_PLACEHOLDER " - -d";
 static char default_encoder_args[] = "- " FILENAME_PLACEHOLDER " -c2000";
 
+static FILE *open_for_input(char *,proc_info *);
 static bool input_header_kluge(unsigned char *,wave_info *);
+static bool probe_header(sniff_buffer *,wave_info *);
 
 format_module format_ape = {
   "ape",
@@ -43,22 +62,50 @@ format_module format_ape = {
   MAC_MAGIC,
   0,
   "ape",
-  MAC,
+  default_decoder,
   default_decoder_args,
   MAC,
   default_encoder_args,
   NULL,
+  open_for_input,
   NULL,
   NULL,
   NULL,
-  NULL,
-  input_header_kluge
+  input_header_kluge,
+  probe_header
 };
 
+static bool native_decoding()
+/* files are decoded in-process, unless a decoder was named with -i or in the environment */
+{
+  return (format_ape.decoder == default_decoder);
+}
+
+static FILE *open_for_input(char *filename,proc_info *pinfo)
+{
+  FILE *input;
+
+  if (native_decoding()) {
+    if ((input = ape_decode_open(filename))) {
+      pinfo->pid = NO_CHILD_PID;
+      return input;
+    }
+
+    st_debug1("can't decode file in-process, falling back to [%s]: [%s]",format_ape.decoder,filename);
+  }
+
+  return launch_input(&format_ape,filename,pinfo);
+}
+
 static bool input_header_kluge(unsigned char *header,wave_info *info)
+/* mac sends the WAVE header stored in the file verbatim, sizes and all, and these can be wrong */
 {
   wlong adjusted_data_size;
 
+  /* the in-process decoder sends an exact header already */
+  if (NO_CHILD_PID == info->input_proc.pid)
+    return TRUE;
+
   adjusted_data_size = info->data_size;
   if (PROB_ODD_SIZED_DATA(info))
     adjusted_data_size++;
@@ -70,3 +117,109 @@ static bool input_header_kluge(unsigned char *header,wave_info *info)
 
   return TRUE;
 }
+
+static bool probe_header(sniff_buffer *sb,wave_info *info)
+/* fills out info from the original WAVE header that mac stores (and sends verbatim), or from the
+ * stream properties when the file was created without one and mac has to make up a canonical header.
+ * for files the in-process decoder handles, it is the header that decoder sends.
+ */
+{
+  unsigned char buf[APE_DESCRIPTOR_SIZE + APE_HEADER_SIZE],wav_header[HEADER_CACHE_SIZE],header[HEADER_CACHE_SIZE];
+  unsigned long total_frames,final_frame_blocks,blocks_per_frame,wav_header_size,blocks;
+  unsigned short version,compression,flags,channels,bits_per_sample;
+  unsigned long samples_per_sec;
+  long wav_header_pos;
+  int header_size;
+
+  if (APE_OLD_HEADER_SIZE != sniff_read(sb,0,buf,APE_OLD_HEADER_SIZE) || tagcmp(buf,(unsigned char *)MAC_MAGIC))
+    return FALSE;
+
+  version = uchar_to_ushort_le(buf+4);
+
+  if (version >= APE_DESCRIPTOR_VERSION) {
+    unsigned long descriptor_size,header_size,seek_table_size;
+
+    if (sizeof(buf) != sniff_read(sb,0,buf,sizeof(buf)))
+      return FALSE;
+
+    descriptor_size = uchar_to_ulong_le(buf+8);
+    header_size = uchar_to_ulong_le(buf+12);
+    seek_table_size = uchar_to_ulong_le(buf+16);
+    wav_header_size = uchar_to_ulong_le(buf+20);
+
+    if (descriptor_size != APE_DESCRIPTOR_SIZE && APE_HEADER_SIZE != sniff_read(sb,(long)descriptor_size,buf+APE_DESCRIPTOR_SIZE,APE_HEADER_SIZE))
+      return FALSE;
+
+    compression = uchar_to_ushort_le(buf+APE_DESCRIPTOR_SIZE);
+    flags = uchar_to_ushort_le(buf+APE_DESCRIPTOR_SIZE+2);
+    blocks_per_frame = uchar_to_ulong_le(buf+APE_DESCRIPTOR_SIZE+4);
+    final_frame_blocks = uchar_to_ulong_le(buf+APE_DESCRIPTOR_SIZE+8);
+    total_frames = uchar_to_ulong_le(buf+APE_DESCRIPTOR_SIZE+12);
+    bits_per_sample = uchar_to_ushort_le(buf+APE_DESCRIPTOR_SIZE+16);
+    channels = uchar_to_ushort_le(buf+APE_DESCRIPTOR_SIZE+18);
+    samples_per_sec = uchar_to_ulong_le(buf+APE_DESCRIPTOR_SIZE+20);
+
+    wav_header_pos = (long)(descriptor_size + header_size + seek_table_size);
+  }
+  else {
+    compression = uchar_to_ushort_le(buf+6);
+    flags = uchar_to_ushort_le(buf+8);
+    channels = uchar_to_ushort_le(buf+10);
+    samples_per_sec = uchar_to_ulong_le(buf+12);
+    wav_header_size = uchar_to_ulong_le(buf+16);
+    total_frames = uchar_to_ulong_le(buf+24);
+    final_frame_blocks = uchar_to_ulong_le(buf+28);
+
+    if (flags & APE_FLAG_8_BIT)
+      bits_per_sample = 8;
+    else if (flags & APE_FLAG_24_BIT)
+      bits_per_sample = 24;
+    else
+      bits_per_sample = 16;
+
+    if (version >= 3950)
+      blocks_per_frame = 73728 * 4;
+    else if (version >= 3900 || (version >= 3800 && APE_COMPRESSION_EXTRA_HIGH == compression))
+      blocks_per_frame = 73728;
+    else
+      blocks_per_frame = 9216;
+
+    wav_header_pos = APE_OLD_HEADER_SIZE;
+    if (flags & APE_FLAG_HAS_PEAK_LEVEL)
+      wav_header_pos += 4;
+    if (flags & APE_FLAG_HAS_SEEK_ELEMENTS)
+      wav_header_pos += 4;
+  }
+
+  if (0 == total_frames)
+    return FALSE;
+
+  blocks = (total_frames - 1) * blocks_per_frame + final_frame_blocks;
+
+  /* the in-process decoder sends the stored header with its sizes fixed, so there is nothing to reject */
+  if (native_decoding() && ape_decode_supported(version,compression,channels,bits_per_sample)) {
+    if ((flags & APE_FLAG_CREATE_WAV_HEADER) || 0 == wav_header_size || wav_header_size > HEADER_CACHE_SIZE ||
+        (int)wav_header_size != sniff_read(sb,wav_header_pos,wav_header,(int)wav_header_size))
+      header_size = ape_make_header(header,NULL,0,channels,bits_per_sample,samples_per_sec,blocks,info->filename);
+    else
+      header_size = ape_make_header(header,wav_header,(int)wav_header_size,channels,bits_per_sample,samples_per_sec,blocks,info->filename);
+
+    return (header_size > 0 && probe_wav_header(info,header,header_size));
+  }
+
+  if (flags & APE_FLAG_CREATE_WAV_HEADER)
+    return probe_canonical_header(info,channels,bits_per_sample,samples_per_sec,blocks);
+
+  if (0 == wav_header_size || wav_header_size > HEADER_CACHE_SIZE ||
+      (int)wav_header_size != sniff_read(sb,wav_header_pos,wav_header,(int)wav_header_size))
+    return FALSE;
+
+  if (!probe_wav_header(info,wav_header,(int)wav_header_size))
+    return FALSE;
+
+  /* stored headers with the wrong data size are fixed up by the kluge, but only the decoder knows for sure */
+  if (info->data_size != blocks * channels * ((bits_per_sample + 7) / 8))
+    return FALSE;
+
+  return TRUE;
+}
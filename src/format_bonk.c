@@ -32,7 +32,7 @@ static char default_decoder_args[] = "decode -o " TERMODEVICE " " FILENAME_PLACE
 static char default_encoder_args[] = "encode -o " FILENAME_PLACEHOLDER " " TERMIDEVICE;
 #endif
 
-static bool is_our_file(char *);
+static bool is_our_file(sniff_buffer *);
 
 format_module format_bonk = {
   "bonk",
@@ -61,10 +61,11 @@ format_module format_bonk = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
 
-static bool is_our_file(char *filename)
+static bool is_our_file(sniff_buffer *sb)
 {
-  return (check_for_magic(filename,BONK_MAGIC,0) || check_for_magic(filename,BONK_MAGIC,1));
+  return (check_for_magic(sb,BONK_MAGIC,0) || check_for_magic(sb,BONK_MAGIC,1));
 }
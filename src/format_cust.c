@@ -43,5 +43,6 @@ format_module format_cust = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
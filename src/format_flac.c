@@ -17,6 +17,8 @@
  */
 
 #include "format.h"
+#include "convert.h"
+#include "codec.h"
 
 CVSID("$Id: format_flac.c,v 1.57 2009/03/11 17:18:01 jason Exp $")
 
@@ -24,9 +26,18 @@ CVSID("$Id: format_flac.c,v 1.57 2009/03/11 17:18:01 jason Exp $")
 
 #define FLAC_MAGIC "fLaC"
 
+#define FLAC_METADATA_STREAMINFO 0
+#define FLAC_STREAMINFO_SIZE     34
+
+static char default_decoder[] = FLAC;
 static char default_decoder_args[] = "-c -d -s " FILENAME_PLACEHOLDER;
+static char default_encoder[] = FLAC;
 static char default_encoder_args[] = "-s -o " FILENAME_PLACEHOLDER " -";
 
+static FILE *open_for_input(char *,proc_info *);
+static FILE *open_for_output(char *,proc_info *);
+static bool probe_header(sniff_buffer *,wave_info *);
+
 format_module format_flac = {
   "flac",
   "Free Lossless Audio Codec",
@@ -41,14 +52,99 @@ format_module format_flac = {
   FLAC_MAGIC,
   0,
   "flac",
-  FLAC,
+  default_decoder,
   default_decoder_args,
-  FLAC,
+  default_encoder,
   default_encoder_args,
   NULL,
+  open_for_input,
+  open_for_output,
   NULL,
   NULL,
   NULL,
-  NULL,
-  NULL
+  probe_header
 };
+
+static bool native_decoding()
+/* files are decoded in-process, unless a decoder was named with -i or in the environment */
+{
+  return (format_flac.decoder == default_decoder);
+}
+
+static FILE *open_for_input(char *filename,proc_info *pinfo)
+{
+  FILE *input;
+
+  if (native_decoding()) {
+    if ((input = flac_decode_open(filename))) {
+      pinfo->pid = NO_CHILD_PID;
+      return input;
+    }
+
+    st_debug1("can't decode file in-process, falling back to [%s]: [%s]",format_flac.decoder,filename);
+  }
+
+  return launch_input(&format_flac,filename,pinfo);
+}
+
+static bool native_encoding()
+/* files are encoded in-process, unless an encoder was named with -o or in the environment */
+{
+  return (format_flac.encoder == default_encoder);
+}
+
+static FILE *launch_encoder(char *filename,proc_info *pinfo)
+{
+  st_debug1("can't encode file in-process, falling back to [%s]: [%s]",format_flac.encoder,filename);
+
+  return launch_output(&format_flac,filename,pinfo);
+}
+
+static FILE *open_for_output(char *filename,proc_info *pinfo)
+{
+  if (!native_encoding())
+    return launch_output(&format_flac,filename,pinfo);
+
+  if (!clobber_check(filename))
+    return NULL;
+
+  pinfo->pid = NO_CHILD_PID;
+  return flac_encode_open(filename,launch_encoder);
+}
+
+static bool probe_header(sniff_buffer *sb,wave_info *info)
+/* reads the audio properties from the STREAMINFO block, which the FLAC format requires to come first */
+{
+  unsigned char buf[8 + FLAC_STREAMINFO_SIZE];
+  unsigned char *si = buf + 8;
+  wlong samples_per_sec,samples;
+  wshort channels,bits_per_sample;
+
+  if (sizeof(buf) != sniff_read(sb,0,buf,sizeof(buf)))
+    return FALSE;
+
+  if (tagcmp(buf,(unsigned char *)FLAC_MAGIC) || FLAC_METADATA_STREAMINFO != (buf[4] & 0x7f) ||
+      FLAC_STREAMINFO_SIZE != ((buf[5] << 16) | (buf[6] << 8) | buf[7]))
+    return FALSE;
+
+  /* 20 bits of sample rate, 3 bits of (channels - 1), 5 bits of (bits/sample - 1), 36 bits of total samples */
+  samples_per_sec = ((wlong)si[10] << 12) | ((wlong)si[11] << 4) | (si[12] >> 4);
+  channels = ((si[12] >> 1) & 0x07) + 1;
+  bits_per_sample = (((si[12] & 0x01) << 4) | (si[13] >> 4)) + 1;
+
+  /* a total that needs more than 32 bits won't fit in a WAVE header anyway */
+  if (si[13] & 0x0f)
+    return FALSE;
+
+  samples = uchar_to_ulong_be(si + 14);
+
+  if (0 == samples)
+    return FALSE;
+
+  /* 'flac' describes anything but 8/16-bit mono/stereo audio with a WAVE_FORMAT_EXTENSIBLE header */
+  if (native_decoding() ? !flac_decode_supported(channels,bits_per_sample) :
+                          (channels > 2 || (8 != bits_per_sample && 16 != bits_per_sample)))
+    return FALSE;
+
+  return probe_canonical_header(info,channels,bits_per_sample,samples_per_sec,samples);
+}
@@ -49,5 +49,6 @@ format_module format_kxs = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
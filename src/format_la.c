@@ -49,5 +49,6 @@ format_module format_la = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
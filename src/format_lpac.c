@@ -49,5 +49,6 @@ format_module format_lpac = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
@@ -50,5 +50,6 @@ format_module format_mkw = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
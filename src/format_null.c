@@ -47,6 +47,7 @@ format_module format_null = {
   open_for_output,
   NULL,
   create_output_filename,
+  NULL,
   NULL
 };
 
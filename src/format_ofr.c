@@ -28,7 +28,7 @@ CVSID("$Id: format_ofr.c,v 1.56 2009/03/11 17:18:01 jason Exp $")
 static char default_decoder_args[] = "--decode " FILENAME_PLACEHOLDER " --output -";
 static char default_encoder_args[] = "--encode - --output " FILENAME_PLACEHOLDER;
 
-static bool is_our_file(char *);
+static bool is_our_file(sniff_buffer *);
 
 format_module format_ofr = {
   "ofr",
@@ -53,10 +53,11 @@ format_module format_ofr = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
 
-static bool is_our_file(char *filename)
+static bool is_our_file(sniff_buffer *sb)
 {
-  return (check_for_magic(filename,OPTIMFROG_MAGIC,0) || check_for_magic(filename,OPTIMFROG_MAGIC_OLD,0));
+  return (check_for_magic(sb,OPTIMFROG_MAGIC,0) || check_for_magic(sb,OPTIMFROG_MAGIC_OLD,0));
 }
@@ -17,6 +17,8 @@
  */
 
 #include "format.h"
+#include "convert.h"
+#include "codec.h"
 
 CVSID("$Id: format_shn.c,v 1.65 2009/03/11 17:18:01 jason Exp $")
 
@@ -25,10 +27,41 @@ CVSID("$Id: format_shn.c,v 1.65 2009/03/11 17:18:01 jason Exp $")
 #define SHORTEN_MAGIC "ajkg"
 #define SHORTEN_SEEKTABLE_MAGIC "SHNAMPSK"
 
+/* bitstream definitions from shorten.h */
+#define SHN_MAX_VERSION         3
+#define SHN_BITSTREAM_OFFSET    5
+#define SHN_ULONGSIZE           2
+#define SHN_TYPESIZE            4
+#define SHN_CHANSIZE            0
+#define SHN_BLOCKSIZESIZE       8
+#define SHN_LPCQSIZE            2
+#define SHN_NSKIPSIZE           1
+#define SHN_XBYTESIZE           7
+#define SHN_FNSIZE              2
+#define SHN_FN_VERBATIM         9
+#define SHN_VERBATIM_CKSIZE_SIZE 5
+#define SHN_VERBATIM_BYTE_SIZE  8
+
+/* longest unary prefix accepted before giving up on a damaged bitstream */
+#define SHN_MAX_UNARY           64
+
+typedef struct _shn_bits {
+  sniff_buffer *sb;
+  long pos;
+  unsigned long word;
+  int bits_left;
+  int version;
+} shn_bits;
+
+static char default_decoder[] = SHORTEN;
 static char default_decoder_args[] = "-x " FILENAME_PLACEHOLDER " -";
+static char default_encoder[] = SHORTEN;
 static char default_encoder_args[] = "- " FILENAME_PLACEHOLDER;
 
+static FILE *open_for_input(char *,proc_info *);
+static FILE *open_for_output(char *,proc_info *);
 static void show_extra_info(char *);
+static bool probe_header(sniff_buffer *,wave_info *);
 
 format_module format_shn = {
   "shn",
@@ -44,18 +77,66 @@ format_module format_shn = {
   SHORTEN_MAGIC,
   0,
   "shn",
-  SHORTEN,
+  default_decoder,
   default_decoder_args,
-  SHORTEN,
+  default_encoder,
   default_encoder_args,
   NULL,
-  NULL,
-  NULL,
+  open_for_input,
+  open_for_output,
   show_extra_info,
   NULL,
-  NULL
+  NULL,
+  probe_header
 };
 
+static bool native_decoding()
+/* files are decoded in-process, unless a decoder was named with -i or in the environment */
+{
+  return (format_shn.decoder == default_decoder);
+}
+
+static FILE *open_for_input(char *filename,proc_info *pinfo)
+{
+  FILE *input;
+
+  if (native_decoding()) {
+    if ((input = shn_decode_open(filename))) {
+      pinfo->pid = NO_CHILD_PID;
+      return input;
+    }
+
+    st_debug1("can't decode file in-process, falling back to [%s]: [%s]",format_shn.decoder,filename);
+  }
+
+  return launch_input(&format_shn,filename,pinfo);
+}
+
+static bool native_encoding()
+/* files are encoded in-process, unless an encoder was named with -o or in the environment */
+{
+  return (format_shn.encoder == default_encoder);
+}
+
+static FILE *launch_encoder(char *filename,proc_info *pinfo)
+{
+  st_debug1("can't encode file in-process, falling back to [%s]: [%s]",format_shn.encoder,filename);
+
+  return launch_output(&format_shn,filename,pinfo);
+}
+
+static FILE *open_for_output(char *filename,proc_info *pinfo)
+{
+  if (!native_encoding())
+    return launch_output(&format_shn,filename,pinfo);
+
+  if (!clobber_check(filename))
+    return NULL;
+
+  pinfo->pid = NO_CHILD_PID;
+  return shn_encode_open(filename,launch_encoder);
+}
+
 static void show_extra_info(char *filename)
 {
   FILE *f;
@@ -89,3 +170,119 @@ static void show_extra_info(char *filename)
   else
     st_output("no\n");
 }
+
+static bool shn_get_bit(shn_bits *bits,int *bit)
+{
+  unsigned char buf[4];
+
+  if (0 == bits->bits_left) {
+    if (4 != sniff_read(bits->sb,bits->pos,buf,4))
+      return FALSE;
+
+    bits->pos += 4;
+    bits->word = uchar_to_ulong_be(buf);
+    bits->bits_left = 32;
+  }
+
+  bits->bits_left--;
+
+  *bit = (int)((bits->word >> bits->bits_left) & 1);
+
+  return TRUE;
+}
+
+static bool shn_get_uvar(shn_bits *bits,int nbin,unsigned long *val)
+/* reads a Rice-coded value: a unary-coded high part, followed by nbin low bits */
+{
+  unsigned long result = 0;
+  int bit;
+
+  for (;;) {
+    if (!shn_get_bit(bits,&bit))
+      return FALSE;
+
+    if (bit)
+      break;
+
+    if (++result > SHN_MAX_UNARY)
+      return FALSE;
+  }
+
+  while (nbin-- > 0) {
+    if (!shn_get_bit(bits,&bit))
+      return FALSE;
+
+    result = (result << 1) | bit;
+  }
+
+  *val = result;
+
+  return TRUE;
+}
+
+static bool shn_get_uint(shn_bits *bits,int nbin,unsigned long *val)
+/* version 0 files store header values with a fixed Rice parameter, later versions store the parameter first */
+{
+  unsigned long nbits;
+
+  if (0 == bits->version)
+    return shn_get_uvar(bits,nbin,val);
+
+  if (!shn_get_uvar(bits,SHN_ULONGSIZE,&nbits) || nbits > 32)
+    return FALSE;
+
+  return shn_get_uvar(bits,(int)nbits,val);
+}
+
+static bool probe_header(sniff_buffer *sb,wave_info *info)
+/* shorten keeps the original WAVE header in a verbatim block at the start of the bitstream, and sends it
+ * as-is when decoding - so only the stream header and that block need to be decoded to describe the file.
+ */
+{
+  unsigned char buf[SHN_BITSTREAM_OFFSET],header[HEADER_CACHE_SIZE];
+  unsigned long val,nskip,header_len,i;
+  shn_bits bits;
+
+  if (SHN_BITSTREAM_OFFSET != sniff_read(sb,0,buf,SHN_BITSTREAM_OFFSET) || tagcmp(buf,(unsigned char *)SHORTEN_MAGIC))
+    return FALSE;
+
+  if (buf[4] > SHN_MAX_VERSION)
+    return FALSE;
+
+  bits.sb = sb;
+  bits.pos = SHN_BITSTREAM_OFFSET;
+  bits.word = 0;
+  bits.bits_left = 0;
+  bits.version = buf[4];
+
+  /* file type and channel count */
+  if (!shn_get_uint(&bits,SHN_TYPESIZE,&val) || !shn_get_uint(&bits,SHN_CHANSIZE,&val))
+    return FALSE;
+
+  if (bits.version > 0) {
+    /* block size, LPC order, mean block count, and bytes to skip */
+    if (!shn_get_uint(&bits,SHN_BLOCKSIZESIZE,&val) || !shn_get_uint(&bits,SHN_LPCQSIZE,&val) ||
+        !shn_get_uint(&bits,0,&val) || !shn_get_uint(&bits,SHN_NSKIPSIZE,&nskip))
+      return FALSE;
+
+    for (i=0;i<nskip;i++) {
+      if (!shn_get_uvar(&bits,SHN_XBYTESIZE,&val))
+        return FALSE;
+    }
+  }
+
+  if (!shn_get_uvar(&bits,SHN_FNSIZE,&val) || SHN_FN_VERBATIM != val)
+    return FALSE;
+
+  if (!shn_get_uvar(&bits,SHN_VERBATIM_CKSIZE_SIZE,&header_len) || 0 == header_len || header_len > HEADER_CACHE_SIZE)
+    return FALSE;
+
+  for (i=0;i<header_len;i++) {
+    if (!shn_get_uvar(&bits,SHN_VERBATIM_BYTE_SIZE,&val))
+      return FALSE;
+
+    header[i] = (unsigned char)(val & 0xff);
+  }
+
+  return probe_wav_header(info,header,(int)header_len);
+}
@@ -50,5 +50,6 @@ format_module format_tak = {
   NULL,
   NULL,
   NULL,
+  NULL,
   NULL
 };
@@ -17,6 +17,8 @@
  */
 
 #include "format.h"
+#include "convert.h"
+#include "codec.h"
 
 CVSID("$Id: format_tta.c,v 1.24 2009/03/11 17:18:01 jason Exp $")
 
@@ -24,9 +26,18 @@ CVSID("$Id: format_tta.c,v 1.24 2009/03/11 17:18:01 jason Exp $")
 
 #define TTA_MAGIC "TTA1"
 
+#define TTA_HEADER_SIZE     22
+#define TTA_FORMAT_SIMPLE   1
+
+static char default_decoder[] = TTA;
 static char default_decoder_args[] = "-d -o - " FILENAME_PLACEHOLDER;
+static char default_encoder[] = TTA;
 static char default_encoder_args[] = "-e -o " FILENAME_PLACEHOLDER " -";
 
+static FILE *open_for_input(char *,proc_info *);
+static FILE *open_for_output(char *,proc_info *);
+static bool probe_header(sniff_buffer *,wave_info *);
+
 format_module format_tta = {
   "tta",
   "TTA Lossless Audio Codec",
@@ -41,14 +52,91 @@ format_module format_tta = {
   TTA_MAGIC,
   0,
   "tta",
-  TTA,
+  default_decoder,
   default_decoder_args,
-  TTA,
+  default_encoder,
   default_encoder_args,
   NULL,
+  open_for_input,
+  open_for_output,
   NULL,
   NULL,
   NULL,
-  NULL,
-  NULL
+  probe_header
 };
+
+static bool native_decoding()
+/* files are decoded in-process, unless a decoder was named with -i or in the environment */
+{
+  return (format_tta.decoder == default_decoder);
+}
+
+static FILE *open_for_input(char *filename,proc_info *pinfo)
+{
+  FILE *input;
+
+  if (native_decoding()) {
+    if ((input = tta_decode_open(filename))) {
+      pinfo->pid = NO_CHILD_PID;
+      return input;
+    }
+
+    st_debug1("can't decode file in-process, falling back to [%s]: [%s]",format_tta.decoder,filename);
+  }
+
+  return launch_input(&format_tta,filename,pinfo);
+}
+
+static bool native_encoding()
+/* files are encoded in-process, unless an encoder was named with -o or in the environment */
+{
+  return (format_tta.encoder == default_encoder);
+}
+
+static FILE *launch_encoder(char *filename,proc_info *pinfo)
+{
+  st_debug1("can't encode file in-process, falling back to [%s]: [%s]",format_tta.encoder,filename);
+
+  return launch_output(&format_tta,filename,pinfo);
+}
+
+static FILE *open_for_output(char *filename,proc_info *pinfo)
+{
+  if (!native_encoding())
+    return launch_output(&format_tta,filename,pinfo);
+
+  if (!clobber_check(filename))
+    return NULL;
+
+  pinfo->pid = NO_CHILD_PID;
+  return tta_encode_open(filename,launch_encoder);
+}
+
+static bool probe_header(sniff_buffer *sb,wave_info *info)
+/* reads the audio properties from the TTA1 header, so that len/info/cue don't have to wait for
+ * 'ttaenc', which decodes the whole file before it sends anything
+ */
+{
+  unsigned char buf[TTA_HEADER_SIZE];
+  wshort channels,bits_per_sample;
+
+  if (TTA_HEADER_SIZE != sniff_read(sb,0,buf,TTA_HEADER_SIZE))
+    return FALSE;
+
+  /* encrypted files need a password, which only the decoder can ask for */
+  if (tagcmp(buf,(unsigned char *)TTA_MAGIC) || TTA_FORMAT_SIMPLE != uchar_to_ushort_le(buf+4))
+    return FALSE;
+
+  channels = uchar_to_ushort_le(buf+6);
+  bits_per_sample = uchar_to_ushort_le(buf+8);
+
+  /* the in-process decoder handles more channels than 'ttaenc' */
+  if (native_decoding()) {
+    if (!tta_decode_supported(channels,bits_per_sample))
+      return FALSE;
+  }
+  else if (channels > 2 || (8 != bits_per_sample && 16 != bits_per_sample && 24 != bits_per_sample))
+    return FALSE;
+
+  return probe_canonical_header(info,channels,bits_per_sample,uchar_to_ulong_le(buf+10),uchar_to_ulong_le(buf+14));
+}
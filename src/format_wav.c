@@ -17,13 +17,14 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "format.h"
 
 CVSID("$Id: format_wav.c,v 1.61 2009/03/11 17:18:01 jason Exp $")
 
 static FILE *open_for_input(char *,proc_info *);
 static FILE *open_for_output(char *,proc_info *);
-static bool is_our_file(char *);
+static bool is_our_file(sniff_buffer *);
 
 #define WAVPACK_MAGIC "wvpk"
 
@@ -50,6 +51,7 @@ format_module format_wav = {
   open_for_output,
   NULL,
   NULL,
+  NULL,
   NULL
 };
 
@@ -68,37 +70,42 @@ static FILE *open_for_output(char *filename,proc_info *pinfo)
   return open_output(filename);
 }
 
-static bool is_our_file(char *filename)
+static bool is_our_file(sniff_buffer *sb)
 {
   wave_info *info;
   unsigned char buf[4];
+  int cached;
 
   if (NULL == (info = new_wave_info(NULL)))
     st_error("could not allocate memory for WAVE info in wav check");
 
-  info->filename = filename;
+  info->filename = sb->filename;
+  info->input_format = &format_wav;
+
+  /* hand the sniffed bytes to the header parser, and let it continue from the file if the header is longer */
+  cached = min(sb->size,HEADER_CACHE_SIZE);
+  memcpy(info->header_cache,sb->data,cached);
+  info->header_cached = cached;
+  info->header_cache_pos = 0;
 
-  if (NULL == (info->input = open_input(filename))) {
+  if (fseek(sb->file,(long)sb->id3v2_tag_size + cached,SEEK_SET)) {
     st_free(info);
     return FALSE;
   }
 
-  info->input_format = &format_wav;
+  info->input = sb->file;
 
   if (!verify_wav_header(info)) {
-    fclose(info->input);
     st_free(info);
     return FALSE;
   }
 
   /* WavPack header might follow RIFF header - make sure this isn't a WavPack file */
-  if (4 != fread(buf,1,4,info->input)) {
-    fclose(info->input);
+  if (4 != sniff_read(sb,(long)info->header_size,buf,4)) {
     st_free(info);
     return TRUE;
   }
 
-  fclose(info->input);
   st_free(info);
 
   if (tagcmp(buf,(unsigned char *)WAVPACK_MAGIC))
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <ctype.h>
 #include "format.h"
+#include "codec.h"
 
 CVSID("$Id: format_wv.c,v 1.72 2009/03/11 17:18:01 jason Exp $")
 
@@ -28,6 +29,9 @@ CVSID("$Id: format_wv.c,v 1.72 2009/03/11 17:18:01 jason Exp $")
 
 #define WAVPACK_MAGIC "wvpk"
 #define WV_COMMON_HEADER_SIZE 10
+#define WV_SCAN_SIZE 4096
+
+static char default_decoder[] = WVUNPACK;
 
 #ifdef WIN32
 static char default_decoder_args[] = "-q -y " FILENAME_PLACEHOLDER " -";
@@ -52,9 +56,22 @@ typedef struct _WavpackHeader3 {
 } WavpackHeader3;
 
 /* definitions for version 4 */
+#define BYTES_STORED         3
+#define MONO_FLAG            4
 #define HYBRID_FLAG          8
+#define FLOAT_DATA        0x80
+#define INITIAL_BLOCK    0x800
+#define FINAL_BLOCK     0x1000
+#define SHIFT_LSB           13
+#define SHIFT_MASK  (0x1fL << SHIFT_LSB)
+#define SRATE_LSB           23
+#define SRATE_MASK   (0xfL << SRATE_LSB)
+#define ID_UNIQUE         0x3f
+#define ID_ODD_SIZE       0x40
+#define ID_LARGE          0x80
 #define ID_WVC_BITSTREAM  0xb  /* these metadata identify .wvc */
 #define ID_SHAPING_WEIGHTS  0x7
+#define ID_RIFF_HEADER    0x21  /* original RIFF header, which wvunpack sends verbatim */
 #define WavpackHeader4Format "4LS2LLLLL"
 
 typedef struct _WavpackHeader4 {
@@ -65,7 +82,12 @@ typedef struct _WavpackHeader4 {
   int total_samples, block_index, block_samples, flags, crc;
 } WavpackHeader4;
 
-static bool is_our_file(char *);
+static const wlong sample_rates[] = { 6000, 8000, 9600, 11025, 12000, 16000, 22050,
+  24000, 32000, 44100, 48000, 64000, 88200, 96000, 192000 };
+
+static bool is_our_file(sniff_buffer *);
+static FILE *open_for_input(char *,proc_info *);
+static bool probe_header(sniff_buffer *,wave_info *);
 
 format_module format_wv = {
   "wv",
@@ -81,16 +103,17 @@ format_module format_wv = {
   NULL,
   0,
   "wv",
-  WVUNPACK,
+  default_decoder,
   default_decoder_args,
   WAVPACK,
   default_encoder_args,
   is_our_file,
+  open_for_input,
   NULL,
   NULL,
   NULL,
   NULL,
-  NULL
+  probe_header
 };
 
 static char *filespec_ext(char *filespec)
@@ -141,9 +164,9 @@ static void little_endian_to_native (void *data, char *format)
   }
 }
 
-static bool file_exists_with_alternate_extension(char *filename,char *ext)
+static bool file_exists_with_alternate_extension(char *filename,char *ext,char *wvc_filename)
+/* checks for filename with its extension replaced by ext, leaving the name it tried in wvc_filename */
 {
-  char wvc_filename[FILENAME_SIZE];
   char *extp;
   FILE *f;
 
@@ -164,94 +187,73 @@ static bool file_exists_with_alternate_extension(char *filename,char *ext)
   return FALSE;
 }
 
-static long get_header_offset(FILE *f)
+static bool find_correction_file(char *filename,char *wvc_filename)
 {
-  unsigned char buf[4];
-  long curpos;
+  return (file_exists_with_alternate_extension(filename,".wvc",wvc_filename) ||
+          file_exists_with_alternate_extension(filename,".WVC",wvc_filename));
+}
 
-  buf[0] = 'x';
-  buf[1] = 'x';
-  buf[2] = 'x';
-  buf[3] = 'x';
+static long get_header_offset(sniff_buffer *sb)
+{
+  unsigned char buf[WV_SCAN_SIZE];
+  long offset;
+  int i,bytes;
 
   /* like WavPack, we check the first 1 meg of the file for a header. */
-  /* unlike WavPack, we do it in the most inefficient way possible.   */
 
-  for (curpos=0;curpos<1024*1024;curpos++) {
-    buf[0] = buf[1];
-    buf[1] = buf[2];
-    buf[2] = buf[3];
-    buf[3] = fgetc(f);
-
-    if (feof(f)) {
+  for (offset=0;offset<1024*1024;offset+=bytes-3) {
+    if ((bytes = sniff_read(sb,offset,buf,WV_SCAN_SIZE)) < 4)
       return -1;
-    }
 
-    if (!tagcmp(buf,(unsigned char *)WAVPACK_MAGIC)) {
-      return curpos - 3;
+    for (i=0;i<=bytes-4 && offset+i+4<=1024*1024;i++) {
+      if (!tagcmp(buf+i,(unsigned char *)WAVPACK_MAGIC))
+        return offset + i;
     }
+
+    if (bytes < WV_SCAN_SIZE)
+      return -1;
   }
 
   return -1;
 }
 
-static bool is_our_file(char *filename)
+static bool is_our_file(sniff_buffer *sb)
 {
-  wave_info *info;
   unsigned char wph[64];
   WavpackHeader3 *wph3;
   WavpackHeader4 *wph4;
+  char wvc_filename[FILENAME_SIZE];
   char first_id;
   int remaining_bytes;
   long header_offset;
+  char *filename = sb->filename;
 
-  if (NULL == (info = new_wave_info(NULL)))
-    st_error("could not allocate memory for WAVE info in wv check");
-
-  info->filename = filename;
-
-  if (NULL == (info->input = open_input(filename))) {
-    st_free(info);
+  if (-1 == (header_offset = get_header_offset(sb)))
     return FALSE;
-  }
-
-  if (-1 == (header_offset = get_header_offset(info->input))) {
-    fclose(info->input);
-    st_free(info);
-    return FALSE;
-  }
-
-  fseek(info->input,header_offset,SEEK_SET);
 
   /* read up to size of largest header, making sure we read enough to fill the smallest header */
   memset((void *)wph,0,64);
 
-  if (fread(&wph,1,WV_COMMON_HEADER_SIZE,info->input) != WV_COMMON_HEADER_SIZE) {
-    fclose(info->input);
-    st_free(info);
+  if (sniff_read(sb,header_offset,wph,WV_COMMON_HEADER_SIZE) != WV_COMMON_HEADER_SIZE)
     return FALSE;
-  }
 
   if (wph[9] >= 4) {
     /* we're dealing with a version 4+ file */
 
     remaining_bytes = sizeof(WavpackHeader4) - WV_COMMON_HEADER_SIZE;
-    if (fread(wph+WV_COMMON_HEADER_SIZE,1,remaining_bytes,info->input) != remaining_bytes) {
-      fclose(info->input);
-      st_free(info);
+    if (sniff_read(sb,header_offset+WV_COMMON_HEADER_SIZE,wph+WV_COMMON_HEADER_SIZE,remaining_bytes) != remaining_bytes)
       return FALSE;
-    }
 
-    first_id = getc(info->input) & 0x1f;
+    if (1 != sniff_read(sb,header_offset+sizeof(WavpackHeader4),(unsigned char *)&first_id,1))
+      first_id = EOF;
 
-    fclose(info->input);
-    st_free(info);
+    first_id &= 0x1f;
 
     wph4 = (WavpackHeader4 *)wph;
 
     little_endian_to_native(wph4,WavpackHeader4Format);
 
-    if (tagcmp((unsigned char *)wph4->ckID,(unsigned char *)WAVPACK_MAGIC) || wph4->version < 4 || wph4->version > 0x40f) {
+    if (tagcmp((unsigned char *)wph4->ckID,(unsigned char *)WAVPACK_MAGIC) || wph4->version < 4 || wph4->version > 0x410) {
       return FALSE;
     }
 
@@ -266,7 +268,7 @@ static bool is_our_file(char *filename)
 
       if (wph4->flags & HYBRID_FLAG) {
         /* hybrid */
-        if (file_exists_with_alternate_extension(filename,".wvc") || file_exists_with_alternate_extension(filename,".WVC"))
+        if (find_correction_file(filename,wvc_filename))
           return TRUE;
 
         /* lossy */
@@ -282,14 +284,8 @@ static bool is_our_file(char *filename)
   /* we're dealing with an older file */
 
   remaining_bytes = sizeof(WavpackHeader3) - WV_COMMON_HEADER_SIZE;
-  if (fread(wph+WV_COMMON_HEADER_SIZE,1,remaining_bytes,info->input) != remaining_bytes) {
-    fclose(info->input);
-    st_free(info);
+  if (sniff_read(sb,header_offset+WV_COMMON_HEADER_SIZE,wph+WV_COMMON_HEADER_SIZE,remaining_bytes) != remaining_bytes)
     return FALSE;
-  }
-
-  fclose(info->input);
-  st_free(info);
 
   wph3 = (WavpackHeader3 *)wph;
 
@@ -309,7 +305,7 @@ static bool is_our_file(char *filename)
 
   if (wph3->bits) {
     /* hybrid */
-    if (file_exists_with_alternate_extension(filename,".wvc") || file_exists_with_alternate_extension(filename,".WVC"))
+    if (find_correction_file(filename,wvc_filename))
       return TRUE;
 
     /* lossy */
@@ -320,3 +316,102 @@ static bool is_our_file(char *filename)
   /* lossless */
   return TRUE;
 }
+
+static bool native_decoding()
+/* files are decoded in-process, unless a decoder was named with -i or in the environment */
+{
+  return (format_wv.decoder == default_decoder);
+}
+
+static FILE *open_for_input(char *filename,proc_info *pinfo)
+{
+  char wvc_filename[FILENAME_SIZE];
+  FILE *input;
+
+  if (native_decoding()) {
+    if ((input = wv_decode_open(filename,find_correction_file(filename,wvc_filename) ? wvc_filename : NULL))) {
+      pinfo->pid = NO_CHILD_PID;
+      return input;
+    }
+
+    st_debug1("can't decode file in-process, falling back to [%s]: [%s]",format_wv.decoder,filename);
+  }
+
+  return launch_input(&format_wv,filename,pinfo);
+}
+
+static bool probe_header(sniff_buffer *sb,wave_info *info)
+/* fills out info from the first block of a version 4 file - from the original RIFF header if one was
+ * stored, since that's what wvunpack sends, otherwise from the block header.
+ */
+{
+  unsigned char wph[sizeof(WavpackHeader4)],riff_header[HEADER_CACHE_SIZE],id_size[4];
+  WavpackHeader4 *wph4;
+  long header_offset,pos,block_end,data_size;
+  wshort channels,bits_per_sample;
+  int srate_index;
+
+  if (-1 == (header_offset = get_header_offset(sb)))
+    return FALSE;
+
+  if (sniff_read(sb,header_offset,wph,sizeof(WavpackHeader4)) != sizeof(WavpackHeader4))
+    return FALSE;
+
+  wph4 = (WavpackHeader4 *)wph;
+
+  little_endian_to_native(wph4,WavpackHeader4Format);
+
+  if (tagcmp((unsigned char *)wph4->ckID,(unsigned char *)WAVPACK_MAGIC) || wph4->version < 4 || wph4->version > 0x410)
+    return FALSE;
+
+  /* look through the metadata sub-blocks for the original RIFF header */
+  pos = header_offset + sizeof(WavpackHeader4);
+  block_end = header_offset + 8 + (long)(unsigned int)wph4->ckSize;
+
+  while (pos + 2 <= block_end) {
+    if (2 != sniff_read(sb,pos,id_size,2))
+      return FALSE;
+
+    if (id_size[0] & ID_LARGE) {
+      if (4 != sniff_read(sb,pos,id_size,4))
+        return FALSE;
+      data_size = ((long)id_size[1] | ((long)id_size[2] << 8) | ((long)id_size[3] << 16)) * 2;
+      pos += 4;
+    }
+    else {
+      data_size = (long)id_size[1] * 2;
+      pos += 2;
+    }
+
+    if ((id_size[0] & ID_UNIQUE) == ID_RIFF_HEADER) {
+      if (id_size[0] & ID_ODD_SIZE)
+        data_size--;
+
+      if (data_size > HEADER_CACHE_SIZE || data_size != sniff_read(sb,pos,riff_header,(int)data_size))
+        return FALSE;
+
+      if (!probe_wav_header(info,riff_header,(int)data_size))
+        return FALSE;
+
+      /* make sure the stored header agrees with the number of samples that will be decoded */
+      if (-1 != wph4->total_samples && info->data_size != (wlong)(unsigned int)wph4->total_samples * info->block_align)
+        return FALSE;
+
+      return TRUE;
+    }
+
+    pos += data_size;
+  }
+
+  /* no stored header, so wvunpack creates one - predictable only for plain mono or stereo integer data of known length */
+  srate_index = (int)((wph4->flags & SRATE_MASK) >> SRATE_LSB);
+
+  if (-1 == wph4->total_samples || (wph4->flags & FLOAT_DATA) || srate_index >= (int)(sizeof(sample_rates)/sizeof(sample_rates[0])) ||
+      (wph4->flags & (INITIAL_BLOCK | FINAL_BLOCK)) != (INITIAL_BLOCK | FINAL_BLOCK))
+    return FALSE;
+
+  channels = (wph4->flags & MONO_FLAG) ? 1 : 2;
+  bits_per_sample = (wshort)(((wph4->flags & BYTES_STORED) + 1) * 8 - ((wph4->flags & SHIFT_MASK) >> SHIFT_LSB));
+
+  return probe_canonical_header(info,channels,bits_per_sample,sample_rates[srate_index],(wlong)(unsigned int)wph4->total_samples);
+}
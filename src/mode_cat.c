@@ -123,7 +123,7 @@ static bool cat_file(wave_info *info)
     st_error("could not allocate %d bytes for WAVE header",info->header_size);
   }
 
-  if (read_n_bytes(info->input,header,info->header_size,NULL) != info->header_size) {
+  if (read_header_bytes(info,header,info->header_size) != info->header_size) {
     prog_error(&proginfo);
     st_error("error while reading %d-byte WAVE header",info->header_size);
   }
@@ -112,7 +112,7 @@ static bool conv_file(wave_info *info)
     goto cleanup;
   }
 
-  if (read_n_bytes(info->input,header,info->header_size,NULL) != info->header_size) {
+  if (read_header_bytes(info,header,info->header_size) != info->header_size) {
     prog_error(&proginfo);
     st_warning("error while discarding %d-byte WAVE header -- skipping.",info->header_size);
     goto cleanup;
@@ -266,22 +266,13 @@ static bool process_file(char *filename)
 
 static bool process(int argc,char **argv,int start)
 {
-  char *filename;
-  bool success;
-
-  success = TRUE;
-
   if (read_from_terminal) {
     return conv_terminal();
   }
 
   input_init(start,argc,argv);
 
-  while ((filename = input_get_filename())) {
-    success = (process_file(filename) && success);
-  }
-
-  return success;
+  return run_input_jobs(process_file,NULL);
 }
 
 static bool conv_main(int argc,char **argv)
@@ -218,7 +218,7 @@ static bool reopen_input_file(int i,progress_info *proginfo)
     return FALSE;
   }
 
-  if (read_n_bytes(files[i]->input,header,files[i]->header_size,NULL) != files[i]->header_size) {
+  if (read_header_bytes(files[i],header,files[i]->header_size) != files[i]->header_size) {
     prog_error(proginfo);
     st_warning("error while reading %d-byte WAVE header",files[i]->header_size);
     st_free(header);
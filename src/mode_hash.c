@@ -18,11 +18,19 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
-#ifdef HAVE_CONFIG_H
 #include "config.h"
-#endif
 
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_SHA_INTRINSICS
+#include <cpuid.h>
+#endif
+#if defined(HAVE_SHA_INTRINSICS) || defined(HAVE_AVX2_INTRINSICS) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "mode.h"
 
 CVSID("$Id: mode_hash.c,v 1.93 2009/03/17 17:23:05 jason Exp $")
@@ -33,7 +41,7 @@ static void hash_help(void);
 mode_module mode_hash = {
   "hash",
   "shnhash",
-  "Computes the MD5 or SHA1 fingerprint of PCM WAVE data",
+  "Computes MD5, SHA1, SHA256, XXH128, BLAKE3, CRC32 and/or AccurateRip fingerprints of PCM WAVE data",
   CVSIDSTR,
   FALSE,
   hash_main,
@@ -42,23 +50,230 @@ mode_module mode_hash = {
 
 enum {
   HASH_MD5,
-  HASH_SHA1
+  HASH_SHA1,
+  HASH_SHA256,
+  HASH_XXH128,
+  HASH_BLAKE3,
+  HASH_CRC32,
+  HASH_CRC32NN,
+  HASH_ARV1,
+  HASH_ARV2,
+  NUM_HASHES
+};
+
+typedef struct _hash_type {
+  char *name;        /* as given to -t */
+  int   size;        /* bytes in a fingerprint */
+  bool  prefixed;    /* whether fingerprints are prefixed with the name - MD5 and SHA1 ones aren't, as they never were */
+  bool  cd_only;     /* whether it's only defined for CD-quality data */
+} hash_type;
+
+/* in the same order as above */
+static hash_type hash_types[] = {
+  { "md5",     16, FALSE, FALSE },
+  { "sha1",    20, FALSE, FALSE },
+  { "sha256",  32, TRUE,  FALSE },
+  { "xxh128",  16, TRUE,  FALSE },
+  { "blake3",  32, TRUE,  FALSE },
+  { "crc32",   4,  TRUE,  FALSE },
+  { "crc32nn", 4,  TRUE,  TRUE  },
+  { "arv1",    4,  TRUE,  TRUE  },
+  { "arv2",    4,  TRUE,  TRUE  },
+  { NULL,      0,  FALSE, FALSE }
 };
 
 #define COMPOSITE "composite"
 
+#define HASH_MAX_TRACKS 256
+
 static unsigned long maxbytes;
-static unsigned char audio_hash[32];
+static unsigned char audio_hash[HASH_MAX_TRACKS][NUM_HASHES][32];
+
+/* the fingerprints of each track are finished as its end goes by - without a split point file, each input file
+ * (or, for a composite fingerprint, all of them together) is one track
+ */
+static char *split_point_file = NULL;
+static wlong track_ends[HASH_MAX_TRACKS];      /* offset into the WAVE data at which each track ends */
+static int num_tracks = 1;
+static int first_track = 0;                     /* 1 when a CUE sheet puts the first split point after a pregap */
+static int current_track;
+static wlong track_bytes_left;
+static bool track_is_first;
+static bool track_is_last;
+static char *first_filename = NULL;
+static char *last_filename = NULL;
 
 static bool composite_hash = FALSE;
-static int remaining_bytes = 0;
 static int num_processed = 0;
 static int numfiles;
-static int hash_algorithm = HASH_MD5;
+static int hash_list[NUM_HASHES] = { HASH_MD5 };   /* fingerprints to generate, in the order they're printed */
+static int num_hashes = 1;
 static progress_info proginfo;
 
 static wave_info **files;
 
+/* WAVE data is read by a separate thread into a ring of large buffers, so that the decoder (or disk) and the
+ * digest can work at the same time, and so that a whole buffer is handed to the digest at once
+ */
+#define HASH_BUFFER_SIZE 4194304
+#define HASH_BUFFERS     3
+
+#if HASH_BUFFER_SIZE % 64 != 0
+# error "invalid HASH_BUFFER_SIZE"
+#endif
+
+typedef struct _hash_reader {
+  FILE            *stream;
+  unsigned long    bytes_left;                  /* WAVE data not yet read from the stream */
+  unsigned char   *data[HASH_BUFFERS];
+  unsigned long    bytes[HASH_BUFFERS];         /* how much of each buffer was filled */
+  bool             full[HASH_BUFFERS];
+  int              next;                        /* buffer to be hashed next */
+  int              status;                      /* 0 if all data was read, 1 on a read error, 2 if it ended early */
+  bool             done;                        /* no more buffers will be filled */
+  bool             threaded;
+  pthread_t        id;
+  pthread_mutex_t  lock;
+  pthread_cond_t   filled;
+  pthread_cond_t   emptied;
+} hash_reader;
+
+static hash_reader reader;
+
+static unsigned long fill_buffer(int i)
+/* reads the next chunk of WAVE data into buffer i, noting whether the stream came up short */
+{
+  unsigned long wanted,got;
+
+  wanted = min(reader.bytes_left,HASH_BUFFER_SIZE);
+
+  got = (unsigned long)read_n_bytes(reader.stream,reader.data[i],(int)wanted,NULL);
+
+  if (got != wanted)
+    reader.status = ferror(reader.stream) ? 1 : 2;
+
+  return got;
+}
+
+static void *reading_thread(void *arg)
+{
+  unsigned long got;
+  int i = 0;
+
+  pthread_mutex_lock(&reader.lock);
+
+  while (!reader.done) {
+    while (reader.full[i])
+      pthread_cond_wait(&reader.emptied,&reader.lock);
+
+    pthread_mutex_unlock(&reader.lock);
+
+    got = fill_buffer(i);
+
+    pthread_mutex_lock(&reader.lock);
+
+    reader.bytes[i] = got;
+    reader.full[i] = TRUE;
+    reader.bytes_left -= got;
+    if (0 == reader.bytes_left || 0 != reader.status)
+      reader.done = TRUE;
+    pthread_cond_broadcast(&reader.filled);
+
+    i = (i + 1) % HASH_BUFFERS;
+  }
+
+  pthread_mutex_unlock(&reader.lock);
+
+  return NULL;
+}
+
+static void start_reading(FILE *stream,unsigned long bytes)
+/* starts reading 'bytes' bytes of WAVE data from 'stream' - in this thread instead, as buffers are needed, if
+ * no thread can be started
+ */
+{
+  int i;
+
+  for (i=0;i<HASH_BUFFERS;i++) {
+    if (NULL == reader.data[i] && NULL == (reader.data[i] = malloc(HASH_BUFFER_SIZE)))
+      st_error("could not allocate %d-byte hash buffer",HASH_BUFFER_SIZE);
+    reader.full[i] = FALSE;
+  }
+
+  reader.stream = stream;
+  reader.bytes_left = bytes;
+  reader.next = 0;
+  reader.status = 0;
+  reader.done = FALSE;
+
+  pthread_mutex_init(&reader.lock,NULL);
+  pthread_cond_init(&reader.filled,NULL);
+  pthread_cond_init(&reader.emptied,NULL);
+
+  reader.threaded = (0 == pthread_create(&reader.id,NULL,reading_thread,NULL));
+
+  if (!reader.threaded)
+    st_debug1("could not start reading thread, so data will be read and hashed in turn");
+}
+
+static unsigned char *next_buffer(unsigned long *bytes)
+/* waits for the next buffer of WAVE data, returning NULL once all of it has been hashed */
+{
+  if (!reader.threaded) {
+    if (reader.done)
+      return NULL;
+    *bytes = fill_buffer(0);
+    reader.bytes_left -= *bytes;
+    if (0 == reader.bytes_left || 0 != reader.status)
+      reader.done = TRUE;
+    return reader.data[0];
+  }
+
+  pthread_mutex_lock(&reader.lock);
+
+  while (!reader.full[reader.next] && !reader.done)
+    pthread_cond_wait(&reader.filled,&reader.lock);
+
+  pthread_mutex_unlock(&reader.lock);
+
+  if (!reader.full[reader.next])
+    return NULL;
+
+  *bytes = reader.bytes[reader.next];
+
+  return reader.data[reader.next];
+}
+
+static void release_buffer(unsigned long bytes)
+/* hands a hashed buffer back to the reading thread, and shows the progress made */
+{
+  proginfo.bytes_written += bytes;
+  prog_update(&proginfo);
+
+  if (!reader.threaded)
+    return;
+
+  pthread_mutex_lock(&reader.lock);
+  reader.full[reader.next] = FALSE;
+  reader.next = (reader.next + 1) % HASH_BUFFERS;
+  pthread_cond_signal(&reader.emptied);
+  pthread_mutex_unlock(&reader.lock);
+}
+
+static int stop_reading()
+{
+  if (reader.threaded)
+    pthread_join(reader.id,NULL);
+
+  pthread_mutex_destroy(&reader.lock);
+  pthread_cond_destroy(&reader.filled);
+  pthread_cond_destroy(&reader.emptied);
+
+  return reader.status;
+}
+
+#define HASH_MAX_THREADS 16
+
 /* shdtool: modified GNU coreutils 5.93 md5/sha1 routines below */
 
 /* md5.c - Functions to compute MD5 message digest of files or memory blocks
@@ -93,7 +308,6 @@ static wave_info **files;
 # define md5_process_bytes __md5_process_bytes
 # define md5_finish_ctx __md5_finish_ctx
 # define md5_read_ctx __md5_read_ctx
-# define md5_stream __md5_stream
 # define md5_buffer __md5_buffer
 #endif
 
@@ -109,16 +323,9 @@ static wave_info **files;
 #endif
 
 /* shdtool: begin common md5/sha1 definitions */
-#define BLOCKSIZE 4096
-#if BLOCKSIZE % 64 != 0
-# error "invalid BLOCKSIZE"
-#endif
-
 /* This array contains the bytes used to pad the buffer to the next
    64-byte boundary.  (RFC 1321, 3.1: Step 1)  */
 static const unsigned char fillbuf[64] = { 0x80, 0 /* , 0, 0, ...  */ };
-
-char global_buffer[BLOCKSIZE + 72];
 /* shdtool: end common md5/sha1 definitions */
 
 /* shdtool: global md5 context */
@@ -185,102 +392,6 @@ md5_finish_ctx (struct md5_ctx *ctx, void *resbuf)
   return md5_read_ctx (ctx, resbuf);
 }
 
-/* Compute MD5 message digest for bytes read from STREAM.  The
-   resulting message digest number will be written into the 16 bytes
-   beginning at RESBLOCK.  */
-int
-md5_stream (FILE *stream, void *resblock)
-{
-  size_t sum;
-  unsigned long totalbytes = 0;  /* shdtool */
-
-  /* shdtool: */
-  if (0 == maxbytes)
-    return 0;
-
-  /* Initialize the computation context.  */
-  /* shdtool: now done outside of this function */
-/*
-  md5_init_ctx (&md5_global_ctx);
-*/
-
-  /* Iterate over full file contents.  */
-  /* shdtool: stop after WAVE data is read */
-  while (1)
-    {
-      /* We read the file in blocks of BLOCKSIZE bytes.  One call of the
-	 computation function processes the whole buffer so that with the
-	 next round of the loop another block can be read.  */
-      size_t n;
-      sum = 0;
-
-      /* Read block.  Take care for partial reads.  */
-
-      while (1)
-	{
-	  n = read_n_bytes(stream, (unsigned char *)(global_buffer + sum), BLOCKSIZE - sum, &proginfo);
-
-	  sum += n;
-      totalbytes += n;  /* shdtool */
-
-      /* shdtool: if total bytes read exceeded the WAVE data size, discard the rest and adjust sum */
-      if (totalbytes > maxbytes) {
-        sum -= (totalbytes - maxbytes);
-        totalbytes = maxbytes;
-      }
-
-	  if (sum == BLOCKSIZE)
-	    break;
-
-	  if (n == 0)
-	    {
-	      /* Check for the error flag IFF N == 0, so that we don't
-		 exit the loop after a partial read due to e.g., EAGAIN
-		 or EWOULDBLOCK.  */
-	      if (ferror (stream))
-		return 1;
-	      goto md5_process_partial_block;
-	    }
-
-	  /* We've read at least one byte, so ignore errors.  But always
-	     check for EOF, since feof may be true even though N > 0.
-	     Otherwise, we could end up calling fread after EOF.  */
-	  if (feof (stream))
-	    goto md5_process_partial_block;
-	}
-
-      /* Process buffer with BLOCKSIZE bytes.  Note that
-			BLOCKSIZE % 64 == 0
-       */
-      md5_process_block (global_buffer, BLOCKSIZE, &md5_global_ctx);
-    }
-
- md5_process_partial_block:;
-
-  /* Process any remaining bytes.  */
-  /* shdtool: now done outside this function */
-/*
-  if (sum > 0)
-    md5_process_bytes (global_buffer, sum, &md5_global_ctx);
-*/
-
-  /* shdtool: keep track of partial blocks */
-  remaining_bytes = sum;
-
-  /* Construct result in desired memory.  */
-  /* shdtool: now done outside this function */
-/*
-  md5_finish_ctx (&md5_global_ctx, resblock);
-*/
-
-  /* shdtool: use custom return code */
-/*
-  return 0;
-*/
-
-  return (totalbytes == maxbytes) ? 0 : 2;
-}
-
 /* Compute MD5 message digest for LEN bytes beginning at BUFFER.  The
    result is always in little endian byte order, so that a byte-wise
    output yields to the wanted ASCII representation of the message
@@ -639,101 +750,6 @@ sha1_finish_ctx (struct sha1_ctx *ctx, void *resbuf)
   return sha1_read_ctx (ctx, resbuf);
 }
 
-/* Compute SHA1 message digest for bytes read from STREAM.  The
-   resulting message digest number will be written into the 16 bytes
-   beginning at RESBLOCK.  */
-int
-sha1_stream (FILE *stream, void *resblock)
-{
-  size_t sum;
-  unsigned long totalbytes = 0;  /* shdtool */
-
-  /* shdtool: */
-  if (0 == maxbytes)
-    return 0;
-
-  /* Initialize the computation context.  */
-  /* shdtool: now done outside of this function */
-/*
-  sha1_init_ctx (&sha1_global_ctx);
-*/
-
-  /* Iterate over full file contents.  */
-  /* shdtool: stop after WAVE data is read */
-  while (1)
-    {
-      /* We read the file in blocks of BLOCKSIZE bytes.  One call of the
-	 computation function processes the whole buffer so that with the
-	 next round of the loop another block can be read.  */
-      size_t n;
-      sum = 0;
-
-      /* Read block.  Take care for partial reads.  */
-      while (1)
-	{
-	  n = read_n_bytes(stream, (unsigned char *)(global_buffer + sum), BLOCKSIZE - sum, &proginfo);
-
-	  sum += n;
-      totalbytes += n;  /* shdtool */
-
-      /* shdtool: if total bytes read exceeded the WAVE data size, discard the rest and adjust sum */
-      if (totalbytes > maxbytes) {
-        sum -= (totalbytes - maxbytes);
-        totalbytes = maxbytes;
-      }
-
-	  if (sum == BLOCKSIZE)
-	    break;
-
-	  if (n == 0)
-	    {
-	      /* Check for the error flag IFF N == 0, so that we don't
-		 exit the loop after a partial read due to e.g., EAGAIN
-		 or EWOULDBLOCK.  */
-	      if (ferror (stream))
-		return 1;
-	      goto sha1_process_partial_block;
-	    }
-
-	  /* We've read at least one byte, so ignore errors.  But always
-	     check for EOF, since feof may be true even though N > 0.
-	     Otherwise, we could end up calling fread after EOF.  */
-	  if (feof (stream))
-	    goto sha1_process_partial_block;
-	}
-
-      /* Process buffer with BLOCKSIZE bytes.  Note that
-			BLOCKSIZE % 64 == 0
-       */
-      sha1_process_block (global_buffer, BLOCKSIZE, &sha1_global_ctx);
-    }
-
- sha1_process_partial_block:;
-
-  /* Process any remaining bytes.  */
-  /* shdtool: now done outside this function */
-/*
-  if (sum > 0)
-    sha1_process_bytes (global_buffer, sum, &sha1_global_ctx);
-*/
-
-  /* shdtool: keep track of partial blocks */
-  remaining_bytes = sum;
-
-  /* Construct result in desired memory.  */
-  /* shdtool: now done outside this function */
-/*
-  sha1_finish_ctx (&sha1_global_ctx, resblock);
-*/
-
-  /* shdtool: use custom return code */
-/*
-  return 0;
-*/
-
-  return (totalbytes == maxbytes) ? 0 : 2;
-}
-
 /* Compute MD5 message digest for LEN bytes beginning at BUFFER.  The
    result is always in little endian byte order, so that a byte-wise
    output yields to the wanted ASCII representation of the message
@@ -833,6 +849,86 @@ sha1_process_bytes (const void *buffer, size_t len, struct sha1_ctx *ctx)
 #define F3(B,C,D) ( ( B & C ) | ( D & ( B | C ) ) )
 #define F4(B,C,D) (B ^ C ^ D)
 
+#ifdef HAVE_SHA_INTRINSICS
+/* shdtool: SHA1 using the SHA extensions found in newer x86 processors.
+   Each group of four rounds is one sha1rnds4 instruction, while
+   sha1msg1/sha1msg2 expand the message schedule four words at a time.
+   MSG(G % 4) holds the words used in group G.  */
+
+static bool
+have_sha_extensions (void)
+{
+  static int sha_extensions = -1;
+  unsigned int eax, ebx, ecx, edx;
+
+  if (-1 == sha_extensions)
+    {
+      sha_extensions = __get_cpuid (1, &eax, &ebx, &ecx, &edx)
+		       && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)
+		       && __get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx)
+		       && (ebx & bit_SHA);
+      if (sha_extensions)
+	st_debug2 ("using the processor's SHA extensions for SHA1");
+    }
+
+  return sha_extensions;
+}
+
+#define SHA1_GROUP(G)							\
+  do {									\
+    if ((G) < 4)							\
+      msg[G] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) words + (G)), mask); \
+    if (0 == (G))							\
+      e[0] = _mm_add_epi32 (e[0], msg[0]);				\
+    else								\
+      e[(G) % 2] = _mm_sha1nexte_epu32 (e[(G) % 2], msg[(G) % 4]);	\
+    e[((G) + 1) % 2] = abcd;						\
+    if ((G) >= 3 && (G) <= 18)						\
+      msg[((G) + 1) % 4] = _mm_sha1msg2_epu32 (msg[((G) + 1) % 4], msg[(G) % 4]); \
+    abcd = _mm_sha1rnds4_epu32 (abcd, e[(G) % 2], (G) / 5);		\
+    if ((G) >= 1 && (G) <= 16)						\
+      msg[((G) + 3) % 4] = _mm_sha1msg1_epu32 (msg[((G) + 3) % 4], msg[(G) % 4]); \
+    if ((G) >= 2 && (G) <= 17)						\
+      msg[((G) + 2) % 4] = _mm_xor_si128 (msg[((G) + 2) % 4], msg[(G) % 4]); \
+  } while (0)
+
+__attribute__ ((target ("sha,sse4.1")))
+static void
+sha1_process_block_sha_ext (const void *buffer, size_t len, struct sha1_ctx *ctx)
+{
+  const unsigned char *words = buffer;
+  const unsigned char *endp = words + len;
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e_save, e[2], msg[4];
+
+  abcd = _mm_set_epi32 (ctx->A, ctx->B, ctx->C, ctx->D);
+  e[0] = _mm_set_epi32 (ctx->E, 0, 0, 0);
+
+  while (words < endp)
+    {
+      abcd_save = abcd;
+      e_save = e[0];
+
+      SHA1_GROUP (0);  SHA1_GROUP (1);  SHA1_GROUP (2);  SHA1_GROUP (3);
+      SHA1_GROUP (4);  SHA1_GROUP (5);  SHA1_GROUP (6);  SHA1_GROUP (7);
+      SHA1_GROUP (8);  SHA1_GROUP (9);  SHA1_GROUP (10); SHA1_GROUP (11);
+      SHA1_GROUP (12); SHA1_GROUP (13); SHA1_GROUP (14); SHA1_GROUP (15);
+      SHA1_GROUP (16); SHA1_GROUP (17); SHA1_GROUP (18); SHA1_GROUP (19);
+
+      e[0] = _mm_sha1nexte_epu32 (e[0], e_save);
+      abcd = _mm_add_epi32 (abcd, abcd_save);
+
+      words += 64;
+    }
+
+  ctx->A = _mm_extract_epi32 (abcd, 3);
+  ctx->B = _mm_extract_epi32 (abcd, 2);
+  ctx->C = _mm_extract_epi32 (abcd, 1);
+  ctx->D = _mm_extract_epi32 (abcd, 0);
+  ctx->E = _mm_extract_epi32 (e[0], 3);
+}
+#endif
+
 /* Process LEN bytes of BUFFER, accumulating context into CTX.
    It is assumed that LEN % 64 == 0.
    Most of this code comes from GnuPG's cipher/sha1.c.  */
@@ -857,6 +953,15 @@ sha1_process_block (const void *buffer, size_t len, struct sha1_ctx *ctx)
   if (ctx->total[0] < len)
     ++ctx->total[1];
 
+#ifdef HAVE_SHA_INTRINSICS
+  /* shdtool: let the processor do the work, if it can */
+  if (have_sha_extensions ())
+    {
+      sha1_process_block_sha_ext (buffer, len, ctx);
+      return;
+    }
+#endif
+
 #define rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
 
 #define M(I) ( tm =   x[I&0x0f] ^ x[(I-14)&0x0f] \
@@ -969,141 +1074,1549 @@ sha1_process_block (const void *buffer, size_t len, struct sha1_ctx *ctx)
     }
 }
 
-/* shdtool-specific stuff starts here */
+/* shdtool: SHA256, XXH128, BLAKE3, CRC32 and AccurateRip below - the first three written from FIPS 180-4, the xxHash
+ * (XXH3) specification and the BLAKE3 paper, respectively.  all are byte-order independent, so no swapping macros are needed.
+ */
 
-static void hash_help()
+static uint32_t read_le32(const unsigned char *p)
 {
-  st_info("Usage: %s [OPTIONS] [files]\n",st_progname());
-  st_info("\n");
-  st_info("Mode-specific options:\n");
-  st_info("\n");
-  st_info("  -c      generate composite fingerprint from input files\n");
-  st_info("  -h      show this help screen\n");
-  st_info("  -m      generate MD5 fingerprints (default)\n");
-  st_info("  -s      generate SHA1 fingerprints\n");
-  st_info("\n");
+  return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
-static void parse(int argc,char **argv,int *first_arg)
+static uint64_t read_le64(const unsigned char *p)
 {
-  int c;
-
-  while ((c = st_getopt(argc,argv,"cms")) != -1) {
-    switch (c) {
-      case 'c':
-        composite_hash = TRUE;
-        break;
-      case 'm':
-        hash_algorithm = HASH_MD5;
-        break;
-      case 's':
-        hash_algorithm = HASH_SHA1;
-        break;
-    }
-  }
+  return ((uint64_t)read_le32(p)) | ((uint64_t)read_le32(p + 4) << 32);
+}
 
-  *first_arg = optind;
+static uint32_t read_be32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | ((uint32_t)p[3]);
 }
 
-void hash_init_ctx()
+static void write_be32(unsigned char *p,uint32_t v)
 {
-  switch (hash_algorithm) {
-    case HASH_MD5:
-      md5_init_ctx(&md5_global_ctx);
-      break;
-    case HASH_SHA1:
-      sha1_init_ctx(&sha1_global_ctx);
-      break;
-  }
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
 }
 
-int hash_stream(FILE *stream)
+static void write_be64(unsigned char *p,uint64_t v)
 {
-  switch (hash_algorithm) {
-    case HASH_MD5:
-      return md5_stream(stream,audio_hash);
-      break;
-    case HASH_SHA1:
-      return sha1_stream(stream,audio_hash);
-      break;
-  }
+  write_be32(p,(uint32_t)(v >> 32));
+  write_be32(p + 4,(uint32_t)v);
+}
 
-  return 3;
+static void write_le32(unsigned char *p,uint32_t v)
+{
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
 }
 
-void hash_process_bytes()
+#define ROTR32(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL64(x,n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/* SHA256 */
+
+typedef struct _sha256_ctx {
+  uint32_t      state[8];
+  uint64_t      total;
+  size_t        buflen;
+  unsigned char buffer[64];
+} sha256_ctx;
+
+static sha256_ctx sha256_global_ctx;
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static void sha256_init_ctx(sha256_ctx *ctx)
 {
-  switch (hash_algorithm) {
-    case HASH_MD5:
-      md5_process_bytes(global_buffer,remaining_bytes,&md5_global_ctx);
-      break;
-    case HASH_SHA1:
-      sha1_process_bytes(global_buffer,remaining_bytes,&sha1_global_ctx);
-      break;
-  }
+  memcpy(ctx->state,sha256_iv,sizeof(sha256_iv));
+  ctx->total = 0;
+  ctx->buflen = 0;
 }
 
-void hash_finish_ctx()
+static void sha256_process_block(const unsigned char *buffer,size_t len,sha256_ctx *ctx)
+/* processes len bytes of buffer, which must be a multiple of 64 */
 {
-  switch (hash_algorithm) {
-    case HASH_MD5:
-      md5_finish_ctx(&md5_global_ctx,audio_hash);
-      break;
-    case HASH_SHA1:
-      sha1_finish_ctx(&sha1_global_ctx,audio_hash);
-      break;
+  uint32_t w[64],a,b,c,d,e,f,g,h,t1,t2;
+  int i;
+
+  for (;len>=64;len-=64,buffer+=64) {
+    for (i=0;i<16;i++)
+      w[i] = read_be32(buffer + 4 * i);
+
+    for (i=16;i<64;i++)
+      w[i] = w[i-16] + (ROTR32(w[i-15],7) ^ ROTR32(w[i-15],18) ^ (w[i-15] >> 3))
+                     + w[i-7] + (ROTR32(w[i-2],17) ^ ROTR32(w[i-2],19) ^ (w[i-2] >> 10));
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+    for (i=0;i<64;i++) {
+      t1 = h + (ROTR32(e,6) ^ ROTR32(e,11) ^ ROTR32(e,25)) + (g ^ (e & (f ^ g))) + sha256_k[i] + w[i];
+      t2 = (ROTR32(a,2) ^ ROTR32(a,13) ^ ROTR32(a,22)) + ((a & b) | (c & (a | b)));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
   }
 }
 
-void hash_process_block()
+static void sha256_process_bytes(const unsigned char *buffer,size_t len,sha256_ctx *ctx)
 {
-  switch (hash_algorithm) {
-    case HASH_MD5:
-      md5_process_block(global_buffer,BLOCKSIZE,&md5_global_ctx);
-      break;
-    case HASH_SHA1:
-      sha1_process_block(global_buffer,BLOCKSIZE,&sha1_global_ctx);
-      break;
+  size_t add;
+
+  ctx->total += len;
+
+  if (ctx->buflen > 0) {
+    add = min(64 - ctx->buflen,len);
+    memcpy(ctx->buffer + ctx->buflen,buffer,add);
+    ctx->buflen += add;
+    buffer += add;
+    len -= add;
+    if (ctx->buflen < 64)
+      return;
+    sha256_process_block(ctx->buffer,64,ctx);
+    ctx->buflen = 0;
   }
+
+  sha256_process_block(buffer,len & ~(size_t)63,ctx);
+
+  memcpy(ctx->buffer,buffer + (len & ~(size_t)63),len & 63);
+  ctx->buflen = len & 63;
 }
 
-static void print_audio_hash(char *filename)
+static void sha256_finish_ctx(sha256_ctx *ctx,unsigned char *resbuf)
 {
-  int i,hash_hex_bytes = 0;
+  uint64_t bits = ctx->total << 3;
+  int i;
 
-  switch (hash_algorithm) {
-    case HASH_MD5:
-      hash_hex_bytes = 32;
-      break;
-    case HASH_SHA1:
-      hash_hex_bytes = 40;
-      break;
+  ctx->buffer[ctx->buflen++] = 0x80;
+
+  if (ctx->buflen > 56) {
+    memset(ctx->buffer + ctx->buflen,0,64 - ctx->buflen);
+    sha256_process_block(ctx->buffer,64,ctx);
+    ctx->buflen = 0;
   }
 
-  for (i=0;i<(hash_hex_bytes/2);i++)
-    st_output("%02x",audio_hash[i]);
+  memset(ctx->buffer + ctx->buflen,0,56 - ctx->buflen);
+  write_be64(ctx->buffer + 56,bits);
+  sha256_process_block(ctx->buffer,64,ctx);
 
-  st_output("  [shdtool]  %s\n",filename);
+  for (i=0;i<8;i++)
+    write_be32(resbuf + 4 * i,ctx->state[i]);
 }
 
-static bool generate_audio_hash_single(wave_info *info)
-{
-  unsigned char *header;
-  int retval;
-  bool success;
+/* XXH128 - the 128-bit variant of XXH3, with the default secret and no seed */
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1 0x165667919E3779F9ULL
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define XXH_SECRET_SIZE        192
+#define XXH_STRIPE_LEN         64
+#define XXH_STRIPES_PER_BLOCK  ((XXH_SECRET_SIZE - XXH_STRIPE_LEN) / 8)
+#define XXH_SECRET_LIMIT       (XXH_SECRET_SIZE - XXH_STRIPE_LEN)
+#define XXH_BUFFER_SIZE        256
+#define XXH_MIDSIZE_MAX        240
+
+static const unsigned char xxh_secret[XXH_SECRET_SIZE] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
 
-  success = FALSE;
+typedef struct _xxh128_ctx {
+  uint64_t      acc[8];
+  unsigned char buffer[XXH_BUFFER_SIZE];
+  size_t        buflen;
+  size_t        stripes;         /* stripes taken so far in the current block */
+  uint64_t      total;
+} xxh128_ctx;
 
-  proginfo.initialized = FALSE;
-  proginfo.filename2 = info->filename;
-  proginfo.filedesc2 = info->m_ss;
-  proginfo.bytes_total = info->data_size;
+static xxh128_ctx xxh128_global_ctx;
 
-  prog_update(&proginfo);
+typedef struct _xxh128_hash {
+  uint64_t low;
+  uint64_t high;
+} xxh128_hash;
 
-  if (!open_input_stream(info)) {
-    st_warning("could not reopen input file: [%s]",info->filename);
-    return FALSE;
+static xxh128_hash xxh_mult64to128(uint64_t a,uint64_t b)
+{
+  xxh128_hash r;
+#ifdef __SIZEOF_INT128__
+  /* __extension__ keeps -pedantic quiet about a type that ISO C lacks */
+  __extension__ typedef unsigned __int128 xxh_uint128;
+  xxh_uint128 p = (xxh_uint128)a * b;
+
+  r.low = (uint64_t)p;
+  r.high = (uint64_t)(p >> 64);
+#else
+  uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF),
+           hi_lo = (a >> 32) * (b & 0xFFFFFFFF),
+           lo_hi = (a & 0xFFFFFFFF) * (b >> 32),
+           hi_hi = (a >> 32) * (b >> 32),
+           cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+
+  r.high = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  r.low = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+#endif
+
+  return r;
+}
+
+static uint64_t xxh_mul128_fold64(uint64_t a,uint64_t b)
+{
+  xxh128_hash r = xxh_mult64to128(a,b);
+
+  return r.low ^ r.high;
+}
+
+static uint64_t xxh64_avalanche(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= XXH_PRIME_MX1;
+  h ^= h >> 32;
+
+  return h;
+}
+
+static uint64_t xxh_swap64(uint64_t x)
+{
+  return ((x << 56) & 0xff00000000000000ULL) | ((x << 40) & 0x00ff000000000000ULL) |
+         ((x << 24) & 0x0000ff0000000000ULL) | ((x <<  8) & 0x000000ff00000000ULL) |
+         ((x >>  8) & 0x00000000ff000000ULL) | ((x >> 24) & 0x0000000000ff0000ULL) |
+         ((x >> 40) & 0x000000000000ff00ULL) | ((x >> 56) & 0x00000000000000ffULL);
+}
+
+static uint64_t xxh_mix16(const unsigned char *in,const unsigned char *secret)
+{
+  return xxh_mul128_fold64(read_le64(in) ^ read_le64(secret),read_le64(in + 8) ^ read_le64(secret + 8));
+}
+
+static void xxh_mix32(xxh128_hash *acc,const unsigned char *in1,const unsigned char *in2,const unsigned char *secret)
+{
+  acc->low += xxh_mix16(in1,secret);
+  acc->low ^= read_le64(in2) + read_le64(in2 + 8);
+  acc->high += xxh_mix16(in2,secret + 16);
+  acc->high ^= read_le64(in1) + read_le64(in1 + 8);
+}
+
+static xxh128_hash xxh128_short(const unsigned char *in,size_t len)
+/* hashes up to XXH_MIDSIZE_MAX bytes, which XXH3 treats differently from longer input */
+{
+  const unsigned char *s = xxh_secret;
+  xxh128_hash h,m,acc;
+  uint64_t lo,hi;
+  uint32_t combined;
+  size_t i;
+
+  if (0 == len) {
+    h.low = xxh64_avalanche(read_le64(s + 64) ^ read_le64(s + 72));
+    h.high = xxh64_avalanche(read_le64(s + 80) ^ read_le64(s + 88));
+    return h;
+  }
+
+  if (len <= 3) {
+    combined = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) | (uint32_t)in[len - 1] | ((uint32_t)len << 8);
+    h.low = xxh64_avalanche((uint64_t)combined ^ (uint64_t)(read_le32(s) ^ read_le32(s + 4)));
+    combined = ((combined >> 24) | ((combined >> 8) & 0xff00) | ((combined << 8) & 0xff0000) | (combined << 24));
+    combined = (combined << 13) | (combined >> 19);
+    h.high = xxh64_avalanche((uint64_t)combined ^ (uint64_t)(read_le32(s + 8) ^ read_le32(s + 12)));
+    return h;
+  }
+
+  if (len <= 8) {
+    lo = (uint64_t)read_le32(in) + ((uint64_t)read_le32(in + len - 4) << 32);
+    m = xxh_mult64to128(lo ^ (read_le64(s + 16) ^ read_le64(s + 24)),XXH_PRIME64_1 + (len << 2));
+    m.high += m.low << 1;
+    m.low ^= m.high >> 3;
+    m.low ^= m.low >> 35;
+    m.low *= XXH_PRIME_MX2;
+    m.low ^= m.low >> 28;
+    m.high = xxh3_avalanche(m.high);
+    return m;
+  }
+
+  if (len <= 16) {
+    lo = read_le64(in);
+    hi = read_le64(in + len - 8);
+    m = xxh_mult64to128(lo ^ hi ^ (read_le64(s + 32) ^ read_le64(s + 40)),XXH_PRIME64_1);
+    m.low += (uint64_t)(len - 1) << 54;
+    hi ^= read_le64(s + 48) ^ read_le64(s + 56);
+    m.high += hi + (uint64_t)(uint32_t)hi * (XXH_PRIME32_2 - 1);
+    m.low ^= xxh_swap64(m.high);
+    h = xxh_mult64to128(m.low,XXH_PRIME64_2);
+    h.high += m.high * XXH_PRIME64_2;
+    h.low = xxh3_avalanche(h.low);
+    h.high = xxh3_avalanche(h.high);
+    return h;
+  }
+
+  acc.low = len * XXH_PRIME64_1;
+  acc.high = 0;
+
+  if (len <= 128) {
+    if (len > 32) {
+      if (len > 64) {
+        if (len > 96)
+          xxh_mix32(&acc,in + 48,in + len - 64,s + 96);
+        xxh_mix32(&acc,in + 32,in + len - 48,s + 64);
+      }
+      xxh_mix32(&acc,in + 16,in + len - 32,s + 32);
+    }
+    xxh_mix32(&acc,in,in + len - 16,s);
+  }
+  else {
+    for (i=32;i<160;i+=32)
+      xxh_mix32(&acc,in + i - 32,in + i - 16,s + i - 32);
+    acc.low = xxh3_avalanche(acc.low);
+    acc.high = xxh3_avalanche(acc.high);
+    for (i=160;i<=len;i+=32)
+      xxh_mix32(&acc,in + i - 32,in + i - 16,s + 3 + i - 160);
+    xxh_mix32(&acc,in + len - 16,in + len - 32,s + 136 - 17 - 16);
+  }
+
+  h.low = xxh3_avalanche(acc.low + acc.high);
+  h.high = (uint64_t)0 - xxh3_avalanche(acc.low * XXH_PRIME64_1 + acc.high * XXH_PRIME64_4 + len * XXH_PRIME64_2);
+
+  return h;
+}
+
+static void xxh_accumulate_stripe(uint64_t *acc,const unsigned char *in,const unsigned char *secret)
+{
+  uint64_t data,key;
+  int i;
+
+  for (i=0;i<8;i++) {
+    data = read_le64(in + 8 * i);
+    key = data ^ read_le64(secret + 8 * i);
+    acc[i ^ 1] += data;
+    acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+  }
+}
+
+static void xxh_scramble(uint64_t *acc)
+{
+  int i;
+
+  for (i=0;i<8;i++)
+    acc[i] = ((acc[i] ^ (acc[i] >> 47)) ^ read_le64(xxh_secret + XXH_SECRET_LIMIT + 8 * i)) * XXH_PRIME32_1;
+}
+
+static void xxh_consume_stripes(uint64_t *acc,size_t *stripes_so_far,const unsigned char *in,size_t stripes)
+/* takes whole stripes into the accumulators, scrambling them at the end of each block */
+{
+  while (stripes > 0) {
+    xxh_accumulate_stripe(acc,in,xxh_secret + 8 * (*stripes_so_far));
+    in += XXH_STRIPE_LEN;
+    stripes--;
+    if (XXH_STRIPES_PER_BLOCK == ++(*stripes_so_far)) {
+      xxh_scramble(acc);
+      *stripes_so_far = 0;
+    }
+  }
+}
+
+static void xxh128_init_ctx(xxh128_ctx *ctx)
+{
+  ctx->acc[0] = XXH_PRIME32_3;
+  ctx->acc[1] = XXH_PRIME64_1;
+  ctx->acc[2] = XXH_PRIME64_2;
+  ctx->acc[3] = XXH_PRIME64_3;
+  ctx->acc[4] = XXH_PRIME64_4;
+  ctx->acc[5] = XXH_PRIME32_2;
+  ctx->acc[6] = XXH_PRIME64_5;
+  ctx->acc[7] = XXH_PRIME32_1;
+  ctx->buflen = 0;
+  ctx->stripes = 0;
+  ctx->total = 0;
+}
+
+static void xxh128_process_bytes(const unsigned char *in,size_t len,xxh128_ctx *ctx)
+/* XXH3 treats the last stripe differently, so at least one byte is always kept back in the buffer */
+{
+  const unsigned char *end = in + len;
+  size_t load;
+
+  ctx->total += len;
+
+  if (len <= XXH_BUFFER_SIZE - ctx->buflen) {
+    memcpy(ctx->buffer + ctx->buflen,in,len);
+    ctx->buflen += len;
+    return;
+  }
+
+  if (ctx->buflen > 0) {
+    load = XXH_BUFFER_SIZE - ctx->buflen;
+    memcpy(ctx->buffer + ctx->buflen,in,load);
+    in += load;
+    xxh_consume_stripes(ctx->acc,&ctx->stripes,ctx->buffer,XXH_BUFFER_SIZE / XXH_STRIPE_LEN);
+    ctx->buflen = 0;
+  }
+
+  if (end - in > XXH_BUFFER_SIZE) {
+    load = (size_t)(end - 1 - in) / XXH_STRIPE_LEN;
+    xxh_consume_stripes(ctx->acc,&ctx->stripes,in,load);
+    in += load * XXH_STRIPE_LEN;
+    /* the last stripe may need to be rebuilt from these bytes when finishing */
+    memcpy(ctx->buffer + XXH_BUFFER_SIZE - XXH_STRIPE_LEN,in - XXH_STRIPE_LEN,XXH_STRIPE_LEN);
+  }
+
+  memcpy(ctx->buffer,in,end - in);
+  ctx->buflen = end - in;
+}
+
+static uint64_t xxh_merge_accs(const uint64_t *acc,const unsigned char *secret,uint64_t start)
+{
+  int i;
+
+  for (i=0;i<4;i++)
+    start += xxh_mul128_fold64(acc[2*i] ^ read_le64(secret + 16 * i),acc[2*i+1] ^ read_le64(secret + 16 * i + 8));
+
+  return xxh3_avalanche(start);
+}
+
+static void xxh128_finish_ctx(xxh128_ctx *ctx,unsigned char *resbuf)
+/* the result is stored big-endian, high half first, as xxHash's canonical representation is */
+{
+  unsigned char last_stripe[XXH_STRIPE_LEN];
+  const unsigned char *last;
+  size_t catchup;
+  xxh128_hash h;
+
+  if (ctx->total > XXH_MIDSIZE_MAX) {
+    if (ctx->buflen >= XXH_STRIPE_LEN) {
+      xxh_consume_stripes(ctx->acc,&ctx->stripes,ctx->buffer,(ctx->buflen - 1) / XXH_STRIPE_LEN);
+      last = ctx->buffer + ctx->buflen - XXH_STRIPE_LEN;
+    }
+    else {
+      catchup = XXH_STRIPE_LEN - ctx->buflen;
+      memcpy(last_stripe,ctx->buffer + XXH_BUFFER_SIZE - catchup,catchup);
+      memcpy(last_stripe + catchup,ctx->buffer,ctx->buflen);
+      last = last_stripe;
+    }
+
+    xxh_accumulate_stripe(ctx->acc,last,xxh_secret + XXH_SECRET_LIMIT - 7);
+
+    h.low = xxh_merge_accs(ctx->acc,xxh_secret + 11,ctx->total * XXH_PRIME64_1);
+    h.high = xxh_merge_accs(ctx->acc,xxh_secret + XXH_SECRET_SIZE - 64 - 11,~(ctx->total * XXH_PRIME64_2));
+  }
+  else
+    h = xxh128_short(ctx->buffer,(size_t)ctx->total);
+
+  write_be64(resbuf,h.high);
+  write_be64(resbuf + 8,h.low);
+}
+
+/* BLAKE3 - data is split into 1 KB chunks, which are the leaves of a binary tree.  whole subtrees of a large
+ * buffer are hashed on separate threads, so that one file can be fingerprinted on every processor.
+ */
+
+#define BLAKE3_BLOCK_LEN   64
+#define BLAKE3_CHUNK_LEN   1024
+#define BLAKE3_MAX_DEPTH   54
+#define BLAKE3_MIN_SPLIT   65536       /* smallest subtree worth handing to a thread */
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END   2
+#define BLAKE3_PARENT      4
+#define BLAKE3_ROOT        8
+
+static const uint32_t blake3_iv[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char blake3_schedule[7][16] = {
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  {  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+  {  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+  { 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+  { 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+  {  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+  { 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 }
+};
+
+typedef struct _blake3_chunk {
+  uint32_t      cv[8];
+  uint64_t      counter;
+  unsigned char buffer[BLAKE3_BLOCK_LEN];
+  size_t        buflen;
+  int           blocks_compressed;
+} blake3_chunk;
+
+typedef struct _blake3_ctx {
+  blake3_chunk chunk;
+  uint32_t     cv_stack[BLAKE3_MAX_DEPTH + 1][8];
+  int          cv_stack_len;
+} blake3_ctx;
+
+/* a compression that hasn't been done yet, since whether it is the root isn't known */
+typedef struct _blake3_output {
+  uint32_t      cv[8];
+  unsigned char block[BLAKE3_BLOCK_LEN];
+  size_t        block_len;
+  uint64_t      counter;
+  uint32_t      flags;
+} blake3_output;
+
+typedef struct _blake3_job {
+  const unsigned char *input;
+  size_t               len;
+  uint64_t             counter;
+  uint32_t             cv[8];
+  pthread_t            id;
+  bool                 running;
+} blake3_job;
+
+static blake3_ctx blake3_global_ctx;
+
+#define BLAKE3_G(a,b,c,d,x,y)                                           \
+  do {                                                                  \
+    v[a] = v[a] + v[b] + (x); v[d] = ROTR32(v[d] ^ v[a],16);            \
+    v[c] = v[c] + v[d];       v[b] = ROTR32(v[b] ^ v[c],12);            \
+    v[a] = v[a] + v[b] + (y); v[d] = ROTR32(v[d] ^ v[a],8);             \
+    v[c] = v[c] + v[d];       v[b] = ROTR32(v[b] ^ v[c],7);             \
+  } while (0)
+
+static void blake3_compress(const uint32_t cv[8],const unsigned char *block,size_t block_len,uint64_t counter,uint32_t flags,uint32_t out[16])
+{
+  uint32_t m[16],v[16];
+  const unsigned char *s;
+  int i;
+
+  for (i=0;i<16;i++)
+    m[i] = read_le32(block + 4 * i);
+
+  for (i=0;i<8;i++)
+    v[i] = cv[i];
+  for (i=0;i<4;i++)
+    v[i+8] = blake3_iv[i];
+  v[12] = (uint32_t)counter;
+  v[13] = (uint32_t)(counter >> 32);
+  v[14] = (uint32_t)block_len;
+  v[15] = flags;
+
+  for (i=0;i<7;i++) {
+    s = blake3_schedule[i];
+    BLAKE3_G(0,4, 8,12,m[s[0]], m[s[1]]);
+    BLAKE3_G(1,5, 9,13,m[s[2]], m[s[3]]);
+    BLAKE3_G(2,6,10,14,m[s[4]], m[s[5]]);
+    BLAKE3_G(3,7,11,15,m[s[6]], m[s[7]]);
+    BLAKE3_G(0,5,10,15,m[s[8]], m[s[9]]);
+    BLAKE3_G(1,6,11,12,m[s[10]],m[s[11]]);
+    BLAKE3_G(2,7, 8,13,m[s[12]],m[s[13]]);
+    BLAKE3_G(3,4, 9,14,m[s[14]],m[s[15]]);
+  }
+
+  for (i=0;i<8;i++) {
+    out[i] = v[i] ^ v[i+8];
+    out[i+8] = v[i+8] ^ cv[i];
+  }
+}
+
+static void blake3_chunk_init(blake3_chunk *chunk,uint64_t counter)
+{
+  memcpy(chunk->cv,blake3_iv,sizeof(blake3_iv));
+  chunk->counter = counter;
+  chunk->buflen = 0;
+  chunk->blocks_compressed = 0;
+}
+
+static size_t blake3_chunk_len(blake3_chunk *chunk)
+{
+  return BLAKE3_BLOCK_LEN * chunk->blocks_compressed + chunk->buflen;
+}
+
+static void blake3_chunk_update(blake3_chunk *chunk,const unsigned char *in,size_t len)
+/* the last block of a chunk is held back, since it has to be flagged as such */
+{
+  uint32_t out[16];
+  size_t take;
+
+  while (len > 0) {
+    if (BLAKE3_BLOCK_LEN == chunk->buflen) {
+      blake3_compress(chunk->cv,chunk->buffer,BLAKE3_BLOCK_LEN,chunk->counter,(0 == chunk->blocks_compressed) ? BLAKE3_CHUNK_START : 0,out);
+      memcpy(chunk->cv,out,sizeof(chunk->cv));
+      chunk->blocks_compressed++;
+      chunk->buflen = 0;
+    }
+
+    take = min(BLAKE3_BLOCK_LEN - chunk->buflen,len);
+    memcpy(chunk->buffer + chunk->buflen,in,take);
+    chunk->buflen += take;
+    in += take;
+    len -= take;
+  }
+}
+
+static void blake3_chunk_output(blake3_chunk *chunk,blake3_output *output)
+{
+  memcpy(output->cv,chunk->cv,sizeof(output->cv));
+  memset(output->block,0,BLAKE3_BLOCK_LEN);
+  memcpy(output->block,chunk->buffer,chunk->buflen);
+  output->block_len = chunk->buflen;
+  output->counter = chunk->counter;
+  output->flags = BLAKE3_CHUNK_END | ((0 == chunk->blocks_compressed) ? BLAKE3_CHUNK_START : 0);
+}
+
+static void blake3_parent_output(const uint32_t left[8],const uint32_t right[8],blake3_output *output)
+{
+  int i;
+
+  memcpy(output->cv,blake3_iv,sizeof(blake3_iv));
+  for (i=0;i<8;i++) {
+    write_le32(output->block + 4 * i,left[i]);
+    write_le32(output->block + 32 + 4 * i,right[i]);
+  }
+  output->block_len = BLAKE3_BLOCK_LEN;
+  output->counter = 0;
+  output->flags = BLAKE3_PARENT;
+}
+
+static void blake3_output_cv(blake3_output *output,uint32_t cv[8])
+{
+  uint32_t out[16];
+
+  blake3_compress(output->cv,output->block,output->block_len,output->counter,output->flags,out);
+  memcpy(cv,out,8 * sizeof(uint32_t));
+}
+
+static void blake3_parent_cv(const uint32_t left[8],const uint32_t right[8],uint32_t cv[8])
+{
+  blake3_output output;
+
+  blake3_parent_output(left,right,&output);
+  blake3_output_cv(&output,cv);
+}
+
+static void blake3_subtree_cv(const unsigned char *in,size_t len,uint64_t counter,uint32_t cv[8])
+/* hashes a whole subtree, whose length is a power-of-two number of chunks, that isn't the root */
+{
+  uint32_t left[8],right[8],out[16];
+  int i;
+
+  if (BLAKE3_CHUNK_LEN == len) {
+    memcpy(cv,blake3_iv,sizeof(blake3_iv));
+    for (i=0;i<BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN;i++) {
+      blake3_compress(cv,in + BLAKE3_BLOCK_LEN * i,BLAKE3_BLOCK_LEN,counter,
+                      ((0 == i) ? BLAKE3_CHUNK_START : 0) | ((BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN - 1 == i) ? BLAKE3_CHUNK_END : 0),out);
+      memcpy(cv,out,8 * sizeof(uint32_t));
+    }
+    return;
+  }
+
+  blake3_subtree_cv(in,len / 2,counter,left);
+  blake3_subtree_cv(in + len / 2,len / 2,counter + len / 2 / BLAKE3_CHUNK_LEN,right);
+  blake3_parent_cv(left,right,cv);
+}
+
+static void *blake3_thread(void *arg)
+{
+  blake3_job *job = (blake3_job *)arg;
+
+  blake3_subtree_cv(job->input,job->len,job->counter,job->cv);
+
+  return NULL;
+}
+
+static void blake3_subtree_children(const unsigned char *in,size_t len,uint64_t counter,uint32_t left[8],uint32_t right[8])
+/* hashes the two halves of a subtree, splitting the work into as many pieces as there are threads to do it */
+{
+  blake3_job jobs[HASH_MAX_THREADS];
+  int i,pieces = 1;
+
+  while (pieces * 2 <= job_threads(HASH_MAX_THREADS) && len / (pieces * 2) >= BLAKE3_MIN_SPLIT)
+    pieces *= 2;
+
+  if (pieces < 2) {
+    blake3_subtree_cv(in,len / 2,counter,left);
+    blake3_subtree_cv(in + len / 2,len / 2,counter + len / 2 / BLAKE3_CHUNK_LEN,right);
+    return;
+  }
+
+  for (i=0;i<pieces;i++) {
+    jobs[i].input = in + len / pieces * i;
+    jobs[i].len = len / pieces;
+    jobs[i].counter = counter + len / pieces / BLAKE3_CHUNK_LEN * i;
+    jobs[i].running = (i > 0 && 0 == pthread_create(&jobs[i].id,NULL,blake3_thread,&jobs[i]));
+  }
+
+  /* this thread takes the first piece, along with any that couldn't be given a thread of their own */
+  for (i=0;i<pieces;i++)
+    if (!jobs[i].running)
+      blake3_thread(&jobs[i]);
+
+  for (i=0;i<pieces;i++)
+    if (jobs[i].running)
+      pthread_join(jobs[i].id,NULL);
+
+  /* join the pieces back up into the two halves */
+  for (;pieces>2;pieces/=2)
+    for (i=0;i<pieces/2;i++)
+      blake3_parent_cv(jobs[2*i].cv,jobs[2*i+1].cv,jobs[i].cv);
+
+  memcpy(left,jobs[0].cv,sizeof(jobs[0].cv));
+  memcpy(right,jobs[1].cv,sizeof(jobs[1].cv));
+}
+
+static void blake3_merge_cv_stack(blake3_ctx *ctx,uint64_t total_chunks)
+/* merges completed subtrees, leaving one on the stack for each bit set in the number of chunks so far - the
+ * last merge is put off until more input arrives, since until then, it might be the root
+ */
+{
+  int post_merge_len = 0;
+
+  for (;total_chunks;total_chunks&=total_chunks-1)
+    post_merge_len++;
+
+  while (ctx->cv_stack_len > post_merge_len) {
+    blake3_parent_cv(ctx->cv_stack[ctx->cv_stack_len-2],ctx->cv_stack[ctx->cv_stack_len-1],ctx->cv_stack[ctx->cv_stack_len-2]);
+    ctx->cv_stack_len--;
+  }
+}
+
+static void blake3_push_cv(blake3_ctx *ctx,const uint32_t cv[8],uint64_t counter)
+{
+  blake3_merge_cv_stack(ctx,counter);
+  memcpy(ctx->cv_stack[ctx->cv_stack_len++],cv,8 * sizeof(uint32_t));
+}
+
+static void blake3_init_ctx(blake3_ctx *ctx)
+{
+  blake3_chunk_init(&ctx->chunk,0);
+  ctx->cv_stack_len = 0;
+}
+
+static void blake3_process_bytes(const unsigned char *in,size_t len,blake3_ctx *ctx)
+{
+  blake3_output output;
+  uint32_t cv[8],right[8];
+  uint64_t counter;
+  size_t take,subtree_len;
+
+  /* finish off a partial chunk first */
+  if (blake3_chunk_len(&ctx->chunk) > 0) {
+    take = min(BLAKE3_CHUNK_LEN - blake3_chunk_len(&ctx->chunk),len);
+    blake3_chunk_update(&ctx->chunk,in,take);
+    in += take;
+    len -= take;
+    if (0 == len)
+      return;
+    blake3_chunk_output(&ctx->chunk,&output);
+    blake3_output_cv(&output,cv);
+    blake3_push_cv(ctx,cv,ctx->chunk.counter);
+    blake3_chunk_init(&ctx->chunk,ctx->chunk.counter + 1);
+  }
+
+  /* then take the largest whole subtrees that line up with what has been hashed so far, always leaving some
+   * input for the final chunk
+   */
+  while (len > BLAKE3_CHUNK_LEN) {
+    counter = ctx->chunk.counter;
+    for (subtree_len=BLAKE3_CHUNK_LEN;subtree_len*2<=len;subtree_len*=2);
+    while (((uint64_t)(subtree_len - 1) & (counter * BLAKE3_CHUNK_LEN)) != 0)
+      subtree_len /= 2;
+
+    if (BLAKE3_CHUNK_LEN == subtree_len) {
+      blake3_subtree_cv(in,subtree_len,counter,cv);
+      blake3_push_cv(ctx,cv,counter);
+    }
+    else {
+      blake3_subtree_children(in,subtree_len,counter,cv,right);
+      blake3_push_cv(ctx,cv,counter);
+      blake3_push_cv(ctx,right,counter + subtree_len / 2 / BLAKE3_CHUNK_LEN);
+    }
+
+    ctx->chunk.counter += subtree_len / BLAKE3_CHUNK_LEN;
+    in += subtree_len;
+    len -= subtree_len;
+  }
+
+  if (len > 0) {
+    blake3_chunk_update(&ctx->chunk,in,len);
+    blake3_merge_cv_stack(ctx,ctx->chunk.counter);
+  }
+}
+
+static void blake3_finish_ctx(blake3_ctx *ctx,unsigned char *resbuf)
+{
+  blake3_output output;
+  uint32_t cv[8],out[16];
+  int i,remaining;
+
+  if (0 == ctx->cv_stack_len || blake3_chunk_len(&ctx->chunk) > 0) {
+    remaining = ctx->cv_stack_len;
+    blake3_chunk_output(&ctx->chunk,&output);
+  }
+  else {
+    /* the input ended on a subtree boundary, so the top of the stack holds the last two subtrees */
+    remaining = ctx->cv_stack_len - 2;
+    blake3_parent_output(ctx->cv_stack[remaining],ctx->cv_stack[remaining+1],&output);
+  }
+
+  while (remaining > 0) {
+    remaining--;
+    blake3_output_cv(&output,cv);
+    blake3_parent_output(ctx->cv_stack[remaining],cv,&output);
+  }
+
+  blake3_compress(output.cv,output.block,output.block_len,0,output.flags | BLAKE3_ROOT,out);
+
+  for (i=0;i<8;i++)
+    write_le32(resbuf + 4 * i,out[i]);
+}
+
+/* CRC32 - the one used by zip, PNG and EAC, processed eight bytes at a time with tables built on first use */
+
+#define CRC32_POLY 0xedb88320
+
+typedef struct _crc32_ctx {
+  uint32_t      crc;
+  unsigned char partial;                        /* first byte of a 16-bit sample split between buffers */
+  bool          have_partial;
+} crc32_ctx;
+
+static crc32_ctx crc32_global_ctx;
+static crc32_ctx crc32nn_global_ctx;
+
+static uint32_t crc32_table[8][256];
+
+static void crc32_init_ctx(crc32_ctx *ctx)
+{
+  uint32_t c;
+  int i,j;
+
+  if (0 == crc32_table[0][1]) {
+    for (i=0;i<256;i++) {
+      c = (uint32_t)i;
+      for (j=0;j<8;j++)
+        c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+      crc32_table[0][i] = c;
+    }
+    for (i=0;i<256;i++)
+      for (j=1;j<8;j++)
+        crc32_table[j][i] = (crc32_table[j-1][i] >> 8) ^ crc32_table[0][crc32_table[j-1][i] & 0xff];
+  }
+
+  ctx->crc = 0xffffffff;
+  ctx->have_partial = FALSE;
+}
+
+static void crc32_process_bytes(const unsigned char *in,size_t len,crc32_ctx *ctx)
+{
+  uint32_t c = ctx->crc,lo,hi;
+
+  for (;len>=8;len-=8,in+=8) {
+    lo = c ^ read_le32(in);
+    hi = read_le32(in + 4);
+    c = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^ crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+        crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^ crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+  }
+
+  for (;len>0;len--,in++)
+    c = (c >> 8) ^ crc32_table[0][(c ^ *in) & 0xff];
+
+  ctx->crc = c;
+}
+
+static void crc32nn_process_bytes(const unsigned char *in,size_t len,crc32_ctx *ctx)
+/* EAC's CRC without null samples - 16-bit samples that are zero are left out, so that it doesn't change with the
+ * amount of silence around the audio
+ */
+{
+  uint32_t c = ctx->crc;
+  unsigned char first;
+
+  if (0 == len)
+    return;
+
+  if (ctx->have_partial) {
+    first = ctx->partial;
+    ctx->have_partial = FALSE;
+    if (first | in[0])
+      c = (c >> 16) ^ crc32_table[1][(c ^ first) & 0xff] ^ crc32_table[0][((c >> 8) ^ in[0]) & 0xff];
+    in++;
+    len--;
+  }
+
+  for (;len>=2;len-=2,in+=2)
+    if (in[0] | in[1])
+      c = (c >> 16) ^ crc32_table[1][(c ^ in[0]) & 0xff] ^ crc32_table[0][((c >> 8) ^ in[1]) & 0xff];
+
+  if (len > 0) {
+    ctx->partial = in[0];
+    ctx->have_partial = TRUE;
+  }
+
+  ctx->crc = c;
+}
+
+static void crc32_finish_ctx(crc32_ctx *ctx,unsigned char *resbuf)
+{
+  write_be32(resbuf,~ctx->crc);
+}
+
+/* AccurateRip - each 32-bit stereo sample of a track is multiplied by its position in the track, counting from 1.
+ * v1 sums the low 32 bits of the products, and v2 sums both halves.  the first 5 sectors of the first track and
+ * the last 5 sectors of the last track are left out, since drives can't agree on where a disc starts and ends.
+ */
+
+#define AR_SKIPPED_SAMPLES (5 * CD_BLOCK_SIZE / 4)
+
+typedef struct _accuraterip_ctx {
+  uint32_t      sum_low;
+  uint32_t      sum_high;
+  uint64_t      position;                       /* of the next sample */
+  uint64_t      check_from;                     /* first and last positions that are counted */
+  uint64_t      check_to;
+  unsigned char partial[4];                     /* a sample split between buffers */
+  int           partial_len;
+} accuraterip_ctx;
+
+static accuraterip_ctx arv1_global_ctx;
+static accuraterip_ctx arv2_global_ctx;
+
+static void accuraterip_init_ctx(accuraterip_ctx *ctx,wlong track_bytes,bool first,bool last)
+{
+  ctx->sum_low = 0;
+  ctx->sum_high = 0;
+  ctx->position = 1;
+  ctx->check_from = (first) ? AR_SKIPPED_SAMPLES : 1;
+  ctx->check_to = (uint64_t)track_bytes / 4;
+  if (last)
+    ctx->check_to = (ctx->check_to > AR_SKIPPED_SAMPLES) ? ctx->check_to - AR_SKIPPED_SAMPLES : 0;
+  ctx->partial_len = 0;
+}
+
+static void accuraterip_sum(const unsigned char *in,size_t samples,uint32_t multiplier,uint32_t *low,uint32_t *high)
+/* adds each sample times its multiplier, counting up from multiplier, to the low and high halves of the sums */
+{
+  uint32_t sample;
+  uint64_t product;
+  size_t i;
+
+  for (i=0;i<samples;i++) {
+#ifdef WORDS_BIGENDIAN
+    sample = read_le32(in + 4 * i);
+#else
+    memcpy(&sample,in + 4 * i,4);
+#endif
+    product = (uint64_t)sample * multiplier++;
+    *low += (uint32_t)product;
+    *high += (uint32_t)(product >> 32);
+  }
+}
+
+#ifdef __SSE2__
+/* pmuludq multiplies the even 32-bit lanes into 64-bit products, and the odd lanes are shifted down to be
+ * multiplied the same way.  adding a product to the sums as two 32-bit lanes keeps the low and high halves
+ * apart, dropping the carries between them just as the scalar code does.  SSE2 is part of every x86-64
+ * processor, so this needs no check at run time.
+ */
+
+static void accuraterip_sum_sse2(const unsigned char *in,size_t samples,uint32_t multiplier,uint32_t *low,uint32_t *high)
+{
+  const __m128i step = _mm_set1_epi32(4);
+  __m128i m = _mm_setr_epi32((int)multiplier,(int)(multiplier + 1),(int)(multiplier + 2),(int)(multiplier + 3));
+  __m128i sums = _mm_setzero_si128(),s;
+  uint32_t lanes[4];
+  size_t i;
+
+  for (i=0;i+4<=samples;i+=4) {
+    s = _mm_loadu_si128((const __m128i *)(in + 4 * i));
+    sums = _mm_add_epi32(sums,_mm_mul_epu32(s,m));
+    sums = _mm_add_epi32(sums,_mm_mul_epu32(_mm_srli_epi64(s,32),_mm_srli_epi64(m,32)));
+    m = _mm_add_epi32(m,step);
+  }
+
+  _mm_storeu_si128((__m128i *)lanes,sums);
+  *low += lanes[0] + lanes[2];
+  *high += lanes[1] + lanes[3];
+
+  accuraterip_sum(in + 4 * i,samples - i,multiplier + (uint32_t)i,low,high);
+}
+#endif
+
+#ifdef HAVE_AVX2_INTRINSICS
+/* the same with 256-bit registers, for processors that have AVX2 */
+
+__attribute__((target("avx2")))
+static void accuraterip_sum_avx2(const unsigned char *in,size_t samples,uint32_t multiplier,uint32_t *low,uint32_t *high)
+{
+  const __m256i step = _mm256_set1_epi32(8);
+  __m256i m = _mm256_setr_epi32((int)multiplier,(int)(multiplier + 1),(int)(multiplier + 2),(int)(multiplier + 3),
+                                (int)(multiplier + 4),(int)(multiplier + 5),(int)(multiplier + 6),(int)(multiplier + 7));
+  __m256i sums = _mm256_setzero_si256(),s;
+  uint32_t lanes[8];
+  size_t i;
+
+  for (i=0;i+8<=samples;i+=8) {
+    s = _mm256_loadu_si256((const __m256i *)(in + 4 * i));
+    sums = _mm256_add_epi32(sums,_mm256_mul_epu32(s,m));
+    sums = _mm256_add_epi32(sums,_mm256_mul_epu32(_mm256_srli_epi64(s,32),_mm256_srli_epi64(m,32)));
+    m = _mm256_add_epi32(m,step);
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes,sums);
+  *low += lanes[0] + lanes[2] + lanes[4] + lanes[6];
+  *high += lanes[1] + lanes[3] + lanes[5] + lanes[7];
+
+  accuraterip_sum(in + 4 * i,samples - i,multiplier + (uint32_t)i,low,high);
+}
+#endif
+
+static void accuraterip_samples(const unsigned char *in,size_t samples,accuraterip_ctx *ctx)
+/* the checksum kernel - the samples that aren't counted are trimmed off first, then the rest are summed with the
+ * widest vector instructions that the processor has
+ */
+{
+  uint32_t low = 0,high = 0;
+  size_t first = 0,last = 0;
+
+  if (ctx->check_from < ctx->position + samples && ctx->check_to >= ctx->position) {
+    first = (size_t)(max(ctx->position,ctx->check_from) - ctx->position);
+    last = (size_t)(min(ctx->position + samples,ctx->check_to + 1) - ctx->position);
+  }
+
+  if (first < last) {
+#ifdef HAVE_AVX2_INTRINSICS
+    if (__builtin_cpu_supports("avx2"))
+      accuraterip_sum_avx2(in + 4 * first,last - first,(uint32_t)(ctx->position + first),&low,&high);
+    else
+#endif
+#ifdef __SSE2__
+      accuraterip_sum_sse2(in + 4 * first,last - first,(uint32_t)(ctx->position + first),&low,&high);
+#else
+      accuraterip_sum(in + 4 * first,last - first,(uint32_t)(ctx->position + first),&low,&high);
+#endif
+  }
+
+  ctx->sum_low += low;
+  ctx->sum_high += high;
+  ctx->position += samples;
+}
+
+static void accuraterip_process_bytes(const unsigned char *in,size_t len,accuraterip_ctx *ctx)
+{
+  size_t n;
+
+  if (ctx->partial_len > 0) {
+    n = min(4 - ctx->partial_len,len);
+    memcpy(ctx->partial + ctx->partial_len,in,n);
+    ctx->partial_len += (int)n;
+    in += n;
+    len -= n;
+    if (ctx->partial_len < 4)
+      return;
+    accuraterip_samples(ctx->partial,1,ctx);
+    ctx->partial_len = 0;
+  }
+
+  accuraterip_samples(in,len / 4,ctx);
+
+  n = len % 4;
+  memcpy(ctx->partial,in + len - n,n);
+  ctx->partial_len = (int)n;
+}
+
+static void arv1_finish_ctx(accuraterip_ctx *ctx,unsigned char *resbuf)
+{
+  write_be32(resbuf,ctx->sum_low);
+}
+
+static void arv2_finish_ctx(accuraterip_ctx *ctx,unsigned char *resbuf)
+{
+  write_be32(resbuf,ctx->sum_low + ctx->sum_high);
+}
+
+/* shdtool-specific stuff starts here */
+
+static void hash_help()
+{
+  st_info("Usage: %s [OPTIONS] [files]\n",st_progname());
+  st_info("\n");
+  st_info("Mode-specific options:\n");
+  st_info("\n");
+  st_info("  -c      generate composite fingerprint from input files\n");
+  st_info("  -f file generate fingerprints of each track of the input file, split at the points in file\n");
+  st_info("  -h      show this help screen\n");
+  st_info("  -m      generate MD5 fingerprints (default)\n");
+  st_info("  -s      generate SHA1 fingerprints\n");
+  st_info("  -t list generate fingerprints of each type in a comma-separated list, in one pass (*)\n");
+  st_info("\n");
+  st_info("          (*) types are: {[md5], sha1, sha256, xxh128, blake3, crc32, crc32nn, arv1, arv2}\n");
+  st_info("              crc32nn leaves out null samples, and arv1 and arv2 are AccurateRip checksums\n");
+  st_info("\n");
+}
+
+static int get_hash_type(char *type)
+{
+  int i;
+
+  for (i=0;hash_types[i].name;i++)
+    if (!strcmp(type,hash_types[i].name))
+      return i;
+
+  return -1;
+}
+
+static void get_hash_list(char *list)
+/* fills in the fingerprints to generate from a comma-separated list of types, ignoring repeats */
+{
+  char *type,*next;
+  int i,j;
+
+  num_hashes = 0;
+
+  for (type=list;type;type=next) {
+    if ((next = strchr(type,',')))
+      *next++ = '\0';
+
+    if (-1 == (i = get_hash_type(type)))
+      st_help("unknown fingerprint type: [%s]",type);
+
+    for (j=0;j<num_hashes;j++)
+      if (hash_list[j] == i)
+        break;
+
+    if (j == num_hashes)
+      hash_list[num_hashes++] = i;
+  }
+}
+
+static void parse(int argc,char **argv,int *first_arg)
+{
+  int c;
+
+  while ((c = st_getopt(argc,argv,"cf:mst:")) != -1) {
+    switch (c) {
+      case 'c':
+        composite_hash = TRUE;
+        break;
+      case 'f':
+        if (NULL == optarg)
+          st_error("missing split point file");
+        split_point_file = optarg;
+        break;
+      case 'm':
+        hash_list[0] = HASH_MD5;
+        num_hashes = 1;
+        break;
+      case 's':
+        hash_list[0] = HASH_SHA1;
+        num_hashes = 1;
+        break;
+      case 't':
+        if (NULL == optarg)
+          st_error("missing fingerprint type");
+        get_hash_list(optarg);
+        break;
+    }
+  }
+
+  if (composite_hash && split_point_file)
+    st_help("a composite fingerprint can't be split into tracks");
+
+  *first_arg = optind;
+}
+
+static void hash_init_ctx(int type)
+{
+  switch (type) {
+    case HASH_MD5:
+      md5_init_ctx(&md5_global_ctx);
+      break;
+    case HASH_SHA1:
+      sha1_init_ctx(&sha1_global_ctx);
+      break;
+    case HASH_SHA256:
+      sha256_init_ctx(&sha256_global_ctx);
+      break;
+    case HASH_XXH128:
+      xxh128_init_ctx(&xxh128_global_ctx);
+      break;
+    case HASH_BLAKE3:
+      blake3_init_ctx(&blake3_global_ctx);
+      break;
+    case HASH_CRC32:
+      crc32_init_ctx(&crc32_global_ctx);
+      break;
+    case HASH_CRC32NN:
+      crc32_init_ctx(&crc32nn_global_ctx);
+      break;
+    case HASH_ARV1:
+      accuraterip_init_ctx(&arv1_global_ctx,track_bytes_left,track_is_first,track_is_last);
+      break;
+    case HASH_ARV2:
+      accuraterip_init_ctx(&arv2_global_ctx,track_bytes_left,track_is_first,track_is_last);
+      break;
+  }
+}
+
+static void hash_process_bytes(int type,unsigned char *buffer,unsigned long bytes)
+{
+  switch (type) {
+    case HASH_MD5:
+      md5_process_bytes(buffer,bytes,&md5_global_ctx);
+      break;
+    case HASH_SHA1:
+      sha1_process_bytes(buffer,bytes,&sha1_global_ctx);
+      break;
+    case HASH_SHA256:
+      sha256_process_bytes(buffer,bytes,&sha256_global_ctx);
+      break;
+    case HASH_XXH128:
+      xxh128_process_bytes(buffer,bytes,&xxh128_global_ctx);
+      break;
+    case HASH_BLAKE3:
+      blake3_process_bytes(buffer,bytes,&blake3_global_ctx);
+      break;
+    case HASH_CRC32:
+      crc32_process_bytes(buffer,bytes,&crc32_global_ctx);
+      break;
+    case HASH_CRC32NN:
+      crc32nn_process_bytes(buffer,bytes,&crc32nn_global_ctx);
+      break;
+    case HASH_ARV1:
+      accuraterip_process_bytes(buffer,bytes,&arv1_global_ctx);
+      break;
+    case HASH_ARV2:
+      accuraterip_process_bytes(buffer,bytes,&arv2_global_ctx);
+      break;
+  }
+}
+
+static void hash_finish_ctx(int type)
+{
+  switch (type) {
+    case HASH_MD5:
+      md5_finish_ctx(&md5_global_ctx,audio_hash[current_track][type]);
+      break;
+    case HASH_SHA1:
+      sha1_finish_ctx(&sha1_global_ctx,audio_hash[current_track][type]);
+      break;
+    case HASH_SHA256:
+      sha256_finish_ctx(&sha256_global_ctx,audio_hash[current_track][type]);
+      break;
+    case HASH_XXH128:
+      xxh128_finish_ctx(&xxh128_global_ctx,audio_hash[current_track][type]);
+      break;
+    case HASH_BLAKE3:
+      blake3_finish_ctx(&blake3_global_ctx,audio_hash[current_track][type]);
+      break;
+    case HASH_CRC32:
+      crc32_finish_ctx(&crc32_global_ctx,audio_hash[current_track][type]);
+      break;
+    case HASH_CRC32NN:
+      crc32_finish_ctx(&crc32nn_global_ctx,audio_hash[current_track][type]);
+      break;
+    case HASH_ARV1:
+      arv1_finish_ctx(&arv1_global_ctx,audio_hash[current_track][type]);
+      break;
+    case HASH_ARV2:
+      arv2_finish_ctx(&arv2_global_ctx,audio_hash[current_track][type]);
+      break;
+  }
+}
+
+static void init_all_ctx()
+{
+  int i;
+
+  for (i=0;i<num_hashes;i++)
+    hash_init_ctx(hash_list[i]);
+}
+
+static void finish_all_ctx()
+{
+  int i;
+
+  for (i=0;i<num_hashes;i++)
+    hash_finish_ctx(hash_list[i]);
+}
+
+/* when more than one fingerprint is being generated, each buffer is handed to the digests on separate threads -
+ * each digest has its own context, so they only have to agree on when the buffer can be given back
+ */
+typedef struct _digest_job {
+  unsigned char *buffer;
+  unsigned long  bytes;
+  int            first;                         /* index into hash_list of the first digest this job runs */
+  int            step;
+  bool           running;
+  pthread_t      id;
+} digest_job;
+
+static void *digest_thread(void *arg)
+{
+  digest_job *job = (digest_job *)arg;
+  int i;
+
+  for (i=job->first;i<num_hashes;i+=job->step)
+    hash_process_bytes(hash_list[i],job->buffer,job->bytes);
+
+  return NULL;
+}
+
+static void process_all_bytes(unsigned char *buffer,unsigned long bytes)
+/* feeds a buffer of WAVE data to every digest being generated */
+{
+  digest_job jobs[NUM_HASHES];
+  int i,count;
+
+  count = min(num_hashes,job_threads(HASH_MAX_THREADS));
+
+  for (i=0;i<count;i++) {
+    jobs[i].buffer = buffer;
+    jobs[i].bytes = bytes;
+    jobs[i].first = i;
+    jobs[i].step = count;
+    jobs[i].running = (i > 0 && 0 == pthread_create(&jobs[i].id,NULL,digest_thread,&jobs[i]));
+  }
+
+  /* this thread takes the first job, along with any that couldn't be given a thread of their own */
+  for (i=0;i<count;i++)
+    if (!jobs[i].running)
+      digest_thread(&jobs[i]);
+
+  for (i=0;i<count;i++)
+    if (jobs[i].running)
+      pthread_join(jobs[i].id,NULL);
+}
+
+static void begin_track(int track)
+/* starts the fingerprints of the given track - AccurateRip needs to know its length and where it is on the disc */
+{
+  current_track = track;
+  track_bytes_left = track_ends[track] - ((track > 0) ? track_ends[track-1] : 0);
+
+  if (split_point_file) {
+    track_is_first = (first_track == track);
+    track_is_last = (num_tracks - 1 == track);
+  }
+
+  init_all_ctx();
+}
+
+static void hash_bytes(unsigned char *buffer,unsigned long bytes)
+/* feeds WAVE data to the digests, finishing each track's fingerprints as its end goes by - the last track's are
+ * finished by the caller, once it's known that all of its data was there
+ */
+{
+  unsigned long n;
+
+  while (current_track < num_tracks - 1 && (wlong)bytes >= track_bytes_left) {
+    n = (unsigned long)track_bytes_left;
+    if (n > 0)
+      process_all_bytes(buffer,n);
+    buffer += n;
+    bytes -= n;
+    finish_all_ctx();
+    begin_track(current_track + 1);
+  }
+
+  if (bytes > 0)
+    process_all_bytes(buffer,bytes);
+
+  track_bytes_left -= bytes;
+}
+
+int hash_stream(FILE *stream)
+/* hashes the next maxbytes bytes of WAVE data from the stream - 0 is returned if all of it was there */
+{
+  unsigned char *buffer;
+  unsigned long bytes;
+
+  if (0 == maxbytes)
+    return 0;
+
+  start_reading(stream,maxbytes);
+
+  /* each buffer but the last is a multiple of 64 bytes long, so the block-based digests take it in one go
+   * unless an earlier file in a composite fingerprint left a partial block
+   */
+  while ((buffer = next_buffer(&bytes))) {
+    hash_bytes(buffer,bytes);
+    release_buffer(bytes);
+  }
+
+  return stop_reading();
+}
+
+static void print_audio_hash(char *filename)
+/* prints one line per fingerprint, in the order they were asked for, for each track */
+{
+  int i,j,track,type;
+
+  for (track=0;track<num_tracks;track++) {
+    for (j=0;j<num_hashes;j++) {
+      type = hash_list[j];
+
+      if (hash_types[type].prefixed)
+        st_output("%s:",hash_types[type].name);
+
+      for (i=0;i<hash_types[type].size;i++)
+        st_output("%02x",audio_hash[track][type][i]);
+
+      if (split_point_file)
+        st_output("  [shdtool]  %s (track %02d)\n",filename,track + 1 - first_track);
+      else
+        st_output("  [shdtool]  %s\n",filename);
+    }
+  }
+}
+
+static bool cd_quality_needed(wave_info *info)
+/* reports whether any of the fingerprints asked for are only defined for CD-quality data that this file doesn't have */
+{
+  int j;
+
+  if (!PROB_NOT_CD(info))
+    return FALSE;
+
+  for (j=0;j<num_hashes;j++)
+    if (hash_types[hash_list[j]].cd_only)
+      return TRUE;
+
+  return FALSE;
+}
+
+static void read_split_points(wave_info *info)
+/* reads track split points from a file - either one length per line, or the INDEX 01 lines of a CUE sheet.  as in
+ * split mode, a CUE sheet whose first track doesn't start at the beginning of the file has a pregap, which becomes track 00
+ */
+{
+  FILE *fd;
+  char line[BUF_SIZE],*p,*token,*q;
+  wlong point,previous = 0;
+  bool cue = FALSE,starts_at_zero = FALSE;
+
+  if (NULL == (fd = fopen(split_point_file,"rb")))
+    st_error("could not open split point file: [%s]",split_point_file);
+
+  num_tracks = 0;
+  first_track = 0;
+
+  while (fgets(line,BUF_SIZE-1,fd)) {
+    /* skip over any binary junk at the beginning (including Unicode BOMs) */
+    for (p=line;*p && !isprint((unsigned char)*p);p++);
+
+    if (NULL == (token = strtok(p," \t\r\n")))
+      continue;
+
+    if (!strcmp(token,"INDEX")) {
+      cue = TRUE;
+      if (NULL == (token = strtok(NULL," \t\r\n")) || strcmp(token,"01") || NULL == (token = strtok(NULL," \t\r\n")))
+        continue;
+      /* convert m:ss:ff to m:ss.ff */
+      if ((q = strrchr(token,':')) && q != strchr(token,':'))
+        *q = '.';
+    }
+    else if (!isdigit((unsigned char)*token)) {
+      continue;
+    }
+
+    point = smrt_parse((unsigned char *)token,info);
+
+    if (0 == num_tracks && 0 == point) {
+      starts_at_zero = TRUE;
+      continue;
+    }
+
+    if (point <= previous)
+      st_error("split point %lu is not greater than previous split point %lu",point,previous);
+
+    if (point >= info->data_size)
+      st_error("split point %lu is not less than data size of input file: [%s]",point,info->filename);
+
+    if (HASH_MAX_TRACKS - 1 == num_tracks)
+      st_error("too many tracks -- maximum is %d",HASH_MAX_TRACKS);
+
+    if (cue && 0 == num_tracks && !starts_at_zero)
+      first_track = 1;
+
+    track_ends[num_tracks++] = point;
+
+    previous = point;
+  }
+
+  fclose(fd);
+
+  if (0 == num_tracks)
+    st_error("no split points given -- nothing to do");
+
+  track_ends[num_tracks++] = info->data_size;
+}
+
+static bool generate_audio_hash_single(wave_info *info)
+{
+  unsigned char *header;
+  int retval;
+  bool success;
+
+  success = FALSE;
+
+  if (cd_quality_needed(info)) {
+    st_warning("AccurateRip and null-sample CRC fingerprints can only be generated from CD-quality data: [%s]",info->filename);
+    return FALSE;
+  }
+
+  proginfo.initialized = FALSE;
+  proginfo.filename2 = info->filename;
+  proginfo.filedesc2 = info->m_ss;
+  proginfo.bytes_total = info->data_size;
+
+  prog_update(&proginfo);
+
+  if (!open_input_stream(info)) {
+    st_warning("could not reopen input file: [%s]",info->filename);
+    return FALSE;
   }
 
   if (NULL == (header = malloc(info->header_size * sizeof(unsigned char)))) {
@@ -1112,26 +2625,30 @@ static bool generate_audio_hash_single(wave_info *info)
     goto cleanup_single1;
   }
 
-  if (read_n_bytes(info->input,header,info->header_size,NULL) != info->header_size) {
+  if (read_header_bytes(info,header,info->header_size) != info->header_size) {
     prog_error(&proginfo);
     st_warning("error while discarding %d-byte WAVE header from file: [%s]",info->header_size,info->filename);
     goto cleanup_single2;
   }
 
   maxbytes = info->data_size;
-  remaining_bytes = 0;
+
+  if (split_point_file) {
+    read_split_points(info);
+  }
+  else {
+    track_ends[0] = info->data_size;
+    track_is_first = !strcmp(info->filename,first_filename);
+    track_is_last = !strcmp(info->filename,last_filename);
+  }
 
   /* Initialize the computation context.  */
-  hash_init_ctx();
+  begin_track(0);
 
   retval = hash_stream(info->input);
 
-  /* Add the last bytes if necessary.  */
-  if (remaining_bytes > 0)
-    hash_process_bytes();
-
   /* Construct result in desired memory.  */
-  hash_finish_ctx();
+  finish_all_ctx();
 
   if (retval) {
     prog_error(&proginfo);
@@ -1157,42 +2674,25 @@ cleanup_single1:
 static bool generate_audio_hash_composite(wave_info *info)
 {
   unsigned char *header;
-  int retval,bytes_to_read;
+  int retval;
   bool success;
 
   success = FALSE;
 
+  if (cd_quality_needed(info))
+    st_error("AccurateRip and null-sample CRC fingerprints can only be generated from CD-quality data: [%s]",info->filename);
+
   if (!open_input_stream(info))
     st_error("could not reopen input file: [%s]",info->filename);
 
   if (NULL == (header = malloc(info->header_size * sizeof(unsigned char))))
     st_error("could not allocate %d-byte WAVE header",info->header_size);
 
-  if (read_n_bytes(info->input,header,info->header_size,NULL) != info->header_size)
+  if (read_header_bytes(info,header,info->header_size) != info->header_size)
     st_error("error while discarding %d-byte WAVE header from file: [%s]",info->header_size,info->filename);
 
-  bytes_to_read = 0;
-
-  /* in order to generate the correct MD5/SHA1 signature, all data (modulus the
-   * final bytes) must be processed in blocks.  if the previous file left
-   * extra bytes that didn't fill out a full block, then try to read enough
-   * from this file to fill it out and process it.
-   */
-  if (remaining_bytes > 0) {
-    bytes_to_read = min(info->data_size,BLOCKSIZE - remaining_bytes);
-
-    if (read_n_bytes(info->input,(unsigned char *)(global_buffer + remaining_bytes),bytes_to_read,NULL) != bytes_to_read)
-      st_error("error while filling out block with data from file: [%s]",info->filename);
-
-    remaining_bytes += bytes_to_read;
-
-    if (BLOCKSIZE == remaining_bytes) {
-      hash_process_block();
-      remaining_bytes = 0;
-    }
-  }
-
-  maxbytes = info->data_size - bytes_to_read;
+  /* the digest holds on to any partial block left by the previous file, and completes it with data from this one */
+  maxbytes = info->data_size;
 
   retval = hash_stream(info->input);
 
@@ -1236,10 +2736,13 @@ static void composite_init(wlong total)
   if (!composite_hash)
     return;
 
-  /* Initialize the computation context.  */
-  hash_init_ctx();
+  /* the files are taken as one track that makes up the whole disc */
+  track_ends[0] = total;
+  track_is_first = TRUE;
+  track_is_last = TRUE;
 
-  remaining_bytes = 0;
+  /* Initialize the computation context.  */
+  begin_track(0);
 
   proginfo.initialized = FALSE;
   proginfo.filename2 = COMPOSITE;
@@ -1257,12 +2760,8 @@ static void composite_finish()
   if (0 == num_processed)
     st_error("need at least one valid file to process");
 
-  /* Add the last bytes if necessary.  */
-  if (remaining_bytes > 0)
-    hash_process_bytes();
-
   /* Construct result in desired memory.  */
-  hash_finish_ctx();
+  finish_all_ctx();
 
   prog_success(&proginfo);
 
@@ -1285,8 +2784,17 @@ static bool process(int argc,char **argv,int start)
   if (NULL == (files = malloc((numfiles + 1) * sizeof(wave_info *))))
     st_error("could not allocate memory for file info array");
 
+  if (split_point_file && 1 != numfiles)
+    st_error("split points can only be applied to one file at a time");
+
   for (i=0;i<numfiles;i++) {
     filename = input_get_filename();
+
+    /* AccurateRip takes the files as the tracks of a disc, in the order given */
+    if (0 == i)
+      first_filename = filename;
+    last_filename = filename;
+
     if (NULL == (files[j] = new_wave_info(filename))) {
       if (composite_hash)
         st_error("all files must be valid to generate a composite fingerprint");
@@ -1314,8 +2822,14 @@ static bool process(int argc,char **argv,int start)
 
   input_init(start,argc,argv);
 
-  while ((filename = input_get_filename())) {
-    success = (process_file(filename) && success);
+  /* a composite fingerprint needs the files' data in order, so it is always generated one file at a time */
+  if (composite_hash) {
+    while ((filename = input_get_filename())) {
+      success = (process_file(filename) && success);
+    }
+  }
+  else {
+    success = (run_input_jobs(process_file,NULL) && success);
   }
 
   composite_finish();
@@ -186,19 +186,10 @@ static bool process_file(char *filename)
 }
 
 static bool process(int argc,char **argv,int start)
-{  
-  char *filename;
-  bool success;
-
-  success = TRUE;
-
+{
   input_init(start,argc,argv);
 
-  while ((filename = input_get_filename())) {
-    success = (process_file(filename) && success);
-  }
-
-  return success;
+  return run_input_jobs(process_file,NULL);
 }
 
 static bool info_main(int argc,char **argv)
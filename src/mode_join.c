@@ -184,7 +184,7 @@ static bool do_join()
 
     while (bytes_to_skip > 0) {
       bytes_to_xfer = min(bytes_to_skip,CANONICAL_HEADER_SIZE);
-      if (read_n_bytes(files[i]->input,header,bytes_to_xfer,NULL) != bytes_to_xfer) {
+      if (read_header_bytes(files[i],header,bytes_to_xfer) != bytes_to_xfer) {
         prog_error(&proginfo);
         st_warning("error while reading %d bytes of data",bytes_to_xfer);
         goto cleanup;
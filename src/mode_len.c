@@ -312,8 +312,14 @@ static void show_totals_line()
   st_free(info);
 }
 
-static void update_totals(wave_info *info)
+static void update_totals(unsigned char *data,int size)
+/* adds a file's WAVE info (sent by process_file(), possibly from a parallel job) to the running totals */
 {
+  wave_info *info = (wave_info *)data;
+
+  if (sizeof(wave_info) != size)
+    return;
+
   total_size += (double)info->total_size;
   total_data_size += (double)info->data_size;
   total_length += (double)info->data_size / (double)info->avg_bytes_per_sec;
@@ -335,7 +341,7 @@ static bool process_file(char *filename)
     return FALSE;
 
   if ((success = show_stats(info)))
-    update_totals(info);
+    job_send_result((unsigned char *)info,sizeof(wave_info));
 
   st_free(info);
 
@@ -344,18 +350,13 @@ static bool process_file(char *filename)
 
 static bool process(int argc,char **argv,int start)
 {
-  char *filename;
   bool success;
 
-  success = TRUE;
-
   show_len_banner();
 
   input_init(start,argc,argv);
 
-  while ((filename = input_get_filename())) {
-    success = (process_file(filename) && success);
-  }
+  success = run_input_jobs(process_file,update_totals);
 
   show_totals_line();
 
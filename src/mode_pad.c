@@ -42,6 +42,7 @@ enum {
 #define PAD_POSTFIX "-padded"
 
 static int pad_type = PAD_UNKNOWN;
+static bool in_place = FALSE;
 
 static void pad_help()
 {
@@ -52,6 +53,7 @@ static void pad_help()
   st_info("  -b      pad the beginning of files with silence\n");
   st_info("  -e      pad the end of files with silence (default)\n");
   st_info("  -h      show this help screen\n");
+  st_info("  -p      post-pad WAVE files in place, by appending silence and updating the header\n");
   st_info("\n");
 }
 
@@ -63,7 +65,7 @@ static void parse(int argc,char **argv,int *first_arg)
   st_ops.output_postfix = PAD_POSTFIX;
   pad_type = PAD_POSTPAD;
 
-  while ((c = st_getopt(argc,argv,"be")) != -1) {
+  while ((c = st_getopt(argc,argv,"bep")) != -1) {
     switch (c) {
       case 'b':
         pad_type = PAD_PREPAD;
@@ -71,12 +73,111 @@ static void parse(int argc,char **argv,int *first_arg)
       case 'e':
         pad_type = PAD_POSTPAD;
         break;
+      case 'p':
+        in_place = TRUE;
+        break;
     }
   }
 
+  if (in_place && PAD_PREPAD == pad_type)
+    st_help("pre-padding can't be done in place, since the audio data would have to move\n");
+
+  if (in_place && st_ops.output_format && (st_ops.output_format->is_compressed || st_ops.output_format->is_translated))
+    st_help("in-place padding can only leave WAVE files behind, so an output format can't be given\n");
+
   *first_arg = optind;
 }
 
+static bool pad_in_place(wave_info *info,progress_info *proginfo,int pad_bytes)
+/* post-pads a WAVE file where it is.  the silence is appended and synced to disk before the header is updated to
+ * cover it, so a crash at any point leaves either the original file (perhaps followed by some zeros) or the padded one.
+ */
+{
+  unsigned char *header = NULL;
+  wlong data_end;
+  struct stat sz;
+  FILE *file = NULL;
+  int tail;
+  bool has_null_pad,success;
+
+  success = FALSE;
+
+  if (info->input_format->is_compressed || info->input_format->is_translated) {
+    prog_error(proginfo);
+    st_warning("only WAVE files can be padded in place -- skipping.");
+    return FALSE;
+  }
+
+  if (PROB_EXTRA_CHUNKS(info)) {
+    prog_error(proginfo);
+    st_warning("file has extra RIFF chunks after the data chunk, so it can't be padded in place -- skipping.");
+    return FALSE;
+  }
+
+  /* with no extra RIFF chunks, this doesn't have to read the file.  a NULL pad byte is the first byte of silence */
+  has_null_pad = odd_sized_data_chunk_is_null_padded(info);
+  tail = (PROB_ODD_SIZED_DATA(info) && has_null_pad) ? 1 : 0;
+
+  data_end = info->id3v2_tag_size + info->header_size + info->data_size;
+
+  if (NULL == (header = malloc(info->header_size * sizeof(unsigned char)))) {
+    prog_error(proginfo);
+    st_warning("could not allocate %d-byte WAVE header -- skipping.",info->header_size);
+    return FALSE;
+  }
+
+  if (NULL == (file = fopen(info->filename,"r+b"))) {
+    prog_error(proginfo);
+    st_warning("could not open file for writing -- skipping.");
+    goto cleanup;
+  }
+
+  if (0 != fstat(fileno(file),&sz) || sz.st_size != (off_t)(data_end + tail)) {
+    prog_error(proginfo);
+    st_warning("file has data past the end of its RIFF chunk, so it can't be padded in place -- skipping.");
+    goto cleanup;
+  }
+
+  if (0 != fseeko(file,(off_t)info->id3v2_tag_size,SEEK_SET) || read_n_bytes(file,header,info->header_size,NULL) != info->header_size) {
+    prog_error(proginfo);
+    st_warning("error while reading %d-byte WAVE header -- skipping.",info->header_size);
+    goto cleanup;
+  }
+
+  put_data_size(header,info->header_size,info->data_size+pad_bytes);
+  put_chunk_size(header,info->header_size+info->data_size+pad_bytes-8);
+
+  if (0 != fseeko(file,(off_t)(data_end + tail),SEEK_SET) || pad_bytes - tail != write_padding(file,pad_bytes - tail,proginfo) ||
+      0 != fflush(file) || 0 != fsync(fileno(file))) {
+    prog_error(proginfo);
+    st_warning("error while post-padding with %d zero-bytes -- skipping.",pad_bytes);
+    if (0 != ftruncate(fileno(file),(off_t)(data_end + tail)))
+      st_warning("could not remove the zero-bytes already written -- they now follow the RIFF chunk.");
+    goto cleanup;
+  }
+
+  if (0 != fseeko(file,(off_t)info->id3v2_tag_size,SEEK_SET) || write_n_bytes(file,header,info->header_size,NULL) != info->header_size ||
+      0 != fflush(file) || 0 != fsync(fileno(file))) {
+    prog_error(proginfo);
+    st_warning("error while writing %d-byte WAVE header -- file may now be damaged.",info->header_size);
+    goto cleanup;
+  }
+
+  success = TRUE;
+
+  prog_success(proginfo);
+
+cleanup:
+  if (file && 0 != fclose(file) && success) {
+    st_warning("error while closing file -- it may be damaged.");
+    success = FALSE;
+  }
+
+  st_free(header);
+
+  return success;
+}
+
 static bool pad_file(wave_info *info)
 {
   int pad_bytes;
@@ -90,27 +191,31 @@ static bool pad_file(wave_info *info)
 
   success = FALSE;
 
-  create_output_filename(info->filename,info->input_format->extension,outfilename);
+  if (!in_place)
+    create_output_filename(info->filename,info->input_format->extension,outfilename);
 
   proginfo.initialized = FALSE;
   proginfo.prefix = (pad_type == PAD_PREPAD) ? "Pre-padding" : "Post-padding";
-  proginfo.clause = "-->";
+  proginfo.clause = (in_place) ? "in place" : "-->";
   proginfo.filename1 = info->filename;
   proginfo.filedesc1 = info->m_ss;
-  proginfo.filename2 = outfilename;
+  proginfo.filename2 = (in_place) ? NULL : outfilename;
   proginfo.filedesc2 = NULL;
   proginfo.bytes_total = info->total_size;
 
   prog_update(&proginfo);
 
+  pad_bytes = CD_BLOCK_SIZE - (info->data_size % CD_BLOCK_SIZE);
+
+  if (in_place)
+    return pad_in_place(info,&proginfo,pad_bytes);
+
   if (files_are_identical(info->filename,outfilename)) {
     prog_error(&proginfo);
     st_warning("output file would overwrite input file -- skipping.");
     return FALSE;
   }
 
-  pad_bytes = CD_BLOCK_SIZE - (info->data_size % CD_BLOCK_SIZE);
-
   has_null_pad = odd_sized_data_chunk_is_null_padded(info);
 
   if (!open_input_stream(info)) {
@@ -131,7 +236,7 @@ static bool pad_file(wave_info *info)
     goto cleanup;
   }
 
-  if (read_n_bytes(info->input,header,info->header_size,NULL) != info->header_size) {
+  if (read_header_bytes(info,header,info->header_size) != info->header_size) {
     prog_error(&proginfo);
     st_warning("error while discarding %d-byte WAVE header -- skipping.",info->header_size);
     goto cleanup;
@@ -240,19 +345,10 @@ static bool process_file(char *filename)
 }
 
 static bool process(int argc,char **argv,int start)
-{  
-  char *filename;
-  bool success;
-
-  success = TRUE;
-
+{
   input_init(start,argc,argv);
 
-  while ((filename = input_get_filename())) {
-    success = (process_file(filename) && success);
-  }
-
-  return success;
+  return run_input_jobs(process_file,NULL);
 }
 
 static bool pad_main(int argc,char **argv)
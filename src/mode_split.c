@@ -16,8 +16,14 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #include "mode.h"
 
 CVSID("$Id: mode_split.c,v 1.145 2009/03/18 22:25:00 jason Exp $")
@@ -39,6 +45,9 @@ mode_module mode_split = {
 #define SPLIT_MAX_PIECES 256
 #define SPLIT_NUM_FORMAT "%02d"
 
+/* with -j, tracks up to this size are collected in memory and encoded in the background */
+#define SPLIT_MAX_BUFFERED_SIZE (128 * 1024 * 1024)
+
 enum {
   SPLIT_INPUT_UNKNOWN,
   SPLIT_INPUT_RAW,
@@ -78,6 +87,21 @@ static cue_info cueinfo;
 static wave_info *files[SPLIT_MAX_PIECES];
 static bool extract_track[SPLIT_MAX_PIECES];
 
+typedef struct _track_output {
+  FILE   *encoder;      /* encoder's stdin, while the track is being collected in memory */
+  char   *buffer;       /* track contents, as written by open_memstream() */
+  size_t  buffer_size;
+  char   *filename;
+  pid_t   feeder;       /* process handing the buffer to the encoder, or NO_CHILD_PID */
+  pthread_t writer;     /* thread handing the buffer to an in-process encoder, if writing */
+  bool    writing;
+  bool    written;      /* whether the encoder took all of the buffer, and finished the file */
+} track_output;
+
+static track_output outputs[SPLIT_MAX_PIECES];
+static int max_encoders = 1;
+static bool encoders_ok = TRUE;
+
 static void split_help()
 {
   int i;
@@ -212,11 +236,242 @@ static void adjust_for_leadinout(wlong leadin_bytes,wlong leadout_bytes)
   }
 }
 
+static void finish_written_track(int track)
+/* checks how an in-process encoder fared with a buffered track, once it has been handed all of it */
+{
+  if (!outputs[track].written) {
+    st_warning("encoder failed to create output file: [%s]",outputs[track].filename);
+    remove_file(outputs[track].filename);
+    encoders_ok = FALSE;
+  }
+
+  st_free(outputs[track].buffer);
+  st_free(outputs[track].filename);
+}
+
+static void wait_for_feeder(int track)
+/* waits until a track's buffer has been handed to its encoder, and for the encoder to finish */
+{
+  int status;
+
+  if (outputs[track].writing) {
+    pthread_join(outputs[track].writer,NULL);
+    outputs[track].writing = FALSE;
+    finish_written_track(track);
+    return;
+  }
+
+  while (-1 == waitpid(outputs[track].feeder,&status,0)) {
+    if (EINTR != errno) {
+      status = -1;
+      break;
+    }
+  }
+
+  outputs[track].feeder = NO_CHILD_PID;
+
+  if (-1 == status || !WIFEXITED(status) || 0 != WEXITSTATUS(status)) {
+    st_warning("encoder did not receive all data for output file: [%s]",outputs[track].filename);
+    close_output(NULL,files[track]->output_proc);
+    remove_file(outputs[track].filename);
+    encoders_ok = FALSE;
+  }
+  else if (CLOSE_CHILD_ERROR_OUTPUT == close_output(NULL,files[track]->output_proc)) {
+    st_warning("encoder failed to create output file: [%s]",outputs[track].filename);
+    remove_file(outputs[track].filename);
+    encoders_ok = FALSE;
+  }
+
+  st_free(outputs[track].filename);
+}
+
+static void reap_encoders(int keep)
+/* waits for the oldest background encoders until no more than keep are still running */
+{
+  int i,oldest,running;
+
+  for (;;) {
+    oldest = -1;
+    running = 0;
+
+    for (i=0;i<numfiles;i++) {
+      if (NO_CHILD_PID != outputs[i].feeder || outputs[i].writing) {
+        if (-1 == oldest)
+          oldest = i;
+        running++;
+      }
+    }
+
+    if (running <= keep)
+      break;
+
+    wait_for_feeder(oldest);
+  }
+}
+
+static void discard_outputs()
+/* before giving up on a split - waits for the encoders still being fed in the background, and frees any track
+ * still held in memory
+ */
+{
+  int i;
+
+  reap_encoders(0);
+
+  for (i=0;i<numfiles;i++) {
+    st_free(outputs[i].buffer);
+    st_free(outputs[i].filename);
+  }
+}
+
+static bool feed_encoder(int track)
+/* runs in the feeder process - writes a buffered track to its encoder */
+{
+  char *p;
+  ssize_t bytes;
+  size_t left;
+  int i,fd,max_fds;
+
+  fd = fileno(outputs[track].encoder);
+
+  /* don't keep the decoder's or other encoders' pipes open on their behalf */
+#ifdef HAVE_SYSCONF
+  max_fds = sysconf(_SC_OPEN_MAX);
+#else
+  max_fds = 1024;
+#endif
+  for (i=3;i<max_fds;i++)
+    if (fd != i)
+      close(i);
+
+  p = outputs[track].buffer;
+  left = outputs[track].buffer_size;
+
+  while (left > 0) {
+    if ((bytes = write(fd,p,left)) < 0) {
+      if (EINTR == errno)
+        continue;
+      return FALSE;
+    }
+    p += bytes;
+    left -= bytes;
+  }
+
+  return (0 == close(fd));
+}
+
+static void *feed_codec_encoder(void *arg)
+/* runs in its own thread - writes a buffered track to an in-process encoder, and closes it, which finishes the file */
+{
+  track_output *output = (track_output *)arg;
+  bool ok;
+
+  ok = (output->buffer_size == fwrite(output->buffer,1,output->buffer_size,output->encoder));
+  ok = (0 == fclose(output->encoder) && ok);
+
+  output->encoder = NULL;
+  output->written = ok;
+
+  return NULL;
+}
+
+static bool open_track_output(int track,char *outfilename)
+/* launches the encoder for a track.  with -j, the track is collected in memory, and handed to the
+ * encoder by a separate process (or a thread, for an in-process encoder) once complete, so that the
+ * next track can be read right away
+ */
+{
+  FILE *encoder;
+
+  reap_encoders(max_encoders - 1);
+
+  if (NULL == (encoder = open_output_stream(outfilename,&files[track]->output_proc)))
+    return FALSE;
+
+  files[track]->output = encoder;
+  outputs[track].filename = strdup(outfilename);
+
+  if (max_encoders < 2 || files[track]->total_size > SPLIT_MAX_BUFFERED_SIZE)
+    return TRUE;
+
+  if (NULL == (files[track]->output = open_memstream(&outputs[track].buffer,&outputs[track].buffer_size))) {
+    st_debug1("could not collect track %d in memory, writing it directly: [%s]",track+1,strerror(errno));
+    files[track]->output = encoder;
+    return TRUE;
+  }
+
+  outputs[track].encoder = encoder;
+
+  return TRUE;
+}
+
+static void close_track_output(int track)
+/* closes a track's output - for a track collected in memory, this starts handing it to the encoder */
+{
+  if (NULL == outputs[track].encoder) {
+    if (CLOSE_CHILD_ERROR_OUTPUT == close_output(files[track]->output,files[track]->output_proc)) {
+      st_warning("encoder failed to create output file: [%s]",outputs[track].filename);
+      remove_file(outputs[track].filename);
+      encoders_ok = FALSE;
+    }
+    st_free(outputs[track].filename);
+    return;
+  }
+
+  /* this makes buffer and buffer_size final */
+  fclose(files[track]->output);
+  files[track]->output = NULL;
+
+  reap_encoders(max_encoders - 1);
+
+  /* an in-process encoder has no pipe to feed from another process, so a thread runs it instead */
+  if (fileno(outputs[track].encoder) < 0) {
+    if (0 == pthread_create(&outputs[track].writer,NULL,feed_codec_encoder,&outputs[track])) {
+      st_debug2("started thread to feed in-process encoder for output file: [%s]",outputs[track].filename);
+      outputs[track].writing = TRUE;
+      return;
+    }
+
+    st_debug1("could not start thread to feed in-process encoder, feeding it directly: [%s]",outputs[track].filename);
+    feed_codec_encoder(&outputs[track]);
+    finish_written_track(track);
+    return;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  switch ((outputs[track].feeder = fork())) {
+    case -1:
+      outputs[track].feeder = NO_CHILD_PID;
+      close_output(outputs[track].encoder,files[track]->output_proc);
+      remove_file(outputs[track].filename);
+      st_warning("error while forking process for output file [%s]: [%s]",outputs[track].filename,strerror(errno));
+      discard_outputs();
+      st_error("failed to split file");
+      break;
+
+    case 0:
+      _exit(feed_encoder(track) ? 0 : 1);
+      break;
+
+    default:
+      st_debug2("started process %d to feed [%s] output process %d",(int)outputs[track].feeder,
+                st_ops.output_format->encoder,files[track]->output_proc.pid);
+      break;
+  }
+
+  fclose(outputs[track].encoder);
+  outputs[track].encoder = NULL;
+
+  st_free(outputs[track].buffer);
+}
+
 static bool split_file(wave_info *info)
 {
   unsigned char header[CANONICAL_HEADER_SIZE];
   char outfilename[FILENAME_SIZE],filenum[FILENAME_SIZE];
-  int current;
+  int current,last_extracted;
   wint discard,bytes;
   bool success;
   wlong leadin_bytes, leadout_bytes, bytes_to_xfer;
@@ -241,7 +496,7 @@ static bool split_file(wave_info *info)
   discard = info->header_size;
   while (discard > 0) {
     bytes = min(discard,CANONICAL_HEADER_SIZE);
-    if (read_n_bytes(info->input,header,bytes,NULL) != bytes) {
+    if (read_header_bytes(info,header,bytes) != bytes) {
       prog_error(&proginfo);
       st_error("error while discarding %d-byte WAVE header",info->header_size);
     }
@@ -252,6 +507,24 @@ static bool split_file(wave_info *info)
   leadout_bytes = (leadout) ? smrt_parse((unsigned char *)leadout,info) : 0;
   adjust_for_leadinout(leadin_bytes,leadout_bytes);
 
+  max_encoders = job_limit();
+
+  /* in-process encoders share the processors among the tracks being encoded at once */
+  set_jobs_at_once(max_encoders);
+
+  last_extracted = -1;
+
+  for (current=0;current<numfiles;current++) {
+    if (extract_track[current])
+      last_extracted = current;
+
+    outputs[current].encoder = NULL;
+    outputs[current].buffer = NULL;
+    outputs[current].filename = NULL;
+    outputs[current].feeder = NO_CHILD_PID;
+    outputs[current].writing = FALSE;
+  }
+
   for (current=0;current<numfiles;current++) {
     if (SPLIT_INPUT_CUE == input_type && cueinfo.format) {
       create_output_filename(cueinfo.filenames[current],"",outfilename);
@@ -282,8 +555,9 @@ static bool split_file(wave_info *info)
       proginfo.prefix = "Splitting";
       proginfo.filename2 = outfilename;
 
-      if (NULL == (files[current]->output = open_output_stream(outfilename,&files[current]->output_proc))) {
+      if (!open_track_output(current,outfilename)) {
         prog_error(&proginfo);
+        discard_outputs();
         st_error("could not open output file");
       }
     }
@@ -293,6 +567,7 @@ static bool split_file(wave_info *info)
 
       if (NULL == (files[current]->output = open_output(NULLDEVICE))) {
         prog_error(&proginfo);
+        discard_outputs();
         st_error("while skipping track %d: could not open output file: [%s]",current+1,NULLDEVICE);
       }
 
@@ -314,8 +589,15 @@ static bool split_file(wave_info *info)
 
     /* if this is not the first file, finish up writing previous file, and simultaneously start writing to current file */
     if (0 != current) {
-      /* write overlapping lead-in/lead-out data to both previous and current files */
-      if (transfer_n_bytes2(info->input,files[current]->output,files[current-1]->output,leadin_bytes+leadout_bytes,&proginfo) != leadin_bytes+leadout_bytes) {
+      /* write overlapping lead-in/lead-out data to both previous and current files, unless neither is wanted */
+      if (!extract_track[current] && !extract_track[current-1]) {
+        if (skip_n_bytes(info->input,leadin_bytes+leadout_bytes,&proginfo) != leadin_bytes+leadout_bytes) {
+          prog_error(&proginfo);
+          st_warning("error while skipping %ld bytes of lead-in/lead-out",leadin_bytes+leadout_bytes);
+          goto cleanup;
+        }
+      }
+      else if (transfer_n_bytes2(info->input,files[current]->output,files[current-1]->output,leadin_bytes+leadout_bytes,&proginfo) != leadin_bytes+leadout_bytes) {
         prog_error(&proginfo);
         st_warning("error while transferring %ld bytes of lead-in/lead-out",leadin_bytes+leadout_bytes);
         goto cleanup;
@@ -328,7 +610,15 @@ static bool split_file(wave_info *info)
         goto cleanup;
       }
 
-      close_output(files[current-1]->output,files[current-1]->output_proc);
+      close_track_output(current-1);
+
+      /* the rest of the input isn't needed, so don't bother reading it */
+      if (current > last_extracted) {
+        close_output(files[current]->output,files[current]->output_proc);
+        prog_success(&proginfo);
+        st_debug1("no more tracks to extract, ignoring the rest of the input file");
+        break;
+      }
     }
 
     /* transfer unique non-overlapping data from input file to current file */
@@ -338,7 +628,14 @@ static bool split_file(wave_info *info)
     if (numfiles - 1 != current)
       bytes_to_xfer -= leadin_bytes;
 
-    if (transfer_n_bytes(info->input,files[current]->output,bytes_to_xfer,&proginfo) != bytes_to_xfer) {
+    if (!extract_track[current]) {
+      if (skip_n_bytes(info->input,bytes_to_xfer,&proginfo) != bytes_to_xfer) {
+        prog_error(&proginfo);
+        st_warning("error while skipping %ld bytes of data",bytes_to_xfer);
+        goto cleanup;
+      }
+    }
+    else if (transfer_n_bytes(info->input,files[current]->output,bytes_to_xfer,&proginfo) != bytes_to_xfer) {
       prog_error(&proginfo);
       st_warning("error while transferring %ld bytes of data",bytes_to_xfer);
       goto cleanup;
@@ -353,7 +650,7 @@ static bool split_file(wave_info *info)
         goto cleanup;
       }
 
-      close_output(files[current]->output,files[current]->output_proc);
+      close_track_output(current);
     }
 
     prog_success(&proginfo);
@@ -361,12 +658,28 @@ static bool split_file(wave_info *info)
 
   close_input_stream(info);
 
+  reap_encoders(0);
+
+  set_jobs_at_once(1);
+
+  if (!encoders_ok) {
+    discard_outputs();
+    st_error("failed to split file");
+  }
+
   success = TRUE;
 
 cleanup:
   if (!success) {
+    /* a track being collected in memory hasn't reached its encoder yet, which gets end-of-file instead */
+    if (outputs[current].encoder) {
+      fclose(files[current]->output);
+      files[current]->output = outputs[current].encoder;
+      outputs[current].encoder = NULL;
+    }
     close_output(files[current]->output,files[current]->output_proc);
     remove_file(outfilename);
+    discard_outputs();
     st_error("failed to split file");
   }
 
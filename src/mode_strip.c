@@ -17,6 +17,7 @@
  */
 
 #include "mode.h"
+#include "convert.h"
 
 CVSID("$Id: mode_strip.c,v 1.105 2009/03/17 17:23:05 jason Exp $")
 
@@ -37,6 +38,7 @@ mode_module mode_strip = {
 
 static bool strip_header = TRUE;
 static bool strip_chunks = TRUE;
+static bool in_place = FALSE;
 
 static void strip_help()
 {
@@ -47,6 +49,7 @@ static void strip_help()
   st_info("  -c      don't strip unnecessary RIFF chunks\n");
   st_info("  -e      don't rewrite WAVE header in canonical format\n");
   st_info("  -h      show this help screen\n");
+  st_info("  -p      strip WAVE files in place, rewriting only the header and truncating the file\n");
   st_info("\n");
 }
 
@@ -57,7 +60,7 @@ static void parse(int argc,char **argv,int *first_arg)
   st_ops.output_directory = INPUT_FILE_DIR;
   st_ops.output_postfix = STRIP_POSTFIX;
 
-  while ((c = st_getopt(argc,argv,"ce")) != -1) {
+  while ((c = st_getopt(argc,argv,"cep")) != -1) {
     switch (c) {
       case 'c':
         strip_chunks = FALSE;
@@ -65,15 +68,135 @@ static void parse(int argc,char **argv,int *first_arg)
       case 'e':
         strip_header = FALSE;
         break;
+      case 'p':
+        in_place = TRUE;
+        break;
     }
   }
 
   if (!strip_header && !strip_chunks)
     st_help("nothing to do if not stripping headers or RIFF chunks\n");
 
+  if (in_place && st_ops.output_format && (st_ops.output_format->is_compressed || st_ops.output_format->is_translated))
+    st_help("in-place stripping can only leave WAVE files behind, so an output format can't be given\n");
+
   *first_arg = optind;
 }
 
+static bool strip_in_place(wave_info *info,progress_info *proginfo)
+/* strips a WAVE file without moving its audio data: the header is rewritten where it is, with a JUNK chunk
+ * taking up any room left over by the canonical header, and extra RIFF chunks are cut off the end of the file
+ */
+{
+  unsigned char *old_header = NULL,*new_header = NULL,canonical_header[CANONICAL_HEADER_SIZE];
+  wlong new_chunk_size,new_file_size;
+  wint filler_size;
+  FILE *file = NULL;
+  bool success;
+
+  success = FALSE;
+
+  if (info->input_format->is_compressed || info->input_format->is_translated) {
+    prog_error(proginfo);
+    st_warning("only WAVE files can be stripped in place -- skipping.");
+    return FALSE;
+  }
+
+  filler_size = info->header_size - CANONICAL_HEADER_SIZE;
+
+  if (strip_header && 0 != filler_size && (filler_size < 8 || filler_size % 2)) {
+    prog_error(proginfo);
+    st_warning("no room for a canonical header and a JUNK chunk in the existing %d-byte header -- skipping.",info->header_size);
+    return FALSE;
+  }
+
+  /* the header stays the same size, so only chunks being cut off change the RIFF chunk size */
+  if (strip_chunks)
+    new_chunk_size = info->header_size + info->padded_data_size - 8;
+  else
+    new_chunk_size = info->chunk_size;
+
+  new_file_size = info->id3v2_tag_size + info->header_size + info->padded_data_size;
+
+  if (NULL == (old_header = malloc(info->header_size * sizeof(unsigned char))) ||
+      NULL == (new_header = malloc(info->header_size * sizeof(unsigned char)))) {
+    prog_error(proginfo);
+    st_warning("could not allocate %d-byte WAVE header -- skipping.",info->header_size);
+    goto cleanup;
+  }
+
+  if (NULL == (file = fopen(info->filename,"r+b"))) {
+    prog_error(proginfo);
+    st_warning("could not open file for writing -- skipping.");
+    goto cleanup;
+  }
+
+  if (0 != fseeko(file,(off_t)info->id3v2_tag_size,SEEK_SET) || read_n_bytes(file,old_header,info->header_size,NULL) != info->header_size) {
+    prog_error(proginfo);
+    st_warning("error while reading %d bytes of data -- skipping.",info->header_size);
+    goto cleanup;
+  }
+
+  memcpy(new_header,old_header,info->header_size);
+
+  if (strip_header) {
+    make_canonical_header(canonical_header,info);
+
+    /* everything up to the data chunk, then filler, then the data chunk header right where it was */
+    memcpy(new_header,canonical_header,CANONICAL_HEADER_SIZE - 8);
+    if (filler_size > 0) {
+      memset(new_header + CANONICAL_HEADER_SIZE - 8,0,filler_size);
+      memcpy(new_header + CANONICAL_HEADER_SIZE - 8,WAVE_JUNK,4);
+      ulong_to_uchar_le(new_header + CANONICAL_HEADER_SIZE - 4,filler_size - 8);
+    }
+    memcpy(new_header + info->header_size - 8,canonical_header + CANONICAL_HEADER_SIZE - 8,8);
+  }
+
+  put_chunk_size(new_header,new_chunk_size);
+
+  if (!memcmp(new_header,old_header,info->header_size) && (!strip_chunks || new_file_size >= info->actual_size)) {
+    prog_error(proginfo);
+    st_warning("file has already been stripped in place -- skipping.");
+    goto cleanup;
+  }
+
+  if (0 != fseeko(file,(off_t)info->id3v2_tag_size,SEEK_SET) || write_n_bytes(file,new_header,info->header_size,NULL) != info->header_size || 0 != fflush(file)) {
+    prog_error(proginfo);
+    st_warning("error while writing %d bytes of data -- file may now be damaged.",info->header_size);
+    goto cleanup;
+  }
+
+  /* odd-sized data gets the NULL pad byte called for by the RIFF specs, whatever was there before */
+  if (strip_chunks && PROB_ODD_SIZED_DATA(info) &&
+      (0 != fseeko(file,(off_t)(new_file_size - 1),SEEK_SET) || 1 != write_padding(file,1,NULL) || 0 != fflush(file))) {
+    prog_error(proginfo);
+    st_warning("error while writing NULL pad byte -- file may now be damaged.");
+    goto cleanup;
+  }
+
+  /* the header goes first, so that a failure here leaves a file whose RIFF chunk ends before its end, not after it */
+  if (strip_chunks && new_file_size < info->actual_size && 0 != ftruncate(fileno(file),(off_t)new_file_size)) {
+    prog_error(proginfo);
+    st_warning("error while truncating file to %lu bytes -- extra RIFF chunks were not removed.",new_file_size);
+    goto cleanup;
+  }
+
+  success = TRUE;
+
+  prog_success(proginfo);
+
+cleanup:
+  if (file && 0 != fclose(file) && success) {
+    st_warning("error while closing file -- it may be damaged.");
+    success = FALSE;
+  }
+
+  st_free(old_header);
+  st_free(new_header);
+
+  return success;
+}
+
 static bool strip_and_canonicize(wave_info *info)
 {
   wint new_header_size;
@@ -82,20 +205,21 @@ static bool strip_and_canonicize(wave_info *info)
   char outfilename[FILENAME_SIZE];
   FILE *output = NULL;
   proc_info output_proc;
-  long possible_extra_stuff;
-  bool has_null_pad,success;
+  wlong trailing_size;
+  bool success;
   progress_info proginfo;
 
   success = FALSE;
 
-  create_output_filename(info->filename,info->input_format->extension,outfilename);
+  if (!in_place)
+    create_output_filename(info->filename,info->input_format->extension,outfilename);
 
   proginfo.initialized = FALSE;
   proginfo.prefix = "Stripping";
-  proginfo.clause = "-->";
+  proginfo.clause = (in_place) ? "in place" : "-->";
   proginfo.filename1 = info->filename;
   proginfo.filedesc1 = info->m_ss;
-  proginfo.filename2 = outfilename;
+  proginfo.filename2 = (in_place) ? NULL : outfilename;
   proginfo.filedesc2 = NULL;
   proginfo.bytes_total = info->total_size;
 
@@ -131,27 +255,31 @@ static bool strip_and_canonicize(wave_info *info)
     return FALSE;
   }
 
+  if (in_place)
+    return strip_in_place(info,&proginfo);
+
   if (files_are_identical(info->filename,outfilename)) {
     prog_error(&proginfo);
     st_warning("output file would overwrite input file -- skipping.");
     return FALSE;
   }
 
-  has_null_pad = odd_sized_data_chunk_is_null_padded(info);
-
-  if (!has_null_pad)
-    info->extra_riff_size++;
-
   new_header_size = info->header_size;
-  possible_extra_stuff = (info->extra_riff_size > 0) ? info->extra_riff_size : 0;
 
   if (strip_header)
     new_header_size = CANONICAL_HEADER_SIZE;
 
-  if (strip_chunks)
-    possible_extra_stuff = 0;
-
-  new_chunk_size = info->chunk_size - (info->header_size - new_header_size) - (info->extra_riff_size - possible_extra_stuff);
+  /* whether or not odd-sized data was followed by a NULL pad byte, it is followed by one once the extra RIFF chunks
+   * are stripped, and kept together with them otherwise - so there's no need to find out which it was
+   */
+  if (strip_chunks) {
+    new_chunk_size = new_header_size + info->padded_data_size - 8;
+    trailing_size = 0;
+  }
+  else {
+    new_chunk_size = info->chunk_size - (info->header_size - new_header_size);
+    trailing_size = info->total_size - info->header_size - info->data_size;
+  }
 
   if (!open_input_stream(info)) {
     prog_error(&proginfo);
@@ -171,7 +299,7 @@ static bool strip_and_canonicize(wave_info *info)
     goto cleanup;
   }
 
-  if (read_n_bytes(info->input,header,info->header_size,NULL) != info->header_size) {
+  if (read_header_bytes(info,header,info->header_size) != info->header_size) {
     prog_error(&proginfo);
     st_warning("error while reading %d bytes of data -- skipping.",info->header_size);
     goto cleanup;
@@ -195,15 +323,15 @@ static bool strip_and_canonicize(wave_info *info)
     goto cleanup;
   }
 
-  if (PROB_ODD_SIZED_DATA(info) && has_null_pad && (1 != transfer_n_bytes(info->input,output,1,NULL))) {
+  if (strip_chunks && PROB_ODD_SIZED_DATA(info) && (1 != write_padding(output,1,NULL))) {
     prog_error(&proginfo);
-    st_warning("error while transferring NULL pad byte -- skipping.");
+    st_warning("error while writing NULL pad byte -- skipping.");
     goto cleanup;
   }
 
-  if ((possible_extra_stuff > 0) && (transfer_n_bytes(info->input,output,possible_extra_stuff,NULL) != possible_extra_stuff)) {
+  if ((trailing_size > 0) && (transfer_n_bytes(info->input,output,trailing_size,NULL) != trailing_size)) {
     prog_error(&proginfo);
-    st_warning("error while transferring %lu extra bytes -- skipping.",possible_extra_stuff);
+    st_warning("error while transferring %lu extra bytes -- skipping.",trailing_size);
     goto cleanup;
   }
 
@@ -240,19 +368,10 @@ static bool process_file(char *filename)
 }
 
 static bool process(int argc,char **argv,int start)
-{  
-  char *filename;
-  bool success;
-
-  success = TRUE;
-
+{
   input_init(start,argc,argv);
 
-  while ((filename = input_get_filename())) {
-    success = (process_file(filename) && success);
-  }
-
-  return success;
+  return run_input_jobs(process_file,NULL);
 }
 
 static bool strip_main(int argc,char **argv)
@@ -174,6 +174,9 @@ static void scan_file(wave_info *info,wlong *skip_beginning,wlong *skip_end,prog
     bytes_remaining -= bytes_to_read;
   }
 
+  /* the pad byte is right there, which spares trim_file() another pass to find out about it */
+  check_null_pad(info);
+
   close_input_stream(info);
 
   *skip_beginning = tmp_beginning_bytes;
@@ -265,12 +268,14 @@ static bool trim_file(wave_info *info)
     goto cleanup;
   }
 
-  if (read_n_bytes(info->input,header,info->header_size,&proginfo) != info->header_size) {
+  if (read_header_bytes(info,header,info->header_size) != info->header_size) {
     prog_error(&proginfo);
     st_warning("error while discarding %d-byte WAVE header -- skipping.",info->header_size);
     goto cleanup;
   }
 
+  proginfo.bytes_written += info->header_size;
+
   if (!do_header_kluges(header,info)) {
     prog_error(&proginfo);
     st_warning("could not fix WAVE header -- skipping.");
@@ -371,19 +376,10 @@ static bool process_file(char *filename)
 }
 
 static bool process(int argc,char **argv,int start)
-{  
-  char *filename;
-  bool success;
-
-  success = TRUE;
-
+{
   input_init(start,argc,argv);
 
-  while ((filename = input_get_filename())) {
-    success = (process_file(filename) && success);
-  }
-
-  return success;
+  return run_input_jobs(process_file,NULL);
 }
 
 static bool trim_main(int argc,char **argv)